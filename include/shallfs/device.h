@@ -45,7 +45,10 @@ struct shall_devsuper {
 	__le64 new_size;			/*  768: see tuneshallfs */
 	__le32 new_alignment;			/*  776: see tuneshallfs */
 	__le32 new_superblocks;			/*  780: see tuneshallfs */
-	char __reserved1[228];			/*  784: */
+	__le64 new_moved;			/*  784: see tuneshallfs */
+	__le64 new_saved;			/*  792: see tuneshallfs */
+	__le32 new_saved_crc;			/*  800: see tuneshallfs */
+	char __reserved1[208];			/*  804: */
 	char magic2[8];				/* 1012: "SHALL 01" */
 	__le32 checksum;			/* 1020: checksum */
 } __attribute__((packed));			/* 1024 bytes */
@@ -105,6 +108,16 @@ struct shall_devregion {
 	__le32 fileid;				/*  16: file ID */
 } __attribute__((packed));			/*  20 bytes */
 
+/* on-disk clone format: "length" bytes starting at "src_start" in file
+ * "src_fileid" now also appear at "dst_start" in file "dst_fileid" */
+struct shall_devclone {
+	__le64 src_start;			/*   0: start of source region */
+	__le64 length;				/*   8: length of region */
+	__le64 dst_start;			/*  16: start of destination */
+	__le32 src_fileid;			/*  24: source file ID */
+	__le32 dst_fileid;			/*  28: destination file ID */
+} __attribute__((packed));			/*  32 bytes */
+
 /* on-disk hash format */
 struct shall_devhash {
 	__le64 start;				/*   0: start of region */
@@ -0,0 +1,86 @@
+/* include/shallfs/ioctl.h
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ *
+ * this file is part of SHALLFS
+ *
+ * Copyright (c) 2017-2019 Claudio Calvelli <shallfs@gladserv.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 2 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program (see the file COPYING in the distribution).
+ * If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef _SHALL_IOCTL_H
+#define _SHALL_IOCTL_H
+
+#include <linux/ioctl.h>
+#include <linux/types.h>
+
+#define SHALL_IOC_MAGIC		'S'
+
+/* filter for /proc/fs/shallfs/DEVICE/plog readers: an event is returned
+ * if it passes all the tests selected by "flags" */
+#define SHALL_FILTER_OPERATION	0x0001	/* operation in mask */
+#define SHALL_FILTER_UID	0x0002	/* real UID equal to "uid" */
+#define SHALL_FILTER_PREFIX	0x0004	/* file name has prefix */
+#define SHALL_FILTER_ALL	0x0007
+
+#define SHALL_FILTER_PREFIX_MAX	256
+
+struct shall_filter {
+	__u32 flags;				/* see SHALL_FILTER_* */
+	__u32 prefix_length;			/* length of "prefix" */
+	__u64 operations;			/* bit N: accept operation N */
+	__u64 uid;				/* real UID to accept */
+	char prefix[SHALL_FILTER_PREFIX_MAX];	/* file name prefix */
+};
+
+/* ioctls accepted by /proc/fs/shallfs/DEVICE/plog */
+
+/* say that the reader has finished with all events before a cursor
+ * position; the argument points to a __u64 containing the position,
+ * usually obtained with lseek(fd, 0, SEEK_CUR) after reading and storing
+ * the events; the events are removed from the journal once all registered
+ * readers have acknowledged them */
+#define SHALL_IOC_ACK		_IOW(SHALL_IOC_MAGIC, 0x01, __u64)
+
+/* set or clear the reader's filter; the argument points to a struct
+ * shall_filter, and flags == 0 means return all events */
+#define SHALL_IOC_FILTER	_IOW(SHALL_IOC_MAGIC, 0x02, struct shall_filter)
+
+/* register (argument points to a nonzero __u32) or unregister (zero) the
+ * reader: events are kept in the journal until all registered readers
+ * have acknowledged them; readers are registered when opened */
+#define SHALL_IOC_REGISTER	_IOW(SHALL_IOC_MAGIC, 0x03, __u32)
+
+/* ioctls accepted by any file or directory inside a shallfs mount */
+
+/* a batch of user log markers: "data" points to "length" bytes holding
+ * one or more strings separated by NUL characters; each nonempty string
+ * is added to the journal as a separate USERLOG event; each marker must
+ * fit in one event, which cannot be larger than the commit size */
+#define SHALL_USERLOG_MAX	1048576
+
+struct shall_userlog {
+	__u64 data;				/* pointer to the markers */
+	__u64 length;				/* total length, bytes */
+};
+
+/* add a batch of markers to the journal; the argument points to a struct
+ * shall_userlog, and the result is the number of events added; the file
+ * must be open for writing, unless the caller has CAP_SYS_ADMIN; if any
+ * marker is too long, nothing is added and the result is -E2BIG */
+#define SHALL_IOC_USERLOG _IOW(SHALL_IOC_MAGIC, 0x04, struct shall_userlog)
+
+#endif /* _SHALL_IOCTL_H */
@@ -59,6 +59,10 @@ const struct shall_opdata shall_opdata[SHALL_MAX_OPCODE] = {
 	[SHALL_DEL_XATTR]	= { "DEL_XATTR", 1, SHALL_LOG_XATTR },
 
 	[SHALL_USERLOG]		= { "USER_LOG",  1, SHALL_LOG_NODATA },
+
+	[SHALL_CLONE]		= { "CLONE",     0, SHALL_LOG_CLONE },
+
+	[SHALL_LOST]		= { "LOST",      0, SHALL_LOG_SIZE },
 };
 
 #endif /* _SHALLFS_OPDATA_H_ */
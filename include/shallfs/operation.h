@@ -52,6 +52,10 @@ enum shall_operation {
 
 	SHALL_USERLOG,
 
+	SHALL_CLONE,
+
+	SHALL_LOST,
+
 	SHALL_MAX_OPCODE
 };
 
@@ -69,7 +73,8 @@ enum shall_log_flags {
 	SHALL_LOG_ACL		= 0x2000,	/* ACL present */
 	SHALL_LOG_HASH          = 0x4000,       /* hash of data present */
 	SHALL_LOG_DATA          = 0x8000,       /* full data present */
-	SHALL_LOG_DMASK		= 0xff00,	/* mask to get data type */
+	SHALL_LOG_CLONE		= 0x10000,	/* clone region present */
+	SHALL_LOG_DMASK		= 0x1ff00,	/* mask to get data type */
 };
 
 #define SHALL_HEADER_MAGIC 0x4c4a4853
@@ -0,0 +1,48 @@
+/* include/shallfs/ring.h
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ *
+ * this file is part of SHALLFS
+ *
+ * Copyright (c) 2017-2019 Claudio Calvelli <shallfs@gladserv.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 2 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program (see the file COPYING in the distribution).
+ * If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef _SHALL_RING_H
+#define _SHALL_RING_H
+
+#include <linux/types.h>
+
+/* layout of /proc/fs/shallfs/DEVICE/ring when mapped into memory: the
+ * control page is at file offset 0 and can be mapped read-write; the data
+ * area starts at file offset equal to the page size, and must be mapped
+ * read-only with a length of exactly twice control->size: the data area
+ * appears twice in a row, so that an event starting at any position can
+ * be read in place even if it wraps around the end of the ring; events
+ * have the same format as in the journal, and the consumer reads the
+ * event at (tail % size) while tail != head */
+
+struct shall_ring_control {
+	__u64 head;		/* kernel: total data written to ring */
+	__u64 tail;		/* consumer: total data consumed */
+	__u64 lost;		/* kernel: events dropped because ring full */
+	__u32 size;		/* size of data area, a power of 2 */
+	__u32 version;		/* layout of this structure, currently 1 */
+};
+
+#define SHALL_RING_VERSION	1
+
+#endif /* _SHALL_RING_H */
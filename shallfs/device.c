@@ -31,6 +31,7 @@
 #include <linux/wait.h>
 #include <linux/crc32.h>
 #include <linux/buffer_head.h>
+#include <linux/blkdev.h>
 #include <linux/atomic.h>
 #include <linux/kthread.h>
 #include <shallfs/operation.h>
@@ -184,6 +185,9 @@ int shall_write_superblock(const struct shall_fsinfo *fi, int n, int sync) {
 	ds.new_size = cpu_to_le64(0);
 	ds.new_alignment = cpu_to_le32(0);
 	ds.new_superblocks = cpu_to_le32(0);
+	ds.new_moved = cpu_to_le64(0);
+	ds.new_saved = cpu_to_le64(0);
+	ds.new_saved_crc = cpu_to_le32(0);
 	strncpy(ds.magic2, SHALL_SB_MAGIC, sizeof(ds.magic2));
 	ds.checksum = cpu_to_le32(checksum_super(ds));
 	bh = sb_bread(fi->sb, shall_superblock_location(n));
@@ -218,8 +222,9 @@ int shall_write_superblock(const struct shall_fsinfo *fi, int n, int sync) {
 /* calculate block containing some data given the ring buffer offset and
  * the total number of superblocks */
 void shall_calculate_block(loff_t p, int ns, struct shall_devptr *b) {
-	/* this does not need to be fast or clever: it is executed just
-	 * twice for each mount */
+	/* this does not need to be fast or clever: it is executed twice
+	 * for each mount, and once for each shall_peek_start() and
+	 * shall_readahead_data() call */
 	sector_t remain = p / SHALL_DEV_BLOCK, prev = 0, result = 1;
 	int nsb = 1;
 	b->offset = p % SHALL_DEV_BLOCK;
@@ -267,28 +272,36 @@ static inline void inc_block(struct shall_devptr *b,
 
 /* code for shall_read_data_*(), this is a macro so that we can make sure
  * the code for both is identical (apart for the actual copy to kernel or
- * user buffers) */
-#define read_code(name, type, preif, copy, postif) \
+ * user buffers); "copy" must return nonzero on error, and "bread" is 0 if
+ * there is nothing to copy, so the blocks don't need to be read at all */
+#define read_code(name, type, copy, bread) \
 ssize_t name(struct shall_fsinfo *fi, void type *_d, size_t len) { \
 	char type * dest = _d; \
 	size_t orig = len; \
 	if (len < 1) return 0; \
 	if (len > fi->sbi.rw.read.data_length) return 0; \
 	fi->sbi.rw.read.data_length -= len; \
+	fi->sbi.rw.read.consumed += len; \
 	/* first read any data which has already been committed */ \
 	if (fi->sbi.rw.read.committed > 0) { \
 		int offset = fi->sbi.rw.read.startptr.offset; \
 		while (len > 0 && fi->sbi.rw.read.committed > 0) { \
 			struct buffer_head * bh; \
 			size_t todo = len; \
+			int err; \
 			if (todo > fi->sbi.rw.read.committed) \
 				todo = fi->sbi.rw.read.committed; \
 			if (todo + offset > SHALL_DEV_BLOCK) \
 				todo = SHALL_DEV_BLOCK - offset; \
-			bh = sb_bread(fi->sb, \
-				      fi->sbi.rw.read.startptr.block); \
-			if (! bh) return -EIO; \
-			preif(copy(dest, bh->b_data + offset, todo)) postif; \
+			/* shall_mark_read() has nothing to copy */ \
+			if (bread) { \
+				bh = sb_bread(fi->sb, \
+					fi->sbi.rw.read.startptr.block); \
+				if (! bh) return -EIO; \
+				err = copy(dest, bh->b_data + offset, todo); \
+				brelse(bh); \
+				if (err) return -EFAULT; \
+			} \
 			fi->sbi.rw.read.data_start += todo; \
 			if (fi->sbi.rw.read.data_start >= \
 				fi->sbi.ro.data_space) \
@@ -308,11 +321,11 @@ ssize_t name(struct shall_fsinfo *fi, void type *_d, size_t len) { \
 	} \
 	if (len <= 0) return orig; \
 	/* if we get here, we'll need to read some uncommitted data */ \
-	preif(copy(dest, \
-		   fi->sbi.rw.other.commit_buffer + \
-		   	fi->sbi.rw.read.buffer_read, \
-		   len)) \
-		postif; \
+	if (copy(dest, \
+		 fi->sbi.rw.other.commit_buffer + \
+		 	fi->sbi.rw.read.buffer_read, \
+		 len)) \
+		return -EFAULT; \
 	fi->sbi.rw.read.buffer_read += len; \
 	/* we also need to adjust data_start even though we aren't writing \
 	 * there */ \
@@ -344,8 +357,9 @@ ssize_t name(struct shall_fsinfo *fi, void type *_d, size_t len) { \
  * corresponding area on the device as unused; there are two versions of
  * this, depending on whether the destination is user or kernel space;
  * caller must hold the mutex locked */
-read_code(shall_read_data_kernel, /* kernel */, /* no if */, memcpy, /* no */)
-read_code(shall_read_data_user, __user, if, copy_to_user, return -EFAULT)
+#define kernelcpy(d, s, l) (memcpy((d), (s), (l)), 0)
+read_code(shall_read_data_kernel, /* kernel */, kernelcpy, 1)
+read_code(shall_read_data_user, __user, copy_to_user, 1)
 
 /* mark some data as read without actually reading it;  this is about the
  * same as:
@@ -354,7 +368,7 @@ read_code(shall_read_data_user, __user, if, copy_to_user, return -EFAULT)
  * except that it does not need to allocate any buffers
  */
 #define nullcpy(d, s, l) 0
-static read_code(_mark_read, /* kernel */, if, nullcpy, /* nothing */; )
+static read_code(_mark_read, /* kernel */, nullcpy, 0)
 
 ssize_t shall_mark_read(struct shall_fsinfo *fi, size_t len) {
 	if (len > fi->sbi.rw.read.data_length)
@@ -362,6 +376,132 @@ ssize_t shall_mark_read(struct shall_fsinfo *fi, size_t len) {
 	return _mark_read(fi, NULL, len);
 }
 
+/* set up a cursor "skip" bytes after the beginning of the journal, for
+ * reading through it with shall_peek_next_*(); the device position is
+ * only calculated once here, and then advanced as we read */
+void shall_peek_start(struct shall_fsinfo *fi, loff_t skip,
+		      struct shall_peekptr *pp)
+{
+	loff_t where;
+	pp->skip = skip;
+	if (skip < 0 || skip >= fi->sbi.rw.read.committed) return;
+	if (skip == 0) {
+		pp->ptr = fi->sbi.rw.read.startptr;
+		return;
+	}
+	where = fi->sbi.rw.read.data_start + skip;
+	if (where >= fi->sbi.ro.data_space)
+		where -= fi->sbi.ro.data_space;
+	shall_calculate_block(where, fi->sbi.ro.num_superblocks, &pp->ptr);
+}
+
+/* code for shall_peek_next_*(): like read_code, but starts at the cursor
+ * and only advances the cursor, so the data stays in the journal; "copy"
+ * must return nonzero on error */
+#define peek_code(name, type, copy) \
+ssize_t name(struct shall_fsinfo *fi, struct shall_peekptr *pp, \
+	     void type *_d, size_t len) \
+{ \
+	char type * dest = _d; \
+	size_t orig = len; \
+	loff_t committed = fi->sbi.rw.read.committed - pp->skip; \
+	if (len < 1) return 0; \
+	if (pp->skip < 0 || pp->skip + len > fi->sbi.rw.read.data_length) \
+		return 0; \
+	pp->skip += len; \
+	/* first read any data which has already been committed */ \
+	while (len > 0 && committed > 0) { \
+		struct buffer_head * bh; \
+		size_t todo = len; \
+		int err; \
+		if (todo > committed) \
+			todo = committed; \
+		if (todo + pp->ptr.offset > SHALL_DEV_BLOCK) \
+			todo = SHALL_DEV_BLOCK - pp->ptr.offset; \
+		bh = sb_bread(fi->sb, pp->ptr.block); \
+		if (! bh) return -EIO; \
+		err = copy(dest, bh->b_data + pp->ptr.offset, todo); \
+		brelse(bh); \
+		if (err) return -EFAULT; \
+		len -= todo; \
+		dest += todo; \
+		committed -= todo; \
+		pp->ptr.offset += todo; \
+		if (pp->ptr.offset >= SHALL_DEV_BLOCK) { \
+			pp->ptr.offset -= SHALL_DEV_BLOCK; \
+			inc_block(&pp->ptr, &fi->sbi.ro.maxptr); \
+		} \
+	} \
+	if (len <= 0) return orig; \
+	/* if we get here, we'll need to read some uncommitted data */ \
+	if (copy(dest, \
+		 fi->sbi.rw.other.commit_buffer + \
+		 	fi->sbi.rw.read.buffer_read + \
+			pp->skip - len - fi->sbi.rw.read.committed, \
+		 len)) \
+		return -EFAULT; \
+	return orig; \
+}
+
+/* read a block of data from device or commit buffer at a cursor without
+ * removing it from the journal, and advance the cursor; caller must hold
+ * the mutex locked */
+peek_code(shall_peek_next_kernel, /* kernel */, kernelcpy)
+peek_code(shall_peek_next_user, __user, copy_to_user)
+
+/* read a block of data from device or commit buffer without removing it
+ * from the journal; "skip" is the number of bytes to skip from the start
+ * of the journal; caller must hold the mutex locked */
+ssize_t shall_peek_data_kernel(struct shall_fsinfo *fi, loff_t skip,
+			       void *dest, size_t len)
+{
+	struct shall_peekptr pp;
+	shall_peek_start(fi, skip, &pp);
+	return shall_peek_next_kernel(fi, &pp, dest, len);
+}
+
+ssize_t shall_peek_data_user(struct shall_fsinfo *fi, loff_t skip,
+			     void __user *dest, size_t len)
+{
+	struct shall_peekptr pp;
+	shall_peek_start(fi, skip, &pp);
+	return shall_peek_next_user(fi, &pp, dest, len);
+}
+
+/* start reading the device blocks which hold the committed part of the
+ * "len" bytes of journal data starting "skip" bytes after the beginning
+ * of the journal, without waiting for the I/O to complete: the
+ * shall_*_data_*() functions then find the blocks in the buffer cache
+ * instead of waiting for each one in turn; blocks which are already
+ * cached (for example because they were committed recently) don't cause
+ * any I/O; caller must hold the mutex locked */
+void shall_readahead_data(struct shall_fsinfo *fi, loff_t skip, size_t len) {
+	struct shall_devptr ptr;
+	struct blk_plug plug;
+	loff_t where, committed = fi->sbi.rw.read.committed;
+	int nblocks;
+	if (skip < 0 || skip >= committed) return;
+	if (len > committed - skip) len = committed - skip;
+	if (len > SHALL_READAHEAD_MAX) len = SHALL_READAHEAD_MAX;
+	if (skip == 0) {
+		ptr = fi->sbi.rw.read.startptr;
+	} else {
+		where = fi->sbi.rw.read.data_start + skip;
+		if (where >= fi->sbi.ro.data_space)
+			where -= fi->sbi.ro.data_space;
+		shall_calculate_block(where, fi->sbi.ro.num_superblocks, &ptr);
+	}
+	nblocks = (ptr.offset + len + SHALL_DEV_BLOCK - 1) / SHALL_DEV_BLOCK;
+	/* plug the queue so that runs of adjacent blocks go to the device
+	 * as a few large requests */
+	blk_start_plug(&plug);
+	while (nblocks-- > 0) {
+		sb_breadahead(fi->sb, ptr.block);
+		inc_block(&ptr, &fi->sbi.ro.maxptr);
+	}
+	blk_finish_plug(&plug);
+}
+
 /* write commit buffer to device; can be called with the mutex locked
  * or unlocked, but the caller needs to say what */
 int shall_write_data(struct shall_fsinfo *fi, int locked, int why, int sync) {
@@ -51,6 +51,42 @@ ssize_t shall_read_data_user(struct shall_fsinfo *, void __user *, size_t);
  */
 ssize_t shall_mark_read(struct shall_fsinfo *, size_t);
 
+/* read a block of data from device or commit buffer without removing it
+ * from the journal; "skip" is the number of bytes to skip from the start
+ * of the journal; caller must hold the mutex locked */
+ssize_t shall_peek_data_kernel(struct shall_fsinfo *, loff_t skip,
+			       void *, size_t);
+ssize_t shall_peek_data_user(struct shall_fsinfo *, loff_t skip,
+			     void __user *, size_t);
+
+/* a cursor for reading through the journal without removing anything;
+ * this avoids calculating the device position for each read */
+struct shall_peekptr {
+	struct shall_devptr ptr;	/* device position, if committed */
+	loff_t skip;			/* bytes from start of journal */
+};
+
+/* set up a cursor "skip" bytes after the start of the journal; caller
+ * must hold the mutex locked */
+void shall_peek_start(struct shall_fsinfo *, loff_t skip,
+		      struct shall_peekptr *);
+
+/* like shall_peek_data_*(), but read at a cursor and advance it; after
+ * an error the cursor must not be used again; caller must hold the
+ * mutex locked */
+ssize_t shall_peek_next_kernel(struct shall_fsinfo *, struct shall_peekptr *,
+			       void *, size_t);
+ssize_t shall_peek_next_user(struct shall_fsinfo *, struct shall_peekptr *,
+			     void __user *, size_t);
+
+/* max amount of data shall_readahead_data() asks the device for */
+#define SHALL_READAHEAD_MAX (256 * SHALL_DEV_BLOCK)
+
+/* start reading the blocks holding some committed journal data, without
+ * waiting for them; "skip" and "len" are like shall_peek_data_*(); caller
+ * must hold the mutex locked */
+void shall_readahead_data(struct shall_fsinfo *, loff_t skip, size_t len);
+
 /* write n-th superblock; caller needs to either hold the mutex, or
  * call this during umount after all operations complete */
 int shall_write_superblock(const struct shall_fsinfo *, int n, int sync);
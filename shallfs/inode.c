@@ -43,12 +43,15 @@
 #include <linux/poll.h>
 #include <linux/seq_file.h>
 #include <linux/xattr.h>
+#include <linux/uaccess.h>
+#include <linux/compat.h>
 #include <linux/version.h>
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 16, 0)
 #include <linux/iversion.h>
 #endif
 #include <shallfs/operation.h>
 #include <shallfs/device.h>
+#include <shallfs/ioctl.h>
 #include "shallfs.h"
 #include "log.h"
 
@@ -84,6 +87,19 @@
 #define SHALL_USE_OLD_XATTR_CODE 0
 #endif
 
+/* reflink support appeared as clone_file_range/dedupe_file_range and was
+ * later merged into a single remap_file_range */
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4, 5, 0)
+#define SHALL_HAS_CLONE_CODE 0
+#define SHALL_USE_OLD_CLONE_CODE 0
+#elif LINUX_VERSION_CODE < KERNEL_VERSION(4, 20, 0)
+#define SHALL_HAS_CLONE_CODE 1
+#define SHALL_USE_OLD_CLONE_CODE 1
+#else
+#define SHALL_HAS_CLONE_CODE 1
+#define SHALL_USE_OLD_CLONE_CODE 0
+#endif
+
 #if LINUX_VERSION_CODE < KERNEL_VERSION(4, 18, 0)
 typedef struct timespec struct_timespec;
 #else
@@ -515,6 +531,24 @@ static inline int log_writes(struct shall_file_data *fd) {
 	return 0;
 }
 
+/* the first operation which modifies data logs an OPEN and assigns a
+ * file ID; returns 1 if the file has an ID, 0 if it is not being logged */
+static int need_fileid(struct shall_fsinfo *fi, struct file *file,
+		       struct shall_file_data *fd)
+{
+	char * freeit, * path;
+	if (fd->has_id) return 1;
+	if (! log_writes(fd)) return 0;
+	path = find_path(file->f_path.dentry, &freeit);
+	if (! path) return -ENOMEM;
+	fd->has_id = 1;
+	fd->cached_log = 0;
+	fd->id = atomic_inc_return(&last_fileid);
+	shall_log_1i(fi, SHALL_OPEN, path, fd->id, 0);
+	if (freeit) shall_putname(fi, freeit);
+	return 1;
+}
+
 static ssize_t log_write_data(struct shall_fsinfo *fi,
 			      struct shall_file_data *fd,
 			      shall_log_mode_t log_mode,
@@ -548,15 +582,7 @@ static ssize_t shall_write(struct file *file, const char __user *src,
 	ssize_t res;
 	shall_log_mode_t log_mode;
 	if (! fd) return -EPIPE;
-	if (! fd->has_id && log_writes(fd)) {
-		char * freeit, * path = find_path(file->f_path.dentry, &freeit);
-		if (! path) return -ENOMEM;
-		fd->has_id = 1;
-		fd->cached_log = 0;
-		fd->id = atomic_inc_return(&last_fileid);
-		shall_log_1i(fi, SHALL_OPEN, path, fd->id, 0);
-		if (freeit) shall_putname(fi, freeit);
-	}
+	if (need_fileid(fi, file, fd) < 0) return -ENOMEM;
 	log_mode = fd->log_mode;
 	if (IS_LOG_BEFORE(fi) && log_writes(fd)) {
 		res = log_write_data(fi, fd, log_mode, -SHALL_WRITE,
@@ -1165,6 +1191,180 @@ static int shall_fsync(struct file *file, loff_t from, loff_t to, int data) {
 	return vfs_fsync_range(fd->file, from, to, data);
 }
 
+#if SHALL_HAS_CLONE_CODE
+/* reflink (FICLONE, FICLONERANGE, copy_file_range on filesystems which
+ * can share blocks): pass it on to the underlying filesystem and log a
+ * single CLONE event saying where the data came from, rather than making
+ * the destination look like a big write; if the source file cannot be
+ * identified (for example it has been deleted) we log the destination
+ * region as a WRITE instead, which is less compact but still correct */
+static loff_t clone_range(struct file *file_in, loff_t pos_in,
+			  struct file *file_out, loff_t pos_out,
+			  loff_t len, unsigned int remap_flags)
+{
+	struct shall_file_data * fd_in = file_in->private_data;
+	struct shall_file_data * fd_out = file_out->private_data;
+	struct shall_fsinfo * fi;
+	int log, src, err;
+	loff_t res;
+	if (! fd_in || ! fd_out) return -EINVAL;
+	fi = fd_out->fi;
+	log = need_fileid(fi, file_out, fd_out);
+	if (log < 0) return log;
+	src = log ? need_fileid(fi, file_in, fd_in) : 0;
+	if (src < 0) return src;
+	if (log) {
+		/* any cached WRITE must appear in the journal before the
+		 * clone, for both files */
+		if (src && log_writes(fd_in)) log_previous(fi, fd_in);
+		log_previous(fi, fd_out);
+	}
+	if (log && IS_LOG_BEFORE(fi)) {
+		if (src)
+			err = shall_log_0c(fi, -SHALL_CLONE, pos_in, len,
+					   fd_in->id, pos_out, fd_out->id, 0);
+		else
+			err = shall_log_0r(fi, -SHALL_WRITE, pos_out, len,
+					   fd_out->id, 0);
+		if (err) return err;
+	}
+#if SHALL_USE_OLD_CLONE_CODE
+	res = vfs_clone_file_range(fd_in->file, pos_in,
+				   fd_out->file, pos_out, len);
+	/* a length of 0 means "up to the end of the source file", and
+	 * the old interface returns 0 on success, so we work out what
+	 * has been cloned */
+	if (res == 0 && len == 0)
+		len = i_size_read(file_inode(fd_in->file)) - pos_in;
+#else
+	res = vfs_clone_file_range(fd_in->file, pos_in,
+				   fd_out->file, pos_out, len, remap_flags);
+	/* the new interface returns the length actually cloned, which
+	 * may be less than requested (or more, if len was 0) */
+	if (res > 0) len = res;
+#endif
+	if (log && IS_LOG_AFTER(fi)) {
+		/* like WRITE, the result is 0 on success and the region
+		 * describes what was actually done */
+		int result = res < 0 ? res : 0;
+		if (src)
+			shall_log_0c(fi, SHALL_CLONE, pos_in, len,
+				     fd_in->id, pos_out, fd_out->id, result);
+		else
+			shall_log_0r(fi, SHALL_WRITE, pos_out, len,
+				     fd_out->id, result);
+	}
+	return res;
+}
+
+#if SHALL_USE_OLD_CLONE_CODE
+static int shall_clone_file_range(struct file *file_in, loff_t pos_in,
+				  struct file *file_out, loff_t pos_out,
+				  u64 len)
+{
+	return clone_range(file_in, pos_in, file_out, pos_out, len, 0);
+}
+
+/* deduplication only succeeds if the data is already identical, so the
+ * file contents do not change and there is nothing to log */
+static ssize_t shall_dedupe_file_range(struct file *src, u64 loff, u64 len,
+				       struct file *dst, u64 dst_loff)
+{
+	struct shall_file_data * fd_src = src->private_data;
+	struct shall_file_data * fd_dst = dst->private_data;
+	struct file * u_src;
+	if (! fd_src || ! fd_dst) return -EINVAL;
+	u_src = fd_src->file;
+	if (! u_src->f_op || ! u_src->f_op->dedupe_file_range)
+		return -EINVAL;
+	return u_src->f_op->dedupe_file_range(u_src, loff, len,
+					      fd_dst->file, dst_loff);
+}
+#else
+static loff_t shall_remap_file_range(struct file *file_in, loff_t pos_in,
+				     struct file *file_out, loff_t pos_out,
+				     loff_t len, unsigned int remap_flags)
+{
+	struct shall_file_data * fd_in = file_in->private_data;
+	struct shall_file_data * fd_out = file_out->private_data;
+	if (! fd_in || ! fd_out) return -EINVAL;
+	/* deduplication only succeeds if the data is already identical,
+	 * so the file contents do not change and there is nothing to log */
+	if (remap_flags & REMAP_FILE_DEDUP)
+		return vfs_dedupe_file_range_one(fd_in->file, pos_in,
+						 fd_out->file, pos_out,
+						 len, remap_flags);
+	return clone_range(file_in, pos_in, file_out, pos_out,
+			   len, remap_flags);
+}
+#endif
+#endif /* SHALL_HAS_CLONE_CODE */
+
+/* add a batch of USERLOG events, see include/shallfs/ioctl.h */
+static long log_userlog(struct file *file, void __user *arg) {
+	struct shall_fsinfo * fi = file_inode(file)->i_sb->s_fs_info;
+	struct shall_userlog ul;
+	const void __user * data;
+	char * copy, * ptr, * end;
+	long done = 0;
+	int err = 0, max;
+	/* anybody who can change the file can say why they did it */
+	if (! (file->f_mode & FMODE_WRITE) && ! capable(CAP_SYS_ADMIN))
+		return -EPERM;
+	if (copy_from_user(&ul, arg, sizeof(ul))) return -EFAULT;
+	if (ul.length > SHALL_USERLOG_MAX) return -E2BIG;
+	if (ul.length < 1) return 0;
+	data = (const void __user *)(unsigned long)ul.data;
+	copy = shall_vmalloc(fi, ul.length + 1);
+	if (! copy) return -ENOMEM;
+	if (copy_from_user(copy, data, ul.length)) {
+		err = -EFAULT;
+		goto out;
+	}
+	/* make sure the last string is terminated */
+	copy[ul.length] = 0;
+	end = copy + ul.length;
+	/* check all markers before logging any, so a batch with a marker
+	 * which would be logged as TOO_BIG is rejected as a whole */
+	max = shall_log_1n_max(fi);
+	for (ptr = copy; ptr < end; ptr += strlen(ptr) + 1) {
+		if ((long)strlen(ptr) > max) {
+			err = -E2BIG;
+			goto out;
+		}
+	}
+	for (ptr = copy; ptr < end; ptr += strlen(ptr) + 1) {
+		if (! *ptr) continue;
+		err = shall_log_1n(fi, SHALL_USERLOG, ptr, 0);
+		if (err) break;
+		done++;
+	}
+out:
+	shall_vfree(fi, copy);
+	return done > 0 ? done : err;
+}
+
+/* ioctls on files and directories; we don't pass anything we don't know
+ * to the underlying filesystem, as it could change the file without us
+ * logging it */
+static long shall_ioctl(struct file *file, unsigned int cmd,
+			unsigned long arg)
+{
+	switch (cmd) {
+		case SHALL_IOC_USERLOG :
+			return log_userlog(file, (void __user *)arg);
+	}
+	return -ENOTTY;
+}
+
+#ifdef CONFIG_COMPAT
+static long shall_compat_ioctl(struct file *file, unsigned int cmd,
+			       unsigned long arg)
+{
+	return shall_ioctl(file, cmd, (unsigned long)compat_ptr(arg));
+}
+#endif
+
 /* file operations for regular files; pretty much everything except
  * readdir */
 static struct file_operations shall_file_file_operations = {
@@ -1178,8 +1378,16 @@ static struct file_operations shall_file_file_operations = {
 	.poll		= shall_poll,
 	.show_fdinfo	= shall_show_fdinfo,
 	.fsync		= shall_fsync,
-	// XXX long (*unlocked_ioctl) (struct file *, unsigned int, unsigned long);
-	// XXX long (*compat_ioctl) (struct file *, unsigned int, unsigned long);
+#if SHALL_USE_OLD_CLONE_CODE
+	.clone_file_range	= shall_clone_file_range,
+	.dedupe_file_range	= shall_dedupe_file_range,
+#elif SHALL_HAS_CLONE_CODE
+	.remap_file_range	= shall_remap_file_range,
+#endif
+	.unlocked_ioctl	= shall_ioctl,
+#ifdef CONFIG_COMPAT
+	.compat_ioctl	= shall_compat_ioctl,
+#endif
 	// XXX int (*mmap) (struct file *, struct vm_area_struct *);
 	// XXX void (*mremap)(struct file *, struct vm_area_struct *);
 	// XXX int (*fasync) (int, struct file *, int);
@@ -1200,9 +1408,11 @@ static struct file_operations shall_dir_file_operations = {
 	.llseek		= shall_llseek,
 	.read		= generic_read_dir,
 	.release	= shall_release,
-	.fsync		= shall_fsync
-	// XXX long (*unlocked_ioctl) (struct file *, unsigned int, unsigned long);
-	// XXX long (*compat_ioctl) (struct file *, unsigned int, unsigned long);
+	.fsync		= shall_fsync,
+	.unlocked_ioctl	= shall_ioctl,
+#ifdef CONFIG_COMPAT
+	.compat_ioctl	= shall_compat_ioctl,
+#endif
 };
 
 /* inode operation for "other" types of files, which in this context means
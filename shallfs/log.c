@@ -42,6 +42,7 @@
 #include "shallfs.h"
 #include "super.h"
 #include "device.h"
+#include "ring.h"
 #include "log.h"
 
 #ifdef CONFIG_SHALL_FS_DEBUG
@@ -364,6 +365,7 @@ static int print_log(char __user *dest, int remain, int operation, int result,
 	const struct shall_devsize *dsh;
 	const struct shall_devxattr *dx;
 	const struct shall_devhash *dh;
+	const struct shall_devclone *dc;
 	int prnop = operation, dataflag, xf, n, ne, err = 0, len = remain;
 	add_time(&dest, &len, "@", time);
 	if (prnop == 0) {
@@ -477,6 +479,24 @@ static int print_log(char __user *dest, int remain, int operation, int result,
 				err = add_data(&dest, &len, " data=",
 					       &dr[1], le64_to_cpu(dr->length));
 			break;
+		case SHALL_LOG_CLONE :
+			dc = data_ptr;
+			if (err == 0)
+				err = add_number(&dest, &len, " id=",
+						 le32_to_cpu(dc->src_fileid));
+			if (err == 0)
+				err = add_bignum(&dest, &len, " start=",
+						 le64_to_cpu(dc->src_start));
+			if (err == 0)
+				err = add_bignum(&dest, &len, " length=",
+						 le64_to_cpu(dc->length));
+			if (err == 0)
+				err = add_number(&dest, &len, " to_id=",
+						 le32_to_cpu(dc->dst_fileid));
+			if (err == 0)
+				err = add_bignum(&dest, &len, " to_start=",
+						 le64_to_cpu(dc->dst_start));
+			break;
 	}
 	return err ? err : (remain - len);
 }
@@ -513,6 +533,15 @@ static void add_padding(struct shall_fsinfo *fi, int len) {
 	}
 }
 
+/* copy the event just added to the commit buffer, starting at "start",
+ * to the mmap ring if there is one; caller must hold the mutex locked */
+static inline void ring_event(struct shall_fsinfo *fi, int start) {
+	if (fi->ring)
+		shall_ring_add(fi->ring,
+			       fi->sbi.rw.other.commit_buffer + start,
+			       fi->sbi.rw.read.buffer_written - start);
+}
+
 /* calculate checksum on a log header: all data is stored to device in
  * little-endian format so we use crc32_le */
 #define checksum_header(sh) \
@@ -535,7 +564,7 @@ static void log_overflow(struct shall_fsinfo *fi, int space) {
 	struct shall_devheader ovh;
 	struct timespec overflowed;
 	unsigned int next_header;
-	int num_dropped;
+	int num_dropped, start;
 	/* we need to lock the log queue; we make sure the order is mutex
 	 * first, spin next, to avoid the possibility of deadlock */
 	spin_lock(&fi->lq.log_queue.lock);
@@ -566,15 +595,18 @@ static void log_overflow(struct shall_fsinfo *fi, int space) {
 	ovh.result = cpu_to_le32(0);
 	ovh.flags = cpu_to_le32(SHALL_LOG_NODATA);
 	ovh.checksum = cpu_to_le32(checksum_header(ovh));
+	start = fi->sbi.rw.read.buffer_written;
 	add_blob(fi, &ovh, sizeof(ovh));
 	if (next_header > sizeof(ovh))
 		add_padding(fi, next_header - sizeof(ovh));
+	ring_event(fi, start);
 	if (fi->sbi.rw.read.buffer_written >= fi->options.commit_size)
 		shall_write_data(fi, 1, 1, 0);
 	fi->sbi.rw.other.logged++;
 	if (fi->sbi.rw.other.max_length < fi->sbi.rw.read.data_length)
 		fi->sbi.rw.other.max_length = fi->sbi.rw.read.data_length;
 	atomic_set(&fi->sbi.ro.some_data, 1);
+	atomic_inc(&fi->sbi.ro.log_seq);
 	wake_up_all(&fi->sbi.ro.data_queue);
 }
 
@@ -590,7 +622,7 @@ static int append_logs(struct shall_fsinfo *fi, int operation, int result,
 	struct timespec requested = current_kernel_time();
 	const struct cred * kcreds;
 	unsigned int next_header, required, padding;
-	int err, data, dataflag;
+	int err, data, dataflag, start;
 	__le64 id;
 	/* we always log credentials; the flag is only there because logs
 	 * generated from older version didn't have them */
@@ -743,6 +775,7 @@ retry_size_check:
 	/* OK, we have enough space in the buffer, we have enough space in
 	 * the device, and we have the mutex, time to store all that data */
 	need_commit(fi, next_header);
+	start = fi->sbi.rw.read.buffer_written;
 	add_blob(fi, &lh, sizeof(lh));
 	if (flags & SHALL_LOG_CREDS)
 		add_blob(fi, &dcreds, sizeof(dcreds));
@@ -758,11 +791,13 @@ retry_size_check:
 	}
 	if (dataflag) add_blob(fi, dptr[data], dlen[data]);
 	if (padding > 0) add_padding(fi, padding);
+	ring_event(fi, start);
 out_noerror:
 	if (fi->sbi.rw.other.max_length < fi->sbi.rw.read.data_length)
 		fi->sbi.rw.other.max_length = fi->sbi.rw.read.data_length;
 	mutex_unlock(&fi->sbi.mutex);
 	atomic_set(&fi->sbi.ro.some_data, 1);
+	atomic_inc(&fi->sbi.ro.log_seq);
 	wake_up_all(&fi->sbi.ro.data_queue);
 	return 0;
 }
@@ -837,6 +872,32 @@ int shall_log_0d(struct shall_fsinfo *fi, int operation,
 	}
 }
 
+/* log an event with 0 filenames and a clone structure */
+int shall_log_0c(struct shall_fsinfo *fi, int operation,
+		 loff_t src_start, size_t length, int src_fileid,
+		 loff_t dst_start, int dst_fileid, int result)
+{
+	struct shall_devclone dc;
+	const void * ptr = &dc;
+	int len = sizeof(dc);
+	dc.src_start = cpu_to_le64(src_start);
+	dc.length = cpu_to_le64(length);
+	dc.dst_start = cpu_to_le64(dst_start);
+	dc.src_fileid = cpu_to_le32(src_fileid);
+	dc.dst_fileid = cpu_to_le32(dst_fileid);
+	return append_logs(fi, operation, result, SHALL_LOG_CLONE, &ptr, &len);
+}
+
+/* largest name shall_log_1n can log in one commit */
+int shall_log_1n_max(const struct shall_fsinfo *fi) {
+	/* logsize(len) <= commit_size if and only if len is no more than
+	 * commit_size rounded down to the alignment */
+	int space = rounddown(fi->options.commit_size,
+			      fi->sbi.ro.log_alignment);
+	return space - sizeof(struct shall_devheader) -
+		sizeof(struct shall_devcreds) - sizeof(struct shall_devfileid);
+}
+
 /* log an event with 1 filename and no other data */
 int shall_log_1n(struct shall_fsinfo *fi, int operation,
 		 const char *name, int result)
@@ -1020,11 +1081,11 @@ static void shall_log_recovery(struct shall_fsinfo *fi) {
 	struct shall_devsize dsh;
 	struct timespec recovered;
 	int64_t extra_space;
-	int data_size = sizeof(sh) + sizeof(dsh), num_dropped;
+	int data_size = sizeof(sh) + sizeof(dsh), num_dropped, start;
 	int next_header = logsize(fi, data_size);
 	int required = next_header + logsize(fi, sizeof(sh));
 	if (required + fi->sbi.rw.read.data_length > fi->sbi.ro.data_space)
-		return
+		return;
 	/* lock the queue... note order of locking to avoid deadlock, the
 	 * mutex first (done by caller), the spin lock next */
 	spin_lock(&fi->lq.log_queue.lock);
@@ -1047,16 +1108,19 @@ static void shall_log_recovery(struct shall_fsinfo *fi) {
 	sh.result = cpu_to_le32(num_dropped);
 	sh.flags = cpu_to_le32(SHALL_LOG_SIZE);
 	sh.checksum = cpu_to_le32(checksum_header(sh));
+	start = fi->sbi.rw.read.buffer_written;
 	add_blob(fi, &sh, sizeof(sh));
 	add_blob(fi, &dsh, sizeof(dsh));
 	if (next_header > data_size)
 		add_padding(fi, next_header - data_size);
+	ring_event(fi, start);
 	if (fi->sbi.rw.read.buffer_written >= fi->options.commit_size)
 		shall_write_data(fi, 1, 1, 0);
 	fi->sbi.rw.other.logged++;
 	if (fi->sbi.rw.other.max_length < fi->sbi.rw.read.data_length)
 		fi->sbi.rw.other.max_length = fi->sbi.rw.read.data_length;
 	atomic_set(&fi->sbi.ro.some_data, 1);
+	atomic_inc(&fi->sbi.ro.log_seq);
 	wake_up_all(&fi->sbi.ro.data_queue);
 }
 
@@ -1077,41 +1141,107 @@ static int get_log_devheader(struct shall_fsinfo *fi,
 	return next_header;
 }
 
+/* check a header found "skip" bytes after the start of the journal;
+ * returns the total length of the event, or negative if invalid */
+static int check_log_devheader(struct shall_fsinfo *fi, loff_t skip,
+			       const struct shall_devheader *evh)
+{
+	int next_header, chk;
+	chk = checksum_header(*evh);
+	if (chk != le32_to_cpu(evh->checksum)) return -EINVAL;
+	next_header = le32_to_cpu(evh->next_header);
+	if (next_header < sizeof(*evh)) return -EINVAL;
+	if (skip + next_header > fi->sbi.rw.read.data_length) return -EINVAL;
+	return next_header;
+}
+
+/* like get_log_devheader, but looks at the header "skip" bytes after the
+ * start of the journal and leaves it there; returns 0 if there isn't a
+ * complete header at that position */
+static int peek_log_devheader(struct shall_fsinfo *fi, loff_t skip,
+			      struct shall_devheader *evh)
+{
+	int err;
+	if (skip + sizeof(*evh) > fi->sbi.rw.read.data_length) return 0;
+	err = shall_peek_data_kernel(fi, skip, evh, sizeof(*evh));
+	if (err <= 0) return err;
+	return check_log_devheader(fi, skip, evh);
+}
+
+/* like peek_log_devheader, but reads the header at a cursor and advances
+ * it to the event's data */
+static int next_log_devheader(struct shall_fsinfo *fi,
+			      struct shall_peekptr *pp,
+			      struct shall_devheader *evh)
+{
+	loff_t skip = pp->skip;
+	int err;
+	if (skip + sizeof(*evh) > fi->sbi.rw.read.data_length) return 0;
+	err = shall_peek_next_kernel(fi, pp, evh, sizeof(*evh));
+	if (err <= 0) return err;
+	return check_log_devheader(fi, skip, evh);
+}
+
+/* lock the mutex before reading logs; if "nowait" is set and somebody
+ * else holds the mutex, return -EAGAIN instead of sleeping */
+static inline int lock_for_reading(struct shall_fsinfo *fi, int nowait) {
+	if (! nowait) {
+		mutex_lock(&fi->sbi.mutex);
+		return 0;
+	}
+	return mutex_trylock(&fi->sbi.mutex) ? 0 : -EAGAIN;
+}
+
 /* retrieves logs from device and/or memory buffer and store it in the
  * memory area provided; returns the amount of buffer actually used,
  * which may be 0 if there was nothing available, or negative if an
  * error occurred */
 ssize_t shall_bin_logs(struct shall_fsinfo *fi,
-		       char __user *buffer, size_t space)
+		       char __user *buffer, size_t space, int nowait)
 {
 	struct shall_sbinfo_rw_read save;
 	struct shall_devheader evh;
+	struct shall_peekptr pp;
 	ssize_t done = 0, err = 0;
 	if (space < 1) return 0;
-	mutex_lock(&fi->sbi.mutex);
+	err = lock_for_reading(fi, nowait);
+	if (err) return err;
 	save = fi->sbi.rw.read;
-	while (space >= sizeof(evh)) {
-		/* read next event header and make sure it's valid */
-		int next_header, err;
-		save = fi->sbi.rw.read;
-		err = get_log_devheader(fi, &evh);
-		if (err <= 0) goto out_restore;
-		next_header = err;
-		/* see if the user has enough space */
-		if (space < next_header) goto out_nospace;
-		/* copy header to userspace */
-		if (copy_to_user(buffer, &evh, sizeof(evh))) goto out_fault;
-		/* read remaining log data into userspace */
+	/* get the device started on all the blocks we may need */
+	shall_readahead_data(fi, 0, space);
+	/* copy as many complete events as fit in the space provided,
+	 * checking each header as we go; the cursor walks the journal so
+	 * each block is only looked up once, and the events stay in the
+	 * journal until we know how much we copied */
+	shall_peek_start(fi, 0, &pp);
+	while (space - done >= sizeof(evh)) {
+		int next_header = next_log_devheader(fi, &pp, &evh);
+		if (next_header < 0) err = next_header;
+		if (next_header <= 0) break;
+		if (space - done < next_header) {
+			err = -EFBIG;
+			break;
+		}
+		if (copy_to_user(buffer + done, &evh, sizeof(evh))) {
+			err = -EFAULT;
+			break;
+		}
 		if (next_header > sizeof(evh)) {
-			err = shall_read_data_user(fi, buffer + sizeof(evh),
+			err = shall_peek_next_user(fi, &pp,
+						   buffer + done + sizeof(evh),
 						   next_header - sizeof(evh));
-			if (err < 0) goto out_restore;
-			if (err == 0) goto out_invalid;
+			if (err <= 0) {
+				if (err == 0) err = -EINVAL;
+				break;
+			}
 		}
-		space -= next_header;
-		buffer += next_header;
 		done += next_header;
 	}
+	if (done < 1) goto out_restore;
+	/* now remove all these events in one go */
+	err = shall_mark_read(fi, done);
+	if (err < 0) goto out_restore;
+	if (err < done) goto out_invalid;
 	atomic_set(&fi->sbi.ro.some_data,
 		   fi->sbi.rw.read.data_length >=
 		   	sizeof(struct shall_devheader));
@@ -1123,36 +1253,20 @@ ssize_t shall_bin_logs(struct shall_fsinfo *fi,
 	return done;
 out_invalid:
 	err = -EINVAL;
-	goto out_restore;
-out_nospace:
-	err = -EFBIG;
-	goto out_restore;
-out_fault:
-	err = -EFAULT;
 out_restore:
 	fi->sbi.rw.read = save;
-	atomic_set(&fi->sbi.ro.some_data,
-		   fi->sbi.rw.read.data_length >=
-		   	sizeof(struct shall_devheader));
-	if (done > 0) {
-		/* if we are in an overflow situation, try to log a
-		 * recovery event */
-		shall_log_recovery(fi);
-		/* if anybody was waiting for space... let them try */
-		wake_up_all(&fi->lq.log_queue);
-	}
 	mutex_unlock(&fi->sbi.mutex);
-	return done > 0 ? done : err;
+	return err;
 }
 
-/* remove logs from journal without storing them anywhere; caller must
- * not already hold the mutex */
-int shall_delete_logs(struct shall_fsinfo *fi, size_t skip) {
+/* remove logs from journal without storing them anywhere; can be called
+ * with the mutex locked or unlocked, but the caller needs to say what */
+ssize_t shall_delete_logs(struct shall_fsinfo *fi, size_t skip, int locked) {
 	struct shall_sbinfo_rw_read save;
 	struct shall_devheader evh;
 	ssize_t done = 0, err = 0;
 	if (skip < 1) return 0;
-	mutex_lock(&fi->sbi.mutex);
+	if (! locked) mutex_lock(&fi->sbi.mutex);
 	save = fi->sbi.rw.read;
 	while (skip >= sizeof(struct shall_devheader)) {
 		/* read next event header and skip the whole thing */
@@ -1177,7 +1291,7 @@ int shall_delete_logs(struct shall_fsinfo *fi, size_t skip) {
 	shall_log_recovery(fi);
 	/* if anybody was waiting for space... let them try */
 	wake_up_all(&fi->lq.log_queue);
-	mutex_unlock(&fi->sbi.mutex);
+	if (! locked) mutex_unlock(&fi->sbi.mutex);
 	return done;
 out_restore:
 	fi->sbi.rw.read = save;
@@ -1191,10 +1305,256 @@ out_restore:
 		/* if anybody was waiting for space... let them try */
 		wake_up_all(&fi->lq.log_queue);
 	}
+	if (! locked) mutex_unlock(&fi->sbi.mutex);
+	return done > 0 ? done : err;
+}
+
+/* read a number (fileid or name length) while checking a plog filter */
+static int peek_number(struct shall_fsinfo *fi, loff_t ptr, loff_t end,
+		       int *num)
+{
+	struct shall_devfileid dfi;
+	int err;
+	if (ptr + sizeof(dfi) > end) return -EINVAL;
+	err = shall_peek_data_kernel(fi, ptr, &dfi, sizeof(dfi));
+	if (err <= 0) return err ? err : -EINVAL;
+	*num = le32_to_cpu(dfi.fileid);
+	return 0;
+}
+
+/* check if the file name at "*ptr" starts with the filter prefix, and
+ * advance "*ptr" past it; returns 1 if it matches, 0 if not, negative
+ * if error */
+static int peek_prefix(struct shall_reader *rd, loff_t *ptr, loff_t end) {
+	char name[SHALL_FILTER_PREFIX_MAX];
+	int len, plen = rd->filter.prefix_length, matches = 0, err;
+	err = peek_number(rd->fi, *ptr, end, &len);
+	if (err) return err;
+	*ptr += sizeof(struct shall_devfileid);
+	if (len < 0 || *ptr + len > end) return -EINVAL;
+	if (len >= plen) {
+		if (plen > 0) {
+			err = shall_peek_data_kernel(rd->fi, *ptr, name, plen);
+			if (err < 0) return err;
+		}
+		matches = memcmp(name, rd->filter.prefix, plen) == 0;
+	}
+	*ptr += len;
+	return matches;
+}
+
+/* decide whether a plog reader wants the event at "skip"; events without
+ * file names or file IDs (mount, overflow, etc) always pass the prefix
+ * test, and file IDs pass it if they were opened with a matching name
+ * while this reader was reading; "*forget" is set to a file ID to stop
+ * tracking once the event has been processed; called with mutex locked;
+ * returns 1 if the event is wanted, 0 if not, negative if error */
+static int reader_wants(struct shall_reader *rd, loff_t skip,
+			const struct shall_devheader *evh, int *forget)
+{
+	struct shall_fsinfo * fi = rd->fi;
+	const struct shall_filter * filter = &rd->filter;
+	int operation = (int)le32_to_cpu(evh->operation);
+	/* events logged before the operation have negative opcodes */
+	unsigned int opcode = operation < 0 ? -operation : operation;
+	unsigned int flags = le32_to_cpu(evh->flags);
+	loff_t ptr = skip + sizeof(*evh);
+	loff_t end = skip + le32_to_cpu(evh->next_header);
+	int wanted = 1, err, ids[2], nids = 0, n;
+	*forget = 0;
+	if (! filter->flags) return 1;
+	if (filter->flags & SHALL_FILTER_OPERATION) {
+		if (opcode >= 64 ||
+		    ! (filter->operations & (1ULL << opcode)))
+			wanted = 0;
+	}
+	if (flags & SHALL_LOG_CREDS) {
+		struct shall_devcreds dc;
+		if (filter->flags & SHALL_FILTER_UID) {
+			if (ptr + sizeof(dc) > end) return -EINVAL;
+			err = shall_peek_data_kernel(fi, ptr, &dc, sizeof(dc));
+			if (err <= 0) return err ? err : -EINVAL;
+			if (le64_to_cpu(dc.uid) != filter->uid) wanted = 0;
+		}
+		ptr += sizeof(dc);
+	} else if (filter->flags & SHALL_FILTER_UID) {
+		wanted = 0;
+	}
+	if (! (filter->flags & SHALL_FILTER_PREFIX)) return wanted;
+	/* we need to look at the names even if the event is not wanted,
+	 * because an OPEN tells us which file IDs are under the prefix */
+	if (flags & (SHALL_LOG_FILE1 | SHALL_LOG_FILE2)) {
+		int matches = 0;
+		if (flags & SHALL_LOG_FILE1) {
+			err = peek_prefix(rd, &ptr, end);
+			if (err < 0) return err;
+			matches |= err;
+		}
+		if (flags & SHALL_LOG_FILE2) {
+			err = peek_prefix(rd, &ptr, end);
+			if (err < 0) return err;
+			matches |= err;
+		}
+		if ((flags & SHALL_LOG_DMASK) == SHALL_LOG_FILEID &&
+		    matches)
+		{
+			/* remember this file ID */
+			err = peek_number(fi, ptr, end, &ids[0]);
+			if (err) return err;
+			if (ids[0] > 0 && ! idr_find(&rd->fileids, ids[0])) {
+				err = idr_alloc(&rd->fileids, rd, ids[0],
+						ids[0] + 1, GFP_KERNEL);
+				if (err < 0 && err != -ENOSPC) return err;
+			}
+		}
+		return wanted && matches;
+	}
+	switch (flags & SHALL_LOG_DMASK) {
+		case SHALL_LOG_FILEID :
+			err = peek_number(fi, ptr, end, &ids[nids++]);
+			if (err) return err;
+			break;
+		case SHALL_LOG_REGION :
+		case SHALL_LOG_HASH :
+		case SHALL_LOG_DATA :
+			err = peek_number(fi,
+					  ptr + offsetof(struct shall_devregion,
+							 fileid),
+					  end, &ids[nids++]);
+			if (err) return err;
+			break;
+		case SHALL_LOG_CLONE :
+			err = peek_number(fi,
+					  ptr + offsetof(struct shall_devclone,
+							 src_fileid),
+					  end, &ids[nids++]);
+			if (err) return err;
+			err = peek_number(fi,
+					  ptr + offsetof(struct shall_devclone,
+							 dst_fileid),
+					  end, &ids[nids++]);
+			if (err) return err;
+			break;
+	}
+	if (nids == 0) return wanted;
+	for (n = 0; n < nids; n++)
+		if (ids[n] > 0 && idr_find(&rd->fileids, ids[n]))
+			break;
+	if (n >= nids) return 0;
+	if (operation == SHALL_CLOSE)
+		*forget = ids[n];
+	return wanted;
+}
+
+/* like shall_bin_logs, but leaves the logs in the journal and returns
+ * only the events which pass the reader's filter; "*pos" is the reader's
+ * cursor, measured from the start of the data consumed since mount (see
+ * rw.read.consumed) and updated to point just after the last event
+ * examined; if the data under the cursor has been removed by somebody
+ * else, the cursor moves to the current start of the journal */
+ssize_t shall_peek_logs(struct shall_reader *rd, loff_t *pos,
+			char __user *buffer, size_t space, int nowait)
+{
+	struct shall_fsinfo * fi = rd->fi;
+	struct shall_devheader evh;
+	ssize_t done = 0, err = 0;
+	loff_t skip, scanned = 0;
+	if (space < 1) return 0;
+	err = lock_for_reading(fi, nowait);
+	if (err) return err;
+	rd->seen = atomic_read(&fi->sbi.ro.log_seq);
+	skip = *pos - fi->sbi.rw.read.consumed;
+	if (skip < 0) skip = 0;
+	shall_readahead_data(fi, skip, SHALL_PEEK_SCAN);
+	while (space >= sizeof(evh)) {
+		/* read next event header and make sure it's valid */
+		int next_header, forget;
+		/* don't hold the mutex forever skipping unwanted events */
+		if (scanned >= SHALL_PEEK_SCAN) break;
+		err = peek_log_devheader(fi, skip, &evh);
+		if (err <= 0) goto out;
+		next_header = err;
+		/* see if the reader wants this at all */
+		err = reader_wants(rd, skip, &evh, &forget);
+		if (err < 0) goto out;
+		if (err == 0) {
+			if (forget) idr_remove(&rd->fileids, forget);
+			skip += next_header;
+			scanned += next_header;
+			continue;
+		}
+		/* see if the user has enough space */
+		if (space < next_header) goto out_nospace;
+		/* copy header and remaining log data to userspace */
+		if (copy_to_user(buffer, &evh, sizeof(evh))) goto out_fault;
+		if (next_header > sizeof(evh)) {
+			err = shall_peek_data_user(fi, skip + sizeof(evh),
+						   buffer + sizeof(evh),
+						   next_header - sizeof(evh));
+			if (err < 0) goto out;
+			if (err == 0) goto out_invalid;
+		}
+		if (forget) idr_remove(&rd->fileids, forget);
+		skip += next_header;
+		scanned += next_header;
+		space -= next_header;
+		buffer += next_header;
+		done += next_header;
+	}
+	err = 0;
+	goto out;
+out_invalid:
+	err = -EINVAL;
+	goto out;
+out_nospace:
+	err = -EFBIG;
+	goto out;
+out_fault:
+	err = -EFAULT;
+out:
+	*pos = fi->sbi.rw.read.consumed + skip;
+	rd->more = fi->sbi.rw.read.data_length >= skip + sizeof(evh);
 	mutex_unlock(&fi->sbi.mutex);
 	return done > 0 ? done : err;
 }
 
+/* remove from the journal whatever all registered readers have finished
+ * with; only whole events are removed, so if the slowest reader is in the
+ * middle of an event that event stays in the journal; if there are no
+ * registered readers nothing is removed; caller must hold the mutex */
+ssize_t shall_reclaim_logs(struct shall_fsinfo *fi) {
+	struct shall_reader * rd;
+	loff_t upto = -1, skip;
+	list_for_each_entry(rd, &fi->readers, list)
+		if (rd->registered && (upto < 0 || rd->acked < upto))
+			upto = rd->acked;
+	if (upto < 0) return 0;
+	skip = upto - fi->sbi.rw.read.consumed;
+	if (skip < 1) return 0;
+	return shall_delete_logs(fi, skip, 1);
+}
+
+/* record that a reader has finished with everything before position
+ * "upto", as returned in the cursor by shall_peek_logs(), and remove from
+ * the journal whatever all registered readers have finished with; caller
+ * must not already hold the mutex */
+ssize_t shall_ack_logs(struct shall_reader *rd, loff_t upto) {
+	struct shall_fsinfo * fi = rd->fi;
+	ssize_t err = 0;
+	mutex_lock(&fi->sbi.mutex);
+	if (upto > fi->sbi.rw.read.consumed + fi->sbi.rw.read.data_length) {
+		err = -EINVAL;
+		goto out;
+	}
+	if (rd->acked < upto) rd->acked = upto;
+	/* space is only reclaimed up to the slowest registered reader */
+	if (rd->registered)
+		err = shall_reclaim_logs(fi);
+out:
+	mutex_unlock(&fi->sbi.mutex);
+	return err;
+}
+
 #ifdef CONFIG_SHALL_FS_DEBUG
 /* read and decode next log header; called with mutex locked; returns the
  * amount of data read, 0 if not enough data available, or negative if error */
@@ -1232,7 +1592,7 @@ static inline int add_string_user(char __user *dest, int *used,
 
 /* similar to shall_bin_logs, but produces a printable version */
 ssize_t shall_print_logs(struct shall_fsinfo *fi,
-			 char __user * buffer, size_t space)
+			 char __user * buffer, size_t space, int nowait)
 {
 	struct shall_sbinfo_rw_read save, svfile1, svfile2, svtemp;
 	struct shall_header sh;
@@ -1243,11 +1603,13 @@ ssize_t shall_print_logs(struct shall_fsinfo *fi,
 	struct shall_devacl dlh;
 	struct shall_devxattr dxh;
 	struct shall_devhash dhh;
+	struct shall_devclone dch;
 	struct shall_devcreds credh;
 	void * freeit = NULL;
 	ssize_t done = 0, err = 0;
 	if (space < 1) return 0;
-	mutex_lock(&fi->sbi.mutex);
+	err = lock_for_reading(fi, nowait);
+	if (err) return err;
 	save = fi->sbi.rw.read;
 	while (space > 0) {
 		/* read next event header and make sure it's valid */
@@ -1386,6 +1748,12 @@ ssize_t shall_print_logs(struct shall_fsinfo *fi,
 				s_count += err;
 				data_ptr = freeit;
 				break;
+			case SHALL_LOG_CLONE :
+				err = read_structure(dch);
+				if (err <= 0) goto out_restore;
+				data_ptr = &dch;
+				s_count += err;
+				break;
 		}
 		/* now try to print log */
 		if (space < d_space + 10) goto out_nospace;
@@ -24,6 +24,8 @@
 #define _SHALL_LOG_H_
 
 #include <linux/posix_acl.h>
+#include <linux/idr.h>
+#include <shallfs/ioctl.h>
 #ifdef CONFIG_SHALL_FS_DEBUG
 #include <linux/slab.h>
 #endif
@@ -56,10 +58,19 @@ int shall_log_0d(struct shall_fsinfo *, int operation,
 		 loff_t start, size_t length, const char __user *data,
 		 int fileid, int result);
 
+/* log an event with 0 filenames and a clone structure */
+int shall_log_0c(struct shall_fsinfo *, int operation,
+		 loff_t src_start, size_t length, int src_fileid,
+		 loff_t dst_start, int dst_fileid, int result);
+
 /* log an event with 1 filename and no other data */
 int shall_log_1n(struct shall_fsinfo *, int operation,
 		 const char *, int result);
 
+/* length of the longest filename shall_log_1n() can log without the
+ * event becoming TOO_BIG */
+int shall_log_1n_max(const struct shall_fsinfo *);
+
 /* log an event with 1 filename and integer data (fileid) */
 int shall_log_1i(struct shall_fsinfo *, int operation,
 		 const char *, int fileid, int result);
@@ -202,16 +213,54 @@ static __always_inline void __shall_putname(struct shall_fsinfo *fi, char *ptr,
 /* retrieves logs from journal and/or memory buffer and store it in the
  * memory area provided; returns the amount of buffer actually used,
  * which may be 0 if there was nothing available, or negative if an
- * error occurred */
-ssize_t shall_bin_logs(struct shall_fsinfo *, char __user *, size_t);
+ * error occurred; if the last argument is nonzero and the mutex is
+ * busy, returns -EAGAIN rather than waiting for it */
+ssize_t shall_bin_logs(struct shall_fsinfo *, char __user *, size_t,
+		       int nowait);
+
+/* removes logs from journal without storing them anywhere; can be called
+ * with the mutex locked or unlocked, but the caller needs to say what */
+ssize_t shall_delete_logs(struct shall_fsinfo *, size_t, int locked);
+
+/* state of a /proc/fs/shallfs/<device>/plog reader (see proc.c); all
+ * fields except "fi" are protected by the mutex */
+struct shall_reader {
+	struct shall_fsinfo * fi;
+	struct list_head list;		/* all readers of filesystem */
+	loff_t acked;			/* reader is done with data before
+					 * this position */
+	int registered;			/* hold unacked data */
+	int more;			/* data left after last read */
+	int seen;			/* log_seq at the last read */
+	struct shall_filter filter;	/* events the reader wants */
+	struct idr fileids;		/* file IDs opened under
+					 * filter.prefix */
+};
+
+/* max amount of data shall_peek_logs examines while holding the mutex */
+#define SHALL_PEEK_SCAN 1048576
+
+/* like shall_bin_logs, but leaves the logs in the journal and only
+ * returns events matching the reader's filter; the second argument is
+ * the reader's cursor, which is updated to point just after the last
+ * event examined */
+ssize_t shall_peek_logs(struct shall_reader *, loff_t *,
+			char __user *, size_t, int nowait);
+
+/* records that a reader is done with all data before the given cursor
+ * position, and removes from the journal any data which all registered
+ * readers are done with; caller must not already hold the mutex */
+ssize_t shall_ack_logs(struct shall_reader *, loff_t);
 
-/* removes logs from journal without storing them anywhere; caller must
- * not already hold the mutex */
-int shall_delete_logs(struct shall_fsinfo *, size_t);
+/* removes from the journal any data which all registered readers are
+ * done with, for example after the slowest reader went away; caller
+ * must hold the mutex */
+ssize_t shall_reclaim_logs(struct shall_fsinfo *);
 
 #ifdef CONFIG_SHALL_FS_DEBUG
 /* similar to shall_bin_logs, but produces a printable version */
-ssize_t shall_print_logs(struct shall_fsinfo *, char __user *, size_t);
+ssize_t shall_print_logs(struct shall_fsinfo *, char __user *, size_t,
+			 int nowait);
 #endif
 
 #endif /* _SHALL_LOG_H_ */
@@ -31,15 +31,20 @@
 #include <linux/sched.h>
 #include <linux/atomic.h>
 #include <linux/ctype.h>
+#include <linux/uaccess.h>
+#include <linux/compat.h>
 #include <shallfs/device.h>
 #include <shallfs/operation.h>
+#include <shallfs/ioctl.h>
 #include "shallfs.h"
 #include "super.h"
 #include "log.h"
 #include "device.h"
+#include "ring.h"
 #include "proc.h"
 
-typedef ssize_t (*get_logs_t)(struct shall_fsinfo *, char __user *, size_t);
+typedef ssize_t (*get_logs_t)(struct shall_fsinfo *, char __user *, size_t,
+			      int);
 
 /* structure used by log readers so they can be notified of umounts */
 struct shall_proc_user {
@@ -304,7 +309,9 @@ static ssize_t xlog_read(struct file *file, char __user *buf,
 	ssize_t ret;
 	/* if the filesystem was unmounted, return end-of-file */
 	if (! atomic_read(&fi->sbi.ro.logs_valid)) return 0;
-	ret = li->get(fi, buf, count);
+	/* a nonblocking reader doesn't wait for data, and it doesn't wait
+	 * for the mutex either */
+	ret = li->get(fi, buf, count, file->f_flags & O_NONBLOCK);
 	if (ret != 0) return ret;
 	if (file->f_flags & O_NONBLOCK)
 		return -EAGAIN;
@@ -325,7 +332,7 @@ static ssize_t xlog_read(struct file *file, char __user *buf,
 		/* quickly read here before checking for end-of-file, as
 		 * this will return the unmount log if it fits; however
 		 * this must not block as the umount may be waiting... */
-		ret = li->get(fi, buf, count);
+		ret = li->get(fi, buf, count, 0);
 		/* might have started an umount while we waited... check */
 		if (! atomic_read(&fi->sbi.ro.logs_valid)) return ret;
 		/* might also have closed the file... */
@@ -345,8 +352,11 @@ static int xlog_open(struct inode *inode, struct file *file, get_logs_t func) {
 	if (! atomic_read(&fi->sbi.ro.logs_valid)) return -ENOENT;
 	if (func) {
 		/* blog/hlog are exclusive, if you open one, you can't have
-		 * another; we now atomically test logs_open while setting it */
-		if (atomic_xchg(&fi->sbi.ro.logs_reading, 1)) return -EBUSY;
+		 * another, and you can't have any plog; we now atomically test
+		 * logs_reading while setting it (plog readers count up from
+		 * 0, blog/hlog set it to -1) */
+		if (atomic_cmpxchg(&fi->sbi.ro.logs_reading, 0, -1))
+			return -EBUSY;
 	} else {
 		/* ctrl can be open as many times as you want... but we must
 		 * count how many times it is open so the unmount can wait
@@ -419,6 +429,309 @@ struct file_operations shall_proc_hlog = {
 };
 #endif
 
+/* code specific to plog files: these return the same data as blog, but
+ * do not remove it from the journal, and many readers can have the file
+ * open at the same time, each with its own cursor and filter; the file
+ * position is the cursor, which increases for the whole time the
+ * filesystem is mounted, and the reader uses the SHALL_IOC_ACK ioctl to
+ * say that it's done with everything before a cursor position; data is
+ * removed from the journal when all registered readers are done with it */
+
+static int plog_open(struct inode *inode, struct file *file) {
+	struct shall_fsinfo * fi;
+	struct shall_reader * rd;
+	if (file->f_mode & FMODE_WRITE)
+		return -EPERM;
+	fi = proc_get_parent_data(inode);
+	if (! fi) return -ENOENT;
+	if (! atomic_read(&fi->sbi.ro.logs_valid)) return -ENOENT;
+	/* count readers, but fail if blog/hlog is open */
+	if (! atomic_inc_unless_negative(&fi->sbi.ro.logs_reading))
+		return -EBUSY;
+	rd = shall_kmalloc(fi, sizeof(*rd), GFP_KERNEL);
+	if (! rd) {
+		atomic_dec(&fi->sbi.ro.logs_reading);
+		return -ENOMEM;
+	}
+	memset(rd, 0, sizeof(*rd));
+	rd->fi = fi;
+	rd->registered = 1;
+	rd->more = 1;
+	idr_init(&rd->fileids);
+	/* start reading from the beginning of the journal */
+	mutex_lock(&fi->sbi.mutex);
+	rd->acked = fi->sbi.rw.read.consumed;
+	list_add_tail(&rd->list, &fi->readers);
+	mutex_unlock(&fi->sbi.mutex);
+	file->f_pos = rd->acked;
+	file->private_data = rd;
+	return 0;
+}
+
+/* see if a plog reader has anything to read, or needs to wake up */
+static inline int plog_has_data(const struct shall_reader *rd) {
+	return atomic_read(&rd->fi->sbi.ro.log_seq) != rd->seen ||
+	       rd->more ||
+	       ! atomic_read(&rd->fi->sbi.ro.logs_valid);
+}
+
+static ssize_t plog_read(struct file *file, char __user *buf,
+			 size_t count, loff_t *pos)
+{
+	struct shall_reader * rd = file->private_data;
+	struct shall_fsinfo * fi = rd->fi;
+	ssize_t ret;
+	loff_t start;
+	/* every event starts with a header, so a smaller buffer could
+	 * never make any progress */
+	if (count < 1) return 0;
+	if (count < sizeof(struct shall_devheader)) return -EINVAL;
+	while (1) {
+		/* if the filesystem was unmounted, return end-of-file */
+		if (! atomic_read(&fi->sbi.ro.logs_valid)) return 0;
+		start = *pos;
+		ret = shall_peek_logs(rd, pos, buf, count,
+				      file->f_flags & O_NONBLOCK);
+		if (ret != 0) return ret;
+		/* if the filter skipped some data and the scan stopped
+		 * part-way, there may be more to look at */
+		if (*pos != start && rd->more) {
+			if (signal_pending(current)) return -EINTR;
+			cond_resched();
+			continue;
+		}
+		/* otherwise there is nothing we can read until some new
+		 * data arrives */
+		rd->more = 0;
+		if (file->f_flags & O_NONBLOCK)
+			return -EAGAIN;
+		if (wait_event_interruptible(fi->sbi.ro.data_queue,
+					     plog_has_data(rd)))
+			return -EINTR;
+	}
+}
+
+static loff_t plog_llseek(struct file *file, loff_t offset, int whence) {
+	struct shall_reader * rd = file->private_data;
+	struct shall_fsinfo * fi = rd->fi;
+	loff_t start, end;
+	mutex_lock(&fi->sbi.mutex);
+	start = fi->sbi.rw.read.consumed;
+	end = start + fi->sbi.rw.read.data_length;
+	mutex_unlock(&fi->sbi.mutex);
+	switch (whence) {
+		case SEEK_SET :
+			break;
+		case SEEK_CUR :
+			offset += file->f_pos;
+			break;
+		case SEEK_END :
+			offset += end;
+			break;
+		default :
+			return -EINVAL;
+	}
+	if (offset < 0) return -EINVAL;
+	/* any data before "start" has been removed, so skip to it */
+	if (offset < start) offset = start;
+	rd->more = 1;
+	return vfs_setpos(file, offset, end);
+}
+
+static long plog_ioctl(struct file *file, unsigned int cmd,
+		       unsigned long arg)
+{
+	struct shall_reader * rd = file->private_data;
+	struct shall_fsinfo * fi = rd->fi;
+	struct shall_filter filter;
+	__u64 upto;
+	__u32 registered;
+	ssize_t err;
+	if (! atomic_read(&fi->sbi.ro.logs_valid))
+		return -EPIPE;
+	switch (cmd) {
+		case SHALL_IOC_ACK :
+			if (copy_from_user(&upto, (void __user *)arg,
+					   sizeof(upto)))
+				return -EFAULT;
+			err = shall_ack_logs(rd, upto);
+			return err < 0 ? err : 0;
+		case SHALL_IOC_FILTER :
+			if (copy_from_user(&filter, (void __user *)arg,
+					   sizeof(filter)))
+				return -EFAULT;
+			if (filter.flags & ~SHALL_FILTER_ALL)
+				return -EINVAL;
+			if (filter.prefix_length > sizeof(filter.prefix))
+				return -EINVAL;
+			/* a new prefix means we forget all file IDs */
+			mutex_lock(&fi->sbi.mutex);
+			rd->filter = filter;
+			idr_destroy(&rd->fileids);
+			idr_init(&rd->fileids);
+			rd->more = 1;
+			mutex_unlock(&fi->sbi.mutex);
+			return 0;
+		case SHALL_IOC_REGISTER :
+			if (copy_from_user(&registered, (void __user *)arg,
+					   sizeof(registered)))
+				return -EFAULT;
+			mutex_lock(&fi->sbi.mutex);
+			rd->registered = registered != 0;
+			/* if this was the slowest reader, the others may be
+			 * done with some data */
+			err = registered ? 0 : shall_reclaim_logs(fi);
+			mutex_unlock(&fi->sbi.mutex);
+			return err < 0 ? err : 0;
+	}
+	return -ENOTTY;
+}
+
+#ifdef CONFIG_COMPAT
+static long plog_compat_ioctl(struct file *file, unsigned int cmd,
+			      unsigned long arg)
+{
+	return plog_ioctl(file, cmd, (unsigned long)compat_ptr(arg));
+}
+#endif
+
+static unsigned int plog_poll(struct file *file, poll_table *poll) {
+	struct shall_reader * rd = file->private_data;
+	struct shall_fsinfo * fi = rd->fi;
+	unsigned int ret = 0;
+	poll_wait(file, &fi->sbi.ro.data_queue, poll);
+	if (! atomic_read(&fi->sbi.ro.logs_valid))
+		ret = POLLHUP | POLLRDHUP;
+	else if (plog_has_data(rd))
+		ret = POLLIN | POLLRDNORM;
+	return ret;
+}
+
+static int plog_release(struct inode *inode, struct file *file) {
+	struct shall_reader * rd = file->private_data;
+	struct shall_fsinfo * fi;
+	file->private_data = NULL;
+	if (! rd) return 0;
+	fi = rd->fi;
+	idr_destroy(&rd->fileids);
+	if (atomic_read(&fi->sbi.ro.logs_valid)) {
+		/* if this was the slowest reader, the others may be done
+		 * with some data which can now go */
+		mutex_lock(&fi->sbi.mutex);
+		list_del(&rd->list);
+		if (rd->registered) shall_reclaim_logs(fi);
+		mutex_unlock(&fi->sbi.mutex);
+		atomic_dec(&fi->sbi.ro.logs_reading);
+		shall_kfree(fi, rd);
+	} else {
+		atomic_dec(&fi->sbi.ro.logs_reading);
+		kfree(rd);
+	}
+	return 0;
+}
+
+struct file_operations shall_proc_plog = {
+	.open		= plog_open,
+	.read		= plog_read,
+	.llseek		= plog_llseek,
+	.release	= plog_release,
+	.poll		= plog_poll,
+	.unlocked_ioctl	= plog_ioctl,
+#ifdef CONFIG_COMPAT
+	.compat_ioctl	= plog_compat_ioctl,
+#endif
+};
+
+/* code specific to ring files: opening the file creates a ring buffer
+ * which receives a copy of all new events, and the reader maps it into
+ * memory (see <shallfs/ring.h>); events are not removed from the journal,
+ * so the ring is just another way to look at them; there can only be one
+ * ring at a time, and it is freed when the file is closed and unmapped;
+ * the file only keeps a reference to the ring, and the umount detaches
+ * the ring from the filesystem, so the file can outlive the filesystem */
+
+static int ring_open(struct inode *inode, struct file *file) {
+	struct shall_fsinfo * fi;
+	struct shall_ring * ring;
+	int err = 0;
+	/* no check on FMODE_WRITE, as it's required to map the control
+	 * page writable, so the reader can update the tail */
+	fi = proc_get_parent_data(inode);
+	if (! fi) return -ENOENT;
+	if (! atomic_read(&fi->sbi.ro.logs_valid)) return -ENOENT;
+	/* ring_size can only change on remount, so we don't lock here */
+	if (! fi->options.ring_size) return -ENXIO;
+	ring = shall_ring_alloc(fi->options.ring_size);
+	if (! ring) return -ENOMEM;
+	ring->fi = fi;
+	mutex_lock(&fi->sbi.mutex);
+	if (fi->ring) {
+		err = -EBUSY;
+	} else {
+		/* one reference for the filesystem, one for the file */
+		shall_ring_get(ring);
+		fi->ring = ring;
+	}
+	mutex_unlock(&fi->sbi.mutex);
+	if (err) {
+		shall_ring_put(ring);
+		return err;
+	}
+	/* count the ring with the ctrl files so the umount waits for it */
+	atomic_inc(&fi->sbi.ro.logs_writing);
+	file->private_data = ring;
+	return 0;
+}
+
+static int ring_mmap(struct file *file, struct vm_area_struct *vma) {
+	struct shall_ring * ring = file->private_data;
+	if (! READ_ONCE(ring->fi)) return -EPIPE;
+	return shall_ring_mmap(ring, vma);
+}
+
+static unsigned int ring_poll(struct file *file, poll_table *poll) {
+	struct shall_ring * ring = file->private_data;
+	poll_wait(file, &ring->wait, poll);
+	if (! READ_ONCE(ring->fi))
+		return POLLHUP | POLLRDHUP;
+	if (smp_load_acquire(&ring->control->head) !=
+	    READ_ONCE(ring->control->tail))
+		return POLLIN | POLLRDNORM;
+	return 0;
+}
+
+static int ring_release(struct inode *inode, struct file *file) {
+	struct shall_ring * ring = file->private_data;
+	struct shall_fsinfo * fi;
+	file->private_data = NULL;
+	if (! ring) return 0;
+	/* if the filesystem is still there, detach the ring from it; the
+	 * umount does the same, under the same mutex, so only one of us
+	 * drops the filesystem's reference */
+	mutex_lock(&shall_fs_mutex);
+	fi = ring->fi;
+	if (fi) {
+		mutex_lock(&fi->sbi.mutex);
+		if (fi->ring == ring) fi->ring = NULL;
+		mutex_unlock(&fi->sbi.mutex);
+		shall_ring_detach(ring);
+		atomic_dec(&fi->sbi.ro.logs_writing);
+		shall_ring_put(ring);
+	}
+	mutex_unlock(&shall_fs_mutex);
+	/* any mappings keep their own reference to the ring */
+	shall_ring_put(ring);
+	return 0;
+}
+
+struct file_operations shall_proc_ring = {
+	.open		= ring_open,
+	.mmap		= ring_mmap,
+	.llseek		= no_llseek,
+	.release	= ring_release,
+	.poll		= ring_poll,
+};
+
 /* special file to issue control commands */
 
 static int ctrl_open(struct inode *inode, struct file *file) {
@@ -482,7 +795,7 @@ static ssize_t ctrl_write(struct file *file, const char __user *buf,
 				goto error_unlock;
 			}
 			if (discard == 0) goto unlock;
-			err = shall_delete_logs(fi, discard);
+			err = shall_delete_logs(fi, discard, 1);
 			if (err < 0) {
 				if (done > eptr)
 					done -= eptr;
@@ -494,8 +807,10 @@ static ssize_t ctrl_write(struct file *file, const char __user *buf,
 		if (strncmp(copy, "userlog", 7) == 0) {
 		    const char * data = copy + 7;
 		    if (*data && isspace(*data)) data++;
+		    /* logging needs to acquire the mutex itself */
+		    mutex_unlock(&fi->sbi.mutex);
 		    shall_log_1n(fi, SHALL_USERLOG, data, 0);
-		    goto unlock;
+		    goto do_nothing;
 		}
 		/* invalid command */
 		err = -EINVAL;
@@ -30,6 +30,8 @@ extern struct file_operations shall_proc_blog;
 #ifdef CONFIG_SHALL_FS_DEBUG
 extern struct file_operations shall_proc_hlog;
 #endif
+extern struct file_operations shall_proc_plog;
+extern struct file_operations shall_proc_ring;
 extern struct file_operations shall_proc_ctrl;
 
 void shall_notify_umount(struct shall_fsinfo *);
@@ -0,0 +1,145 @@
+/* linux/fs/shallfs/ring.c
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ *
+ * this file is part of SHALLFS
+ *
+ * Copyright (c) 2017-2019 Claudio Calvelli <shallfs@gladserv.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 2 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program (see the file COPYING in the distribution).
+ * If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <linux/module.h>
+#include <linux/fs.h>
+#include <linux/mm.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+#include <linux/kref.h>
+#include <linux/atomic.h>
+#include "ring.h"
+
+/* allocate a new ring buffer with "size" bytes of data; the memory is
+ * zeroed by vmalloc_user, so the consumer sees an empty ring */
+struct shall_ring * shall_ring_alloc(u32 size) {
+	struct shall_ring * ring;
+	void * area;
+	if (size < PAGE_SIZE || (size & (size - 1))) return NULL;
+	ring = kmalloc(sizeof(*ring), GFP_KERNEL);
+	if (! ring) return NULL;
+	area = vmalloc_user(PAGE_SIZE + size);
+	if (! area) {
+		kfree(ring);
+		return NULL;
+	}
+	kref_init(&ring->ref);
+	init_waitqueue_head(&ring->wait);
+	ring->fi = NULL;
+	ring->control = area;
+	ring->data = area + PAGE_SIZE;
+	ring->head = 0;
+	ring->size = size;
+	ring->control->size = size;
+	ring->control->version = SHALL_RING_VERSION;
+	return ring;
+}
+
+static void ring_free(struct kref *ref) {
+	struct shall_ring * ring = container_of(ref, struct shall_ring, ref);
+	vfree(ring->control);
+	kfree(ring);
+}
+
+void shall_ring_get(struct shall_ring *ring) {
+	kref_get(&ring->ref);
+}
+
+void shall_ring_put(struct shall_ring *ring) {
+	kref_put(&ring->ref, ring_free);
+}
+
+/* copy an event to the ring buffer; the consumer may be reading at the
+ * same time, so we read its tail before writing data, and we make the
+ * data visible before we update the head */
+void shall_ring_add(struct shall_ring *ring, const void *event, int len) {
+	u64 tail = smp_load_acquire(&ring->control->tail);
+	u64 used = ring->head - tail;
+	u32 offset, first;
+	if (used > ring->size || len > ring->size - used) {
+		/* no space, or the consumer wrote nonsense in tail */
+		WRITE_ONCE(ring->control->lost, ring->control->lost + 1);
+		return;
+	}
+	offset = ring->head & (ring->size - 1);
+	first = ring->size - offset;
+	if (first > len) first = len;
+	memcpy(ring->data + offset, event, first);
+	if (len > first)
+		memcpy(ring->data, event + first, len - first);
+	ring->head += len;
+	smp_store_release(&ring->control->head, ring->head);
+	if (wq_has_sleeper(&ring->wait))
+		wake_up_all(&ring->wait);
+}
+
+/* tell the consumer that the filesystem has gone; the ring and any
+ * mappings stay valid until the last reference is dropped */
+void shall_ring_detach(struct shall_ring *ring) {
+	WRITE_ONCE(ring->fi, NULL);
+	wake_up_all(&ring->wait);
+}
+
+static void ring_vm_open(struct vm_area_struct *vma) {
+	shall_ring_get(vma->vm_private_data);
+}
+
+static void ring_vm_close(struct vm_area_struct *vma) {
+	shall_ring_put(vma->vm_private_data);
+}
+
+static const struct vm_operations_struct ring_vm_ops = {
+	.open		= ring_vm_open,
+	.close		= ring_vm_close,
+};
+
+/* map part of the ring buffer into userspace: page 0 is the control page,
+ * and the data follows, mapped twice; the mapping keeps a reference to
+ * the ring, so it remains valid after the file is closed */
+int shall_ring_mmap(struct shall_ring *ring, struct vm_area_struct *vma) {
+	unsigned long len = vma->vm_end - vma->vm_start;
+	int err;
+	if (vma->vm_pgoff == 0) {
+		if (len != PAGE_SIZE) return -EINVAL;
+		err = remap_vmalloc_range_partial(vma, vma->vm_start,
+						  ring->control, PAGE_SIZE);
+	} else if (vma->vm_pgoff == 1) {
+		if (len != 2 * (unsigned long)ring->size) return -EINVAL;
+		/* the data can only be read by userspace */
+		if (vma->vm_flags & VM_WRITE) return -EPERM;
+		vma->vm_flags &= ~VM_MAYWRITE;
+		err = remap_vmalloc_range_partial(vma, vma->vm_start,
+						  ring->data, ring->size);
+		if (! err)
+			err = remap_vmalloc_range_partial(vma,
+						vma->vm_start + ring->size,
+						ring->data, ring->size);
+	} else {
+		return -EINVAL;
+	}
+	if (err) return err;
+	vma->vm_private_data = ring;
+	vma->vm_ops = &ring_vm_ops;
+	ring_vm_open(vma);
+	return 0;
+}
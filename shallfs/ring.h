@@ -0,0 +1,70 @@
+/* shallfs/ring.h
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ *
+ * this file is part of SHALLFS
+ *
+ * Copyright (c) 2017-2019 Claudio Calvelli <shallfs@gladserv.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 2 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program (see the file COPYING in the distribution).
+ * If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef _SHALL_INTERNAL_RING_H_
+#define _SHALL_INTERNAL_RING_H_
+
+#include <linux/kref.h>
+#include <linux/wait.h>
+#include <shallfs/ring.h>
+
+struct shall_fsinfo;
+
+/* a ring buffer which receives a copy of every event and can be mapped
+ * by userspace; it exists only while /proc/fs/shallfs/<device>/ring is
+ * open or mapped; the filesystem and the open file each hold a reference,
+ * so the file never needs to look at the filesystem after umount */
+struct shall_ring {
+	struct kref ref;		/* filesystem + open file + each
+					 * mapping */
+	struct shall_fsinfo * fi;	/* NULL after umount, protected by
+					 * shall_fs_mutex */
+	wait_queue_head_t wait;		/* poll() on the ring file */
+	struct shall_ring_control * control; /* first page of area */
+	char * data;			/* rest of area */
+	u64 head;			/* our copy of control->head */
+	u32 size;			/* size of data, a power of 2 */
+};
+
+/* largest ring accepted by the ring= mount option */
+#define SHALL_RING_MAX (256 * 1024 * 1024)
+
+/* allocate a new ring buffer with "size" bytes of data */
+struct shall_ring * shall_ring_alloc(u32 size);
+
+/* take and release references to a ring buffer */
+void shall_ring_get(struct shall_ring *);
+void shall_ring_put(struct shall_ring *);
+
+/* copy an event to the ring buffer, or count it as lost if there is no
+ * space; caller must hold the mutex */
+void shall_ring_add(struct shall_ring *, const void *, int);
+
+/* tell the consumer that the filesystem has gone; caller must hold
+ * shall_fs_mutex and drop the filesystem's reference afterwards */
+void shall_ring_detach(struct shall_ring *);
+
+/* map part of the ring buffer into userspace */
+int shall_ring_mmap(struct shall_ring *, struct vm_area_struct *);
+
+#endif /* _SHALL_INTERNAL_RING_H_ */
@@ -101,6 +101,7 @@ struct shall_options {
 	int pathfilter_count;
 	int commit_seconds;
 	int commit_size;
+	int ring_size;
 	enum shall_flags flags;
 	char * data;
 };
@@ -133,6 +134,10 @@ struct shall_sbinfo_ro {
 	 * below); we set some_data when adding any data, and we
 	 * clear it when we remove the last log from the journal */
 	atomic_t some_data;
+	/* this changes every time some data is added, so that plog readers
+	 * can wait for data without needing to lock the mutex; see
+	 * fs/shallfs/proc.c */
+	atomic_t log_seq;
 	/* quick test for commit thread actually running; this is because
 	 * if we call kthread_stop() after it dies we get a panic (not
 	 * supposed to happen looking at the kernel sources, but I did
@@ -156,6 +161,9 @@ struct shall_sbinfo_rw_read {
 	int buffer_written;		/* size of data in commit buffer */
 	int buffer_read;		/* any buffered data which has already
 					 * been discarded */
+	loff_t consumed;		/* total data removed from journal
+					 * since mount, used as the base for
+					 * peek cursors */
 };
 
 struct shall_sbinfo_rw_other {
@@ -205,6 +213,8 @@ struct shall_fsinfo {
 	struct super_block * sb;	/* kernel's fs superblock */
 	struct task_struct * commit_thread; /* the commit thread */
 	struct proc_dir_entry * proc;	/* /proc/shallfs/<device> */
+	struct list_head readers;	/* plog readers, protected by mutex */
+	struct shall_ring * ring;	/* mmap ring, protected by mutex */
 	struct path root_path;		/* underlying fs */
 	struct vfsmount * mount;	/* underlying fs */
 	struct shall_fsinfo * prev;	/* linked list of mounted filesystems */
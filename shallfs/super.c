@@ -54,6 +54,7 @@
 #include "log.h"
 #include "proc.h"
 #include "device.h"
+#include "ring.h"
 #include "super.h"
 
 /* we need to get a timestamp for various places, and newer versions
@@ -177,6 +178,7 @@ static const struct shall_options default_options = {
 	.pathfilter	= NULL,
 	.commit_seconds	= 5,
 	.commit_size	= PAGE_SIZE,
+	.ring_size	= 0,
 	.data		= NULL,
 	.flags		= OVERFLOW_WAIT | TOO_BIG_LOG | LOG_AFTER
 #ifdef CONFIG_SHALL_FS_DEBUG
@@ -388,6 +390,21 @@ static int parse_options(char *data, struct shall_options *opts)
 			opts->commit_size = size;
 			continue;
 		}
+		if (set_string(ptr, len, "ring", &vp, NULL)) {
+			int size;
+			if (sscanf(vp, "%d", &size) != 1 ||
+			    (size != 0 &&
+			     (size < PAGE_SIZE || size > SHALL_RING_MAX ||
+			      (size & (size - 1)))))
+			{
+				printk(KERN_ERR
+				       "Invalid value %s for ring\n", vp);
+				ok = 0;
+				continue;
+			}
+			opts->ring_size = size;
+			continue;
+		}
 		printk(KERN_ERR "Invalid mount option %s\n", ptr);
 		ok = 0;
 	}
@@ -466,6 +483,7 @@ static int shall_update_superblock(struct shall_fsinfo *fi) {
  * to journal and free any memory we allocated */
 static void shall_put_super(struct super_block *sb) {
 	struct shall_fsinfo * fi = (struct shall_fsinfo *)sb->s_fs_info;
+	struct shall_ring * ring;
 	/* first log that we are unmounting; this must be done before
 	 * we clear allow_commit_thread or it will deadlock; actually,
 	 * just in case, we set it here */
@@ -486,6 +504,18 @@ static void shall_put_super(struct super_block *sb) {
 	/* make sure all log readers are notified, and they will get an
 	 * end-of-file condition */
 	shall_notify_umount(fi);
+	/* detach the mmap ring, if any: the ring file can stay open after
+	 * the umount, but it no longer looks at the filesystem */
+	mutex_lock(&shall_fs_mutex);
+	mutex_lock(&fi->sbi.mutex);
+	ring = fi->ring;
+	fi->ring = NULL;
+	mutex_unlock(&fi->sbi.mutex);
+	if (ring) {
+		shall_ring_detach(ring);
+		shall_ring_put(ring);
+	}
+	mutex_unlock(&shall_fs_mutex);
 	/* shall_commit_logs has the side effect of waiting for the commit
 	 * thread to complete the current run, and it won't let it start
 	 * a new run if it was called with allow_commit_thread == 0; and
@@ -793,6 +823,8 @@ static int shall_show_options(struct seq_file *m, struct dentry *dentry) {
 	seq_printf(m, ",commit=%d,%d",
 		   fi->options.commit_seconds, fi->options.commit_size);
 	add_flag(m, "log", &log_table, fi->options.flags);
+	if (fi->options.ring_size)
+		seq_printf(m, ",ring=%d", fi->options.ring_size);
 	if (fi->options.pathfilter)
 		add_pathlist(m, "pathfilter", fi->options.pathfilter,
 			     fi->options.pathfilter_count);
@@ -868,6 +900,8 @@ static int create_proc_entries(struct shall_fsinfo *fi) {
 	}
 	if (! proc_create("info", 0400, fi->proc, &shall_proc_info) ||
 	    ! proc_create("blog", 0400, fi->proc, &shall_proc_blog) ||
+	    ! proc_create("plog", 0400, fi->proc, &shall_proc_plog) ||
+	    ! proc_create("ring", 0600, fi->proc, &shall_proc_ring) ||
 #ifdef CONFIG_SHALL_FS_DEBUG
 	    ! proc_create("hlog", 0400, fi->proc, &shall_proc_hlog) ||
 #endif
@@ -1058,9 +1092,12 @@ static int shall_fill_super(struct super_block *sb, void *data, int silent) {
 			      &fi->sbi.rw.read.commitptr);
 	fi->sbi.rw.read.buffer_read = 0;
 	fi->sbi.rw.read.buffer_written = 0;
+	fi->sbi.rw.read.consumed = 0;
 	fi->lq.num_dropped = 0;
 	fi->lq.extra_space = 0;
 	mutex_init(&fi->sbi.mutex);
+	INIT_LIST_HEAD(&fi->readers);
+	fi->ring = NULL;
 	init_waitqueue_head(&fi->lq.log_queue);
 	init_waitqueue_head(&fi->sbi.ro.data_queue);
 	atomic_set(&fi->sbi.ro.logs_reading, 0);
@@ -1069,6 +1106,7 @@ static int shall_fill_super(struct super_block *sb, void *data, int silent) {
 	atomic_set(&fi->sbi.ro.allow_commit_thread, 1);
 	atomic_set(&fi->sbi.ro.inside_commit, 0);
 	atomic_set(&fi->sbi.ro.some_data, fi->sbi.rw.read.data_length > 0);
+	atomic_set(&fi->sbi.ro.log_seq, 0);
 	/* create (but don't yet start) a thread to do background commits */
 	fi->commit_thread =
 		kthread_create(shall_commit_thread, fi, "shallfs:%x:%x",
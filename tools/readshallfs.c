@@ -20,6 +20,7 @@
  * If not, see <http://www.gnu.org/licenses/>.
  */
 
+#define _GNU_SOURCE /* for strptime */
 #include <stdio.h>
 #include <stdlib.h>
 #include <errno.h>
@@ -33,9 +34,15 @@
 #include <time.h>
 #include <ctype.h>
 #include "shallfs-common.h"
+#include "shallfs-event.h"
+#include "shallfs-reader.h"
+#include "shallfs-parallel.h"
+#include "shallfs-format.h"
+#include "shallfs-filter.h"
+#include "shallfs-rotate.h"
+#include "shallfs-merge.h"
 #include <shallfs/operation.h>
 #include <shallfs/device.h>
-#include <shallfs/opdata.h>
 
 /* see print_debug_log() */
 typedef struct follow_s follow_t;
@@ -55,11 +62,51 @@ struct follow_s {
     char filename[0];
 };
 
+/* a chunk of events formatted by a thread, see print_parallel() */
+#define CHUNK_SIZE (4 * 1048576)
+
+typedef struct {
+    int fileid;
+    int event;				/* event number within chunk */
+    size_t pos;				/* position of name in "text" */
+} fileref_t;
+
+typedef struct {
+    const char * data;
+    size_t len;				/* data available */
+    size_t limit;			/* events must start before this */
+    off_t where;			/* journal position of "data" */
+    off_t wrap;				/* journal size, 0 for a file */
+    char * copy;			/* data to free with the chunk */
+    int resync;				/* may start inside an event */
+    /* the following are filled in by format_chunk() */
+    size_t first;			/* offset of first event */
+    size_t end;				/* offset after last event */
+    int error;
+    int nevents;
+    int maxevents;
+    size_t * evtext;			/* start of each event in "text" */
+    char * text;
+    size_t textlen;
+    int nrefs;
+    int maxrefs;
+    fileref_t * refs;
+} chunk_t;
+
 static long help = 0, sbinfo = 0, all_logs = 0, mounted = 0, blocking = 0;
 static long append = 0, input = 0, debug_prog = 0, debug_logs = 0;
-static long clear_logs = 0, max_logs = 0;
+static long clear_logs = 0, max_logs = 0, keep_logs = 0, threads = 1;
+static long json = 0, records = 0, uid = -1;
+static long rotate_size = 0, rotate_time = 0, compress = 0;
 static const char * device = NULL, * filename = NULL;
+static const char * operations = NULL, * prefix = NULL;
+static const char * since = NULL, * until = NULL;
+static shall_event_filter_t * filter = NULL;
+static shall_rotate_t * rotate = NULL;
 static follow_t * follow = NULL;
+static shall_fileids_t * fileids = NULL;
+static shall_optlist_t inputs;		/* more inputs with -I */
+static shall_outbuf_t output;		/* with -J and -R */
 
 static const shall_options_t options[] = {
     { 'a', &append,          NULL,
@@ -70,20 +117,51 @@ static const shall_options_t options[] = {
       "Print debug logs; incompatible with -l" },
     { 'D', &debug_prog,      NULL,
       "Print extra debugging information" },
+    { 'e', &rotate_time,     "SECONDS",
+      "Rotate FILE when it has been written to for SECONDS" },
     { 'h', &help,            NULL,
       "Print this helpful message" },
     { 'i', &input,           NULL,
       "Interpret device-name as a file which was produced by this program" },
+    { 'I', NULL,             "INPUT",
+      "Also read INPUT (a file or unmounted device), merging events by time",
+      NULL, &inputs },
+    { 'j', &threads,         "THREADS",
+      "Decode and print events using THREADS threads" },
+    { 'J', &json,            NULL,
+      "Output events as JSON Lines, one object per event" },
+    { 'k', &keep_logs,       NULL,
+      "With -m, remove events only after they have been stored/printed" },
     { 'l', &all_logs,        NULL,
       "Show all event logs (default if -i)" },
     { 'm', &mounted,         NULL,
       "Search for a mounted filesystem, device-name is mountpoint or fspath" },
+    { 'n', NULL,             "PREFIX",
+      "Only show events on files whose name starts with PREFIX",
+      &prefix },
+    { 'o', NULL,             "OPERATIONS",
+      "Only show the operations in a comma-separated list",
+      &operations },
     { 'p', &max_logs,        "NUM-LOGS",
        "Show partial logs only, stop after NUM-LOGS events" },
+    { 'r', &rotate_size,     "SIZE",
+      "Rotate FILE when it reaches SIZE bytes" },
+    { 'R', &records,         NULL,
+      "Output events as fixed-size binary records" },
     { 's', &sbinfo,          NULL,
       "Show filesystem information (default if no -l and no -i)" },
+    { 't', NULL,             "TIME",
+      "Only show events logged at or after TIME",
+      &since },
+    { 'T', NULL,             "TIME",
+      "Only show events logged before TIME",
+      &until },
+    { 'u', &uid,             "UID",
+      "Only show events from processes with real user ID UID" },
     { 'w', &blocking,        NULL,
       "With -m, wait for new events on end of file (default: stop at EOF)" },
+    { 'z', &compress,        NULL,
+      "Compress rotated files with gzip" },
     {  0,  NULL,             NULL, NULL }
 };
 
@@ -96,16 +174,16 @@ static const shall_args_t args[] = {
 };
 
 /* print a line with file attributes; can fold if it looks too long */
-static void print_attr(const char * head1, const char * head2,
-		       const char * tail, const struct shall_devattr * da)
+static void print_attr(FILE * F, const char * head1, const char * head2,
+		       const char * tail, const shall_event_attr_t * da)
 {
 #define append \
     sl = strlen(buffer); \
     if (len + sl > 80 && len > blen) { \
-    	printf("%s%s", tail, head2); \
+    	fprintf(F, "%s%s", tail, head2); \
 	len = strlen(head2); \
     } \
-    printf("%s", buffer); \
+    fprintf(F, "%s", buffer); \
     len += sl
 #define print(fmt, args...) { \
     int sl; \
@@ -113,26 +191,27 @@ static void print_attr(const char * head1, const char * head2,
     append; \
 }
 #define print_time(what) { \
-    time_t sec = le64toh(da->what##_sec); \
-    int sl, nsec = le32toh(da->what##_nsec); \
+    time_t sec = da->what##_sec; \
+    struct tm tm; \
+    int sl, nsec = da->what##_nsec; \
     snprintf(buffer, sizeof(buffer) - 25, " " #what "=%lld.%03d", \
     	     (long long)sec, nsec / 1000000); \
     sl = strlen(buffer); \
     strftime(buffer + sl, sizeof(buffer) - sl, \
-	     " (%Y-%m-%d %H:%M:%S %Z)", localtime(&sec)); \
+	     " (%Y-%m-%d %H:%M:%S %Z)", localtime_r(&sec, &tm)); \
     append; \
 }
     char buffer[128];
-    int flags = le32toh(da->flags), len = strlen(head1), blen = len;
-    printf("%s", head1);
+    int flags = da->flags, len = strlen(head1), blen = len;
+    fprintf(F, "%s", head1);
     if (flags & shall_attr_mode)
-	print(" mode=%04o", le32toh(da->mode));
+	print(" mode=%04o", da->mode);
     if (flags & shall_attr_user)
-	print(" uid=%d", le32toh(da->user));
+	print(" uid=%d", da->user);
     if (flags & shall_attr_group)
-	print(" gid=%d", le32toh(da->group));
+	print(" gid=%d", da->group);
     if (flags & (shall_attr_block | shall_attr_char | shall_attr_size)) {
-	uint64_t num = le64toh(da->size);
+	uint64_t num = da->size;
 	if (flags & shall_attr_size) {
 	    print(" size=%lld", (long long)num);
 	} else {
@@ -145,7 +224,7 @@ static void print_attr(const char * head1, const char * head2,
 	print_time(atime);
     if (flags & shall_attr_mtime)
 	print_time(mtime);
-    printf("%s", tail);
+    fprintf(F, "%s", tail);
 #undef print_time
 #undef print
 #undef append
@@ -269,230 +348,196 @@ static const char * follow_message(const char * message, int msglen,
     }
 }
 
-#define getdata(dest) \
-	memcpy(&(dest), data, sizeof((dest))); \
-	data += sizeof((dest))
-
 /* send a debug event to file */
-static int print_debug_log(FILE * F, const char * data) {
+static void print_debug_log(FILE * F, const shall_event_t * ev) {
     char ts[64];
-    struct shall_devheader dh;
-    struct shall_devfileid df;
-    time_t req;
+    struct tm tm;
+    time_t req = ev->req_sec;
     const char * message = "", * filename = "", * fmode = "";
-    int length, op, flags, msglen = 0, fnlen = 0, line;
-    getdata(dh);
-    length = le32toh(dh.next_header);
-    op = le32toh(dh.operation);
-    if (op) return length;
-    req = le64toh(dh.req_sec);
-    line = le32toh(dh.result);
-    flags = le32toh(dh.flags);
-    if (flags & SHALL_LOG_FILE1) {
-	getdata(df);
-	msglen = le32toh(df.fileid);
-	message = data;
-	data += msglen;
+    int msglen = 0, fnlen = 0;
+    if (ev->operation) return;
+    if (ev->num_names > 0) {
+	message = ev->name[0];
+	msglen = ev->namelen[0];
     }
-    if (flags & SHALL_LOG_FILE2) {
-	getdata(df);
-	fnlen = le32toh(df.fileid);
-	filename = data;
-	data += fnlen;
+    if (ev->num_names > 1) {
+	filename = ev->name[1];
+	fnlen = ev->namelen[1];
     }
-    fmode = follow_message(message, msglen, filename, fnlen, line);
-    strftime(ts, sizeof(ts), "%Y-%m-%d %H:%M:%S %Z", localtime(&req));
+    fmode = follow_message(message, msglen, filename, fnlen, ev->result);
+    strftime(ts, sizeof(ts), "%Y-%m-%d %H:%M:%S %Z", localtime_r(&req, &tm));
     fprintf(F, "%10lld.%03d %s %.*s:%d %.*s%s\n",
-	    (long long)req, le32toh(dh.req_nsec) / 1000000, ts,
-	    fnlen, filename, line, msglen, message, fmode);
-    return length;
+	    (long long)req, ev->req_nsec / 1000000, ts,
+	    fnlen, filename, ev->result, msglen, message, fmode);
 }
 
-static inline void print_perm(char sep, char who, int id, int perm) {
-    printf("%c%c:", sep, who);
-    if (id >= 0) printf("%d", id);
-    printf(":%c%c%c",
-	   (perm & shall_acl_read) ? 'r' : '-',
-	   (perm & shall_acl_write) ? 'w' : '-',
-	   (perm & shall_acl_execute) ? 'x' : '-');
+static inline void print_perm(FILE * F, char sep, char who, int id, int perm)
+{
+    fprintf(F, "%c%c:", sep, who);
+    if (id >= 0) fprintf(F, "%d", id);
+    fprintf(F, ":%c%c%c",
+	      (perm & shall_acl_read) ? 'r' : '-',
+	      (perm & shall_acl_write) ? 'w' : '-',
+	      (perm & shall_acl_execute) ? 'x' : '-');
     /* the following don't seem to be used by anybody... */
     if ((perm & shall_acl_what) == shall_acl_add)
-	putchar('a');
+	fputc('a', F);
     if ((perm & shall_acl_what) == shall_acl_delete)
-	putchar('d');
+	fputc('d', F);
 }
 
-/* print a single event */
-static int print_log(off_t where, const char * data, int count) {
-    char ts[64];
-    struct shall_devheader dh;
-    struct shall_devregion dr;
-    struct shall_devhash dc;
-    struct shall_devfileid df;
-    struct shall_devsize ds;
-    struct shall_devattr da;
-    struct shall_devacl dl;
-    struct shall_devacl_entry de;
-    struct shall_devxattr dx;
-    struct shall_devcreds dcreds;
-    const char * ba, * name1 = "", * name2 = "";
-    time_t req;
-    int length, op, len1 = 0, len2 = 0, flags, result, n;
-    getdata(dh);
-    length = le32toh(dh.next_header);
-    req = le64toh(dh.req_sec);
-    strftime(ts, sizeof(ts), "%Y-%m-%d %H:%M:%S %Z", localtime(&req));
-    printf("  %-7d", count);
-    if (debug_prog)
-	printf(" @%-10lld len=%-5d", (long long)where, length);
-    printf(" %10lld.%03d (%s)\n",
-	   (long long)req, le32toh(dh.req_nsec) / 1000000, ts);
-    op = le32toh(dh.operation);
-    result = le32toh(dh.result);
-    if (op != 0) {
-	if (op < 0) {
-	    op = -op;
-	    ba = "before";
-	} else {
-	    ba = "after ";
+/* print a file ID, and the file name if we know it; when formatting a
+ * chunk in a thread we don't know the name yet, so we just remember where
+ * it goes and write_chunk() will add it */
+static void print_fileid(FILE * F, chunk_t * ck, const char * prefix,
+			 int fileid)
+{
+    const char * name;
+    fprintf(F, "%sid=%d", prefix, fileid);
+    if (! fileids) return;
+    if (ck) {
+	if (ck->nrefs >= ck->maxrefs) {
+	    int nm = ck->maxrefs + 256;
+	    fileref_t * nr = realloc(ck->refs, nm * sizeof(fileref_t));
+	    if (! nr) {
+		ck->error = ENOMEM;
+		return;
+	    }
+	    ck->refs = nr;
+	    ck->maxrefs = nm;
 	}
-	printf("          %s op#%-2d %-16s -> %d\n",
-	       ba, op,
-	       op > 0 && op < SHALL_MAX_OPCODE ? shall_opdata[op].name : "?",
-	       result);
-    }
-    flags = le32toh(dh.flags);
-    if (flags & SHALL_LOG_CREDS) {
-	getdata(dcreds);
-	printf("          UID %llu, EUID %llu, FSUID %llu, "
-			 "GID %llu, EGID %llu, FSGID %llu\n",
-	       (long long unsigned int)le64toh(dcreds.uid),
-	       (long long unsigned int)le64toh(dcreds.euid),
-	       (long long unsigned int)le64toh(dcreds.fsuid),
-	       (long long unsigned int)le64toh(dcreds.gid),
-	       (long long unsigned int)le64toh(dcreds.egid),
-	       (long long unsigned int)le64toh(dcreds.fsgid));
-    }
-    if (flags & SHALL_LOG_FILE1) {
-	getdata(df);
-	len1 = le32toh(df.fileid);
-	if (op == 0)
-	    name1 = data;
-	else
-	    printf("          [%.*s]\n", len1, data);
-	data += len1;
-    }
-    if (flags & SHALL_LOG_FILE2) {
-	getdata(df);
-	len2 = le32toh(df.fileid);
-	if (op == 0)
-	    name2 = data;
-	else
-	    printf("          [%.*s]\n", len2, data);
-	data += len2;
+	ck->refs[ck->nrefs].fileid = fileid;
+	ck->refs[ck->nrefs].event = ck->nevents;
+	ck->refs[ck->nrefs].pos = ftell(F);
+	ck->nrefs++;
+	return;
     }
-    switch (flags & SHALL_LOG_DMASK) {
+    name = shall_fileids_lookup(fileids, fileid);
+    if (name) fprintf(F, " [%s]", name);
+}
+
+/* print a single event; if formatting a chunk, the count is added later
+ * by write_chunk() */
+static void print_log(FILE * F, chunk_t * ck, off_t where,
+		      const shall_event_t * ev, int count)
+{
+    char ts[64];
+    struct tm tm;
+    const shall_event_region_t * er = &ev->u.region;
+    time_t req = ev->req_sec;
+    int n;
+    strftime(ts, sizeof(ts), "%Y-%m-%d %H:%M:%S %Z", localtime_r(&req, &tm));
+    if (! ck) fprintf(F, "  %-7d", count);
+    if (debug_prog)
+	fprintf(F, " @%-10lld len=%-5d", (long long)where, ev->length);
+    fprintf(F, " %10lld.%03d (%s)\n",
+	      (long long)req, ev->req_nsec / 1000000, ts);
+    if (ev->operation != 0)
+	fprintf(F, "          %s op#%-2d %-16s -> %d\n",
+		  ev->before ? "before" : "after ", ev->operation,
+		  shall_event_opname(ev->operation), ev->result);
+    if (ev->has_creds)
+	fprintf(F, "          UID %llu, EUID %llu, FSUID %llu, "
+			    "GID %llu, EGID %llu, FSGID %llu\n",
+		  (long long unsigned int)ev->creds.uid,
+		  (long long unsigned int)ev->creds.euid,
+		  (long long unsigned int)ev->creds.fsuid,
+		  (long long unsigned int)ev->creds.gid,
+		  (long long unsigned int)ev->creds.egid,
+		  (long long unsigned int)ev->creds.fsgid);
+    if (ev->operation != 0)
+	for (n = 0; n < ev->num_names; n++)
+	    fprintf(F, "          [%.*s]\n", ev->namelen[n], ev->name[n]);
+    switch (ev->data_type) {
 	case SHALL_LOG_ATTR :
-	    getdata(da);
-	    print_attr("          attr:", "               ", "\n", &da);
+	    print_attr(F, "          attr:", "               ", "\n",
+		       &ev->u.attr);
 	    break;
 	case SHALL_LOG_REGION :
-	    getdata(dr);
-	    printf("          id=%d region=%lld:%lld\n",
-		   le32toh(dr.fileid), (long long)le64toh(dr.start),
-		   (long long)le64toh(dr.length));
+	    print_fileid(F, ck, "          ", er->fileid);
+	    fprintf(F, " region=%lld:%lld\n",
+		      (long long)er->start, (long long)er->length);
 	    break;
 	case SHALL_LOG_FILEID :
-	    getdata(df);
-	    printf("          id=%d\n", le32toh(df.fileid));
+	    print_fileid(F, ck, "          ", ev->u.fileid);
+	    fprintf(F, "\n");
 	    break;
 	case SHALL_LOG_SIZE :
-	    getdata(ds);
-	    printf("          size=%lld\n", (long long)le64toh(ds.size));
+	    fprintf(F, "          size=%lld\n", (long long)ev->u.size);
 	    break;
-	case SHALL_LOG_ACL :
-	    getdata(dl);
-	    printf("          acl[");
-	    len2 = le32toh(dl.perm);
-	    printf((len2 & (1 << 28)) ? "access" : "default");
-	    printf("]");
-	    print_perm('=', 'u', -1, len2);
-	    print_perm(',', 'g', -1, len2 >> 7);
-	    print_perm(',', 'o', -1, len2 >> 14);
-	    print_perm(',', 'm', -1, len2 >> 21);
-	    len2 = le32toh(dl.count);
-	    for (n = 0; n < len2; n++) {
-		int type;
-		getdata(de);
-		type = le32toh(de.type);
-		print_perm(',', type & (1 << 28) ? 'g' : 'u',
-			   le32toh(de.name), type);
+	case SHALL_LOG_ACL : {
+	    const shall_event_acl_t * acl = &ev->u.acl;
+	    fprintf(F, "          acl[%s]", acl->access ? "access" : "default");
+	    print_perm(F, '=', 'u', -1, acl->perm);
+	    print_perm(F, ',', 'g', -1, acl->perm >> 7);
+	    print_perm(F, ',', 'o', -1, acl->perm >> 14);
+	    print_perm(F, ',', 'm', -1, acl->perm >> 21);
+	    for (n = 0; n < acl->count; n++) {
+		int perm, is_group, id;
+		id = shall_event_acl_entry(acl, n, &perm, &is_group);
+		print_perm(F, ',', is_group ? 'g' : 'u', id, perm);
 	    }
-	    printf("\n");
+	    fprintf(F, "\n");
 	    break;
-	case SHALL_LOG_XATTR :
-	    getdata(dx);
-	    len2 = le32toh(dx.namelen);
-	    printf("          xattr[%.*s", len2, data);
-	    data += len2;
-	    len2 = le32toh(dx.valuelen);
-	    printf(", %x]=%d[", le32toh(dx.flags), len2);
-	    for (n = 0; n < len2; n++) {
-		unsigned char c = *data++;
+	}
+	case SHALL_LOG_XATTR : {
+	    const shall_event_xattr_t * ex = &ev->u.xattr;
+	    fprintf(F, "          xattr[%.*s, %x]=%d[",
+		      ex->namelen, ex->name, ex->flags, ex->valuelen);
+	    for (n = 0; n < ex->valuelen; n++) {
+		unsigned char c = ex->value[n];
 		if (isascii((int)c) && isprint((int)c) && c != '%')
-		    putchar(c);
+		    fputc(c, F);
 		else
-		    printf("%%%02x", c);
+		    fprintf(F, "%%%02x", c);
 	    }
-	    printf("]\n");
+	    fprintf(F, "]\n");
 	    break;
+	}
 	case SHALL_LOG_HASH :
-	    getdata(dc);
-	    printf("          id=%d region=%lld:%lld\n",
-		   le32toh(dc.fileid), (long long)le64toh(dc.start),
-		   (long long)le64toh(dc.length));
-	    printf("          data_hash=");
+	    print_fileid(F, ck, "          ", er->fileid);
+	    fprintf(F, " region=%lld:%lld\n",
+		      (long long)er->start, (long long)er->length);
+	    fprintf(F, "          data_hash=");
 	    for (n = 0; n < SHALL_HASH_LENGTH; n++)
-		printf("%02x", dc.hash[n]);
-	    printf("\n");
+		fprintf(F, "%02x", er->hash[n]);
+	    fprintf(F, "\n");
 	    break;
 	case SHALL_LOG_DATA :
-	    getdata(dr);
-	    printf("          id=%d region=%lld:%lld\n",
-		   le32toh(dr.fileid), (long long)le64toh(dr.start),
-		   (long long)le64toh(dr.length));
-	    len2 = le64toh(dr.length);
-	    printf("          data=");
-	    for (n = 0; n < len2; n++) {
-		unsigned char c = *data++;
-		printf("%02x", c);
-	    }
-	    printf("\n");
+	    print_fileid(F, ck, "          ", er->fileid);
+	    fprintf(F, " region=%lld:%lld\n",
+		      (long long)er->start, (long long)er->length);
+	    fprintf(F, "          data=");
+	    for (n = 0; n < er->length; n++)
+		fprintf(F, "%02x", er->data[n]);
+	    fprintf(F, "\n");
+	    break;
+	case SHALL_LOG_CLONE : {
+	    const shall_event_clone_t * ek = &ev->u.clone;
+	    print_fileid(F, ck, "          ", ek->src_fileid);
+	    fprintf(F, " region=%lld:%lld ->",
+		      (long long)ek->src_start, (long long)ek->length);
+	    print_fileid(F, ck, " ", ek->dst_fileid);
+	    fprintf(F, " start=%lld\n", (long long)ek->dst_start);
 	    break;
+	}
     }
-    if (op == 0)
-	printf("          DEBUG (%.*s:%d) %.*s\n",
-	       len2, name2, result, len1, name1);
-    return length;
+    if (ev->operation == 0)
+	fprintf(F, "          DEBUG (%.*s:%d) %.*s\n",
+		  ev->num_names > 1 ? ev->namelen[1] : 0,
+		  ev->num_names > 1 ? ev->name[1] : "", ev->result,
+		  ev->num_names > 0 ? ev->namelen[0] : 0,
+		  ev->num_names > 0 ? ev->name[0] : "");
 }
 
 static ssize_t read_events(int fd, char * buffer, size_t len) {
-    struct shall_devheader dh;
     off_t oldptr = lseek(fd, 0, SEEK_CUR);
     ssize_t nr, done;
     if (oldptr < 0) return -1;
     nr = read(fd, buffer, len);
     if (nr <= 0) return nr;
-    done = 0;
-    while (done < nr) {
-	unsigned int chk;
-	memcpy(&dh, buffer + done, sizeof(dh));
-	chk = shall_checksum_log(&dh);
-	if (chk != le32toh(dh.checksum)) break;
-	chk = le32toh(dh.next_header);
-	if (chk < sizeof(dh) || done + chk > nr) break;
-	done += chk;
-    }
+    done = shall_event_scan(buffer, nr);
+    if (done < 0) return -1;
     if (done == 0) {
 	errno = EINVAL;
 	return -1;
@@ -502,6 +547,351 @@ static ssize_t read_events(int fd, char * buffer, size_t len) {
     return done;
 }
 
+/* parse the argument of -t and -T: a number of seconds since the epoch,
+ * or a local date and time like the ones printed by -l */
+static int parse_time(const char * arg, int64_t * result) {
+    static const char * formats[] = {
+	"%Y-%m-%d %H:%M:%S",
+	"%Y-%m-%dT%H:%M:%S",
+	"%Y-%m-%d %H:%M",
+	"%Y-%m-%d",
+	NULL
+    };
+    char * ep;
+    int n;
+    *result = strtoll(arg, &ep, 10);
+    if (ep != arg && ! *ep) return 1;
+    for (n = 0; formats[n]; n++) {
+	struct tm tm;
+	memset(&tm, 0, sizeof(tm));
+	ep = strptime(arg, formats[n], &tm);
+	if (! ep || *ep) continue;
+	tm.tm_isdst = -1;
+	*result = mktime(&tm);
+	return 1;
+    }
+    return 0;
+}
+
+/* set up the filter from the command line; returns an error message or
+ * NULL if OK */
+static const char * make_filter(void) {
+    int64_t from = INT64_MIN, to = INT64_MAX;
+    if (! operations && uid < 0 && ! prefix && ! since && ! until)
+	return NULL;
+    if (since && ! parse_time(since, &from))
+	return "Invalid TIME for -t";
+    if (until && ! parse_time(until, &to))
+	return "Invalid TIME for -T";
+    filter = shall_event_filter_new();
+    if (! filter) return strerror(errno);
+    if (operations && ! shall_event_filter_operations(filter, operations))
+	return "Invalid OPERATIONS for -o";
+    if (uid >= 0)
+	shall_event_filter_uid(filter, uid);
+    if (prefix && ! shall_event_filter_prefix(filter, prefix))
+	return "Invalid PREFIX for -n";
+    if (since || until)
+	shall_event_filter_time(filter, from, to);
+    return NULL;
+}
+
+/* like shall_event_next(), but skips the events which don't pass the
+ * filter, updating "where" for them; the file ID table still needs to
+ * see the ones which could change it */
+static int next_event(shall_event_iter_t * it, shall_event_t * ev,
+		      off_t * where, off_t wrap)
+{
+    while (filter) {
+	const char * event = it->buffer + it->pos;
+	int len, ok;
+	ok = shall_event_filter_match(filter, event, it->len - it->pos, &len);
+	if (ok < 0) return -1;
+	if (ok) break;
+	if (fileids && shall_fileids_relevant(event)) {
+	    if (shall_event_decode(event, len, ev) <= 0) break;
+	    if (! shall_fileids_update(fileids, ev)) return -1;
+	}
+	it->pos += len;
+	*where += len;
+	if (*where >= wrap) *where -= wrap;
+    }
+    return shall_event_next(it, ev);
+}
+
+/* copy the events which pass the filter to the output file; returns 1 if
+ * OK, 0 with errno set if the write failed, -1 with errno set if the data
+ * is not valid */
+static int copy_events(FILE * dest, const char * data, size_t len) {
+    size_t pos = 0, start = 0;
+    while (pos < len) {
+	int evlen = 0, ok;
+	ok = shall_event_filter_match(filter, data + pos, len - pos, &evlen);
+	if (ok < 0) return -1;
+	if (evlen == 0) {
+	    errno = EINVAL;
+	    return -1;
+	}
+	if (! ok) {
+	    /* write the events before this one */
+	    if (pos > start && fwrite(data + start, pos - start, 1, dest) < 1)
+		return 0;
+	    start = pos + evlen;
+	}
+	pos += evlen;
+    }
+    if (pos > start && fwrite(data + start, pos - start, 1, dest) < 1)
+	return 0;
+    return 1;
+}
+
+/* like format_chunk(), for -J and -R: the output does not depend on
+ * previous events, so it just goes in the chunk's text */
+static void format_structured(chunk_t * ck, size_t pos) {
+    shall_outbuf_t ob;
+    if (! shall_outbuf_init(&ob, -1, ck->limit)) {
+	ck->error = errno;
+	return;
+    }
+    while (pos < ck->limit) {
+	shall_event_t ev;
+	off_t where = ck->where + pos;
+	int len, ok;
+	if (filter && ! shall_event_filter_match(filter, ck->data + pos,
+						 ck->len - pos, &len))
+	{
+	    pos += len;
+	    ck->end = pos;
+	    continue;
+	}
+	len = shall_event_decode(ck->data + pos, ck->len - pos, &ev);
+	if (len <= 0) {
+	    ck->error = EINVAL;
+	    break;
+	}
+	if (ck->wrap && where >= ck->wrap) where -= ck->wrap;
+	if (json)
+	    ok = shall_format_json(&ob, where, &ev);
+	else
+	    ok = shall_format_record(&ob, &ev);
+	if (! ok) {
+	    ck->error = errno;
+	    break;
+	}
+	ck->nevents++;
+	pos += len;
+	ck->end = pos;
+    }
+    ck->text = ob.data;
+    ck->textlen = ob.len;
+}
+
+/* decode and format a chunk of events; runs in a thread */
+static void format_chunk(void * _ck, void * arg) {
+    chunk_t * ck = _ck;
+    size_t pos = 0;
+    FILE * F;
+    ck->nevents = ck->nrefs = 0;
+    ck->error = 0;
+    free(ck->text);
+    ck->text = NULL;
+    if (ck->resync) {
+	/* events are always aligned to a multiple of 8, and so are chunks */
+	ssize_t first = shall_event_resync(ck->data, ck->len, ck->limit, 8);
+	pos = first < 0 ? ck->limit : first;
+    }
+    ck->first = ck->end = pos;
+    if (json || records) {
+	format_structured(ck, pos);
+	return;
+    }
+    F = open_memstream(&ck->text, &ck->textlen);
+    if (! F) {
+	ck->error = errno;
+	return;
+    }
+    while (pos < ck->limit && ! ck->error) {
+	shall_event_t ev;
+	off_t where = ck->where + pos;
+	int len;
+	if (filter && ! shall_event_filter_match(filter, ck->data + pos,
+						 ck->len - pos, &len))
+	{
+	    pos += len;
+	    ck->end = pos;
+	    continue;
+	}
+	len = shall_event_decode(ck->data + pos, ck->len - pos, &ev);
+	if (len <= 0) {
+	    ck->error = EINVAL;
+	    break;
+	}
+	if (ck->nevents >= ck->maxevents) {
+	    int nm = ck->maxevents + 1024;
+	    size_t * ne = realloc(ck->evtext, nm * sizeof(size_t));
+	    if (! ne) {
+		ck->error = ENOMEM;
+		break;
+	    }
+	    ck->evtext = ne;
+	    ck->maxevents = nm;
+	}
+	if (ck->wrap && where >= ck->wrap) where -= ck->wrap;
+	ck->evtext[ck->nevents] = ftell(F);
+	print_log(F, ck, where, &ev, 0);
+	ck->nevents++;
+	pos += len;
+	ck->end = pos;
+    }
+    if (fclose(F) == EOF && ! ck->error) ck->error = errno;
+}
+
+/* print the events in a formatted chunk, adding the event numbers and the
+ * file names; returns 1 if OK, 0 with errno set on error */
+static int write_chunk(chunk_t * ck, int * count) {
+    shall_event_iter_t it;
+    shall_event_t ev;
+    off_t where = 0;
+    int n, ref = 0;
+    if (json || records) {
+	*count += ck->nevents;
+	return shall_outbuf_append(&output, ck->text, ck->textlen);
+    }
+    shall_event_iter_init(&it, ck->data + ck->first, ck->end - ck->first);
+    for (n = 0; n < ck->nevents; n++) {
+	size_t pos = ck->evtext[n];
+	size_t end = n + 1 < ck->nevents ? ck->evtext[n + 1] : ck->textlen;
+	/* the file IDs must also see the events which were filtered out */
+	if (fileids && next_event(&it, &ev, &where, 0) <= 0) return 0;
+	(*count)++;
+	printf("  %-7d", *count);
+	for (; ref < ck->nrefs && ck->refs[ref].event == n; ref++) {
+	    const fileref_t * fr = &ck->refs[ref];
+	    const char * name = shall_fileids_lookup(fileids, fr->fileid);
+	    fwrite(ck->text + pos, fr->pos - pos, 1, stdout);
+	    pos = fr->pos;
+	    if (name) printf(" [%s]", name);
+	}
+	fwrite(ck->text + pos, end - pos, 1, stdout);
+	if (fileids && ! shall_fileids_update(fileids, &ev)) return 0;
+    }
+    if (fileids && next_event(&it, &ev, &where, 0) < 0) return 0;
+    return 1;
+}
+
+static void free_chunk(chunk_t * ck) {
+    free(ck->copy);
+    free(ck->evtext);
+    free(ck->text);
+    free(ck->refs);
+    free(ck);
+}
+
+/* print all events using several threads: the input is either a file
+ * mapped in memory, which is split into chunks at arbitrary points and
+ * each thread finds the first event in its chunk; or a device reader,
+ * whose spans are copied as they are already split at event boundaries;
+ * the chunks are printed in order, and if a thread got the start of its
+ * chunk wrong (which is very unlikely) we just do it again; returns 1 if
+ * OK, 0 with errno set on error */
+static int print_parallel(const char * map, size_t maplen,
+			  shall_devreader_t * reader,
+			  shall_sb_data_t * sb, int * count)
+{
+    shall_parallel_t * sp;
+    size_t offset = 0, expected = 0;
+    int eof = 0, ok = 1, sve = 0, partial = 0;
+    sp = shall_parallel_start(threads, 2 * threads, format_chunk, NULL);
+    if (! sp) return 0;
+    while (1) {
+	chunk_t * ck;
+	while (ok && ! eof && ! shall_parallel_full(sp)) {
+	    ck = calloc(1, sizeof(*ck));
+	    if (! ck) {
+		sve = errno;
+		ok = 0;
+		break;
+	    }
+	    if (map) {
+		if (offset >= maplen) {
+		    free(ck);
+		    eof = 1;
+		    break;
+		}
+		ck->data = map + offset;
+		ck->len = maplen - offset;
+		ck->limit = ck->len < CHUNK_SIZE ? ck->len : CHUNK_SIZE;
+		ck->where = offset;
+		ck->resync = offset > 0;
+		offset += ck->limit;
+	    } else {
+		const char * span;
+		off_t where = sb->data_start;
+		ssize_t nr = shall_devreader_next(reader, &span);
+		if (nr <= 0) {
+		    if (nr < 0) {
+			sve = errno;
+			ok = 0;
+		    }
+		    free(ck);
+		    eof = 1;
+		    break;
+		}
+		ck->copy = malloc(nr);
+		if (! ck->copy) {
+		    sve = errno;
+		    free(ck);
+		    ok = 0;
+		    break;
+		}
+		memcpy(ck->copy, span, nr);
+		ck->data = ck->copy;
+		ck->len = ck->limit = nr;
+		ck->where = where;
+		ck->wrap = sb->data_space;
+	    }
+	    shall_parallel_submit(sp, ck);
+	}
+	ck = shall_parallel_next(sp);
+	if (! ck) break;
+	if (ok && map && ck->where + ck->first != expected) {
+	    if (expected < ck->where + ck->limit) {
+		size_t skip = expected - ck->where;
+		ck->data += skip;
+		ck->len -= skip;
+		ck->limit -= skip;
+		ck->where = expected;
+		ck->resync = 0;
+		format_chunk(ck, NULL);
+	    } else {
+		/* the chunk is all inside an event from a previous one */
+		ck->nevents = 0;
+		ck->error = 0;
+		ck->first = ck->end = expected - ck->where;
+	    }
+	}
+	if (ok && ! partial) {
+	    if (! write_chunk(ck, count)) {
+		sve = errno;
+		ok = 0;
+	    } else if (ck->error) {
+		sve = ck->error;
+		ok = 0;
+	    }
+	    expected = ck->where + ck->end;
+	    if (max_logs > 0 && *count > max_logs) eof = partial = 1;
+	}
+	free_chunk(ck);
+    }
+    shall_parallel_stop(sp);
+    if (ok && map && ! partial && expected != maplen) {
+	sve = EINVAL;
+	ok = 0;
+    }
+    errno = sve;
+    return ok;
+}
+
 int main(int argc, char *argv[]) {
     shall_sb_data_t sb;
     const char * pname = strrchr(argv[0], '/');
@@ -516,6 +906,8 @@ int main(int argc, char *argv[]) {
 	shall_print_help(stdout, pname, options, args);
 	return 0;
     }
+    if (inputs.count > 0)
+	input = 1;
     if (! errmsg && mounted && input)
 	errmsg = "Cannot specify both -i and -m";
     if (! errmsg && sbinfo && input)
@@ -528,6 +920,22 @@ int main(int argc, char *argv[]) {
 	errmsg = "Cannot specify -c with -m";
     if (! errmsg && clear_logs && input)
 	errmsg = "Cannot specify -c with -i";
+    if (! errmsg && keep_logs && ! mounted)
+	errmsg = "Cannot specify -k without -m";
+    if (! errmsg && threads < 1)
+	errmsg = "Invalid number of threads";
+    if (! errmsg && json && records)
+	errmsg = "Cannot specify both -J and -R";
+    if (! errmsg && (json || records) && debug_logs)
+	errmsg = "Cannot specify -J or -R with -d";
+    if (! errmsg && rotate_size < 0)
+	errmsg = "Invalid SIZE for -r";
+    if (! errmsg && rotate_time < 0)
+	errmsg = "Invalid SECONDS for -e";
+    if (! errmsg && (rotate_size || rotate_time || compress) && ! filename)
+	errmsg = "Cannot specify -e, -r or -z without FILE";
+    if (! errmsg)
+	errmsg = make_filter();
     if (errmsg) {
 	fprintf(stderr, "%s: %s\nUse \"%s -h\" for help\n",
 		pname, errmsg, pname);
@@ -553,12 +961,26 @@ int main(int argc, char *argv[]) {
 		    pname, device);
 	    return 1;
 	}
-	if (all_logs || debug_logs)
+	if ((all_logs || debug_logs) && keep_logs) {
+	    fd = shall_open_peekfile(sbuff.st_rdev, blocking);
+	    if (fd >= 0 && filter) {
+		/* let the kernel skip what it can */
+		struct shall_filter kf;
+		shall_event_filter_kernel(filter, &kf);
+		if (! shall_peek_filter(fd, &kf)) goto out_close;
+	    }
+	} else if (all_logs || debug_logs)
 	    fd = shall_open_logfile(sbuff.st_rdev, blocking, debug_prog);
 	else
 	    fd = 0;
+    } else if (inputs.count > 0) {
+	/* the merge opens all inputs itself */
+	fd = 0;
+	memset(&sb, 0, sizeof(sb));
+	all_logs = 1;
     } else if (input) {
 	fd = open(device, O_RDONLY);
+	memset(&sb, 0, sizeof(sb));
 	all_logs = 1;
     } else {
 	/* open device, doing automatic recovery if necessary */
@@ -587,57 +1009,161 @@ int main(int argc, char *argv[]) {
     }
     if (all_logs || input || debug_logs) {
 	char buffer[16384];
+	shall_devreader_t * reader = NULL;
+	shall_merge_t * merge = NULL;
 	FILE * dest;
 	off_t where = sb.data_start;
-	int count = 0, report = 1;
+	int count = 0, report = 1, parallel = 0, structured = json || records;
+	if (inputs.count > 0) {
+	    const char * names[inputs.count + 1], * failed = device;
+	    names[0] = device;
+	    memcpy(names + 1, inputs.values, inputs.count * sizeof(char *));
+	    merge = shall_merge_open(names, inputs.count + 1,
+				     debug_prog, &failed);
+	    if (! merge) {
+		fprintf(stderr, "%s: %s: %s\n",
+			pname, failed, strerror(errno));
+		return 1;
+	    }
+	}
 	if (filename) {
-	    dest = fopen(filename, append ? "ab" : "wb");
+	    if (rotate_size || rotate_time || compress) {
+		rotate = shall_rotate_open(filename, append, rotate_size,
+					   rotate_time, compress, pname);
+		dest = rotate ? shall_rotate_file(rotate) : NULL;
+	    } else {
+		dest = fopen(filename, append ? "ab" : "wb");
+	    }
 	    if (! dest) {
 		fprintf(stderr, "%s: %s: %s\n",
 			pname, filename, strerror(errno));
 	    }
 	} else {
 	    dest = NULL;
-	    if (! debug_logs) printf("Events logged in %s:\n", device);
+	    if (! debug_logs && ! structured) {
+		printf("Events logged in %s:\n", device);
+		fileids = shall_fileids_new();
+		if (! fileids) goto out_close;
+	    }
+	}
+	if (structured) {
+	    /* we'll write directly to the file descriptor */
+	    fflush(stdout);
+	    if (! shall_outbuf_init(&output, dest ? fileno(dest) : 1, 0))
+		goto out_close;
 	}
-	while (1) {
+	if (! mounted && ! input) {
+	    reader = shall_devreader_open(fd, &sb, 0, debug_prog);
+	    if (! reader) goto out_close;
+	}
+	if (threads > 1 && ! mounted && ! merge && (! dest || structured) &&
+	    ! debug_logs && ! rotate &&
+	    ! (filter && shall_event_filter_stateful(filter)))
+	{
+	    const char * map = NULL;
+	    size_t maplen = 0;
+	    if (input) map = shall_event_map(fd, &maplen);
+	    if (map || reader) {
+		int ok = print_parallel(map, maplen, reader, &sb, &count);
+		if (map) shall_event_unmap(map, maplen);
+		if (! ok) goto out_close;
+		parallel = 1;
+	    }
+	}
+	while (! parallel) {
+	    const char * data = buffer;
 	    ssize_t nr;
 	    if (max_logs > 0 && count > max_logs) break;
 	    if (mounted)
 		nr = read(fd, buffer, sizeof(buffer));
+	    else if (merge)
+		nr = shall_merge_next(merge, &data, NULL);
 	    else if (input)
 		nr = read_events(fd, buffer, sizeof(buffer));
 	    else
-		nr = shall_read_logs(fd, &sb, buffer,
-				     sizeof(buffer), debug_prog);
+		nr = shall_devreader_next(reader, &data);
 	    if (nr == 0 || (nr < 0 && errno == EAGAIN)) break;
 	    if (nr < 0) goto out_close;
-	    if (dest && ! debug_logs) {
-	    	if (fwrite(buffer, nr, 1, dest) < 1) {
+	    if (dest && ! debug_logs && ! structured) {
+		int ok = filter ? copy_events(dest, data, nr)
+				: fwrite(data, nr, 1, dest) == 1;
+		if (ok < 0) goto out_close;
+		if (! ok) {
 		    fprintf(stderr, "%s: %s: %s\n",
 			    pname, filename, strerror(errno));
 		    report = 0;
 		    break;
 		}
 	    } else {
-		int ptr = 0;
-		while (ptr < nr) {
-		    int next;
+		shall_event_iter_t it;
+		shall_event_t ev;
+		int ok;
+		shall_event_iter_init(&it, data, nr);
+		while ((ok = next_event(&it, &ev, &where, sb.data_space)) > 0) {
 		    count++;
-		    if (debug_logs)
-			next = print_debug_log(dest ? dest : stdout,
-					       buffer + ptr);
-		    else
-			next = print_log(where, buffer + ptr, count);
-		    ptr += next;
-		    where += next;
+		    if (json) {
+			if (! shall_format_json(&output, where, &ev))
+			    goto out_output;
+		    } else if (records) {
+			if (! shall_format_record(&output, &ev))
+			    goto out_output;
+		    } else if (debug_logs) {
+			print_debug_log(dest ? dest : stdout, &ev);
+		    } else {
+			print_log(stdout, NULL, where, &ev, count);
+			if (fileids && ! shall_fileids_update(fileids, &ev))
+			    goto out_close;
+		    }
+		    where += ev.length;
 		    if (where >= sb.data_space)
 			where -= sb.data_space;
 		}
+		if (ok < 0) goto out_close;
+	    }
+	    if (keep_logs) {
+		/* make sure the events are safe before removing them */
+		FILE * F = dest ? dest : stdout;
+		off_t pos;
+		if ((structured && ! shall_outbuf_flush(&output)) ||
+		    fflush(F) == EOF ||
+		    (dest && fsync(fileno(dest)) < 0))
+		{
+		    fprintf(stderr, "%s: %s: %s\n",
+			    pname, filename ? filename : "(stdout)",
+			    strerror(errno));
+		    report = 0;
+		    break;
+		}
+		pos = lseek(fd, 0, SEEK_CUR);
+		if (pos < 0 || ! shall_ack_logs(fd, pos)) goto out_close;
+	    }
+	    if (rotate && shall_rotate_due(rotate)) {
+		/* the file only contains whole events at this point */
+		if ((structured && ! shall_outbuf_flush(&output)) ||
+		    ! shall_rotate_next(rotate))
+		{
+		    fprintf(stderr, "%s: %s: %s\n",
+			    pname, filename, strerror(errno));
+		    report = 0;
+		    break;
+		}
+		dest = shall_rotate_file(rotate);
+		output.fd = fileno(dest);
 	    }
 	}
+	if (reader) shall_devreader_close(reader);
+	if (merge) shall_merge_close(merge);
+	if (structured) {
+	    if (! shall_outbuf_flush(&output) && report) {
+		fprintf(stderr, "%s: %s: %s\n",
+			pname, filename ? filename : "(stdout)",
+			strerror(errno));
+		report = 0;
+	    }
+	    shall_outbuf_free(&output);
+	}
 	if (dest) {
-	    if (fclose(dest) == EOF) {
+	    if (rotate ? ! shall_rotate_close(rotate) : fclose(dest) == EOF) {
 		if (report)
 		    fprintf(stderr, "%s: %s: %s\n",
 			    pname, filename, strerror(errno));
@@ -654,8 +1180,9 @@ int main(int argc, char *argv[]) {
 		    free(fw);
 		}
 	    }
-	} else {
+	} else if (! structured) {
 	    printf("End of journal, %d events\n", count);
+	    shall_fileids_free(fileids);
 	}
 	if (clear_logs) {
 	    struct shall_devsuper dsb;
@@ -668,6 +1195,10 @@ int main(int argc, char *argv[]) {
     }
     if (fd > 0 && close(fd) < 0) goto out_error;
     return 0;
+out_output:
+    fprintf(stderr, "%s: %s: %s\n",
+	    pname, filename ? filename : "(stdout)", strerror(errno));
+    return 1;
 out_close:
     sve = errno;
     close(fd);
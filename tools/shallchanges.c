@@ -0,0 +1,959 @@
+/* summarises a file of events produced by readshallfs or shalldrain as the
+ * set of paths which changed, for incremental backups
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ *
+ * this file is part of SHALLFS
+ *
+ * Copyright (c) 2017-2019 Claudio Calvelli <shallfs@gladserv.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 2 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program (see the file COPYING in the distribution).
+ * If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <string.h>
+#include <ctype.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include "shallfs-common.h"
+#include "shallfs-event.h"
+#include <shallfs/operation.h>
+
+/* every path seen is a node in a tree which mirrors the filesystem, so a
+ * rename just moves one node, whatever is inside it; a node remembers
+ * where it was at the start of the journal, unless it was created later;
+ * the regions written to each file are merged in memory until there are
+ * too many, then written to a temporary file as a run sorted by node
+ * number; the manifest merges all the runs, and when there are too many
+ * runs they are merged into one */
+
+typedef struct {
+    int64_t start;
+    int64_t end;
+} extent_t;
+
+typedef struct node_s node_t;
+struct node_s {
+    node_t * hnext;			/* hash chain */
+    node_t * parent;			/* current position */
+    char * name;
+    node_t * oparent;			/* position at the start, or NULL */
+    char * oname;			/* if the node was created later */
+    long index;
+    int changes;			/* see below */
+    int kind;				/* see below, for new nodes */
+    int deleted;
+    int nextents;
+    int maxextents;
+    extent_t * extents;			/* not yet in a run */
+};
+
+enum {
+    change_data  = 0x0001,
+    change_size  = 0x0002,
+    change_meta  = 0x0004,
+    change_acl   = 0x0008,
+    change_xattr = 0x0010,
+};
+
+enum {
+    kind_unknown,
+    kind_file,
+    kind_dir,
+    kind_symlink,
+    kind_device,
+    kind_special,
+};
+
+static const char * kinds[] = {
+    "?", "file", "dir", "symlink", "device", "special",
+};
+
+/* a spilled extent */
+typedef struct {
+    uint64_t node;
+    int64_t start;
+    int64_t end;
+} record_t;
+
+/* a source of records in order, for the merge: a run, or memory */
+typedef struct {
+    FILE * F;				/* NULL for memory */
+    long pos;				/* in "dirty", for memory */
+    int ext;
+    int valid;
+    record_t rec;
+} source_t;
+
+typedef struct fileid_s fileid_t;
+struct fileid_s {
+    fileid_t * next;
+    int fileid;
+    node_t * node;
+};
+
+#define MAX_RUNS 16
+#define INITIAL_HASH 1024
+#define READ_BUFFER 4194304
+
+static long help = 0, verbose = 0, before = 0, max_extents = 1048576;
+static long checkpoint = 0;
+static const char * events = NULL, * output = NULL, * tmpdir = NULL;
+
+static const shall_options_t options[] = {
+    { 'B', &before,          NULL,
+      "Also use events logged before the operation" },
+    { 'h', &help,            NULL,
+      "Print this helpful message" },
+    { 'm', &max_extents,     "NUMBER",
+      "Keep at most NUMBER regions in memory (default 1048576)" },
+    { 'o', NULL,             "FILE",
+      "Write the manifest to FILE instead of standard output", &output },
+    { 'p', &checkpoint,      "NUMBER",
+      "Also write the manifest after every NUMBER events (needs -o)" },
+    { 'T', NULL,             "DIR",
+      "Write temporary files to DIR (default: $TMPDIR or /tmp)", &tmpdir },
+    { 'v', &verbose,         NULL,
+      "Print statistics on standard error" },
+    {  0,  NULL,             NULL, NULL }
+};
+
+static const shall_args_t args[] = {
+    { &events,   "EVENTS",  0,
+      "File containing events, produced by readshallfs or shalldrain "
+      "(default: standard input)" },
+    { NULL,      NULL,           0, NULL }
+};
+
+static const char * pname;
+static node_t ** nodes = NULL;
+static long nnodes = 0, maxnodes = 0;
+static node_t ** table = NULL;
+static long tablesize = 0;
+static fileid_t ** fileids = NULL;
+static long nfileids = 0, fileidsize = 0;
+static node_t ** dirty = NULL;
+static long ndirty = 0, maxdirty = 0;
+static long extents_in_memory = 0;
+static FILE * runs[MAX_RUNS];
+static int nruns = 0;
+static long spills = 0;
+
+static unsigned long node_hash(const node_t * parent, const char * name,
+			       int len)
+{
+    unsigned long h = 2166136261U ^ (unsigned long)parent->index;
+    while (len-- > 0)
+	h = (h ^ (unsigned char)*name++) * 16777619U;
+    return h;
+}
+
+static int grow_table(void) {
+    long nsize = tablesize ? 2 * tablesize : INITIAL_HASH, n;
+    node_t ** nt = calloc(nsize, sizeof(node_t *));
+    if (! nt) return 0;
+    for (n = 0; n < tablesize; n++) {
+	while (table[n]) {
+	    node_t * d = table[n];
+	    unsigned long h = node_hash(d->parent, d->name, strlen(d->name))
+			    & (nsize - 1);
+	    table[n] = d->hnext;
+	    d->hnext = nt[h];
+	    nt[h] = d;
+	}
+    }
+    free(table);
+    table = nt;
+    tablesize = nsize;
+    return 1;
+}
+
+static void hash_node(node_t * d) {
+    unsigned long h = node_hash(d->parent, d->name, strlen(d->name))
+		    & (tablesize - 1);
+    d->hnext = table[h];
+    table[h] = d;
+}
+
+static void unhash_node(node_t * d) {
+    unsigned long h = node_hash(d->parent, d->name, strlen(d->name))
+		    & (tablesize - 1);
+    node_t ** dp = &table[h];
+    while (*dp && *dp != d) dp = &(*dp)->hnext;
+    if (*dp) *dp = d->hnext;
+}
+
+/* a new node; "existing" means it was there at the start */
+static node_t * new_node(node_t * parent, const char * name, int len,
+			 int existing)
+{
+    node_t * d;
+    if (nnodes >= maxnodes) {
+	long nm = maxnodes ? 2 * maxnodes : 65536;
+	node_t ** nn = realloc(nodes, nm * sizeof(node_t *));
+	if (! nn) return NULL;
+	nodes = nn;
+	maxnodes = nm;
+    }
+    if (nnodes >= tablesize && ! grow_table()) return NULL;
+    d = calloc(1, sizeof(*d));
+    if (! d) return NULL;
+    d->name = malloc(len + 1);
+    if (! d->name) {
+	free(d);
+	return NULL;
+    }
+    memcpy(d->name, name, len);
+    d->name[len] = 0;
+    d->parent = parent;
+    if (existing) {
+	d->oparent = parent;
+	d->oname = d->name;
+    }
+    d->index = nnodes;
+    nodes[nnodes++] = d;
+    if (parent) hash_node(d);
+    return d;
+}
+
+static node_t * find_child(node_t * parent, const char * name, int len) {
+    unsigned long h = node_hash(parent, name, len) & (tablesize - 1);
+    node_t * d;
+    for (d = table[h]; d; d = d->hnext)
+	if (d->parent == parent && strncmp(d->name, name, len) == 0 &&
+	    d->name[len] == 0)
+		return d;
+    return NULL;
+}
+
+/* find the node for a path; the directories containing it are added if
+ * necessary, as they must have existed (at the start, unless they are
+ * inside a new directory); if "last" is NULL, the node itself is added
+ * the same way, otherwise the function stores the
+ * length of the last component there and returns the directory, for the
+ * caller to deal with; returns NULL if out of memory */
+static node_t * find_node(const char * path, int len, int * last) {
+    node_t * d = nodes[0];
+    while (len > 0) {
+	int cl = 0;
+	node_t * c;
+	while (len > 0 && *path == '/') path++, len--;
+	while (cl < len && path[cl] != '/') cl++;
+	if (cl == 0) break;
+	if (last && cl == len) {
+	    *last = cl;
+	    return d;
+	}
+	c = find_child(d, path, cl);
+	if (! c) c = new_node(d, path, cl, d == nodes[0] || d->oparent);
+	if (! c) return NULL;
+	d = c;
+	path += cl;
+	len -= cl;
+    }
+    if (last) *last = 0;
+    return d;
+}
+
+/* remove a node from the tree, for example because it was deleted or
+ * something was renamed over it */
+static void delete_node(node_t * d) {
+    unhash_node(d);
+    d->deleted = 1;
+}
+
+/* move a node to a new position, replacing anything there */
+static int move_node(node_t * d, node_t * parent, const char * name,
+		     int len)
+{
+    node_t * old = find_child(parent, name, len);
+    char * nn;
+    if (old == d) return 1;
+    if (old) delete_node(old);
+    nn = malloc(len + 1);
+    if (! nn) return 0;
+    memcpy(nn, name, len);
+    nn[len] = 0;
+    unhash_node(d);
+    if (d->name != d->oname) free(d->name);
+    d->name = nn;
+    d->parent = parent;
+    hash_node(d);
+    return 1;
+}
+
+/* look up a path, returning the node and, if it is not there, adding it
+ * as "existing" */
+static node_t * lookup(const char * path, int len) {
+    return find_node(path, len, NULL);
+}
+
+static int grow_fileids(void) {
+    long nsize = fileidsize ? 2 * fileidsize : INITIAL_HASH, n;
+    fileid_t ** nt = calloc(nsize, sizeof(fileid_t *));
+    if (! nt) return 0;
+    for (n = 0; n < fileidsize; n++) {
+	while (fileids[n]) {
+	    fileid_t * f = fileids[n];
+	    unsigned long h = ((unsigned int)f->fileid * 2654435761U)
+			    & (nsize - 1);
+	    fileids[n] = f->next;
+	    f->next = nt[h];
+	    nt[h] = f;
+	}
+    }
+    free(fileids);
+    fileids = nt;
+    fileidsize = nsize;
+    return 1;
+}
+
+static fileid_t ** find_fileid(int fileid) {
+    unsigned long h = ((unsigned int)fileid * 2654435761U)
+		    & (fileidsize - 1);
+    fileid_t ** fp = &fileids[h];
+    while (*fp && (*fp)->fileid != fileid) fp = &(*fp)->next;
+    return fp;
+}
+
+static int open_fileid(int fileid, node_t * d) {
+    fileid_t ** fp;
+    if (nfileids >= fileidsize && ! grow_fileids()) return 0;
+    fp = find_fileid(fileid);
+    if (! *fp) {
+	*fp = malloc(sizeof(fileid_t));
+	if (! *fp) return 0;
+	(*fp)->next = NULL;
+	(*fp)->fileid = fileid;
+	nfileids++;
+    }
+    (*fp)->node = d;
+    return 1;
+}
+
+static void close_fileid(int fileid) {
+    fileid_t ** fp, * f;
+    if (fileidsize == 0) return;
+    fp = find_fileid(fileid);
+    f = *fp;
+    if (! f) return;
+    *fp = f->next;
+    free(f);
+    nfileids--;
+}
+
+static node_t * fileid_node(int fileid) {
+    fileid_t ** fp;
+    if (fileidsize == 0) return NULL;
+    fp = find_fileid(fileid);
+    return *fp ? (*fp)->node : NULL;
+}
+
+static int record_cmp(const record_t * a, const record_t * b) {
+    if (a->node != b->node) return a->node < b->node ? -1 : 1;
+    if (a->start != b->start) return a->start < b->start ? -1 : 1;
+    return 0;
+}
+
+static int dirty_cmp(const void * _a, const void * _b) {
+    const node_t * a = *(const node_t **)_a, * b = *(const node_t **)_b;
+    return a->index < b->index ? -1 : a->index > b->index;
+}
+
+static void next_record(source_t * s) {
+    if (s->F) {
+	s->valid = fread(&s->rec, sizeof(s->rec), 1, s->F) == 1;
+	return;
+    }
+    while (s->pos < ndirty && s->ext >= dirty[s->pos]->nextents) {
+	s->pos++;
+	s->ext = 0;
+    }
+    if (s->pos >= ndirty) {
+	s->valid = 0;
+	return;
+    }
+    s->rec.node = dirty[s->pos]->index;
+    s->rec.start = dirty[s->pos]->extents[s->ext].start;
+    s->rec.end = dirty[s->pos]->extents[s->ext].end;
+    s->ext++;
+    s->valid = 1;
+}
+
+/* prepare to merge all runs and, if "memory" is nonzero, the extents in
+ * memory; returns the number of sources */
+static int open_sources(source_t * src, int memory) {
+    int n, ns = 0;
+    for (n = 0; n < nruns; n++) {
+	rewind(runs[n]);
+	src[ns].F = runs[n];
+	next_record(&src[ns]);
+	ns++;
+    }
+    if (memory) {
+	qsort(dirty, ndirty, sizeof(node_t *), dirty_cmp);
+	src[ns].F = NULL;
+	src[ns].pos = 0;
+	src[ns].ext = 0;
+	next_record(&src[ns]);
+	ns++;
+    }
+    return ns;
+}
+
+/* get the next extent in order from all sources, merging overlapping or
+ * adjacent ones for the same node; returns 0 at the end */
+static int merge_next(source_t * src, int ns, record_t * rec) {
+    int n, best = -1;
+    for (n = 0; n < ns; n++)
+	if (src[n].valid &&
+	    (best < 0 || record_cmp(&src[n].rec, &src[best].rec) < 0))
+		best = n;
+    if (best < 0) return 0;
+    *rec = src[best].rec;
+    next_record(&src[best]);
+    while (1) {
+	best = -1;
+	for (n = 0; n < ns; n++)
+	    if (src[n].valid &&
+		(best < 0 || record_cmp(&src[n].rec, &src[best].rec) < 0))
+		    best = n;
+	if (best < 0) return 1;
+	if (src[best].rec.node != rec->node) return 1;
+	if (src[best].rec.start > rec->end) return 1;
+	if (src[best].rec.end > rec->end) rec->end = src[best].rec.end;
+	next_record(&src[best]);
+    }
+}
+
+static FILE * new_run(void) {
+    const char * dir = tmpdir ? tmpdir : getenv("TMPDIR");
+    char * name;
+    FILE * F;
+    int fd;
+    if (! dir || ! *dir) dir = "/tmp";
+    name = malloc(strlen(dir) + 24);
+    if (! name) return NULL;
+    sprintf(name, "%s/shallchanges.XXXXXX", dir);
+    fd = mkstemp(name);
+    if (fd < 0) {
+	free(name);
+	return NULL;
+    }
+    /* nobody else needs to see it */
+    unlink(name);
+    free(name);
+    F = fdopen(fd, "w+");
+    if (! F) close(fd);
+    return F;
+}
+
+static void forget_memory(void) {
+    long n;
+    for (n = 0; n < ndirty; n++) {
+	free(dirty[n]->extents);
+	dirty[n]->extents = NULL;
+	dirty[n]->nextents = dirty[n]->maxextents = 0;
+    }
+    ndirty = 0;
+    extents_in_memory = 0;
+}
+
+/* write the extents in memory to a new run; if there are too many runs,
+ * merge them all into this one; returns 1 if OK, 0 with errno set */
+static int spill(void) {
+    source_t src[MAX_RUNS + 1];
+    record_t rec;
+    int ns, n, merge = nruns >= MAX_RUNS;
+    FILE * F = new_run();
+    if (! F) return 0;
+    ns = open_sources(src, 1);
+    if (! merge) {
+	/* just the memory */
+	src[0] = src[ns - 1];
+	ns = 1;
+    }
+    while (merge_next(src, ns, &rec)) {
+	/* deleted files don't need their data */
+	if (nodes[rec.node]->deleted) continue;
+	if (fwrite(&rec, sizeof(rec), 1, F) < 1) {
+	    int sve = errno;
+	    fclose(F);
+	    errno = sve;
+	    return 0;
+	}
+    }
+    if (fflush(F) != 0) {
+	int sve = errno;
+	fclose(F);
+	errno = sve;
+	return 0;
+    }
+    if (merge) {
+	for (n = 0; n < nruns; n++)
+	    fclose(runs[n]);
+	nruns = 0;
+    }
+    runs[nruns++] = F;
+    forget_memory();
+    spills++;
+    return 1;
+}
+
+/* add a region to a file */
+static int add_extent(node_t * d, int64_t start, int64_t length) {
+    int64_t end = start + length;
+    int first, last;
+    d->changes |= change_data;
+    /* new files will be copied whole */
+    if (! d->oparent || length <= 0) return 1;
+    for (first = d->nextents; first > 0; first--)
+	if (d->extents[first - 1].end < start)
+	    break;
+    for (last = first; last < d->nextents; last++)
+	if (d->extents[last].start > end)
+	    break;
+    if (last > first) {
+	extent_t * e = &d->extents[first];
+	if (e->start > start) e->start = start;
+	if (d->extents[last - 1].end > end) end = d->extents[last - 1].end;
+	e->end = end;
+	memmove(&d->extents[first + 1], &d->extents[last],
+		(d->nextents - last) * sizeof(extent_t));
+	extents_in_memory -= last - first - 1;
+	d->nextents -= last - first - 1;
+	return 1;
+    }
+    if (d->nextents >= d->maxextents) {
+	int nm = d->maxextents ? 2 * d->maxextents : 4;
+	extent_t * ne = realloc(d->extents, nm * sizeof(extent_t));
+	if (! ne) return 0;
+	d->extents = ne;
+	d->maxextents = nm;
+    }
+    if (d->nextents == 0) {
+	if (ndirty >= maxdirty) {
+	    long nm = maxdirty ? 2 * maxdirty : 1024;
+	    node_t ** nd = realloc(dirty, nm * sizeof(node_t *));
+	    if (! nd) return 0;
+	    dirty = nd;
+	    maxdirty = nm;
+	}
+	dirty[ndirty++] = d;
+    }
+    memmove(&d->extents[first + 1], &d->extents[first],
+	    (d->nextents - first) * sizeof(extent_t));
+    d->extents[first].start = start;
+    d->extents[first].end = end;
+    d->nextents++;
+    extents_in_memory++;
+    if (extents_in_memory >= max_extents) return spill();
+    return 1;
+}
+
+/* a name created by the event */
+static int create(const char * path, int len, int kind) {
+    int cl;
+    node_t * dir = find_node(path, len, &cl), * d;
+    if (! dir) return 0;
+    if (cl == 0) return 1;
+    d = find_child(dir, path + len - cl, cl);
+    if (d) delete_node(d);
+    d = new_node(dir, path + len - cl, cl, 0);
+    if (! d) return 0;
+    d->kind = kind;
+    return 1;
+}
+
+static int rename_node(const char * from, int flen,
+		       const char * to, int tlen)
+{
+    int cl;
+    node_t * d = lookup(from, flen), * dir;
+    if (! d) return 0;
+    dir = find_node(to, tlen, &cl);
+    if (! dir) return 0;
+    if (cl == 0 || d == nodes[0]) return 1;
+    return move_node(d, dir, to + tlen - cl, cl);
+}
+
+/* process one event: returns 1 if OK, 0 if out of memory */
+static int process(const shall_event_t * ev) {
+    const char * n0 = ev->name[0], * n1 = ev->name[1];
+    int l0 = ev->namelen[0], l1 = ev->namelen[1];
+    node_t * d;
+    if (ev->before ? ! before : ev->result < 0) return 1;
+    switch (ev->operation) {
+	case SHALL_CREATE :
+	case SHALL_MKDIR :
+	case SHALL_SYMLINK :
+	case SHALL_MKNOD : {
+	    int kind = ev->operation == SHALL_CREATE ? kind_file
+		     : ev->operation == SHALL_MKDIR ? kind_dir
+		     : ev->operation == SHALL_SYMLINK ? kind_symlink
+		     : kind_special;
+	    if (ev->operation == SHALL_MKNOD &&
+		ev->data_type == SHALL_LOG_ATTR &&
+		(ev->u.attr.flags & (shall_attr_block | shall_attr_char)))
+		    kind = kind_device;
+	    if (ev->num_names < 1) return 1;
+	    return create(n0, l0, kind);
+	}
+	case SHALL_LINK :
+	    /* a new name for an existing file: needs to be copied whole */
+	    if (ev->num_names < 2) return 1;
+	    return create(n1, l1, kind_file);
+	case SHALL_DELETE :
+	case SHALL_RMDIR :
+	    if (ev->num_names < 1) return 1;
+	    d = lookup(n0, l0);
+	    if (! d) return 0;
+	    if (d != nodes[0]) delete_node(d);
+	    return 1;
+	case SHALL_MOVE :
+	    if (ev->num_names < 2) return 1;
+	    return rename_node(n0, l0, n1, l1);
+	case SHALL_SWAP : {
+	    node_t * a, * b, * pa;
+	    char * na, * nb;
+	    if (ev->num_names < 2) return 1;
+	    a = lookup(n0, l0);
+	    if (! a) return 0;
+	    b = lookup(n1, l1);
+	    if (! b) return 0;
+	    if (a == b || a == nodes[0] || b == nodes[0]) return 1;
+	    /* exchange the two positions */
+	    na = strdup(b->name);
+	    nb = strdup(a->name);
+	    if (! na || ! nb) {
+		free(na);
+		free(nb);
+		return 0;
+	    }
+	    unhash_node(a);
+	    unhash_node(b);
+	    if (a->name != a->oname) free(a->name);
+	    if (b->name != b->oname) free(b->name);
+	    pa = a->parent;
+	    a->parent = b->parent;
+	    a->name = na;
+	    b->parent = pa;
+	    b->name = nb;
+	    hash_node(a);
+	    hash_node(b);
+	    return 1;
+	}
+	case SHALL_META :
+	    if (ev->num_names < 1) return 1;
+	    d = lookup(n0, l0);
+	    if (! d) return 0;
+	    d->changes |= change_meta;
+	    if (ev->data_type == SHALL_LOG_ATTR &&
+		(ev->u.attr.flags & shall_attr_size))
+		    d->changes |= change_size;
+	    return 1;
+	case SHALL_SET_ACL :
+	    if (ev->num_names < 1) return 1;
+	    d = lookup(n0, l0);
+	    if (! d) return 0;
+	    d->changes |= change_acl;
+	    return 1;
+	case SHALL_SET_XATTR :
+	case SHALL_DEL_XATTR :
+	    if (ev->num_names < 1) return 1;
+	    d = lookup(n0, l0);
+	    if (! d) return 0;
+	    d->changes |= change_xattr;
+	    return 1;
+	case SHALL_OPEN :
+	    if (ev->num_names < 1 || ev->data_type != SHALL_LOG_FILEID)
+		return 1;
+	    d = lookup(n0, l0);
+	    if (! d) return 0;
+	    return open_fileid(ev->u.fileid, d);
+	case SHALL_CLOSE :
+	    if (ev->data_type == SHALL_LOG_FILEID)
+		close_fileid(ev->u.fileid);
+	    return 1;
+	case SHALL_WRITE :
+	    if (ev->data_type != SHALL_LOG_REGION &&
+		ev->data_type != SHALL_LOG_HASH &&
+		ev->data_type != SHALL_LOG_DATA)
+		    return 1;
+	    d = fileid_node(ev->u.region.fileid);
+	    if (! d) return 1;
+	    return add_extent(d, ev->u.region.start, ev->u.region.length);
+	case SHALL_CLONE :
+	    if (ev->data_type != SHALL_LOG_CLONE) return 1;
+	    d = fileid_node(ev->u.clone.dst_fileid);
+	    if (! d) return 1;
+	    return add_extent(d, ev->u.clone.dst_start, ev->u.clone.length);
+    }
+    return 1;
+}
+
+/* write a name, with spaces and anything unprintable as %XX */
+static void print_name(FILE * F, const char * name) {
+    for (; *name; name++) {
+	unsigned char c = *name;
+	if (isascii((int)c) && isprint((int)c) && c != '%' && c != ' ')
+	    fputc(c, F);
+	else
+	    fprintf(F, "%%%02x", c);
+    }
+}
+
+static void print_path(FILE * F, const node_t * d, int original) {
+    const node_t * p = original ? d->oparent : d->parent;
+    if (p != nodes[0]) print_path(F, p, original);
+    fputc('/', F);
+    print_name(F, original ? d->oname : d->name);
+}
+
+/* is the node, or any directory containing it, deleted? */
+static int gone(const node_t * d) {
+    for (; d && d != nodes[0]; d = d->parent)
+	if (d->deleted) return 1;
+    return 0;
+}
+
+/* write the manifest; returns 1 if OK, 0 with errno set */
+static int manifest(FILE * F) {
+    source_t src[MAX_RUNS + 1];
+    record_t rec;
+    int ns, have;
+    long n;
+    for (n = 1; n < nnodes; n++) {
+	const node_t * d = nodes[n];
+	if (! d->oparent || ! gone(d)) continue;
+	/* only the top of a deleted tree */
+	if (d->oparent != nodes[0] && gone(d->oparent)) continue;
+	fprintf(F, "D ");
+	print_path(F, d, 1);
+	fputc('\n', F);
+    }
+    for (n = 1; n < nnodes; n++) {
+	const node_t * d = nodes[n];
+	if (! d->oparent || gone(d)) continue;
+	if (d->parent == d->oparent && strcmp(d->name, d->oname) == 0)
+	    continue;
+	fprintf(F, "R ");
+	print_path(F, d, 1);
+	fputc(' ', F);
+	print_path(F, d, 0);
+	fputc('\n', F);
+    }
+    ns = open_sources(src, 1);
+    have = merge_next(src, ns, &rec);
+    for (n = 1; n < nnodes; n++) {
+	const node_t * d = nodes[n];
+	int sep = '=';
+	if (gone(d)) {
+	    while (have && rec.node == n)
+		have = merge_next(src, ns, &rec);
+	    continue;
+	}
+	if (! d->oparent) {
+	    /* only the top of a new tree */
+	    if (d->parent->oparent || d->parent == nodes[0]) {
+		fprintf(F, "N ");
+		print_path(F, d, 0);
+		fprintf(F, " %s\n", kinds[d->kind]);
+	    }
+	    continue;
+	}
+	if (! d->changes) continue;
+	fprintf(F, "M ");
+	print_path(F, d, 0);
+	if (d->changes & change_data) fprintf(F, " data");
+	while (have && rec.node == n) {
+	    fprintf(F, "%c%lld:%lld", sep, (long long)rec.start,
+		    (long long)(rec.end - rec.start));
+	    sep = ',';
+	    have = merge_next(src, ns, &rec);
+	}
+	if (d->changes & change_size) fprintf(F, " size");
+	if (d->changes & change_meta) fprintf(F, " meta");
+	if (d->changes & change_acl) fprintf(F, " acl");
+	if (d->changes & change_xattr) fprintf(F, " xattr");
+	fputc('\n', F);
+    }
+    for (n = 0; n < nruns; n++)
+	if (ferror(runs[n])) return 0;
+    return ! ferror(F);
+}
+
+/* write the manifest to the output file, replacing it atomically */
+static int write_output(void) {
+    char * tmp;
+    FILE * F;
+    int ok;
+    if (! output) {
+	ok = manifest(stdout);
+	if (fflush(stdout) != 0) ok = 0;
+	return ok;
+    }
+    tmp = malloc(strlen(output) + 5);
+    if (! tmp) return 0;
+    sprintf(tmp, "%s.tmp", output);
+    F = fopen(tmp, "w");
+    if (! F) {
+	free(tmp);
+	return 0;
+    }
+    ok = manifest(F);
+    if (fflush(F) != 0 || fsync(fileno(F)) < 0) ok = 0;
+    if (fclose(F) != 0) ok = 0;
+    if (ok && rename(tmp, output) < 0) ok = 0;
+    if (! ok) {
+	int sve = errno;
+	unlink(tmp);
+	errno = sve;
+    }
+    free(tmp);
+    return ok;
+}
+
+int main(int argc, char *argv[]) {
+    const char * errmsg =
+	shall_parse_options(argc - 1, argv + 1, options, args);
+    char * buffer;
+    size_t bufsize = READ_BUFFER, have = 0;
+    long long count = 0, done = 0;
+    int fd, eof = 0, ok = 1;
+    long n;
+    pname = strrchr(argv[0], '/');
+    if (pname)
+	pname++;
+    else
+	pname = argv[0];
+    if (help) {
+	shall_print_help(stdout, pname, options, args);
+	return 0;
+    }
+    if (! errmsg && max_extents < 1)
+	errmsg = "Invalid NUMBER for -m";
+    if (! errmsg && checkpoint < 0)
+	errmsg = "Invalid NUMBER for -p";
+    if (! errmsg && checkpoint > 0 && ! output)
+	errmsg = "Option -p requires -o";
+    if (errmsg) {
+	fprintf(stderr, "%s: %s\nUse \"%s -h\" for help\n",
+		pname, errmsg, pname);
+	return 1;
+    }
+    if (! events) {
+	events = "(stdin)";
+	fd = 0;
+    } else {
+	fd = open(events, O_RDONLY);
+	if (fd < 0) {
+	    perror(events);
+	    return 1;
+	}
+    }
+    buffer = malloc(bufsize);
+    /* node 0 is the root */
+    if (! buffer || ! new_node(NULL, "", 0, 1)) {
+	perror(pname);
+	return 1;
+    }
+    nodes[0]->oname = nodes[0]->name;
+    while (ok && ! eof) {
+	size_t pos = 0;
+	ssize_t nr = read(fd, buffer + have, bufsize - have);
+	if (nr < 0) {
+	    perror(events);
+	    ok = 0;
+	    break;
+	}
+	if (nr == 0) eof = 1;
+	have += nr;
+	while (pos < have) {
+	    shall_event_t ev;
+	    int len = shall_event_decode(buffer + pos, have - pos, &ev);
+	    if (len == 0) break;
+	    if (len < 0) {
+		fprintf(stderr, "%s: %s: invalid event at %lld\n",
+			pname, events, done + (long long)pos);
+		ok = 0;
+		break;
+	    }
+	    if (! process(&ev)) {
+		perror(pname);
+		ok = 0;
+		break;
+	    }
+	    pos += len;
+	    count++;
+	    if (checkpoint > 0 && count % checkpoint == 0 &&
+		! write_output())
+	    {
+		perror(output);
+		ok = 0;
+		break;
+	    }
+	}
+	if (! ok) break;
+	memmove(buffer, buffer + pos, have - pos);
+	have -= pos;
+	done += pos;
+	if (have == bufsize) {
+	    /* one very large event */
+	    char * nb = realloc(buffer, 2 * bufsize);
+	    if (! nb) {
+		perror(pname);
+		ok = 0;
+		break;
+	    }
+	    buffer = nb;
+	    bufsize *= 2;
+	}
+    }
+    if (ok && have > 0)
+	fprintf(stderr, "%s: %s: ignoring incomplete event at %lld\n",
+		pname, events, done);
+    if (ok && ! write_output()) {
+	perror(output ? output : pname);
+	ok = 0;
+    }
+    if (verbose)
+	fprintf(stderr, "%lld events, %ld paths, %ld spills, %d runs\n",
+		count, nnodes, spills, nruns);
+    for (n = 0; n < nruns; n++)
+	fclose(runs[n]);
+    forget_memory();
+    for (n = 0; n < nnodes; n++) {
+	if (nodes[n]->name != nodes[n]->oname) free(nodes[n]->oname);
+	free(nodes[n]->name);
+	free(nodes[n]);
+    }
+    while (nfileids > 0) {
+	for (n = 0; n < fileidsize; n++)
+	    while (fileids[n])
+		close_fileid(fileids[n]->fileid);
+    }
+    free(nodes);
+    free(table);
+    free(fileids);
+    free(dirty);
+    free(buffer);
+    if (fd > 0) close(fd);
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,914 @@
+/* reduces a file of events produced by readshallfs or shalldrain to an
+ * equivalent, usually smaller, file of events
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ *
+ * this file is part of SHALLFS
+ *
+ * Copyright (c) 2017-2019 Claudio Calvelli <shallfs@gladserv.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 2 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program (see the file COPYING in the distribution).
+ * If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include "shallfs-common.h"
+#include "shallfs-event.h"
+#include <shallfs/operation.h>
+
+/* the events are read in order and each one becomes an item in the
+ * output, unless it can be dropped; there are three kinds of reduction:
+ *
+ * - a file or directory created and then deleted in the journal is
+ *   described by a "life" record; every event which uses it belongs to
+ *   the record, and if the file is deleted without having been linked,
+ *   swapped, used as a clone source or left open, all these events are
+ *   dropped; a directory is only dropped if everything created inside
+ *   it was also dropped
+ *
+ * - WRITE events for the same open file are collected, and overlapping
+ *   or adjacent regions merged, until the next event which could depend
+ *   on them (anything using the file, or a directory containing it)
+ *
+ * - a MOVE from A to B followed by a MOVE from B to C becomes a single
+ *   MOVE from A to C if nothing else used B or C (or a directory above
+ *   them, or a file inside them) in between
+ *
+ * failed operations are dropped too, as they didn't change anything */
+
+typedef struct life_s life_t;
+struct life_s {
+    life_t * next;			/* all records, to free them */
+    int tainted;			/* can't be dropped */
+    int cancelled;			/* all its events dropped */
+    int open;				/* file IDs open on it */
+    int nchildren;
+    int maxchildren;
+    life_t ** children;			/* created inside this directory */
+};
+
+/* what we know about each path which appears in the journal */
+typedef struct path_s path_t;
+struct path_s {
+    path_t * next;			/* hash chain */
+    char * name;
+    int len;
+    long touched;			/* last item using this path */
+    long below;				/* last item using a path inside */
+    long moved;				/* last MOVE to this path */
+    life_t * life;			/* created here and still here */
+    long lives;				/* records here and inside */
+};
+
+typedef enum {
+    item_kept,
+    item_merged,			/* replaced by a merged WRITE */
+    item_collapsed,			/* MOVE merged into an earlier one */
+    item_changed,			/* must be encoded again */
+} item_state_t;
+
+typedef struct {
+    shall_event_t ev;
+    life_t * owner;			/* dropped if this is cancelled */
+    item_state_t state;
+} item_t;
+
+typedef struct {
+    int64_t start;
+    int64_t end;
+    long item;				/* last WRITE in this interval */
+    int count;				/* number of WRITEs */
+} interval_t;
+
+typedef struct open_s open_t;
+struct open_s {
+    open_t * next;			/* hash chain */
+    int fileid;
+    int dirty;				/* index in "dirty", or -1 */
+    life_t * life;
+    int nints;
+    int maxints;
+    interval_t * ints;			/* sorted, not overlapping */
+};
+
+static long help = 0, quiet = 0;
+static const char * input = NULL, * output = NULL;
+
+static const shall_options_t options[] = {
+    { 'h', &help,            NULL,
+      "Print this helpful message" },
+    { 'q', &quiet,           NULL,
+      "Don't print the statistics at the end" },
+    {  0,  NULL,             NULL, NULL }
+};
+
+static const shall_args_t args[] = {
+    { &input,    "INPUT",   1,
+      "File containing events, produced by readshallfs or shalldrain" },
+    { &output,   "OUTPUT",  0,
+      "File to write the reduced events to (omit to just see the "
+      "statistics)" },
+    { NULL,      NULL,           0, NULL }
+};
+
+static const char * pname;
+static item_t * items = NULL;
+static long nitems = 0, maxitems = 0;
+static life_t * lives = NULL;
+static path_t ** paths = NULL;
+static long npaths = 0, pathsize = 0;
+static open_t ** opens = NULL;
+static long nopens = 0, opensize = 0;
+static open_t ** dirty = NULL;
+static int ndirty = 0, maxdirty = 0;
+static long failed = 0;
+
+/* check if one path is the same as the other, or inside it */
+static int related(const char * a, int la, const char * b, int lb) {
+    if (la > lb) {
+	const char * t = a;
+	int lt = la;
+	a = b;
+	la = lb;
+	b = t;
+	lb = lt;
+    }
+    if (strncmp(a, b, la) != 0) return 0;
+    return la == lb || b[la] == '/' || (la > 0 && a[la - 1] == '/');
+}
+
+/* both hash tables double in size when they get too full, and start with
+ * this size */
+#define INITIAL_HASH 1024
+
+static unsigned long path_hash(const char * name, int len) {
+    unsigned long h = 2166136261U;
+    while (len-- > 0)
+	h = (h ^ (unsigned char)*name++) * 16777619U;
+    return h;
+}
+
+static int grow_paths(void) {
+    long nsize = pathsize ? 2 * pathsize : INITIAL_HASH, n;
+    path_t ** nt = calloc(nsize, sizeof(path_t *));
+    if (! nt) return 0;
+    for (n = 0; n < pathsize; n++) {
+	while (paths[n]) {
+	    path_t * p = paths[n];
+	    unsigned long h = path_hash(p->name, p->len) & (nsize - 1);
+	    paths[n] = p->next;
+	    p->next = nt[h];
+	    nt[h] = p;
+	}
+    }
+    free(paths);
+    paths = nt;
+    pathsize = nsize;
+    return 1;
+}
+
+/* find a path, adding it if necessary; returns NULL if out of memory */
+static path_t * find_path(const char * name, int len) {
+    path_t * p;
+    unsigned long h;
+    if (npaths >= pathsize && ! grow_paths()) return NULL;
+    h = path_hash(name, len) & (pathsize - 1);
+    for (p = paths[h]; p; p = p->next)
+	if (p->len == len && memcmp(p->name, name, len) == 0)
+	    return p;
+    p = malloc(sizeof(*p));
+    if (! p) return NULL;
+    p->name = malloc(len + 1);
+    if (! p->name) {
+	free(p);
+	return NULL;
+    }
+    memcpy(p->name, name, len);
+    p->name[len] = 0;
+    p->len = len;
+    p->touched = p->below = p->moved = -1;
+    p->life = NULL;
+    p->lives = 0;
+    p->next = paths[h];
+    paths[h] = p;
+    npaths++;
+    return p;
+}
+
+/* length of the directory containing a path, or -1 for the root */
+static int parent_len(const char * name, int len) {
+    while (len > 0 && name[len - 1] == '/') len--;
+    while (len > 0 && name[len - 1] != '/') len--;
+    while (len > 1 && name[len - 1] == '/') len--;
+    return len > 0 ? len : -1;
+}
+
+/* add or remove a record at a path, keeping count of the records
+ * inside each directory; returns 1 if OK, 0 if out of memory */
+static int count_life(path_t * p, int diff) {
+    int len = p->len;
+    p->lives += diff;
+    while ((len = parent_len(p->name, len)) > 0) {
+	path_t * d = find_path(p->name, len);
+	if (! d) return 0;
+	d->lives += diff;
+    }
+    return 1;
+}
+
+static life_t * new_life(void) {
+    life_t * l = calloc(1, sizeof(*l));
+    if (! l) return NULL;
+    l->next = lives;
+    lives = l;
+    return l;
+}
+
+static int attach(life_t * l, path_t * p) {
+    p->life = l;
+    return count_life(p, 1);
+}
+
+static int detach(path_t * p) {
+    if (! p->life) return 1;
+    p->life = NULL;
+    return count_life(p, -1);
+}
+
+/* something not tracked happened to the files inside a directory, so
+ * none of them can be dropped */
+static int taint_inside(path_t * dir) {
+    long n;
+    if (dir->lives <= (dir->life ? 1 : 0)) return 1;
+    for (n = 0; n < pathsize; n++) {
+	path_t * p;
+	for (p = paths[n]; p; p = p->next) {
+	    if (! p->life || p == dir) continue;
+	    if (p->len <= dir->len) continue;
+	    if (! related(dir->name, dir->len, p->name, p->len)) continue;
+	    p->life->tainted = 1;
+	    if (! detach(p)) return 0;
+	}
+    }
+    return 1;
+}
+
+static int add_child(life_t * dir, life_t * child) {
+    if (dir->nchildren > 0 && dir->children[dir->nchildren - 1] == child)
+	return 1;
+    if (dir->nchildren >= dir->maxchildren) {
+	int nm = dir->maxchildren + 16;
+	life_t ** nc = realloc(dir->children, nm * sizeof(life_t *));
+	if (! nc) return 0;
+	dir->children = nc;
+	dir->maxchildren = nm;
+    }
+    dir->children[dir->nchildren++] = child;
+    return 1;
+}
+
+/* see if a file can be dropped when it is deleted */
+static int can_cancel(const life_t * l) {
+    int n;
+    if (l->tainted || l->open > 0) return 0;
+    for (n = 0; n < l->nchildren; n++)
+	if (! l->children[n]->cancelled)
+	    return 0;
+    return 1;
+}
+
+/* record that an item uses a path: this is needed to decide whether
+ * MOVEs can be collapsed, and to make sure a directory is only dropped
+ * if everything done inside it was dropped too */
+static int visit(const char * name, int len, long item, life_t * owner) {
+    path_t * p = find_path(name, len);
+    int found = 0;
+    if (! p) return 0;
+    if (p->touched < item) p->touched = item;
+    while ((len = parent_len(name, len)) > 0) {
+	p = find_path(name, len);
+	if (! p) return 0;
+	if (p->below < item) p->below = item;
+	if (found || ! p->life) continue;
+	found = 1;
+	if (! owner)
+	    p->life->tainted = 1;
+	else if (owner != p->life && ! add_child(p->life, owner))
+	    return 0;
+    }
+    return 1;
+}
+
+/* see if nothing used a path, the directories above it, or the files
+ * inside it, after "item" */
+static int untouched(const char * name, int len, long item) {
+    path_t * p = find_path(name, len);
+    if (! p || p->touched > item || p->below > item) return 0;
+    while ((len = parent_len(name, len)) > 0) {
+	p = find_path(name, len);
+	if (! p || p->touched > item) return 0;
+    }
+    return 1;
+}
+
+static int grow_opens(void) {
+    long nsize = opensize ? 2 * opensize : INITIAL_HASH, n;
+    open_t ** nt = calloc(nsize, sizeof(open_t *));
+    if (! nt) return 0;
+    for (n = 0; n < opensize; n++) {
+	while (opens[n]) {
+	    open_t * o = opens[n];
+	    unsigned long h = ((unsigned int)o->fileid * 2654435761U)
+			    & (nsize - 1);
+	    opens[n] = o->next;
+	    o->next = nt[h];
+	    nt[h] = o;
+	}
+    }
+    free(opens);
+    opens = nt;
+    opensize = nsize;
+    return 1;
+}
+
+/* find an open file, adding it if "add" is nonzero; returns NULL if it
+ * is not there, or if out of memory with errno set */
+static open_t * find_open(int fileid, int add) {
+    open_t * o;
+    unsigned long h;
+    errno = 0;
+    if (nopens >= opensize && ! grow_opens()) return NULL;
+    h = ((unsigned int)fileid * 2654435761U) & (opensize - 1);
+    for (o = opens[h]; o; o = o->next)
+	if (o->fileid == fileid)
+	    return o;
+    if (! add) return NULL;
+    o = calloc(1, sizeof(*o));
+    if (! o) return NULL;
+    o->fileid = fileid;
+    o->dirty = -1;
+    o->next = opens[h];
+    opens[h] = o;
+    nopens++;
+    return o;
+}
+
+static void remove_open(open_t * o) {
+    unsigned long h = ((unsigned int)o->fileid * 2654435761U)
+		    & (opensize - 1);
+    open_t ** op = &opens[h];
+    while (*op != o) op = &(*op)->next;
+    *op = o->next;
+    nopens--;
+    free(o->ints);
+    free(o);
+}
+
+static item_t * new_item(const shall_event_t * ev, life_t * owner) {
+    item_t * it;
+    if (nitems >= maxitems) {
+	long nm = maxitems ? 2 * maxitems : 65536;
+	item_t * ni = realloc(items, nm * sizeof(item_t));
+	if (! ni) return NULL;
+	items = ni;
+	maxitems = nm;
+    }
+    it = &items[nitems++];
+    it->ev = *ev;
+    it->owner = owner;
+    it->state = item_kept;
+    return it;
+}
+
+/* add a WRITE to the regions of an open file, merging it with any region
+ * it overlaps or touches; returns 1 if OK, 0 if out of memory */
+static int add_write(open_t * o, int64_t start, int64_t end, long item) {
+    int first, last, n;
+    /* find the intervals which this one touches: usually none, or the
+     * last one, for sequential writes */
+    for (first = o->nints; first > 0; first--)
+	if (o->ints[first - 1].end < start)
+	    break;
+    for (last = first; last < o->nints; last++)
+	if (o->ints[last].start > end)
+	    break;
+    if (last > first) {
+	interval_t * i = &o->ints[first];
+	if (i->start > start) i->start = start;
+	if (o->ints[last - 1].end > end) end = o->ints[last - 1].end;
+	i->end = end;
+	i->item = item;
+	for (n = first + 1; n < last; n++)
+	    i->count += o->ints[n].count;
+	i->count++;
+	memmove(&o->ints[first + 1], &o->ints[last],
+		(o->nints - last) * sizeof(interval_t));
+	o->nints -= last - first - 1;
+    } else {
+	if (o->nints >= o->maxints) {
+	    int nm = o->maxints + 16;
+	    interval_t * ni = realloc(o->ints, nm * sizeof(interval_t));
+	    if (! ni) return 0;
+	    o->ints = ni;
+	    o->maxints = nm;
+	}
+	memmove(&o->ints[first + 1], &o->ints[first],
+		(o->nints - first) * sizeof(interval_t));
+	o->ints[first].start = start;
+	o->ints[first].end = end;
+	o->ints[first].item = item;
+	o->ints[first].count = 1;
+	o->nints++;
+    }
+    if (o->dirty < 0) {
+	if (ndirty >= maxdirty) {
+	    int nm = maxdirty + 64;
+	    open_t ** nd = realloc(dirty, nm * sizeof(open_t *));
+	    if (! nd) return 0;
+	    dirty = nd;
+	    maxdirty = nm;
+	}
+	o->dirty = ndirty;
+	dirty[ndirty++] = o;
+    }
+    return 1;
+}
+
+/* write out the merged regions of an open file: a region made of a
+ * single WRITE keeps the original event, the others get a new event
+ * based on the last WRITE they contain; returns 1 if OK, 0 if out of
+ * memory */
+static int flush_writes(open_t * o) {
+    int n;
+    if (o->dirty < 0) return 1;
+    for (n = 0; n < o->nints; n++) {
+	interval_t * i = &o->ints[n];
+	shall_event_t ev;
+	item_t * it;
+	if (i->count == 1) {
+	    items[i->item].state = item_kept;
+	    continue;
+	}
+	ev = items[i->item].ev;
+	ev.u.region.start = i->start;
+	ev.u.region.length = i->end - i->start;
+	it = new_item(&ev, o->life);
+	if (! it) return 0;
+	it->state = item_changed;
+    }
+    o->nints = 0;
+    ndirty--;
+    if (o->dirty < ndirty) {
+	dirty[o->dirty] = dirty[ndirty];
+	dirty[o->dirty]->dirty = o->dirty;
+    }
+    o->dirty = -1;
+    return 1;
+}
+
+/* write out the merged regions of open files which an event could
+ * depend on */
+static int flush_related(const char * name, int len,
+			 const shall_fileids_t * fileids)
+{
+    int n = 0;
+    while (n < ndirty) {
+	const char * fn = shall_fileids_lookup(fileids, dirty[n]->fileid);
+	if (fn && ! related(name, len, fn, strlen(fn))) {
+	    n++;
+	    continue;
+	}
+	/* flush_writes replaces dirty[n] with the last one */
+	if (! flush_writes(dirty[n])) return 0;
+    }
+    return 1;
+}
+
+static int flush_fileid(int fileid) {
+    open_t * o = find_open(fileid, 0);
+    return o ? flush_writes(o) : ! errno;
+}
+
+/* the record for an open file, if it was created in the journal */
+static life_t * fileid_life(int fileid) {
+    open_t * o = find_open(fileid, 0);
+    return o ? o->life : NULL;
+}
+
+/* process one event: returns 1 if OK, 0 if out of memory */
+static int process(const shall_event_t * ev,
+		   const shall_fileids_t * fileids)
+{
+    const char * name[2];
+    int len[2], num = 0, n, named = 0, is_write = 0, collapse = 0;
+    life_t * owner = NULL;
+    long index;
+    item_t * it;
+    /* find the paths used by the event */
+    switch (ev->operation) {
+	case SHALL_SYMLINK :
+	case SHALL_DEL_XATTR :
+	    /* the second name is not a path */
+	    if (ev->num_names > 0) {
+		name[0] = ev->name[0];
+		len[0] = ev->namelen[0];
+		num = named = 1;
+	    }
+	    break;
+	case SHALL_META :
+	case SHALL_MKNOD :
+	case SHALL_MKDIR :
+	case SHALL_LINK :
+	case SHALL_CREATE :
+	case SHALL_DELETE :
+	case SHALL_RMDIR :
+	case SHALL_OPEN :
+	case SHALL_MOVE :
+	case SHALL_SWAP :
+	case SHALL_SET_ACL :
+	case SHALL_SET_XATTR :
+	    for (num = 0; num < ev->num_names && num < 2; num++) {
+		name[num] = ev->name[num];
+		len[num] = ev->namelen[num];
+	    }
+	    named = num > 0;
+	    break;
+	case SHALL_WRITE :
+	case SHALL_COMMIT :
+	case SHALL_CLOSE :
+	case SHALL_CLONE :
+	    break;
+	default :
+	    /* nothing to do with files */
+	    if (! new_item(ev, NULL)) return 0;
+	    return 1;
+    }
+    switch (ev->data_type) {
+	case SHALL_LOG_FILEID :
+	    if (! flush_fileid(ev->u.fileid)) return 0;
+	    if (ev->operation == SHALL_OPEN) break;
+	    name[num] = shall_fileids_lookup(fileids, ev->u.fileid);
+	    if (name[num]) {
+	        len[num] = strlen(name[num]);
+	        num++;
+	    }
+	    owner = fileid_life(ev->u.fileid);
+	    break;
+	case SHALL_LOG_REGION :
+	    is_write = ev->operation == SHALL_WRITE && ! ev->before;
+	    /* fall through */
+	case SHALL_LOG_HASH :
+	case SHALL_LOG_DATA :
+	    if (! is_write && ! flush_fileid(ev->u.region.fileid)) return 0;
+	    name[num] = shall_fileids_lookup(fileids, ev->u.region.fileid);
+	    if (name[num]) {
+	        len[num] = strlen(name[num]);
+	        num++;
+	    }
+	    owner = fileid_life(ev->u.region.fileid);
+	    break;
+	case SHALL_LOG_CLONE : {
+	    life_t * src = fileid_life(ev->u.clone.src_fileid);
+	    if (! flush_fileid(ev->u.clone.src_fileid)) return 0;
+	    if (! flush_fileid(ev->u.clone.dst_fileid)) return 0;
+	    name[0] = shall_fileids_lookup(fileids, ev->u.clone.dst_fileid);
+	    if (name[0]) {
+	        len[0] = strlen(name[0]);
+	        num++;
+	    }
+	    name[num] = shall_fileids_lookup(fileids, ev->u.clone.src_fileid);
+	    if (name[num]) {
+	        len[num] = strlen(name[num]);
+	        num++;
+	    }
+	    owner = fileid_life(ev->u.clone.dst_fileid);
+	    /* the data in the source is needed */
+	    if (src && src != owner) src->tainted = 1;
+	    break;
+	}
+    }
+    if (! is_write)
+	for (n = 0; n < num; n++)
+	    if (! flush_related(name[n], len[n], fileids))
+		return 0;
+    /* the flushes may have added items */
+    index = nitems;
+    /* now see what the event does to the records */
+    if (named) {
+	path_t * p0 = find_path(name[0], len[0]), * p1 = NULL;
+	if (! p0) return 0;
+	if (num > 1) {
+	    p1 = find_path(name[1], len[1]);
+	    if (! p1) return 0;
+	}
+	owner = p0->life;
+	switch (ev->before ? 0 : ev->operation) {
+	    case SHALL_CREATE :
+	    case SHALL_MKNOD :
+	    case SHALL_MKDIR :
+	    case SHALL_SYMLINK :
+		if (p0->life) {
+		    /* we must have missed its deletion */
+		    p0->life->tainted = 1;
+		    if (! detach(p0)) return 0;
+		}
+		owner = new_life();
+		if (! owner || ! attach(owner, p0)) return 0;
+		break;
+	    case SHALL_DELETE :
+	    case SHALL_RMDIR :
+		if (! owner) break;
+		if (can_cancel(owner)) owner->cancelled = 1;
+		if (! detach(p0)) return 0;
+		break;
+	    case SHALL_MOVE :
+		if (! p1) break;
+		/* MOVE A B, MOVE B C -> MOVE A C */
+		if (p0->moved >= 0 && p0->touched == p0->moved &&
+		    untouched(name[0], len[0], p0->moved) &&
+		    untouched(name[1], len[1], p0->moved))
+		{
+		    item_t * prev = &items[p0->moved];
+		    const char * a = prev->ev.name[0];
+		    int la = prev->ev.namelen[0];
+		    index = p0->moved;
+		    collapse = 1;
+		    if (la == len[1] && memcmp(a, name[1], la) == 0) {
+			/* back where it started */
+			prev->state = item_collapsed;
+			p1->moved = -1;
+		    } else {
+			prev->ev.name[1] = name[1];
+			prev->ev.namelen[1] = len[1];
+			prev->state = item_changed;
+			p1->moved = index;
+		    }
+		} else {
+		    p1->moved = nitems;
+		}
+		p0->moved = -1;
+		if (p1->life) {
+		    p1->life->tainted = 1;
+		    if (! detach(p1)) return 0;
+		}
+		if (! taint_inside(p0)) return 0;
+		if (owner) {
+		    if (! detach(p0) || ! attach(owner, p1)) return 0;
+		}
+		break;
+	    case SHALL_SWAP :
+		if (! p1) break;
+		if (! taint_inside(p0) || ! taint_inside(p1)) return 0;
+		if (p0->life) p0->life->tainted = 1;
+		if (p1->life) p1->life->tainted = 1;
+		if (! detach(p0) || ! detach(p1)) return 0;
+		owner = NULL;
+		break;
+	    case SHALL_LINK :
+		if (p0->life) p0->life->tainted = 1;
+		owner = NULL;
+		break;
+	    case SHALL_OPEN : {
+		open_t * o;
+		if (ev->data_type != SHALL_LOG_FILEID) break;
+		o = find_open(ev->u.fileid, 1);
+		if (! o) return 0;
+		if (o->life) o->life->open--;
+		o->life = owner;
+		if (owner) owner->open++;
+		break;
+	    }
+	}
+    }
+    if (ev->operation == SHALL_CLOSE && ! ev->before &&
+	ev->data_type == SHALL_LOG_FILEID)
+    {
+	open_t * o = find_open(ev->u.fileid, 0);
+	if (o) {
+	    if (o->life) o->life->open--;
+	    remove_open(o);
+	} else if (errno) {
+	    return 0;
+	}
+    }
+    for (n = 0; n < num; n++)
+	if (! visit(name[n], len[n], index, owner))
+	    return 0;
+    it = new_item(ev, owner);
+    if (! it) return 0;
+    if (collapse) {
+	it->state = item_collapsed;
+    } else if (is_write) {
+	open_t * o = find_open(ev->u.region.fileid, 1);
+	if (! o) return 0;
+	it->state = item_merged;
+	if (! add_write(o, ev->u.region.start,
+			ev->u.region.start + ev->u.region.length, index))
+	    return 0;
+    }
+    return 1;
+}
+
+int main(int argc, char *argv[]) {
+    const char * errmsg =
+	shall_parse_options(argc - 1, argv + 1, options, args);
+    shall_fileids_t * fileids;
+    const char * map;
+    size_t maplen, pos;
+    long in_events = 0, out_events = 0, merged_in = 0, merged_out = 0;
+    long collapsed = 0, cancelled = 0, n;
+    long long out_bytes = 0;
+    char * buffer = NULL;
+    size_t bufsize = 0;
+    FILE * F = NULL;
+    int fd, ok = 1;
+    pname = strrchr(argv[0], '/');
+    if (pname)
+	pname++;
+    else
+	pname = argv[0];
+    if (help) {
+	shall_print_help(stdout, pname, options, args);
+	return 0;
+    }
+    if (errmsg) {
+	fprintf(stderr, "%s: %s\nUse \"%s -h\" for help\n",
+		pname, errmsg, pname);
+	return 1;
+    }
+    fd = open(input, O_RDONLY);
+    if (fd < 0) {
+	perror(input);
+	return 1;
+    }
+    map = shall_event_map(fd, &maplen);
+    if (! map) {
+	perror(input);
+	return 1;
+    }
+    if (output) {
+	struct stat si, so;
+	/* the input is mapped, so truncating it would be bad */
+	if (stat(output, &so) == 0 && fstat(fd, &si) == 0 &&
+	    si.st_dev == so.st_dev && si.st_ino == so.st_ino)
+	{
+	    fprintf(stderr, "%s: %s and %s are the same file\n",
+		    pname, input, output);
+	    return 1;
+	}
+	F = fopen(output, "w");
+	if (! F) {
+	    perror(output);
+	    return 1;
+	}
+    }
+    fileids = shall_fileids_new();
+    if (! fileids) {
+	perror(pname);
+	return 1;
+    }
+    pos = 0;
+    while (pos < maplen) {
+	shall_event_t ev;
+	int len = shall_event_decode(map + pos, maplen - pos, &ev);
+	if (len == 0) {
+	    fprintf(stderr, "%s: %s: ignoring incomplete event at %lld\n",
+		    pname, input, (long long)pos);
+	    break;
+	}
+	if (len < 0) {
+	    fprintf(stderr, "%s: %s: invalid event at %lld\n",
+		    pname, input, (long long)pos);
+	    ok = 0;
+	    break;
+	}
+	in_events++;
+	if (! ev.before && ev.result < 0 && ev.operation >= SHALL_META &&
+	    ev.operation != SHALL_USERLOG)
+	{
+	    failed++;
+	} else if (! process(&ev, fileids)) {
+	    perror(pname);
+	    ok = 0;
+	    break;
+	}
+	/* after process, which may need the name of a file being closed */
+	if (! shall_fileids_update(fileids, &ev)) {
+	    perror(pname);
+	    ok = 0;
+	    break;
+	}
+	pos += len;
+    }
+    while (ok && ndirty > 0) {
+	if (! flush_writes(dirty[0])) {
+	    perror(pname);
+	    ok = 0;
+	}
+    }
+    for (n = 0; ok && n < nitems; n++) {
+	item_t * it = &items[n];
+	const char * data = it->ev.raw;
+	size_t len = it->ev.length;
+	/* a changed WRITE is the result of merging others */
+	int merge = it->state == item_changed &&
+		    it->ev.operation == SHALL_WRITE;
+	if (it->owner && it->owner->cancelled) {
+	    if (! merge) cancelled++;
+	    continue;
+	}
+	if (it->state == item_merged) {
+	    merged_in++;
+	    continue;
+	}
+	if (merge) merged_out++;
+	if (it->state == item_collapsed) {
+	    collapsed++;
+	    continue;
+	}
+	if (it->state == item_changed) {
+	    len = shall_event_encode(&it->ev, buffer, bufsize);
+	    if (len > bufsize) {
+		free(buffer);
+		bufsize = len + 4096;
+		buffer = malloc(bufsize);
+		if (! buffer) {
+		    perror(pname);
+		    ok = 0;
+		    break;
+		}
+		len = shall_event_encode(&it->ev, buffer, bufsize);
+	    }
+	    data = buffer;
+	}
+	out_events++;
+	out_bytes += len;
+	if (F && fwrite(data, len, 1, F) < 1) {
+	    perror(output);
+	    ok = 0;
+	}
+    }
+    if (F && fclose(F) != 0 && ok) {
+	perror(output);
+	ok = 0;
+    }
+    if (ok && ! quiet) {
+	printf("Events read:                %ld (%lld bytes)\n",
+	       in_events, (long long)pos);
+	printf("Events written:             %ld (%lld bytes)\n",
+	       out_events, out_bytes);
+	if (pos > 0)
+	    printf("Reduction:                  %.1f%%\n",
+		   100.0 - 100.0 * (double)out_bytes / (double)pos);
+	printf("Failed operations dropped:  %ld\n", failed);
+	printf("Events for deleted files:   %ld\n", cancelled);
+	printf("WRITE events merged:        %ld into %ld\n",
+	       merged_in, merged_out);
+	printf("MOVE events collapsed:      %ld\n", collapsed);
+    }
+    while (lives) {
+	life_t * l = lives;
+	lives = l->next;
+	free(l->children);
+	free(l);
+    }
+    for (n = 0; n < pathsize; n++) {
+	while (paths[n]) {
+	    path_t * p = paths[n];
+	    paths[n] = p->next;
+	    free(p->name);
+	    free(p);
+	}
+    }
+    for (n = 0; n < opensize; n++)
+	while (opens[n])
+	    remove_open(opens[n]);
+    free(paths);
+    free(opens);
+    free(dirty);
+    free(items);
+    free(buffer);
+    shall_fileids_free(fileids);
+    shall_event_unmap(map, maplen);
+    close(fd);
+    return ok ? 0 : 1;
+}
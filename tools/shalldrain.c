@@ -0,0 +1,491 @@
+/* drains the journal of a mounted shall filesystem to a file
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ *
+ * this file is part of SHALLFS
+ *
+ * Copyright (c) 2017-2019 Claudio Calvelli <shallfs@gladserv.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 2 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program (see the file COPYING in the distribution).
+ * If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <string.h>
+#include <signal.h>
+#include <endian.h>
+#include <time.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include "shallfs-common.h"
+#include "shallfs-event.h"
+#include "shallfs-rotate.h"
+
+/* the reader thread reads events into a ring of buffers, and the writer
+ * thread writes them out; the writer only syncs the file (and then tells
+ * the filesystem it can remove the events) when it has nothing else to
+ * do, or it has written enough data, or the oldest data not synced is
+ * old enough: so under load one fsync covers many reads, and the reads
+ * continue while the writer waits for the disk */
+
+typedef struct {
+    char * data;
+    size_t len;
+    off_t cursor;			/* plog position after this data */
+} buffer_t;
+
+static long help = 0, verbose = 0, compress = 0;
+static long bufsize = 1048576, nbuffers = 8;
+static long sync_size = 16777216, sync_time = 1000;
+static long rotate_size = 0, rotate_time = 0, interval = 10;
+static const char * fspath = NULL, * filename = NULL, * statsfile = NULL;
+
+static const shall_options_t options[] = {
+    { 'b', &bufsize,         "SIZE",
+      "Read events using buffers of SIZE bytes (default 1m)" },
+    { 'e', &rotate_time,     "SECONDS",
+      "Rotate FILE when it has been written to for SECONDS" },
+    { 'h', &help,            NULL,
+      "Print this helpful message" },
+    { 'i', &interval,        "SECONDS",
+      "Update statistics every SECONDS (default 10)" },
+    { 'n', &nbuffers,        "NUMBER",
+      "Use NUMBER buffers between reader and writer (default 8)" },
+    { 'r', &rotate_size,     "SIZE",
+      "Rotate FILE when it reaches SIZE bytes" },
+    { 's', NULL,             "STATS-FILE",
+      "Write statistics to STATS-FILE",
+      &statsfile },
+    { 'S', &sync_size,       "SIZE",
+      "Sync FILE at least every SIZE bytes written (default 16m)" },
+    { 't', &sync_time,       "MILLISECONDS",
+      "Sync FILE at most MILLISECONDS after writing data (default 1000)" },
+    { 'v', &verbose,         NULL,
+      "Print statistics to standard output" },
+    { 'z', &compress,        NULL,
+      "Compress rotated files with gzip" },
+    {  0,  NULL,             NULL, NULL }
+};
+
+static const shall_args_t args[] = {
+    { &fspath,   "PATH",  1,
+      "The mountpoint/fspath/device of the mounted shallfs to drain" },
+    { &filename, "FILE",  1,
+      "Output file name, events are appended to it" },
+    { NULL,      NULL,           0, NULL }
+};
+
+static buffer_t * buffers;
+static int logfd, outfd, stop_pipe[2];
+static shall_rotate_t * rotate = NULL;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+/* the following are protected by "lock" */
+static long produced = 0;		/* buffers filled by reader */
+static long consumed = 0;		/* buffers written by writer */
+static int finished = 0;		/* reader has stopped */
+static int stopping = 0;		/* reader must stop */
+static int error = 0;			/* first error, if any */
+static const char * error_name = NULL;
+static uint64_t read_bytes = 0, synced_bytes = 0, synced_events = 0;
+static uint64_t syncs = 0;
+
+static void set_error(const char * name, int err) {
+    pthread_mutex_lock(&lock);
+    if (! error) {
+	error = err;
+	error_name = name;
+    }
+    pthread_cond_broadcast(&cond);
+    pthread_mutex_unlock(&lock);
+}
+
+/* ask the reader to stop */
+static void stop_reader(void) {
+    char c = 0;
+    pthread_mutex_lock(&lock);
+    stopping = 1;
+    pthread_cond_broadcast(&cond);
+    pthread_mutex_unlock(&lock);
+    if (write(stop_pipe[1], &c, 1) < 0) {
+	/* the pipe can only fail if it is full, and then it's readable */
+    }
+}
+
+static void * reader_thread(void * _unused) {
+    struct pollfd pfd[2];
+    pfd[0].fd = logfd;
+    pfd[0].events = POLLIN;
+    pfd[1].fd = stop_pipe[0];
+    pfd[1].events = POLLIN;
+    while (1) {
+	buffer_t * buf;
+	ssize_t nr;
+	int stop;
+	pthread_mutex_lock(&lock);
+	while (! stopping && produced - consumed >= nbuffers)
+	    pthread_cond_wait(&cond, &lock);
+	stop = stopping;
+	pthread_mutex_unlock(&lock);
+	if (stop) break;
+	if (poll(pfd, 2, -1) < 0) {
+	    if (errno == EINTR) continue;
+	    set_error(fspath, errno);
+	    break;
+	}
+	if (pfd[1].revents) break;
+	buf = &buffers[produced % nbuffers];
+	nr = read(logfd, buf->data, bufsize);
+	if (nr < 0 && (errno == EAGAIN || errno == EINTR)) continue;
+	if (nr < 0) {
+	    set_error(fspath, errno);
+	    break;
+	}
+	if (nr == 0) break;
+	buf->len = nr;
+	buf->cursor = lseek(logfd, 0, SEEK_CUR);
+	if (buf->cursor < 0) {
+	    set_error(fspath, errno);
+	    break;
+	}
+	pthread_mutex_lock(&lock);
+	produced++;
+	read_bytes += nr;
+	pthread_cond_broadcast(&cond);
+	pthread_mutex_unlock(&lock);
+    }
+    pthread_mutex_lock(&lock);
+    finished = 1;
+    pthread_cond_broadcast(&cond);
+    pthread_mutex_unlock(&lock);
+    return NULL;
+}
+
+/* count the events in a buffer returned by the filesystem, which only
+ * contains whole events */
+static int count_events(const char * data, size_t len) {
+    shall_event_iter_t it;
+    shall_event_t ev;
+    int count = 0;
+    shall_event_iter_init(&it, data, len);
+    while (shall_event_next(&it, &ev) > 0)
+	count++;
+    return count;
+}
+
+static int write_all(const char * data, size_t len) {
+    while (len > 0) {
+	ssize_t nw = write(outfd, data, len);
+	if (nw < 0) {
+	    if (errno == EINTR) continue;
+	    return 0;
+	}
+	data += nw;
+	len -= nw;
+    }
+    return 1;
+}
+
+static long elapsed_ms(const struct timespec * since) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - since->tv_sec) * 1000L
+	 + (now.tv_nsec - since->tv_nsec) / 1000000L;
+}
+
+/* make the data written so far durable, then let the filesystem remove
+ * the events from the journal; returns 1 if OK, 0 with errno set */
+static int sync_output(off_t cursor, uint64_t bytes, uint64_t events) {
+    if (fsync(outfd) < 0) {
+	set_error(filename, errno);
+	return 0;
+    }
+    if (! shall_ack_logs(logfd, cursor)) {
+	set_error(fspath, errno);
+	return 0;
+    }
+    pthread_mutex_lock(&lock);
+    synced_bytes += bytes;
+    synced_events += events;
+    syncs++;
+    pthread_mutex_unlock(&lock);
+    if (rotate && shall_rotate_due(rotate)) {
+	if (! shall_rotate_next(rotate)) {
+	    set_error(filename, errno);
+	    return 0;
+	}
+	outfd = fileno(shall_rotate_file(rotate));
+    }
+    return 1;
+}
+
+static void * writer_thread(void * _unused) {
+    struct timespec first;
+    uint64_t unsynced = 0, events = 0;
+    off_t cursor = 0;
+    while (1) {
+	buffer_t * buf = NULL;
+	int done = 0;
+	pthread_mutex_lock(&lock);
+	/* with data to sync, don't wait: sync it now */
+	if (! unsynced)
+	    while (! finished && consumed >= produced)
+		pthread_cond_wait(&cond, &lock);
+	if (consumed < produced)
+	    buf = &buffers[consumed % nbuffers];
+	else
+	    done = finished;
+	pthread_mutex_unlock(&lock);
+	if (buf) {
+	    if (! write_all(buf->data, buf->len)) {
+		set_error(filename, errno);
+		break;
+	    }
+	    if (! unsynced) clock_gettime(CLOCK_MONOTONIC, &first);
+	    unsynced += buf->len;
+	    events += count_events(buf->data, buf->len);
+	    cursor = buf->cursor;
+	    pthread_mutex_lock(&lock);
+	    consumed++;
+	    pthread_cond_broadcast(&cond);
+	    pthread_mutex_unlock(&lock);
+	}
+	if (unsynced &&
+	    (! buf || unsynced >= sync_size || elapsed_ms(&first) >= sync_time))
+	{
+	    if (! sync_output(cursor, unsynced, events)) break;
+	    unsynced = events = 0;
+	}
+	if (done) break;
+    }
+    /* in case we stopped because of an error, and tell main we are done */
+    stop_reader();
+    kill(getpid(), SIGUSR1);
+    return NULL;
+}
+
+/* write statistics; "journal_fill" is a percentage, "lag" the bytes in
+ * the journal not yet made durable, and the rates are per second since
+ * the previous call */
+static void print_stats(FILE * F, time_t now, const shall_sb_data_t * sb,
+			uint64_t rd, uint64_t sy, uint64_t ev, uint64_t ns,
+			double read_rate, double sync_rate,
+			double event_rate, double fill_rate)
+{
+    fprintf(F, "time: %lld\n", (long long)now);
+    fprintf(F, "read_bytes: %llu\n", (unsigned long long)rd);
+    fprintf(F, "synced_bytes: %llu\n", (unsigned long long)sy);
+    fprintf(F, "synced_events: %llu\n", (unsigned long long)ev);
+    fprintf(F, "syncs: %llu\n", (unsigned long long)ns);
+    fprintf(F, "pending: %llu\n", (unsigned long long)(rd - sy));
+    fprintf(F, "read_rate: %.0f\n", read_rate);
+    fprintf(F, "drain_rate: %.0f\n", sync_rate);
+    fprintf(F, "event_rate: %.0f\n", event_rate);
+    fprintf(F, "lag: %lld\n", (long long)sb->data_length);
+    fprintf(F, "journal_max: %lld\n", (long long)sb->max_length);
+    fprintf(F, "journal_fill: %.1f\n",
+	    sb->max_length > 0 ? 100.0 * sb->data_length / sb->max_length : 0);
+    fprintf(F, "fill_rate: %.0f\n", fill_rate);
+}
+
+/* collect and write statistics; the file is replaced atomically, so a
+ * monitoring program never sees a partial file */
+static void update_stats(dev_t dev) {
+    static struct timespec last;
+    static uint64_t last_read = 0, last_synced = 0, last_events = 0;
+    static off_t last_length = 0;
+    static int started = 0;
+    struct timespec now;
+    shall_sb_data_t sb;
+    uint64_t rd, sy, ev, ns;
+    double secs, read_rate = 0, sync_rate = 0, event_rate = 0, fill_rate = 0;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (! shall_mounted_info(dev, &sb)) memset(&sb, 0, sizeof(sb));
+    pthread_mutex_lock(&lock);
+    rd = read_bytes;
+    sy = synced_bytes;
+    ev = synced_events;
+    ns = syncs;
+    pthread_mutex_unlock(&lock);
+    secs = (now.tv_sec - last.tv_sec) + (now.tv_nsec - last.tv_nsec) / 1e9;
+    if (started && secs > 0) {
+	read_rate = (rd - last_read) / secs;
+	sync_rate = (sy - last_synced) / secs;
+	event_rate = (ev - last_events) / secs;
+	fill_rate = (sb.data_length - last_length) / secs;
+    }
+    started = 1;
+    last = now;
+    last_read = rd;
+    last_synced = sy;
+    last_events = ev;
+    last_length = sb.data_length;
+    if (statsfile) {
+	char * tmpname = malloc(strlen(statsfile) + 5);
+	FILE * F = NULL;
+	if (tmpname) {
+	    sprintf(tmpname, "%s.tmp", statsfile);
+	    F = fopen(tmpname, "w");
+	}
+	if (F) {
+	    print_stats(F, time(NULL), &sb, rd, sy, ev, ns,
+			read_rate, sync_rate, event_rate, fill_rate);
+	    if (fclose(F) == EOF || rename(tmpname, statsfile) < 0)
+		unlink(tmpname);
+	}
+	free(tmpname);
+    }
+    if (verbose) {
+	printf("drained %llu bytes, %llu events; %.0f bytes/s, "
+	       "%.0f events/s; journal %lld bytes (%.1f%%)\n",
+	       (unsigned long long)sy, (unsigned long long)ev,
+	       sync_rate, event_rate, (long long)sb.data_length,
+	       sb.max_length > 0 ? 100.0 * sb.data_length / sb.max_length
+				 : 0);
+	fflush(stdout);
+    }
+}
+
+int main(int argc, char *argv[]) {
+    const char * pname = strrchr(argv[0], '/');
+    const char * errmsg =
+	shall_parse_options(argc - 1, argv + 1, options, args);
+    pthread_t reader, writer;
+    struct stat sbuff;
+    struct timespec timeout;
+    sigset_t sigs;
+    int n;
+    if (pname)
+	pname++;
+    else
+	pname = argv[0];
+    if (help) {
+	shall_print_help(stdout, pname, options, args);
+	return 0;
+    }
+    if (! errmsg && bufsize < SHALL_DEV_BLOCK)
+	errmsg = "Invalid buffer SIZE for -b";
+    if (! errmsg && nbuffers < 2)
+	errmsg = "Invalid NUMBER for -n";
+    if (! errmsg && (sync_size < 0 || sync_time < 0))
+	errmsg = "Invalid sync limit";
+    if (! errmsg && (rotate_size < 0 || rotate_time < 0))
+	errmsg = "Invalid rotation limit";
+    if (! errmsg && interval < 1)
+	errmsg = "Invalid SECONDS for -i";
+    if (errmsg) {
+	fprintf(stderr, "%s: %s\nUse \"%s -h\" for help\n",
+		pname, errmsg, pname);
+	return 1;
+    }
+    /* search for mounted device */
+    if (stat(fspath, &sbuff) < 0) {
+	perror(fspath);
+	return 1;
+    }
+    if (S_ISDIR(sbuff.st_mode)) {
+	if (! shall_find_device(fspath, &sbuff.st_rdev)) {
+	    fprintf(stderr, "%s: cannot find shallfs on %s\n",
+		    pname, fspath);
+	    return 1;
+	}
+    } else if (! S_ISBLK(sbuff.st_mode)) {
+	fprintf(stderr, "%s: %s: not a block device or directory\n",
+		pname, fspath);
+	return 1;
+    }
+    logfd = shall_open_peekfile(sbuff.st_rdev, 0);
+    if (logfd < 0) {
+	perror(fspath);
+	return 1;
+    }
+    if (rotate_size || rotate_time || compress) {
+	rotate = shall_rotate_open(filename, 1, rotate_size, rotate_time,
+				   compress, pname);
+	outfd = rotate ? fileno(shall_rotate_file(rotate)) : -1;
+    } else {
+	outfd = open(filename, O_WRONLY | O_CREAT | O_APPEND, 0600);
+    }
+    if (outfd < 0) {
+	perror(filename);
+	return 1;
+    }
+    buffers = calloc(nbuffers, sizeof(buffer_t));
+    if (! buffers) {
+	perror(pname);
+	return 1;
+    }
+    for (n = 0; n < nbuffers; n++) {
+	buffers[n].data = malloc(bufsize);
+	if (! buffers[n].data) {
+	    perror(pname);
+	    return 1;
+	}
+    }
+    if (pipe(stop_pipe) < 0) {
+	perror(pname);
+	return 1;
+    }
+    /* signals are only received by the main thread, using sigtimedwait;
+     * the writer sends SIGUSR1 when it stops */
+    sigemptyset(&sigs);
+    sigaddset(&sigs, SIGINT);
+    sigaddset(&sigs, SIGTERM);
+    sigaddset(&sigs, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &sigs, NULL);
+    errno = pthread_create(&reader, NULL, reader_thread, NULL);
+    if (errno) {
+	perror(pname);
+	return 1;
+    }
+    errno = pthread_create(&writer, NULL, writer_thread, NULL);
+    if (errno) {
+	perror(pname);
+	return 1;
+    }
+    update_stats(sbuff.st_rdev);
+    timeout.tv_sec = interval;
+    timeout.tv_nsec = 0;
+    while (1) {
+	int sig = sigtimedwait(&sigs, NULL, &timeout);
+	if (sig < 0 && errno == EAGAIN) {
+	    update_stats(sbuff.st_rdev);
+	    continue;
+	}
+	if (sig == SIGINT || sig == SIGTERM || sig == SIGUSR1) break;
+    }
+    /* the writer finishes writing and syncing what the reader has read */
+    stop_reader();
+    pthread_join(reader, NULL);
+    pthread_join(writer, NULL);
+    update_stats(sbuff.st_rdev);
+    if (rotate) {
+	if (! shall_rotate_close(rotate)) set_error(filename, errno);
+    } else if (close(outfd) < 0) {
+	set_error(filename, errno);
+    }
+    close(logfd);
+    if (error) {
+	fprintf(stderr, "%s: %s: %s\n", pname, error_name, strerror(error));
+	return 1;
+    }
+    return 0;
+}
@@ -33,14 +33,22 @@
 #include <errno.h>
 #include <ctype.h>
 #include <sys/sysmacros.h>
+#include <sys/ioctl.h>
 #include "shallfs-common.h"
+#include "shallfs-event.h"
+#include "shallfs-crc.h"
+#include <shallfs/ioctl.h>
 
 #define PROCMOUNTS "/proc/fs/shallfs/mounted"
 #define PROCDIR    "/proc/fs/shallfs/%x:%x"
 #define PROCINFO   "info"
 #define PROCLOGS   "blog"
+#define PROCPEEK   "plog"
 #define PROCCTRL   "ctrl"
 
+/* superblocks requested at once when searching for a valid one */
+#define SB_PREFETCH 64
+
 typedef enum {
     proc_control,
     proc_blocking,
@@ -50,8 +58,8 @@ typedef enum {
 
 static int proc_mode[proc_mode_MAX] = {
     [proc_control]     = O_WRONLY,
-    [proc_blocking]    = O_RDONLY | O_NONBLOCK,
-    [proc_nonblocking] = O_RDONLY,
+    [proc_blocking]    = O_RDONLY,
+    [proc_nonblocking] = O_RDONLY | O_NONBLOCK,
 };
 
 typedef struct {
@@ -112,6 +120,19 @@ const char * shall_parse_options(int argc, char *argv[],
 			a = *argv++;
 			argc--;
 		    }
+		    if (options[n].string) {
+			*options[n].string = a;
+			break;
+		    }
+		    if (options[n].list) {
+			shall_optlist_t * l = options[n].list;
+			const char ** nv =
+			    realloc(l->values, (l->count + 1) * sizeof(char *));
+			if (! nv) return "Out of memory";
+			nv[l->count++] = a;
+			l->values = nv;
+			break;
+		    }
 		    *options[n].value = shall_strtol(a, &ep);
 		    if (a == ep) {
 			snprintf(errmsg, sizeof(errmsg),
@@ -210,30 +231,61 @@ void shall_init_sb(struct shall_devsuper * ssb, const shall_sb_data_t * data,
     ssb->new_size = htole64(change ? change->dev_size : 0);
     ssb->new_alignment = htole32(change ? change->alignment : 0);
     ssb->new_superblocks = htole32(change ? change->num_superblocks : 0);
+    ssb->new_moved = htole64(change ? change->moved : 0);
+    ssb->new_saved = htole64(change ? change->saved : 0);
+    ssb->new_saved_crc = htole32(change ? change->saved_crc : 0);
     strncpy(ssb->magic2, SHALL_SB_MAGIC, sizeof(ssb->magic2));
 }
 
-/* calculate generic crc32; this is not the optimised function one finds
- * in the kernel, but it is equivalent */
-static unsigned int crc32(unsigned int start, const void * _data, size_t len) {
-    const unsigned char * data = _data;
-    while (len-- > 0) {
-	int i;
-	start ^= *data++;
-	for (i = 0; i < 8; i++)
-	    start = (start >> 1) ^ ((start & 1) ? 0xedb88320 : 0);
-    }
-    return start;
-}
-
 /* calculate checksum for superblock structure */
 unsigned int shall_checksum_sb(const struct shall_devsuper * sh) {
-    return crc32(0x4c414853, sh, shall_superblock_checksize);
+    return shall_crc32(0x4c414853, sh, shall_superblock_checksize);
 }
 
 /* calculate checksum for log header structure */
 unsigned int shall_checksum_log(const struct shall_devheader * dh) {
-    return crc32(0x4c414853, dh, shall_devheader_checksize);
+    return shall_crc32(0x4c414853, dh, shall_devheader_checksize);
+}
+
+/* check the checksums of several log headers at once */
+int shall_check_logs(const struct shall_devheader * const * dh, int count) {
+    unsigned int sums[SHALL_CHECK_BATCH];
+    int done = 0;
+    while (done < count) {
+	int todo = count - done, n;
+	if (todo > SHALL_CHECK_BATCH) todo = SHALL_CHECK_BATCH;
+	shall_crc32_batch(0x4c414853, (const void * const *)(dh + done),
+			  shall_devheader_checksize, sums, todo);
+	for (n = 0; n < todo; n++) {
+	    const char * hp = (const char *)dh[done + n];
+	    __le32 checksum;
+	    memcpy(&checksum, hp + shall_devheader_checksize, sizeof(checksum));
+	    if (sums[n] != le32toh(checksum)) return done + n;
+	}
+	done += todo;
+    }
+    return count;
+}
+
+/* check the checksums of several log headers, recording each result */
+void shall_verify_logs(const struct shall_devheader * const * dh, int count,
+		       char * valid)
+{
+    unsigned int sums[SHALL_CHECK_BATCH];
+    int done = 0;
+    while (done < count) {
+	int todo = count - done, n;
+	if (todo > SHALL_CHECK_BATCH) todo = SHALL_CHECK_BATCH;
+	shall_crc32_batch(0x4c414853, (const void * const *)(dh + done),
+			  shall_devheader_checksize, sums, todo);
+	for (n = 0; n < todo; n++) {
+	    const char * hp = (const char *)dh[done + n];
+	    __le32 checksum;
+	    memcpy(&checksum, hp + shall_devheader_checksize, sizeof(checksum));
+	    valid[done + n] = sums[n] == le32toh(checksum);
+	}
+	done += todo;
+    }
 }
 
 /* read some data */
@@ -268,44 +320,85 @@ static int write_data(int fd, const void * _buf, size_t len) {
     return 1;
 }
 
-/* read a superblock from disk, check checksum and decode information */
-static int read_sb(int fd, shall_sb_data_t * sb, int which) {
-    struct shall_devsuper ssb;
-    if (lseek(fd, shall_superblock_location(which), SEEK_SET) < 0) return 0;
-    if (! read_data(fd, &ssb, sizeof(ssb))) return 0;
+/* check checksum of a superblock and decode information */
+static int decode_sb(const struct shall_devsuper * ssb, shall_sb_data_t * sb,
+		     shall_sb_info_t * change)
+{
     /* check: checksum is valid */
-    if (le32toh(ssb.checksum) != shall_checksum_sb(&ssb)) {
+    if (le32toh(ssb->checksum) != shall_checksum_sb(ssb)) {
 	errno = EINVAL;
 	return 0;
     }
     /* check: both magic strings present */
-    if (strncmp(ssb.magic1, SHALL_SB_MAGIC, sizeof(ssb.magic1)) != 0)
+    if (strncmp(ssb->magic1, SHALL_SB_MAGIC, sizeof(ssb->magic1)) != 0)
 	goto invalid;
-    if (strncmp(ssb.magic2, SHALL_SB_MAGIC, sizeof(ssb.magic2)) != 0)
+    if (strncmp(ssb->magic2, SHALL_SB_MAGIC, sizeof(ssb->magic2)) != 0)
 	goto invalid;
     /* decode all data */
-    sb->version = le64toh(ssb.version);
-    sb->device_size = le64toh(ssb.device_size);
-    sb->data_space = le64toh(ssb.data_space);
-    sb->data_start = le64toh(ssb.data_start);
-    sb->data_length = le64toh(ssb.data_length);
-    sb->max_length = le64toh(ssb.max_length);
+    sb->version = le64toh(ssb->version);
+    sb->device_size = le64toh(ssb->device_size);
+    sb->data_space = le64toh(ssb->data_space);
+    sb->data_start = le64toh(ssb->data_start);
+    sb->data_length = le64toh(ssb->data_length);
+    sb->max_length = le64toh(ssb->max_length);
     sb->real_start = -1;
-    sb->flags = le32toh(ssb.flags);
-    sb->num_superblocks = le32toh(ssb.num_superblocks);
-    sb->this_superblock = le32toh(ssb.this_superblock);
-    sb->alignment = le32toh(ssb.alignment);
+    sb->flags = le32toh(ssb->flags);
+    sb->num_superblocks = le32toh(ssb->num_superblocks);
+    sb->this_superblock = le32toh(ssb->this_superblock);
+    sb->alignment = le32toh(ssb->alignment);
     sb->next_superblock = -1;
+    if (change) {
+	change->dev_size = le64toh(ssb->new_size);
+	change->num_superblocks = le32toh(ssb->new_superblocks);
+	change->alignment = le32toh(ssb->new_alignment);
+	change->moved = le64toh(ssb->new_moved);
+	change->saved = le64toh(ssb->new_saved);
+	change->saved_crc = le32toh(ssb->new_saved_crc);
+    }
     return 1;
 invalid:
     errno = EINVAL;
     return 0;
 }
 
+/* read a superblock from disk, check checksum and decode information */
+static int read_sb(int fd, shall_sb_data_t * sb, int which) {
+    struct shall_devsuper ssb;
+    if (lseek(fd, shall_superblock_location(which), SEEK_SET) < 0) return 0;
+    if (! read_data(fd, &ssb, sizeof(ssb))) return 0;
+    return decode_sb(&ssb, sb, NULL);
+}
+
+/* like read_sb, but leaves the file position alone */
+int shall_pread_sb(int fd, shall_sb_data_t * sb, int which) {
+    return shall_pread_sb_update(fd, sb, NULL, which);
+}
+
+/* same, and also get the update plan */
+int shall_pread_sb_update(int fd, shall_sb_data_t * sb,
+			  shall_sb_info_t * change, int which)
+{
+    struct shall_devsuper ssb;
+    ssize_t nr = pread(fd, &ssb, sizeof(ssb), shall_superblock_location(which));
+    if (nr < 0) return 0;
+    if (nr < sizeof(ssb)) {
+	errno = EINVAL;
+	return 0;
+    }
+    return decode_sb(&ssb, sb, change);
+}
+
 /* perform consistency checks on superblock */
 shall_check_t shall_check_sb(int fd, const shall_sb_data_t * sb, int which) {
-    off_t eod = lseek(fd, 0, SEEK_END), dspace;
+    return shall_check_sb_size(lseek(fd, 0, SEEK_END), sb, which);
+}
+
+/* same, given the size of the device */
+shall_check_t shall_check_sb_size(off_t eod, const shall_sb_data_t * sb,
+				  int which)
+{
     shall_check_t result = shall_check_ok;
+    off_t dspace;
     if (eod < 0) result |= shall_check_ioerr;
     /* check: flags contains SHALL_SB_VALID */
     if (! (sb->flags & SHALL_SB_VALID)) result |= shall_check_novalid;
@@ -377,6 +470,19 @@ int shall_write_all_sb(int fd, struct shall_devsuper * ssb, int verbose) {
     return 1;
 }
 
+/* ask the kernel to start reading the superblocks from "first" to
+ * "first + count - 1", so they are all requested at once rather than
+ * waiting for each one in turn */
+static void prefetch_superblocks(int fd, int first, int count, off_t limit) {
+    int n;
+    for (n = first; n < first + count; n++) {
+	off_t where = shall_superblock_location(n);
+	if (where >= limit) break;
+	posix_fadvise(fd, where, sizeof(struct shall_devsuper),
+		      POSIX_FADV_WILLNEED);
+    }
+}
+
 /* find a working superblock */
 static int search_superblock(int fd, shall_sb_data_t * sb) {
     off_t limit = lseek(fd, 0, SEEK_END);
@@ -388,6 +494,8 @@ static int search_superblock(int fd, shall_sb_data_t * sb) {
 	    errno = EINVAL;
 	    return 0;
 	}
+	if (n % SB_PREFETCH == 1)
+	    prefetch_superblocks(fd, n, SB_PREFETCH, limit);
 	if (shall_read_sb(fd, sb, n))
 	    return 1;
     }
@@ -397,6 +505,7 @@ static int search_superblock(int fd, shall_sb_data_t * sb) {
 static void scan_all_superblocks(int fd, shall_sb_data_t * sb) {
     shall_sb_data_t temp;
     int ns = sb->num_superblocks, n;
+    prefetch_superblocks(fd, 0, ns, sb->device_size);
     for (n = 0; n < ns; n++) {
 	if (shall_read_sb(fd, &temp, n))
 	    if (temp.version > sb->version)
@@ -499,7 +608,7 @@ ssize_t shall_read_data(int fd, const shall_sb_data_t * sb,
 	off_t ns = next < sb->num_superblocks
 		 ? (shall_superblock_location(next) - SHALL_SB_OFFSET)
 		 : sb->device_size;
-	size_t todo = ns - sb->real_start;
+	size_t todo = ns - rs;
 	ssize_t nr;
 	if (todo > len - done) todo = len - done;
 	if (todo > data) todo = data;
@@ -525,6 +634,42 @@ ssize_t shall_read_data(int fd, const shall_sb_data_t * sb,
     return done;
 }
 
+/* overwrite journal data */
+int shall_write_data(int fd, const shall_sb_data_t * sb,
+		     const char * src, size_t len)
+{
+    off_t rs = sb->real_start;
+    int next = sb->next_superblock;
+    if (len > sb->data_length) {
+	errno = EINVAL;
+	return 0;
+    }
+    while (len > 0) {
+	off_t ns = next < sb->num_superblocks
+		 ? (shall_superblock_location(next) - SHALL_SB_OFFSET)
+		 : sb->device_size;
+	size_t todo = ns - rs;
+	ssize_t nw;
+	if (todo > len) todo = len;
+	nw = pwrite(fd, src, todo, rs);
+	if (nw < 0) return 0;
+	if (nw == 0) {
+	    errno = ENOSPC;
+	    return 0;
+	}
+	src += nw;
+	rs += nw;
+	len -= nw;
+	if (rs < ns) continue;
+	next++;
+	rs += SHALL_DEV_BLOCK;
+	if (rs < sb->device_size) continue;
+	next = 1;
+	rs = SHALL_DEV_BLOCK;
+    }
+    return 1;
+}
+
 /* advance superblock pointers by given offset */
 void shall_advance_pointers(shall_sb_data_t * sb, size_t len) {
     off_t rs = sb->real_start, data = sb->data_length, start = sb->data_start;
@@ -533,13 +678,14 @@ void shall_advance_pointers(shall_sb_data_t * sb, size_t len) {
 	off_t ns = next < sb->num_superblocks
 		 ? (shall_superblock_location(next) - SHALL_SB_OFFSET)
 		 : sb->device_size;
-	size_t todo = ns - sb->real_start;
+	size_t todo = ns - rs;
 	if (todo > len) todo = len;
 	if (todo > data) todo = data;
 	len -= todo;
 	rs += todo;
 	data -= todo;
 	start += todo;
+	if (start >= sb->data_space) start -= sb->data_space;
 	if (rs < ns) continue;
 	next++;
 	rs += SHALL_DEV_BLOCK;
@@ -553,63 +699,41 @@ void shall_advance_pointers(shall_sb_data_t * sb, size_t len) {
     sb->data_start = start;
 }
 
+/* calculate disk block and offset corresponding to sb->data_start, but
+ * only if it hadn't been calculated before */
+void shall_locate_start(shall_sb_data_t * sb) {
+    off_t rs = sb->data_start;
+    int next = 0;
+    if (sb->next_superblock >= 0) return;
+    while (next < sb->num_superblocks &&
+	   shall_superblock_location(next) - SHALL_SB_OFFSET <= rs)
+    {
+	next++;
+	rs += SHALL_DEV_BLOCK;
+    }
+    sb->real_start = rs;
+    sb->next_superblock = next;
+}
+
 /* read events from disk; return amount of buffer used, 0 if EOF, negative
  * if error; if successful, updates superblock information */
 ssize_t shall_read_logs(int fd, shall_sb_data_t * sb,
 			char * dest, size_t len, int verbose)
 {
-    ssize_t done;
-    int next = sb->next_superblock;
-    /* calculate disk block and offset corresponding to sb->data_start, but
-     * only if it hadn't been calculated before */
-    if (next < 0) {
-	off_t rs = sb->data_start;
-	next = 0;
-	while (next < sb->num_superblocks &&
-	       shall_superblock_location(next) - SHALL_SB_OFFSET <= rs)
-	{
-	    next++;
-	    rs += SHALL_DEV_BLOCK;
-	}
-	sb->real_start = rs;
-	sb->next_superblock = next;
-    }
-    done = shall_read_data(fd, sb, dest, len, verbose);
-    if (done <= 0) return done;
+    ssize_t got, done;
+    shall_locate_start(sb);
+    got = shall_read_data(fd, sb, dest, len, verbose);
+    if (got <= 0) return got;
     /* OK, we've read as much data as there was, or as much it fits in the
      * buffer; the last event will be truncated so adjust things */
-    len = 0;
-    while (len < done) {
-	struct shall_devheader lh;
-	unsigned int chk;
-	int nh;
-	if (done - len < sizeof(lh)) break;
-	memcpy(&lh, dest + len, sizeof(lh));
-	chk = shall_checksum_log(&lh);
-	if (chk != le32toh(lh.checksum)) {
-	    if (len == 0) {
-		errno = EINVAL;
-		return -1;
-	    }
-	    break;
-	}
-	nh = le32toh(lh.next_header);
-	if (nh < sizeof(lh)) {
-	    if (len == 0) {
-		errno = EINVAL;
-		return -1;
-	    }
-	    break;
-	}
-	if (done - len < nh) break;
-	len += nh;
-    }
+    done = shall_event_scan(dest, got);
+    if (done < 0) return -1;
     if (verbose)
-	printf("read_logs done=%ld -> %ld\n", (long)done, (long)len);
-    if (len == 0) return 0;
+	printf("read_logs done=%ld -> %ld\n", (long)got, (long)done);
+    if (done == 0) return 0;
     /* and now advance pointers to the location we've just calculated */
-    shall_advance_pointers(sb, len);
-    return len;
+    shall_advance_pointers(sb, done);
+    return done;
 }
 
 /* open a file in /proc/fs/shallfs/DEVICE */
@@ -634,20 +758,30 @@ static int find_kw(const char * data, int datalen,
     return 1;
 }
 
-/* read superblock information from a mounted filesystem */
-int shall_mounted_info(dev_t dev, shall_sb_data_t * sb) {
-    char buffer[4097];
+/* read the "info" file of a mounted filesystem; returns its length, or
+ * -1 with errno set */
+static ssize_t read_info(dev_t dev, char * buffer, size_t size) {
     ssize_t nr;
-    int fd = open_proc(dev, PROCINFO, proc_blocking), ptr;
-    if (fd < 0) return 0;
-    nr = read(fd, buffer, sizeof(buffer));
+    int fd = open_proc(dev, PROCINFO, proc_blocking);
+    if (fd < 0) return -1;
+    nr = read(fd, buffer, size - 1);
     if (nr <= 0) {
 	int sv = nr < 0 ? errno : EINVAL;
 	close(fd);
 	errno = sv;
-	return 0;
+	return -1;
     }
+    close(fd);
     buffer[nr] = 0;
+    return nr;
+}
+
+/* read superblock information from a mounted filesystem */
+int shall_mounted_info(dev_t dev, shall_sb_data_t * sb) {
+    char buffer[4097];
+    ssize_t nr = read_info(dev, buffer, sizeof(buffer));
+    int ptr;
+    if (nr < 0) return 0;
     memset(sb, 0, sizeof(*sb));
     sb->real_start = -1;
     sb->next_superblock = -1;
@@ -674,15 +808,56 @@ int shall_mounted_info(dev_t dev, shall_sb_data_t * sb) {
 	find("align",    alignment);
 #undef find
     }
-    close(fd);
     return 1;
 }
 
+/* read one of the counters in the "info" file of a mounted filesystem */
+int shall_mounted_counter(dev_t dev, const char * keyword, long long * val) {
+    char buffer[4097];
+    ssize_t nr = read_info(dev, buffer, sizeof(buffer));
+    int ptr = 0, keylen = strlen(keyword);
+    if (nr < 0) return 0;
+    while (ptr < nr) {
+	int bptr = ptr;
+	while (ptr < nr && buffer[ptr] != '\n') ptr++;
+	if (find_kw(buffer + bptr, ptr - bptr, keyword, keylen, val))
+	    return 1;
+	ptr++;
+    }
+    errno = ENOENT;
+    return 0;
+}
+
 /* open mounted filesystem's logfile */
 int shall_open_logfile(dev_t dev, int blocking, int verbose) {
     return open_proc(dev, PROCLOGS, blocking ? proc_blocking : proc_nonblocking);
 }
 
+/* open mounted filesystem's logfile without removing events */
+int shall_open_peekfile(dev_t dev, int blocking) {
+    return open_proc(dev, PROCPEEK, blocking ? proc_blocking : proc_nonblocking);
+}
+
+/* remove events before cursor position from a mounted filesystem */
+int shall_ack_logs(int fd, off_t pos) {
+    uint64_t upto = pos;
+    if (ioctl(fd, SHALL_IOC_ACK, &upto) < 0) return 0;
+    return 1;
+}
+
+/* select which events to read from a file opened by shall_open_peekfile */
+int shall_peek_filter(int fd, const struct shall_filter * filter) {
+    if (ioctl(fd, SHALL_IOC_FILTER, filter) < 0) return 0;
+    return 1;
+}
+
+/* say whether a reader holds events in the journal until acknowledged */
+int shall_peek_register(int fd, int registered) {
+    uint32_t reg = registered;
+    if (ioctl(fd, SHALL_IOC_REGISTER, &reg) < 0) return 0;
+    return 1;
+}
+
 /* send a command to a mounted filesystem */
 static int shall_ctrl(dev_t dev, const char * command) {
     int fd = open_proc(dev, PROCCTRL, proc_control);
@@ -707,6 +882,28 @@ int shall_ctrl_clear(dev_t dev, int discard) {
     return shall_ctrl(dev, buffer);
 }
 
+/* add user logs using the ioctl on a file or directory in the mount;
+ * "data" contains one or more NUL-separated markers */
+int shall_ioctl_userlog(const char * path, const char * data, size_t len) {
+    struct shall_userlog ul;
+    /* the kernel wants the file open for writing, but directories can
+     * only be opened read-only, and root can use those */
+    int fd = open(path, O_WRONLY|O_NONBLOCK|O_NOCTTY);
+    if (fd < 0 && (errno == EISDIR || errno == EACCES))
+	fd = open(path, O_RDONLY|O_NONBLOCK|O_NOCTTY);
+    if (fd < 0) return 0;
+    ul.data = (uintptr_t)data;
+    ul.length = len;
+    if (ioctl(fd, SHALL_IOC_USERLOG, &ul) < 0) {
+	int sverr = errno;
+	close(fd);
+	errno = sverr;
+	return 0;
+    }
+    if (close(fd) < 0) return 0;
+    return 1;
+}
+
 int shall_ctrl_userlog(dev_t dev, const char * text) {
     char buffer[144];
     snprintf(buffer, sizeof(buffer), "userlog %.128s\n", text);
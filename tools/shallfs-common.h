@@ -23,19 +23,25 @@
 #ifndef _SHALL_H_
 #define _SHALL_H_
 
-/* types required so we can read the kernel's device.h */
-typedef uint64_t __le64;
-typedef uint32_t __le32;
-typedef uint16_t __le16;
+/* types required so we can read the kernel's device.h and ioctl.h */
+#include <linux/types.h>
 
 #include <sys/types.h>
 #include <shallfs/device.h>
 
+/* all values of an option which can be repeated */
+typedef struct {
+    int count;
+    const char ** values;
+} shall_optlist_t;
+
 typedef struct {
     char name;
     long * value;
     const char * valname;
     const char * descr;
+    const char ** string;		/* store the value as a string */
+    shall_optlist_t * list;		/* or add it to a list */
 } shall_options_t;
 
 typedef struct {
@@ -49,6 +55,9 @@ typedef struct {
     off_t dev_size;
     int num_superblocks;
     int alignment;
+    off_t moved;			/* data copied so far */
+    off_t saved;			/* data saved in the staging area */
+    unsigned int saved_crc;
 } shall_sb_info_t;
 
 typedef struct {
@@ -126,6 +135,17 @@ static inline off_t shall_superblock_location(int n) {
 /* calculate checksum for log header structure */
 unsigned int shall_checksum_log(const struct shall_devheader *);
 
+/* check the checksums of several log headers, which need not be aligned;
+ * returns the number of headers before the first one with an invalid
+ * checksum, "count" if they are all valid */
+#define SHALL_CHECK_BATCH 64
+int shall_check_logs(const struct shall_devheader * const *, int count);
+
+/* same, but check all headers, setting valid[n] to 1 if header n has a
+ * valid checksum, 0 if not */
+void shall_verify_logs(const struct shall_devheader * const *, int count,
+		       char * valid);
+
 /* find mounted device by underlying path */
 int shall_find_device(const char *, dev_t *);
 
@@ -138,9 +158,23 @@ int shall_read_sb(int fd, shall_sb_data_t *, int which);
 /* like shall_read_sb but without the consistency checks */
 int shall_read_sb_raw(int fd, shall_sb_data_t *, int which);
 
+/* like shall_read_sb_raw but uses pread, so several threads can read
+ * superblocks from the same descriptor at the same time */
+int shall_pread_sb(int fd, shall_sb_data_t *, int which);
+
+/* like shall_pread_sb, and also return the update plan stored by
+ * tuneshallfs, which is only meaningful if SHALL_SB_UPDATE is set */
+int shall_pread_sb_update(int fd, shall_sb_data_t *, shall_sb_info_t *,
+			  int which);
+
 /* do some consistency checks on a superblock and returns the result */
 shall_check_t shall_check_sb(int fd, const shall_sb_data_t *, int which);
 
+/* same as shall_check_sb, but the caller provides the size of the device
+ * (or -1 if unknown) so the file position is not changed */
+shall_check_t shall_check_sb_size(off_t size, const shall_sb_data_t *,
+				  int which);
+
 /* read events from disk; return amount of buffer used, 0 if EOF, negative
  * if error; if successful, updates superblock information */
 ssize_t shall_read_logs(int fd, shall_sb_data_t *, char *, size_t, int);
@@ -152,18 +186,58 @@ ssize_t shall_read_logs(int fd, shall_sb_data_t *, char *, size_t, int);
  * the superblock to recalculate them */
 ssize_t shall_read_data(int fd, const shall_sb_data_t *, char *, size_t, int);
 
+/* the opposite of shall_read_data: overwrite journal data, starting at the
+ * current position, with the contents of the buffer; returns 1 if OK, 0
+ * with errno set on error, including trying to write past the end of the
+ * journal data; like shall_read_data, does not update the superblock */
+int shall_write_data(int fd, const shall_sb_data_t *, const char *, size_t);
+
+/* calculate the real_start and next_superblock fields, which say where the
+ * journal data starts on the device, if not already done */
+void shall_locate_start(shall_sb_data_t *);
+
 /* advance superblock pointers by given offset */
 void shall_advance_pointers(shall_sb_data_t *, size_t);
 
 /* read superblock information from a mounted filesystem */
 int shall_mounted_info(dev_t, shall_sb_data_t *);
 
+/* read one of the counters in the "info" file of a mounted filesystem
+ * (see docs/control), for example "logged"; returns 1 if OK, 0 with
+ * errno set if the file can't be read or doesn't have the counter */
+int shall_mounted_counter(dev_t, const char * keyword, long long *);
+
 /* open mounted filesystem's logfile */
 int shall_open_logfile(dev_t, int blocking, int verbose);
 
+/* open mounted filesystem's logfile for reading without removing events;
+ * the file position is a cursor to pass to shall_ack_logs */
+int shall_open_peekfile(dev_t, int blocking);
+
+/* say that the reader is done with events before cursor position; they
+ * are removed from the mounted filesystem's journal once all registered
+ * readers are done with them; the file must have been opened by
+ * shall_open_peekfile */
+int shall_ack_logs(int fd, off_t pos);
+
+/* select which events to read from a file opened by shall_open_peekfile;
+ * filter->flags == 0 means all events */
+struct shall_filter;
+int shall_peek_filter(int fd, const struct shall_filter *);
+
+/* say whether a reader opened by shall_open_peekfile holds events in the
+ * journal until it acknowledges them (the default), or is just a "tap"
+ * which looks at events without holding them */
+int shall_peek_register(int fd, int registered);
+
 /* send a command to a mounted filesystem */
 int shall_ctrl_commit(dev_t);
 int shall_ctrl_clear(dev_t, int);
 int shall_ctrl_userlog(dev_t, const char *);
 
+/* add user logs by calling the SHALL_IOC_USERLOG ioctl on a file or
+ * directory inside a mounted filesystem; the data contains one or more
+ * markers separated by NUL characters */
+int shall_ioctl_userlog(const char * path, const char *, size_t);
+
 #endif /* _SHALL_H_ */
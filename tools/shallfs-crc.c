@@ -0,0 +1,184 @@
+/* crc32 calculation with slicing-by-8 tables, or the CPU's own crc32
+ * instructions if available; used by all programs
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ *
+ * this file is part of SHALLFS
+ *
+ * Copyright (c) 2017-2019 Claudio Calvelli <shallfs@gladserv.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 2 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program (see the file COPYING in the distribution).
+ * If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <endian.h>
+#include "shallfs-crc.h"
+#if defined(__aarch64__) && defined(__GNUC__)
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#include <arm_acle.h>
+#define HAVE_ARM_CRC
+#endif
+
+#define POLY 0xedb88320
+#define BATCH 4
+
+/* slice_table[0] is the usual byte-at-a-time table; slice_table[n] gives
+ * the effect of a byte followed by n zero bytes */
+static uint32_t slice_table[8][256];
+
+typedef uint32_t (*crc_fn)(uint32_t, const unsigned char *, size_t);
+typedef void (*batch_fn)(uint32_t, const unsigned char * const *, size_t,
+			 uint32_t *);
+
+static inline uint32_t slice_byte(uint32_t crc, unsigned char c) {
+    return (crc >> 8) ^ slice_table[0][(crc ^ c) & 0xff];
+}
+
+static inline uint32_t slice_word(uint32_t crc, const unsigned char * data) {
+    uint32_t one, two;
+    memcpy(&one, data, 4);
+    memcpy(&two, data + 4, 4);
+    one = le32toh(one) ^ crc;
+    two = le32toh(two);
+    return slice_table[7][one & 0xff] ^ slice_table[6][(one >> 8) & 0xff]
+	 ^ slice_table[5][(one >> 16) & 0xff] ^ slice_table[4][one >> 24]
+	 ^ slice_table[3][two & 0xff] ^ slice_table[2][(two >> 8) & 0xff]
+	 ^ slice_table[1][(two >> 16) & 0xff] ^ slice_table[0][two >> 24];
+}
+
+static uint32_t crc_slice(uint32_t crc, const unsigned char * data,
+			  size_t len)
+{
+    for (; len >= 8; len -= 8, data += 8)
+	crc = slice_word(crc, data);
+    while (len-- > 0)
+	crc = slice_byte(crc, *data++);
+    return crc;
+}
+
+/* the table lookups for one block depend on the result for the previous
+ * 8 bytes, so doing several blocks at once keeps the CPU busy */
+static void batch_slice(uint32_t seed, const unsigned char * const * data,
+			size_t len, uint32_t * result)
+{
+    uint32_t c0 = seed, c1 = seed, c2 = seed, c3 = seed;
+    size_t pos;
+    for (pos = 0; pos + 8 <= len; pos += 8) {
+	c0 = slice_word(c0, data[0] + pos);
+	c1 = slice_word(c1, data[1] + pos);
+	c2 = slice_word(c2, data[2] + pos);
+	c3 = slice_word(c3, data[3] + pos);
+    }
+    for (; pos < len; pos++) {
+	c0 = slice_byte(c0, data[0][pos]);
+	c1 = slice_byte(c1, data[1][pos]);
+	c2 = slice_byte(c2, data[2][pos]);
+	c3 = slice_byte(c3, data[3][pos]);
+    }
+    result[0] = c0;
+    result[1] = c1;
+    result[2] = c2;
+    result[3] = c3;
+}
+
+#ifdef HAVE_ARM_CRC
+/* the ARMv8 crc32 instructions use the same polynomial as crc32_le */
+__attribute__((target("+crc")))
+static inline uint32_t arm_word(uint32_t crc, const unsigned char * data) {
+    uint64_t word;
+    memcpy(&word, data, 8);
+    return __crc32d(crc, le64toh(word));
+}
+
+__attribute__((target("+crc")))
+static uint32_t crc_arm(uint32_t crc, const unsigned char * data, size_t len)
+{
+    for (; len >= 8; len -= 8, data += 8)
+	crc = arm_word(crc, data);
+    while (len-- > 0)
+	crc = __crc32b(crc, *data++);
+    return crc;
+}
+
+__attribute__((target("+crc")))
+static void batch_arm(uint32_t seed, const unsigned char * const * data,
+		      size_t len, uint32_t * result)
+{
+    uint32_t c0 = seed, c1 = seed, c2 = seed, c3 = seed;
+    size_t pos;
+    for (pos = 0; pos + 8 <= len; pos += 8) {
+	c0 = arm_word(c0, data[0] + pos);
+	c1 = arm_word(c1, data[1] + pos);
+	c2 = arm_word(c2, data[2] + pos);
+	c3 = arm_word(c3, data[3] + pos);
+    }
+    for (; pos < len; pos++) {
+	c0 = __crc32b(c0, data[0][pos]);
+	c1 = __crc32b(c1, data[1][pos]);
+	c2 = __crc32b(c2, data[2][pos]);
+	c3 = __crc32b(c3, data[3][pos]);
+    }
+    result[0] = c0;
+    result[1] = c1;
+    result[2] = c2;
+    result[3] = c3;
+}
+#endif
+
+static crc_fn crc_one = crc_slice;
+static batch_fn crc_batch = batch_slice;
+
+/* build the tables and select the implementation before main() runs, so
+ * that threads can use the functions without any locking */
+__attribute__((constructor))
+static void crc_init(void) {
+    int n, i;
+    for (n = 0; n < 256; n++) {
+	uint32_t crc = n;
+	for (i = 0; i < 8; i++)
+	    crc = (crc >> 1) ^ ((crc & 1) ? POLY : 0);
+	slice_table[0][n] = crc;
+    }
+    for (n = 0; n < 256; n++)
+	for (i = 1; i < 8; i++)
+	    slice_table[i][n] = slice_byte(slice_table[i - 1][n], 0);
+#ifdef HAVE_ARM_CRC
+    if (getauxval(AT_HWCAP) & HWCAP_CRC32) {
+	crc_one = crc_arm;
+	crc_batch = batch_arm;
+    }
+#endif
+}
+
+unsigned int shall_crc32(unsigned int seed, const void * data, size_t len) {
+    return crc_one(seed, data, len);
+}
+
+void shall_crc32_batch(unsigned int seed, const void * const * _data,
+		       size_t len, unsigned int * result, int count)
+{
+    const unsigned char * const * data = (const unsigned char * const *)_data;
+    uint32_t res[BATCH];
+    int n;
+    for (n = 0; n + BATCH <= count; n += BATCH) {
+	int i;
+	crc_batch(seed, data + n, len, res);
+	for (i = 0; i < BATCH; i++)
+	    result[n + i] = res[i];
+    }
+    for (; n < count; n++)
+	result[n] = crc_one(seed, data[n], len);
+}
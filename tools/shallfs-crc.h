@@ -0,0 +1,41 @@
+/* shallfs-crc.h
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ *
+ * this file is part of SHALLFS
+ *
+ * Copyright (c) 2017-2019 Claudio Calvelli <shallfs@gladserv.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 2 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program (see the file COPYING in the distribution).
+ * If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef _SHALL_CRC_H_
+#define _SHALL_CRC_H_
+
+#include <stddef.h>
+
+/* crc32 as calculated by the kernel's crc32_le, without any inversion at
+ * the start or end, so the result of one call can be used as the seed of
+ * the next; the fastest implementation the CPU supports is selected when
+ * the program starts */
+unsigned int shall_crc32(unsigned int seed, const void *, size_t len);
+
+/* calculate the crc32 of "count" separate blocks of data, all of the same
+ * length, storing the results in "result"; this is faster than calling
+ * shall_crc32 for each block, as the calculations are interleaved */
+void shall_crc32_batch(unsigned int seed, const void * const * data,
+		       size_t len, unsigned int * result, int count);
+
+#endif /* _SHALL_CRC_H_ */
@@ -0,0 +1,706 @@
+/* decode shallfs events; used by readshallfs and any other program which
+ * needs to look inside events
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ *
+ * this file is part of SHALLFS
+ *
+ * Copyright (c) 2017-2019 Claudio Calvelli <shallfs@gladserv.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 2 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program (see the file COPYING in the distribution).
+ * If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stddef.h> /* for offsetof */
+#include <string.h>
+#include <errno.h>
+#include <endian.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include "shallfs-event.h"
+#include <shallfs/operation.h>
+#include <shallfs/device.h>
+#include <shallfs/opdata.h>
+
+/* decode the event at the start of a buffer */
+int shall_event_decode(const char * buffer, size_t len, shall_event_t * ev) {
+    struct shall_devheader dh;
+    const char * ptr, * end;
+    unsigned int next_header;
+    int n;
+#define need(size) \
+    if ((size) < 0 || end - ptr < (size)) goto invalid
+#define getdata(dest) \
+    need((ssize_t)sizeof(dest)); \
+    memcpy(&(dest), ptr, sizeof((dest))); \
+    ptr += sizeof((dest))
+    if (len < sizeof(dh)) return 0;
+    memcpy(&dh, buffer, sizeof(dh));
+    if (shall_checksum_log(&dh) != le32toh(dh.checksum)) goto invalid;
+    next_header = le32toh(dh.next_header);
+    if (next_header < sizeof(dh)) goto invalid;
+    if (next_header > len) return 0;
+    ptr = buffer + sizeof(dh);
+    end = buffer + next_header;
+    memset(ev, 0, sizeof(*ev));
+    ev->raw = buffer;
+    ev->length = next_header;
+    ev->operation = (int)le32toh(dh.operation);
+    if (ev->operation < 0) {
+	ev->operation = -ev->operation;
+	ev->before = 1;
+    }
+    ev->result = (int)le32toh(dh.result);
+    ev->flags = le32toh(dh.flags);
+    ev->req_sec = le64toh(dh.req_sec);
+    ev->req_nsec = le32toh(dh.req_nsec);
+    if (ev->flags & SHALL_LOG_CREDS) {
+	struct shall_devcreds dc;
+	getdata(dc);
+	ev->has_creds = 1;
+	ev->creds.uid = le64toh(dc.uid);
+	ev->creds.euid = le64toh(dc.euid);
+	ev->creds.fsuid = le64toh(dc.fsuid);
+	ev->creds.gid = le64toh(dc.gid);
+	ev->creds.egid = le64toh(dc.egid);
+	ev->creds.fsgid = le64toh(dc.fsgid);
+    }
+    for (n = 0; n < 2; n++) {
+	struct shall_devfileid df;
+	int nl;
+	if (! (ev->flags & (n ? SHALL_LOG_FILE2 : SHALL_LOG_FILE1)))
+	    continue;
+	getdata(df);
+	nl = (int)le32toh(df.fileid);
+	need(nl);
+	ev->name[ev->num_names] = ptr;
+	ev->namelen[ev->num_names] = nl;
+	ev->num_names++;
+	ptr += nl;
+    }
+    ev->data_type = ev->flags & SHALL_LOG_DMASK;
+    switch (ev->data_type) {
+	case SHALL_LOG_NODATA :
+	    break;
+	case SHALL_LOG_FILEID : {
+	    struct shall_devfileid df;
+	    getdata(df);
+	    ev->u.fileid = le32toh(df.fileid);
+	    break;
+	}
+	case SHALL_LOG_SIZE : {
+	    struct shall_devsize ds;
+	    getdata(ds);
+	    ev->u.size = le64toh(ds.size);
+	    break;
+	}
+	case SHALL_LOG_REGION :
+	case SHALL_LOG_DATA : {
+	    struct shall_devregion dr;
+	    getdata(dr);
+	    ev->u.region.start = le64toh(dr.start);
+	    ev->u.region.length = le64toh(dr.length);
+	    ev->u.region.fileid = le32toh(dr.fileid);
+	    if (ev->data_type == SHALL_LOG_DATA) {
+		need((ssize_t)ev->u.region.length);
+		ev->u.region.data = (const unsigned char *)ptr;
+		ptr += ev->u.region.length;
+	    }
+	    break;
+	}
+	case SHALL_LOG_HASH : {
+	    struct shall_devhash dc;
+	    need((ssize_t)sizeof(dc));
+	    memcpy(&dc, ptr, offsetof(struct shall_devhash, hash));
+	    ev->u.region.start = le64toh(dc.start);
+	    ev->u.region.length = le64toh(dc.length);
+	    ev->u.region.fileid = le32toh(dc.fileid);
+	    ev->u.region.hash = (const unsigned char *)ptr
+			      + offsetof(struct shall_devhash, hash);
+	    ptr += sizeof(dc);
+	    break;
+	}
+	case SHALL_LOG_CLONE : {
+	    struct shall_devclone dk;
+	    getdata(dk);
+	    ev->u.clone.src_start = le64toh(dk.src_start);
+	    ev->u.clone.length = le64toh(dk.length);
+	    ev->u.clone.dst_start = le64toh(dk.dst_start);
+	    ev->u.clone.src_fileid = le32toh(dk.src_fileid);
+	    ev->u.clone.dst_fileid = le32toh(dk.dst_fileid);
+	    break;
+	}
+	case SHALL_LOG_ATTR : {
+	    struct shall_devattr da;
+	    getdata(da);
+	    ev->u.attr.flags = le32toh(da.flags);
+	    ev->u.attr.mode = le32toh(da.mode);
+	    ev->u.attr.user = le32toh(da.user);
+	    ev->u.attr.group = le32toh(da.group);
+	    ev->u.attr.size = le64toh(da.size);
+	    ev->u.attr.atime_sec = le64toh(da.atime_sec);
+	    ev->u.attr.mtime_sec = le64toh(da.mtime_sec);
+	    ev->u.attr.atime_nsec = le32toh(da.atime_nsec);
+	    ev->u.attr.mtime_nsec = le32toh(da.mtime_nsec);
+	    break;
+	}
+	case SHALL_LOG_ACL : {
+	    struct shall_devacl dl;
+	    getdata(dl);
+	    ev->u.acl.perm = le32toh(dl.perm);
+	    ev->u.acl.access = (ev->u.acl.perm & (1 << 28)) != 0;
+	    ev->u.acl.count = (int)le32toh(dl.count);
+	    if (ev->u.acl.count < 0) goto invalid;
+	    if (ev->u.acl.count > (end - ptr) /
+				  (ssize_t)sizeof(struct shall_devacl_entry))
+		goto invalid;
+	    ev->u.acl.entries = (const struct shall_devacl_entry *)ptr;
+	    ptr += ev->u.acl.count * sizeof(struct shall_devacl_entry);
+	    break;
+	}
+	case SHALL_LOG_XATTR : {
+	    struct shall_devxattr dx;
+	    getdata(dx);
+	    ev->u.xattr.flags = le32toh(dx.flags);
+	    ev->u.xattr.namelen = (int)le32toh(dx.namelen);
+	    need(ev->u.xattr.namelen);
+	    ev->u.xattr.name = ptr;
+	    ptr += ev->u.xattr.namelen;
+	    ev->u.xattr.valuelen = (int)le32toh(dx.valuelen);
+	    need(ev->u.xattr.valuelen);
+	    ev->u.xattr.value = (const unsigned char *)ptr;
+	    ptr += ev->u.xattr.valuelen;
+	    break;
+	}
+	default :
+	    goto invalid;
+    }
+    return next_header;
+invalid:
+    errno = EINVAL;
+    return -1;
+#undef getdata
+#undef need
+}
+
+/* encode an event in device format */
+size_t shall_event_encode(const shall_event_t * ev, char * buffer,
+			  size_t len)
+{
+    struct shall_devheader dh;
+    size_t size = sizeof(dh), datalen = 0, pos;
+    int n;
+#define put(src, slen) \
+    memcpy(buffer + pos, (src), (slen)); \
+    pos += (slen)
+    /* first see how big it is */
+    if (ev->flags & SHALL_LOG_CREDS)
+	size += sizeof(struct shall_devcreds);
+    for (n = 0; n < ev->num_names && n < 2; n++)
+	size += sizeof(struct shall_devfileid) + ev->namelen[n];
+    switch (ev->flags & SHALL_LOG_DMASK) {
+	case SHALL_LOG_FILEID :
+	    datalen = sizeof(struct shall_devfileid);
+	    break;
+	case SHALL_LOG_SIZE :
+	    datalen = sizeof(struct shall_devsize);
+	    break;
+	case SHALL_LOG_REGION :
+	    datalen = sizeof(struct shall_devregion);
+	    break;
+	case SHALL_LOG_DATA :
+	    datalen = sizeof(struct shall_devregion) + ev->u.region.length;
+	    break;
+	case SHALL_LOG_HASH :
+	    datalen = sizeof(struct shall_devhash);
+	    break;
+	case SHALL_LOG_CLONE :
+	    datalen = sizeof(struct shall_devclone);
+	    break;
+	case SHALL_LOG_ATTR :
+	    datalen = sizeof(struct shall_devattr);
+	    break;
+	case SHALL_LOG_ACL :
+	    datalen = sizeof(struct shall_devacl)
+		    + ev->u.acl.count * sizeof(struct shall_devacl_entry);
+	    break;
+	case SHALL_LOG_XATTR :
+	    datalen = sizeof(struct shall_devxattr)
+		    + ev->u.xattr.namelen + ev->u.xattr.valuelen;
+	    break;
+    }
+    size += datalen;
+    size = (size + SHALL_EVENT_ALIGN - 1) & ~(size_t)(SHALL_EVENT_ALIGN - 1);
+    if (size > len) return size;
+    memset(buffer, 0, size);
+    memset(&dh, 0, sizeof(dh));
+    dh.next_header = htole32(size);
+    dh.operation = htole32(ev->before ? -ev->operation : ev->operation);
+    dh.req_sec = htole64(ev->req_sec);
+    dh.req_nsec = htole32(ev->req_nsec);
+    dh.result = htole32(ev->result);
+    dh.flags = htole32(ev->flags);
+    dh.checksum = htole32(shall_checksum_log(&dh));
+    pos = 0;
+    put(&dh, sizeof(dh));
+    if (ev->flags & SHALL_LOG_CREDS) {
+	struct shall_devcreds dc;
+	dc.uid = htole64(ev->creds.uid);
+	dc.euid = htole64(ev->creds.euid);
+	dc.fsuid = htole64(ev->creds.fsuid);
+	dc.gid = htole64(ev->creds.gid);
+	dc.egid = htole64(ev->creds.egid);
+	dc.fsgid = htole64(ev->creds.fsgid);
+	put(&dc, sizeof(dc));
+    }
+    for (n = 0; n < ev->num_names && n < 2; n++) {
+	struct shall_devfileid df;
+	df.fileid = htole32(ev->namelen[n]);
+	put(&df, sizeof(df));
+	put(ev->name[n], ev->namelen[n]);
+    }
+    switch (ev->flags & SHALL_LOG_DMASK) {
+	case SHALL_LOG_FILEID : {
+	    struct shall_devfileid df;
+	    df.fileid = htole32(ev->u.fileid);
+	    put(&df, sizeof(df));
+	    break;
+	}
+	case SHALL_LOG_SIZE : {
+	    struct shall_devsize ds;
+	    ds.size = htole64(ev->u.size);
+	    put(&ds, sizeof(ds));
+	    break;
+	}
+	case SHALL_LOG_REGION :
+	case SHALL_LOG_DATA : {
+	    struct shall_devregion dr;
+	    dr.start = htole64(ev->u.region.start);
+	    dr.length = htole64(ev->u.region.length);
+	    dr.fileid = htole32(ev->u.region.fileid);
+	    put(&dr, sizeof(dr));
+	    if ((ev->flags & SHALL_LOG_DMASK) == SHALL_LOG_DATA) {
+		put(ev->u.region.data, ev->u.region.length);
+	    }
+	    break;
+	}
+	case SHALL_LOG_HASH : {
+	    struct shall_devhash dc;
+	    dc.start = htole64(ev->u.region.start);
+	    dc.length = htole64(ev->u.region.length);
+	    dc.fileid = htole32(ev->u.region.fileid);
+	    memcpy(dc.hash, ev->u.region.hash, sizeof(dc.hash));
+	    put(&dc, sizeof(dc));
+	    break;
+	}
+	case SHALL_LOG_CLONE : {
+	    struct shall_devclone dk;
+	    dk.src_start = htole64(ev->u.clone.src_start);
+	    dk.length = htole64(ev->u.clone.length);
+	    dk.dst_start = htole64(ev->u.clone.dst_start);
+	    dk.src_fileid = htole32(ev->u.clone.src_fileid);
+	    dk.dst_fileid = htole32(ev->u.clone.dst_fileid);
+	    put(&dk, sizeof(dk));
+	    break;
+	}
+	case SHALL_LOG_ATTR : {
+	    struct shall_devattr da;
+	    da.flags = htole32(ev->u.attr.flags);
+	    da.mode = htole32(ev->u.attr.mode);
+	    da.user = htole32(ev->u.attr.user);
+	    da.group = htole32(ev->u.attr.group);
+	    da.size = htole64(ev->u.attr.size);
+	    da.atime_sec = htole64(ev->u.attr.atime_sec);
+	    da.mtime_sec = htole64(ev->u.attr.mtime_sec);
+	    da.atime_nsec = htole32(ev->u.attr.atime_nsec);
+	    da.mtime_nsec = htole32(ev->u.attr.mtime_nsec);
+	    put(&da, sizeof(da));
+	    break;
+	}
+	case SHALL_LOG_ACL : {
+	    struct shall_devacl dl;
+	    dl.count = htole32(ev->u.acl.count);
+	    dl.perm = htole32(ev->u.acl.perm);
+	    put(&dl, sizeof(dl));
+	    /* the entries are still in device format */
+	    put(ev->u.acl.entries,
+		ev->u.acl.count * sizeof(struct shall_devacl_entry));
+	    break;
+	}
+	case SHALL_LOG_XATTR : {
+	    struct shall_devxattr dx;
+	    dx.flags = htole32(ev->u.xattr.flags);
+	    dx.namelen = htole32(ev->u.xattr.namelen);
+	    dx.valuelen = htole32(ev->u.xattr.valuelen);
+	    put(&dx, sizeof(dx));
+	    put(ev->u.xattr.name, ev->u.xattr.namelen);
+	    put(ev->u.xattr.value, ev->u.xattr.valuelen);
+	    break;
+	}
+    }
+    return size;
+#undef put
+}
+
+/* return the length of the complete valid events at the start of a
+ * buffer; this only looks at the headers, not at the data */
+ssize_t shall_event_scan(const char * buffer, size_t len) {
+    const struct shall_devheader * dh[SHALL_CHECK_BATCH];
+    size_t done = 0;
+    int invalid = 0, partial = 0;
+    /* collect a batch of headers following the next_header fields, which
+     * we can't trust until the checksums have been verified, then check
+     * them all at once and stop at the first invalid one */
+    while (! invalid && ! partial && len - done >= sizeof(*dh[0])) {
+	size_t pos = done;
+	int count = 0, valid, n;
+	while (count < SHALL_CHECK_BATCH && len - pos >= sizeof(*dh[0])) {
+	    __le32 next;
+	    unsigned int nh;
+	    memcpy(&next, buffer + pos, sizeof(next));
+	    nh = le32toh(next);
+	    dh[count++] = (const struct shall_devheader *)(buffer + pos);
+	    if (nh < sizeof(*dh[0])) break;
+	    if (len - pos < nh) {
+		partial = 1;
+		break;
+	    }
+	    pos += nh;
+	}
+	valid = shall_check_logs(dh, count);
+	for (n = 0; n < valid; n++) {
+	    __le32 next;
+	    unsigned int nh;
+	    memcpy(&next, dh[n], sizeof(next));
+	    nh = le32toh(next);
+	    if (nh < sizeof(*dh[0])) {
+		invalid = 1;
+		break;
+	    }
+	    if (len - done < nh) break;
+	    done += nh;
+	}
+	if (valid < count) invalid = 1;
+    }
+    if (done == 0 && invalid) {
+	errno = EINVAL;
+	return -1;
+    }
+    return done;
+}
+
+/* see if the data at the start of a buffer could be an event header,
+ * looking only at fields which are cheap to check; most random data fails
+ * this, so only a few positions need their checksum calculated */
+static inline int maybe_header(const char * buffer, size_t len) {
+    struct shall_devheader dh;
+    unsigned int nh;
+    memcpy(&dh, buffer, sizeof(dh));
+    nh = le32toh(dh.next_header);
+    if (nh < sizeof(dh) || nh > len || nh % 8) return 0;
+    switch (le32toh(dh.flags) & SHALL_LOG_DMASK) {
+	case SHALL_LOG_NODATA :
+	case SHALL_LOG_FILEID :
+	case SHALL_LOG_SIZE :
+	case SHALL_LOG_REGION :
+	case SHALL_LOG_HASH :
+	case SHALL_LOG_DATA :
+	case SHALL_LOG_CLONE :
+	case SHALL_LOG_ATTR :
+	case SHALL_LOG_ACL :
+	case SHALL_LOG_XATTR :
+	    return 1;
+    }
+    return 0;
+}
+
+/* find the first event in a buffer which may start in the middle of one */
+ssize_t shall_event_resync(const char * buffer, size_t len, size_t limit,
+			   size_t align)
+{
+    const struct shall_devheader * dh[SHALL_CHECK_BATCH];
+    size_t at[SHALL_CHECK_BATCH], pos = 0;
+    char valid[SHALL_CHECK_BATCH];
+    if (limit > len) limit = len;
+    /* collect a batch of candidates, check all their checksums at once,
+     * and then decode the valid ones in order */
+    while (pos < limit) {
+	int count = 0, n;
+	while (count < SHALL_CHECK_BATCH && pos < limit &&
+	       len - pos >= sizeof(struct shall_devheader))
+	{
+	    if (maybe_header(buffer + pos, len - pos)) {
+		dh[count] = (const struct shall_devheader *)(buffer + pos);
+		at[count++] = pos;
+	    }
+	    pos += align;
+	}
+	if (count == 0) break;
+	shall_verify_logs(dh, count, valid);
+	for (n = 0; n < count; n++) {
+	    shall_event_t ev;
+	    size_t cp = at[n];
+	    int nh, nn;
+	    if (! valid[n]) continue;
+	    nh = shall_event_decode(buffer + cp, len - cp, &ev);
+	    if (nh <= 0) continue;
+	    /* a random match is very unlikely, but one followed by another
+	     * valid event is even less likely */
+	    if (cp + nh >= len) return cp;
+	    nn = shall_event_decode(buffer + cp + nh, len - cp - nh, &ev);
+	    if (nn >= 0) return cp;
+	}
+    }
+    errno = EINVAL;
+    return -1;
+}
+
+/* name of an operation */
+const char * shall_event_opname(int operation) {
+    if (operation < 0) operation = -operation;
+    if (operation == 0) return "DEBUG";
+    if (operation >= SHALL_MAX_OPCODE || ! shall_opdata[operation].name)
+	return "?";
+    return shall_opdata[operation].name;
+}
+
+/* get the next event from a buffer */
+int shall_event_next(shall_event_iter_t * it, shall_event_t * ev) {
+    int len;
+    if (it->pos >= it->len) return 0;
+    len = shall_event_decode(it->buffer + it->pos, it->len - it->pos, ev);
+    if (len <= 0) return len;
+    it->pos += len;
+    return 1;
+}
+
+/* map a whole file of events in memory */
+const char * shall_event_map(int fd, size_t * len) {
+    struct stat sbuff;
+    void * map;
+    if (fstat(fd, &sbuff) < 0) return NULL;
+    if (! S_ISREG(sbuff.st_mode)) {
+	errno = ENODEV;
+	return NULL;
+    }
+    *len = sbuff.st_size;
+    if (*len < 1) return "";
+    map = mmap(NULL, *len, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED) return NULL;
+    madvise(map, *len, MADV_SEQUENTIAL);
+    return map;
+}
+
+void shall_event_unmap(const char * map, size_t len) {
+    if (len > 0) munmap((void *)map, len);
+}
+
+/* file ID table: a hash table with chaining, resized as it grows */
+typedef struct fileid_s fileid_t;
+struct fileid_s {
+    fileid_t * next;
+    int fileid;
+    char * name;
+};
+
+struct shall_fileids_s {
+    fileid_t ** table;
+    int size;				/* always a power of 2 */
+    int count;
+};
+
+#define INITIAL_FILEIDS 256
+
+static inline int fileid_hash(const shall_fileids_t * fids, int fileid) {
+    return ((unsigned int)fileid * 2654435761U) & (fids->size - 1);
+}
+
+shall_fileids_t * shall_fileids_new(void) {
+    shall_fileids_t * fids = malloc(sizeof(*fids));
+    if (! fids) return NULL;
+    fids->table = calloc(INITIAL_FILEIDS, sizeof(fileid_t *));
+    if (! fids->table) {
+	free(fids);
+	return NULL;
+    }
+    fids->size = INITIAL_FILEIDS;
+    fids->count = 0;
+    return fids;
+}
+
+void shall_fileids_free(shall_fileids_t * fids) {
+    int n;
+    if (! fids) return;
+    for (n = 0; n < fids->size; n++) {
+	while (fids->table[n]) {
+	    fileid_t * fe = fids->table[n];
+	    fids->table[n] = fe->next;
+	    free(fe->name);
+	    free(fe);
+	}
+    }
+    free(fids->table);
+    free(fids);
+}
+
+static fileid_t ** find_fileid(const shall_fileids_t * fids, int fileid) {
+    fileid_t ** fe = &fids->table[fileid_hash(fids, fileid)];
+    while (*fe && (*fe)->fileid != fileid)
+	fe = &(*fe)->next;
+    return fe;
+}
+
+const char * shall_fileids_lookup(const shall_fileids_t * fids, int fileid) {
+    fileid_t ** fe = find_fileid(fids, fileid);
+    return *fe ? (*fe)->name : NULL;
+}
+
+static void remove_fileid(shall_fileids_t * fids, int fileid) {
+    fileid_t ** fe = find_fileid(fids, fileid), * old = *fe;
+    if (! old) return;
+    *fe = old->next;
+    free(old->name);
+    free(old);
+    fids->count--;
+}
+
+/* double the size of the table when it gets too full */
+static void grow_fileids(shall_fileids_t * fids) {
+    fileid_t ** old = fids->table;
+    int osize = fids->size, n;
+    fids->table = calloc(2 * osize, sizeof(fileid_t *));
+    if (! fids->table) {
+	/* not fatal, the table is just slower */
+	fids->table = old;
+	return;
+    }
+    fids->size = 2 * osize;
+    for (n = 0; n < osize; n++) {
+	while (old[n]) {
+	    fileid_t * fe = old[n];
+	    int h = fileid_hash(fids, fe->fileid);
+	    old[n] = fe->next;
+	    fe->next = fids->table[h];
+	    fids->table[h] = fe;
+	}
+    }
+    free(old);
+}
+
+static int add_fileid(shall_fileids_t * fids, int fileid,
+		      const char * name, int namelen)
+{
+    fileid_t ** fe = find_fileid(fids, fileid);
+    char * copy = malloc(namelen + 1);
+    if (! copy) return 0;
+    memcpy(copy, name, namelen);
+    copy[namelen] = 0;
+    if (*fe) {
+	free((*fe)->name);
+	(*fe)->name = copy;
+	return 1;
+    }
+    *fe = malloc(sizeof(fileid_t));
+    if (! *fe) {
+	free(copy);
+	return 0;
+    }
+    (*fe)->next = NULL;
+    (*fe)->fileid = fileid;
+    (*fe)->name = copy;
+    fids->count++;
+    if (fids->count > 2 * fids->size) grow_fileids(fids);
+    return 1;
+}
+
+/* if "name" is "from" or is inside directory "from", change that part
+ * to "to"; returns the new name, or NULL if there's no match or no
+ * memory */
+static char * rename_path(const char * name, const char * from, int fromlen,
+			  const char * to, int tolen)
+{
+    int namelen = strlen(name);
+    char * result;
+    if (namelen < fromlen || strncmp(name, from, fromlen) != 0)
+	return NULL;
+    if (namelen > fromlen && name[fromlen] != '/')
+	return NULL;
+    result = malloc(namelen - fromlen + tolen + 1);
+    if (! result) return NULL;
+    memcpy(result, to, tolen);
+    strcpy(result + tolen, name + fromlen);
+    return result;
+}
+
+/* apply a MOVE (swap == 0) or SWAP (swap != 0) to all names */
+static void move_fileids(shall_fileids_t * fids, const shall_event_t * ev,
+			 int swap)
+{
+    int n;
+    for (n = 0; n < fids->size; n++) {
+	fileid_t * fe;
+	for (fe = fids->table[n]; fe; fe = fe->next) {
+	    char * nn = rename_path(fe->name, ev->name[0], ev->namelen[0],
+				    ev->name[1], ev->namelen[1]);
+	    if (! nn && swap)
+		nn = rename_path(fe->name, ev->name[1], ev->namelen[1],
+				 ev->name[0], ev->namelen[0]);
+	    if (! nn) continue;
+	    free(fe->name);
+	    fe->name = nn;
+	}
+    }
+}
+
+/* see if an event could change the table */
+int shall_fileids_relevant(const char * event) {
+    __le32 op;
+    int operation;
+    memcpy(&op, event + offsetof(struct shall_devheader, operation),
+	   sizeof(op));
+    operation = (int)le32toh(op);
+    if (operation < 0) operation = -operation;
+    return operation == SHALL_OPEN || operation == SHALL_CLOSE ||
+	   operation == SHALL_MOVE || operation == SHALL_SWAP;
+}
+
+/* update the table from an event */
+int shall_fileids_update(shall_fileids_t * fids, const shall_event_t * ev) {
+    switch (ev->operation) {
+	case SHALL_OPEN :
+	    if (ev->num_names < 1 || ev->data_type != SHALL_LOG_FILEID)
+		break;
+	    /* a failed open doesn't produce a file ID */
+	    if (! ev->before && ev->result < 0) {
+		remove_fileid(fids, ev->u.fileid);
+		break;
+	    }
+	    return add_fileid(fids, ev->u.fileid,
+			      ev->name[0], ev->namelen[0]);
+	case SHALL_CLOSE :
+	    if (ev->before || ev->data_type != SHALL_LOG_FILEID) break;
+	    remove_fileid(fids, ev->u.fileid);
+	    break;
+	case SHALL_MOVE :
+	case SHALL_SWAP :
+	    /* open files follow the renames */
+	    if (ev->before || ev->result < 0 || ev->num_names < 2) break;
+	    move_fileids(fids, ev, ev->operation == SHALL_SWAP);
+	    break;
+    }
+    return 1;
+}
@@ -0,0 +1,214 @@
+/* shallfs-event.h
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ *
+ * this file is part of SHALLFS
+ *
+ * Copyright (c) 2017-2019 Claudio Calvelli <shallfs@gladserv.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 2 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program (see the file COPYING in the distribution).
+ * If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _SHALL_EVENT_H_
+#define _SHALL_EVENT_H_
+
+#include <stdint.h>
+#include <endian.h>
+#include <sys/types.h>
+#include "shallfs-common.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* decoded events; the decoder does not copy anything: names and other
+ * variable length data point inside the buffer containing the event, so
+ * the decoded event is only valid as long as that buffer is; fixed size
+ * data is converted to host byte order */
+
+typedef struct {
+    uint64_t uid;
+    uint64_t euid;
+    uint64_t fsuid;
+    uint64_t gid;
+    uint64_t egid;
+    uint64_t fsgid;
+} shall_event_creds_t;
+
+/* SHALL_LOG_REGION, SHALL_LOG_HASH and SHALL_LOG_DATA */
+typedef struct {
+    int64_t start;
+    int64_t length;
+    int fileid;
+    const unsigned char * hash;		/* hash of data, or NULL */
+    const unsigned char * data;		/* "length" bytes, or NULL */
+} shall_event_region_t;
+
+typedef struct {
+    int64_t src_start;
+    int64_t length;
+    int64_t dst_start;
+    int src_fileid;
+    int dst_fileid;
+} shall_event_clone_t;
+
+/* the "flags" are from enum shall_attr_flags, and only the fields they
+ * select are meaningful; "size" is the device number for mknod */
+typedef struct {
+    int flags;
+    int mode;
+    int user;
+    int group;
+    int64_t size;
+    int64_t atime_sec;
+    int64_t mtime_sec;
+    int atime_nsec;
+    int mtime_nsec;
+} shall_event_attr_t;
+
+/* the entries are left in device format, see shall_event_acl_entry */
+typedef struct {
+    int access;				/* access ACL, not default ACL */
+    int perm;				/* see struct shall_devacl */
+    int count;
+    const struct shall_devacl_entry * entries;
+} shall_event_acl_t;
+
+typedef struct {
+    int flags;
+    const char * name;
+    int namelen;
+    const unsigned char * value;
+    int valuelen;
+} shall_event_xattr_t;
+
+typedef struct {
+    const char * raw;			/* start of event in buffer */
+    int length;				/* length including padding */
+    int operation;			/* enum shall_operation, 0 == debug */
+    int before;				/* logged before the operation */
+    int result;
+    int flags;				/* enum shall_log_flags */
+    int64_t req_sec;
+    int req_nsec;
+    int has_creds;
+    shall_event_creds_t creds;
+    int num_names;
+    const char * name[2];		/* not NUL-terminated */
+    int namelen[2];
+    int data_type;			/* flags & SHALL_LOG_DMASK */
+    union {
+	int fileid;			/* SHALL_LOG_FILEID */
+	int64_t size;			/* SHALL_LOG_SIZE */
+	shall_event_region_t region;	/* REGION, HASH, DATA */
+	shall_event_clone_t clone;	/* SHALL_LOG_CLONE */
+	shall_event_attr_t attr;	/* SHALL_LOG_ATTR */
+	shall_event_acl_t acl;		/* SHALL_LOG_ACL */
+	shall_event_xattr_t xattr;	/* SHALL_LOG_XATTR */
+    } u;
+} shall_event_t;
+
+/* decode the event at the start of a buffer; returns the event length if
+ * the buffer contains a complete valid event, 0 if it contains only part
+ * of one, -1 with errno set to EINVAL if the data is not a valid event */
+int shall_event_decode(const char * buffer, size_t len, shall_event_t *);
+
+/* encode an event in device format, the reverse of shall_event_decode:
+ * the header comes from the decoded fields, not from "raw", and the data
+ * present is determined by "flags" and "num_names"; the event is padded
+ * with zeros to a multiple of SHALL_EVENT_ALIGN; returns the length, and
+ * only stores the event if it fits in "len" bytes */
+#define SHALL_EVENT_ALIGN 8
+size_t shall_event_encode(const shall_event_t *, char * buffer, size_t len);
+
+/* return the length of the complete valid events at the start of a
+ * buffer; -1 with errno set to EINVAL if the buffer starts with something
+ * which is not an event */
+ssize_t shall_event_scan(const char * buffer, size_t len);
+
+/* find the first event in a buffer which may start in the middle of one,
+ * for example a chunk of a large file; only offsets which are a multiple
+ * of "align" and less than "limit" are considered, and an offset is only
+ * accepted if there is a valid event there followed by another valid (or
+ * incomplete) event or by the end of the buffer; returns the offset, or
+ * -1 with errno set to EINVAL if there is no such offset */
+ssize_t shall_event_resync(const char * buffer, size_t len, size_t limit,
+			   size_t align);
+
+/* name of an operation, or "?" if unknown */
+const char * shall_event_opname(int operation);
+
+/* decode one ACL entry: returns the user or group ID and stores the
+ * permissions and whether this is a group entry */
+static inline int shall_event_acl_entry(const shall_event_acl_t * acl,
+					int n, int * perm, int * is_group)
+{
+    int type = le32toh(acl->entries[n].type);
+    *perm = type;
+    *is_group = (type & (1 << 28)) != 0;
+    return le32toh(acl->entries[n].name);
+}
+
+/* iterate over all events in a memory buffer */
+typedef struct {
+    const char * buffer;
+    size_t len;
+    size_t pos;				/* start of next event */
+} shall_event_iter_t;
+
+static inline void shall_event_iter_init(shall_event_iter_t * it,
+					 const char * buffer, size_t len)
+{
+    it->buffer = buffer;
+    it->len = len;
+    it->pos = 0;
+}
+
+/* get the next event; returns 1 if there was one, 0 at the end of the
+ * buffer or if the remaining data is an incomplete event, -1 with errno
+ * set if the data at the current position is not an event; in all cases
+ * it->pos is the start of the first event not returned */
+int shall_event_next(shall_event_iter_t *, shall_event_t *);
+
+/* map a whole file of events (such as produced by readshallfs) in memory;
+ * returns NULL with errno set if that isn't possible, for example because
+ * the file is a pipe */
+const char * shall_event_map(int fd, size_t * len);
+void shall_event_unmap(const char *, size_t len);
+
+/* keep track of which file name corresponds to each file ID, as the
+ * events which refer to a file ID don't include a name; feed all events
+ * to shall_fileids_update in the order they were logged */
+typedef struct shall_fileids_s shall_fileids_t;
+
+shall_fileids_t * shall_fileids_new(void);
+void shall_fileids_free(shall_fileids_t *);
+
+/* update the table from an event; returns 1 if OK, 0 if out of memory */
+int shall_fileids_update(shall_fileids_t *, const shall_event_t *);
+
+/* find the name of a file ID; returns NULL if not known; the result is
+ * valid until the next call to shall_fileids_update */
+const char * shall_fileids_lookup(const shall_fileids_t *, int fileid);
+
+/* check whether an event could change the table, looking only at its
+ * header; programs which skip events without decoding them must still
+ * decode these ones and feed them to shall_fileids_update */
+int shall_fileids_relevant(const char * event);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _SHALL_EVENT_H_ */
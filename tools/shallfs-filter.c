@@ -0,0 +1,314 @@
+/* select events without decoding them; used by readshallfs
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ *
+ * this file is part of SHALLFS
+ *
+ * Copyright (c) 2017-2019 Claudio Calvelli <shallfs@gladserv.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 2 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program (see the file COPYING in the distribution).
+ * If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <endian.h>
+#include <stddef.h> /* for offsetof */
+#include "shallfs-filter.h"
+#include <shallfs/operation.h>
+#include <shallfs/device.h>
+
+struct shall_event_filter_s {
+    int flags;
+    uint64_t operations;
+    uint64_t uid;
+    int64_t since;
+    int64_t until;
+    int prefix_length;
+    char prefix[SHALL_FILTER_PREFIX_MAX];
+    /* with SHALL_FILTER_PREFIX, the file IDs opened with a name under
+     * the prefix and not yet closed: an open addressing hash table */
+    int * fileids;
+    int fileids_size;			/* a power of 2, or 0 */
+    int fileids_count;
+};
+
+shall_event_filter_t * shall_event_filter_new(void) {
+    return calloc(1, sizeof(shall_event_filter_t));
+}
+
+void shall_event_filter_free(shall_event_filter_t * ef) {
+    free(ef->fileids);
+    free(ef);
+}
+
+int shall_event_filter_operations(shall_event_filter_t * ef,
+				  const char * list)
+{
+    while (*list) {
+	const char * end = strchr(list, ',');
+	int len = end ? end - list : strlen(list), op;
+	char * ep;
+	op = strtol(list, &ep, 10);
+	if (ep != list + len || len == 0) {
+	    for (op = 0; op < SHALL_MAX_OPCODE; op++) {
+		const char * name = shall_event_opname(op);
+		if (strlen(name) == len && strncasecmp(name, list, len) == 0)
+		    break;
+	    }
+	}
+	if (op < 0 || op >= SHALL_MAX_OPCODE || op >= 64) {
+	    errno = EINVAL;
+	    return 0;
+	}
+	ef->operations |= 1ULL << op;
+	list += len;
+	if (*list) list++;
+    }
+    ef->flags |= SHALL_FILTER_OPERATION;
+    return 1;
+}
+
+void shall_event_filter_uid(shall_event_filter_t * ef, uint64_t uid) {
+    ef->uid = uid;
+    ef->flags |= SHALL_FILTER_UID;
+}
+
+int shall_event_filter_prefix(shall_event_filter_t * ef, const char * prefix)
+{
+    int len = strlen(prefix);
+    if (len > SHALL_FILTER_PREFIX_MAX) {
+	errno = ENAMETOOLONG;
+	return 0;
+    }
+    memcpy(ef->prefix, prefix, len);
+    ef->prefix_length = len;
+    ef->flags |= SHALL_FILTER_PREFIX;
+    return 1;
+}
+
+void shall_event_filter_time(shall_event_filter_t * ef,
+			     int64_t since, int64_t until)
+{
+    ef->since = since;
+    ef->until = until;
+    ef->flags |= SHALL_FILTER_TIME;
+}
+
+void shall_event_filter_kernel(const shall_event_filter_t * ef,
+			       struct shall_filter * kf)
+{
+    memset(kf, 0, sizeof(*kf));
+    kf->flags = ef->flags & SHALL_FILTER_ALL;
+    kf->operations = ef->operations;
+    kf->uid = ef->uid;
+    kf->prefix_length = ef->prefix_length;
+    memcpy(kf->prefix, ef->prefix, ef->prefix_length);
+}
+
+int shall_event_filter_stateful(const shall_event_filter_t * ef) {
+    return (ef->flags & SHALL_FILTER_PREFIX) != 0;
+}
+
+/* read a number (file ID or name length) from the event */
+static inline int get_number(const char * ptr, const char * end, int * num) {
+    __le32 val;
+    if (end - ptr < (ssize_t)sizeof(val)) return 0;
+    memcpy(&val, ptr, sizeof(val));
+    *num = (int)le32toh(val);
+    return 1;
+}
+
+/* check a file name against the prefix and skip it; returns 1 if it
+ * matches, 0 if not, -1 if the event is invalid */
+static int check_name(const shall_event_filter_t * ef,
+		      const char ** ptr, const char * end)
+{
+    int len, matches;
+    if (! get_number(*ptr, end, &len)) return -1;
+    *ptr += sizeof(struct shall_devfileid);
+    if (len < 0 || end - *ptr < len) return -1;
+    matches = len >= ef->prefix_length &&
+	      memcmp(*ptr, ef->prefix, ef->prefix_length) == 0;
+    *ptr += len;
+    return matches;
+}
+
+/* the file IDs opened under the prefix, like the kernel's idr for each
+ * reader: an ID is remembered when an OPEN with a matching name is seen
+ * and forgotten at its CLOSE, and renames make no difference; ID 0 is
+ * never stored, so it marks an empty slot */
+static inline int fileid_slot(const shall_event_filter_t * ef, int fileid) {
+    return ((unsigned int)fileid * 2654435761U) & (ef->fileids_size - 1);
+}
+
+static int find_fileid(const shall_event_filter_t * ef, int fileid) {
+    int n;
+    if (fileid <= 0 || ! ef->fileids_size) return -1;
+    for (n = fileid_slot(ef, fileid); ef->fileids[n];
+	 n = (n + 1) & (ef->fileids_size - 1))
+	if (ef->fileids[n] == fileid)
+	    return n;
+    return -1;
+}
+
+static int remember_fileid(shall_event_filter_t * ef, int fileid) {
+    int n;
+    if (fileid <= 0 || find_fileid(ef, fileid) >= 0) return 1;
+    /* keep the table at most half full */
+    if (2 * (ef->fileids_count + 1) > ef->fileids_size) {
+	int osize = ef->fileids_size, * old = ef->fileids;
+	int nsize = osize ? 2 * osize : 64;
+	ef->fileids = calloc(nsize, sizeof(int));
+	if (! ef->fileids) {
+	    ef->fileids = old;
+	    return 0;
+	}
+	ef->fileids_size = nsize;
+	for (n = 0; n < osize; n++) {
+	    int m;
+	    if (! old[n]) continue;
+	    for (m = fileid_slot(ef, old[n]); ef->fileids[m];
+		 m = (m + 1) & (nsize - 1))
+		;
+	    ef->fileids[m] = old[n];
+	}
+	free(old);
+    }
+    for (n = fileid_slot(ef, fileid); ef->fileids[n];
+	 n = (n + 1) & (ef->fileids_size - 1))
+	;
+    ef->fileids[n] = fileid;
+    ef->fileids_count++;
+    return 1;
+}
+
+static void forget_fileid(shall_event_filter_t * ef, int fileid) {
+    int mask = ef->fileids_size - 1, n = find_fileid(ef, fileid), m;
+    if (n < 0) return;
+    ef->fileids[n] = 0;
+    ef->fileids_count--;
+    /* move back any entry which would no longer be found */
+    for (m = (n + 1) & mask; ef->fileids[m]; m = (m + 1) & mask) {
+	int home = fileid_slot(ef, ef->fileids[m]);
+	if (((m - home) & mask) >= ((m - n) & mask)) {
+	    ef->fileids[n] = ef->fileids[m];
+	    ef->fileids[m] = 0;
+	    n = m;
+	}
+    }
+}
+
+/* the prefix test, once the header and creds have been looked at; this
+ * is the same as the kernel's reader_wants(), and needs to see every
+ * event, wanted or not, to keep track of the file IDs; returns 1 if the
+ * event passes the test, 0 if not, -1 if out of memory */
+static int check_prefix(shall_event_filter_t * ef, int operation, int flags,
+			const char * ptr, const char * end)
+{
+    int ids[2], nids = 0, n;
+    if (flags & (SHALL_LOG_FILE1 | SHALL_LOG_FILE2)) {
+	int matches = 0, ok;
+	if (flags & SHALL_LOG_FILE1) {
+	    ok = check_name(ef, &ptr, end);
+	    if (ok < 0) return 1;
+	    matches |= ok;
+	}
+	if (flags & SHALL_LOG_FILE2) {
+	    ok = check_name(ef, &ptr, end);
+	    if (ok < 0) return 1;
+	    matches |= ok;
+	}
+	/* an OPEN under the prefix: remember this file ID */
+	if ((flags & SHALL_LOG_DMASK) == SHALL_LOG_FILEID && matches &&
+	    get_number(ptr, end, &ids[0]) && ! remember_fileid(ef, ids[0]))
+		return -1;
+	return matches;
+    }
+    switch (flags & SHALL_LOG_DMASK) {
+	case SHALL_LOG_FILEID :
+	    if (! get_number(ptr, end, &ids[nids++])) return 1;
+	    break;
+	case SHALL_LOG_REGION :
+	case SHALL_LOG_HASH :
+	case SHALL_LOG_DATA :
+	    ptr += offsetof(struct shall_devregion, fileid);
+	    if (! get_number(ptr, end, &ids[nids++])) return 1;
+	    break;
+	case SHALL_LOG_CLONE :
+	    if (! get_number(ptr + offsetof(struct shall_devclone, src_fileid),
+			     end, &ids[nids++]))
+		return 1;
+	    if (! get_number(ptr + offsetof(struct shall_devclone, dst_fileid),
+			     end, &ids[nids++]))
+		return 1;
+	    break;
+    }
+    if (nids == 0) return 1;
+    for (n = 0; n < nids; n++)
+	if (find_fileid(ef, ids[n]) >= 0)
+	    break;
+    if (n >= nids) return 0;
+    if (operation == SHALL_CLOSE) forget_fileid(ef, ids[n]);
+    return 1;
+}
+
+int shall_event_filter_match(shall_event_filter_t * ef, const char * buffer,
+			     size_t len, int * length)
+{
+    struct shall_devheader dh;
+    const char * ptr, * end;
+    unsigned int next_header;
+    int operation, opcode, flags, wanted = 1;
+    if (len < sizeof(dh)) return 1;
+    memcpy(&dh, buffer, sizeof(dh));
+    if (shall_checksum_log(&dh) != le32toh(dh.checksum)) return 1;
+    next_header = le32toh(dh.next_header);
+    if (next_header < sizeof(dh) || next_header > len) return 1;
+    /* events logged before the operation have negative opcodes */
+    operation = (int)le32toh(dh.operation);
+    opcode = operation < 0 ? -operation : operation;
+    flags = le32toh(dh.flags);
+    ptr = buffer + sizeof(dh);
+    end = buffer + next_header;
+    if (ef->flags & SHALL_FILTER_TIME) {
+	int64_t sec = le64toh(dh.req_sec);
+	if (sec < ef->since || sec >= ef->until) wanted = 0;
+    }
+    if (ef->flags & SHALL_FILTER_OPERATION) {
+	if (opcode >= 64 || ! (ef->operations & (1ULL << opcode)))
+	    wanted = 0;
+    }
+    if (flags & SHALL_LOG_CREDS) {
+	struct shall_devcreds dc;
+	if (end - ptr < (ssize_t)sizeof(dc)) return 1;
+	if (ef->flags & SHALL_FILTER_UID) {
+	    memcpy(&dc, ptr, sizeof(dc));
+	    if (le64toh(dc.uid) != ef->uid) wanted = 0;
+	}
+	ptr += sizeof(dc);
+    } else if (ef->flags & SHALL_FILTER_UID) {
+	wanted = 0;
+    }
+    if (ef->flags & SHALL_FILTER_PREFIX) {
+	int ok = check_prefix(ef, operation, flags, ptr, end);
+	if (ok < 0) return -1;
+	wanted = wanted && ok;
+    }
+    *length = next_header;
+    return wanted;
+}
@@ -0,0 +1,82 @@
+/* shallfs-filter.h
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ *
+ * this file is part of SHALLFS
+ *
+ * Copyright (c) 2017-2019 Claudio Calvelli <shallfs@gladserv.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 2 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program (see the file COPYING in the distribution).
+ * If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef _SHALL_FILTER_H_
+#define _SHALL_FILTER_H_
+
+#include <stdint.h>
+#include <sys/types.h>
+#include "shallfs-event.h"
+#include <shallfs/ioctl.h>
+
+/* select events using the same tests as the kernel uses for plog readers
+ * (see struct shall_filter and docs/control), plus a time window; the
+ * tests only look at the raw event, without decoding it, so events can
+ * be skipped before doing any work on them */
+
+typedef struct shall_event_filter_s shall_event_filter_t;
+
+/* in addition to the SHALL_FILTER_* flags */
+#define SHALL_FILTER_TIME 0x10000
+
+shall_event_filter_t * shall_event_filter_new(void);
+void shall_event_filter_free(shall_event_filter_t *);
+
+/* accept only the operations in a comma-separated list of names (as
+ * printed by readshallfs, case is ignored) or numbers; returns 1 if OK,
+ * 0 with errno set to EINVAL if the list contains an unknown operation */
+int shall_event_filter_operations(shall_event_filter_t *, const char *);
+
+/* accept only events with the given real UID */
+void shall_event_filter_uid(shall_event_filter_t *, uint64_t uid);
+
+/* accept only events with a file name starting with the prefix, or with
+ * a file ID which was opened with such a name and not closed yet (renames
+ * don't change this, as in the kernel); events without names or file IDs
+ * always pass this test; returns 1 if OK, 0 with errno set to
+ * ENAMETOOLONG if the prefix is too long */
+int shall_event_filter_prefix(shall_event_filter_t *, const char *);
+
+/* accept only events with a request time "since" <= time < "until" */
+void shall_event_filter_time(shall_event_filter_t *,
+			     int64_t since, int64_t until);
+
+/* the tests the kernel can do for a plog reader; the program still needs
+ * to apply the filter to the events it receives, for the time window */
+void shall_event_filter_kernel(const shall_event_filter_t *,
+			       struct shall_filter *);
+
+/* check if the result depends on earlier events (because of file IDs),
+ * in which case all events must be passed to shall_event_filter_match in
+ * order; otherwise it can be called from several threads at once */
+int shall_event_filter_stateful(const shall_event_filter_t *);
+
+/* check the event at the start of a buffer: returns 1 if it matches and
+ * 0 if not, storing the event length; returns 1 without storing the
+ * length if the buffer does not contain a complete valid event header, so
+ * that the decoder can report the problem; returns -1 with errno set on
+ * error (out of memory) */
+int shall_event_filter_match(shall_event_filter_t *, const char * buffer,
+			     size_t len, int * length);
+
+#endif /* _SHALL_FILTER_H_ */
@@ -0,0 +1,442 @@
+/* output events as JSON Lines or binary records; used by readshallfs
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ *
+ * this file is part of SHALLFS
+ *
+ * Copyright (c) 2017-2019 Claudio Calvelli <shallfs@gladserv.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 2 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program (see the file COPYING in the distribution).
+ * If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <endian.h>
+#include <unistd.h>
+#include "shallfs-format.h"
+#include <shallfs/operation.h>
+#include <shallfs/device.h>
+
+int shall_outbuf_init(shall_outbuf_t * ob, int fd, size_t size) {
+    if (size < 1) size = SHALL_OUTBUF_SIZE;
+    ob->data = malloc(size);
+    if (! ob->data) return 0;
+    ob->len = 0;
+    ob->size = size;
+    ob->fd = fd;
+    return 1;
+}
+
+int shall_outbuf_flush(shall_outbuf_t * ob) {
+    size_t done = 0;
+    while (done < ob->len) {
+	ssize_t nw = write(ob->fd, ob->data + done, ob->len - done);
+	if (nw < 0) {
+	    if (errno == EINTR) continue;
+	    /* keep what we haven't written, the caller may retry */
+	    memmove(ob->data, ob->data + done, ob->len - done);
+	    ob->len -= done;
+	    return 0;
+	}
+	done += nw;
+    }
+    ob->len = 0;
+    return 1;
+}
+
+void shall_outbuf_free(shall_outbuf_t * ob) {
+    free(ob->data);
+    ob->data = NULL;
+    ob->len = ob->size = 0;
+}
+
+char * __shall_outbuf_reserve(shall_outbuf_t * ob, size_t len) {
+    if (ob->fd >= 0) {
+	if (! shall_outbuf_flush(ob)) return NULL;
+	if (ob->size >= len) return ob->data;
+    }
+    if (ob->size - ob->len < len) {
+	size_t ns = ob->size * 2;
+	char * nd;
+	if (ns < ob->len + len) ns = ob->len + len;
+	nd = realloc(ob->data, ns);
+	if (! nd) return NULL;
+	ob->data = nd;
+	ob->size = ns;
+    }
+    return ob->data + ob->len;
+}
+
+/* two decimal digits for each number 0 to 99 */
+static const char digits[201] =
+    "00010203040506070809101112131415161718192021222324"
+    "25262728293031323334353637383940414243444546474849"
+    "50515253545556575859606162636465666768697071727374"
+    "75767778798081828384858687888990919293949596979899";
+
+static const char hexdigits[] = "0123456789abcdef";
+
+#define put_lit(p, s) (memcpy((p), (s), sizeof(s) - 1), (p) + sizeof(s) - 1)
+
+static inline char * put_2digits(char * p, unsigned int v) {
+    memcpy(p, digits + 2 * v, 2);
+    return p + 2;
+}
+
+static char * put_u64(char * p, uint64_t v) {
+    char tmp[20], * t = tmp + sizeof(tmp);
+    while (v >= 100) {
+	t -= 2;
+	memcpy(t, digits + 2 * (v % 100), 2);
+	v /= 100;
+    }
+    if (v >= 10) {
+	t -= 2;
+	memcpy(t, digits + 2 * v, 2);
+    } else {
+	*--t = '0' + v;
+    }
+    memcpy(p, t, tmp + sizeof(tmp) - t);
+    return p + (tmp + sizeof(tmp) - t);
+}
+
+static inline char * put_i64(char * p, int64_t v) {
+    if (v >= 0) return put_u64(p, v);
+    *p++ = '-';
+    return put_u64(p, -(uint64_t)v);
+}
+
+/* ISO 8601 time in UTC, with nanoseconds; this is called for every event,
+ * so we convert the date ourselves rather than calling gmtime_r and
+ * strftime (the algorithm is Howard Hinnant's civil_from_days) */
+static char * put_time(char * p, int64_t sec, int nsec) {
+    int64_t days = sec / 86400, rem = sec % 86400, era, year;
+    unsigned int doe, yoe, doy, mp, month, day;
+    if (rem < 0) {
+	rem += 86400;
+	days--;
+    }
+    days += 719468;
+    era = (days >= 0 ? days : days - 146096) / 146097;
+    doe = days - era * 146097;
+    yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+    doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+    mp = (5 * doy + 2) / 153;
+    day = doy - (153 * mp + 2) / 5 + 1;
+    month = mp < 10 ? mp + 3 : mp - 9;
+    year = yoe + era * 400 + (month <= 2);
+    *p++ = '"';
+    if (year >= 0 && year < 10000) {
+	p = put_2digits(p, year / 100);
+	p = put_2digits(p, year % 100);
+    } else {
+	p = put_i64(p, year);
+    }
+    *p++ = '-';
+    p = put_2digits(p, month);
+    *p++ = '-';
+    p = put_2digits(p, day);
+    *p++ = 'T';
+    p = put_2digits(p, rem / 3600);
+    *p++ = ':';
+    p = put_2digits(p, (rem / 60) % 60);
+    *p++ = ':';
+    p = put_2digits(p, rem % 60);
+    *p++ = '.';
+    if (nsec < 0 || nsec > 999999999) nsec = 0;
+    p = put_2digits(p, nsec / 10000000);
+    p = put_2digits(p, (nsec / 100000) % 100);
+    p = put_2digits(p, (nsec / 1000) % 100);
+    p = put_2digits(p, (nsec / 10) % 100);
+    *p++ = '0' + nsec % 10;
+    return put_lit(p, "Z\"");
+}
+
+/* a JSON string; file names are just bytes, so anything which isn't
+ * printable ASCII is written as \u00XX, which keeps the output valid
+ * and lets the reader recover the original bytes; needs 6 * len + 2 */
+static char * put_string(char * p, const char * s, int len) {
+    int n;
+    *p++ = '"';
+    for (n = 0; n < len; n++) {
+	unsigned char c = s[n];
+	if (c == '"' || c == '\\') {
+	    *p++ = '\\';
+	    *p++ = c;
+	} else if (c >= 0x20 && c < 0x7f) {
+	    *p++ = c;
+	} else {
+	    p = put_lit(p, "\\u00");
+	    *p++ = hexdigits[c >> 4];
+	    *p++ = hexdigits[c & 15];
+	}
+    }
+    *p++ = '"';
+    return p;
+}
+
+/* binary data as a hex string; needs 2 * len + 2 */
+static char * put_hex(char * p, const unsigned char * data, size_t len) {
+    size_t n;
+    *p++ = '"';
+    for (n = 0; n < len; n++) {
+	*p++ = hexdigits[data[n] >> 4];
+	*p++ = hexdigits[data[n] & 15];
+    }
+    *p++ = '"';
+    return p;
+}
+
+#define put_field(p, name, value) \
+    put_i64(put_lit((p), ",\"" name "\":"), (value))
+
+static char * put_region(char * p, const shall_event_region_t * er) {
+    p = put_field(p, "fileid", er->fileid);
+    p = put_field(p, "start", er->start);
+    return put_field(p, "length", er->length);
+}
+
+static char * put_attr(char * p, const shall_event_attr_t * da) {
+    int flags = da->flags;
+    p = put_lit(p, ",\"attr\":{\"flags\":");
+    p = put_i64(p, flags);
+    if (flags & shall_attr_mode)
+	p = put_field(p, "mode", da->mode);
+    if (flags & shall_attr_user)
+	p = put_field(p, "uid", da->user);
+    if (flags & shall_attr_group)
+	p = put_field(p, "gid", da->group);
+    if (flags & shall_attr_size) {
+	p = put_field(p, "size", da->size);
+    } else if (flags & (shall_attr_block | shall_attr_char)) {
+	uint64_t num = da->size;
+	if (flags & shall_attr_block)
+	    p = put_lit(p, ",\"bdev\":[");
+	else
+	    p = put_lit(p, ",\"cdev\":[");
+	p = put_u64(p, num >> 32);
+	*p++ = ',';
+	p = put_u64(p, num & 0xffffffff);
+	*p++ = ']';
+    }
+    if (flags & shall_attr_atime)
+	p = put_time(put_lit(p, ",\"atime\":"), da->atime_sec, da->atime_nsec);
+    if (flags & shall_attr_mtime)
+	p = put_time(put_lit(p, ",\"mtime\":"), da->mtime_sec, da->mtime_nsec);
+    *p++ = '}';
+    return p;
+}
+
+static char * put_acl(char * p, const shall_event_acl_t * acl) {
+    int n;
+    p = put_lit(p, ",\"acl\":{\"type\":");
+    if (acl->access)
+	p = put_lit(p, "\"access\"");
+    else
+	p = put_lit(p, "\"default\"");
+    p = put_field(p, "user", acl->perm & shall_acl_what);
+    p = put_field(p, "group", (acl->perm >> 7) & shall_acl_what);
+    p = put_field(p, "other", (acl->perm >> 14) & shall_acl_what);
+    p = put_field(p, "mask", (acl->perm >> 21) & shall_acl_what);
+    p = put_lit(p, ",\"entries\":[");
+    for (n = 0; n < acl->count; n++) {
+	int perm, is_group, id;
+	id = shall_event_acl_entry(acl, n, &perm, &is_group);
+	if (n) *p++ = ',';
+	if (is_group)
+	    p = put_lit(p, "{\"group\":");
+	else
+	    p = put_lit(p, "{\"user\":");
+	p = put_i64(p, id);
+	p = put_field(p, "perm", perm & shall_acl_what);
+	*p++ = '}';
+    }
+    return put_lit(p, "]}");
+}
+
+int shall_format_json(shall_outbuf_t * ob, off_t where,
+		      const shall_event_t * ev)
+{
+    size_t need = 1024;
+    char * p, * start;
+    int n;
+    for (n = 0; n < ev->num_names; n++)
+	need += 6 * ev->namelen[n] + 4;
+    if (ev->data_type == SHALL_LOG_DATA)
+	need += 2 * ev->u.region.length;
+    else if (ev->data_type == SHALL_LOG_XATTR)
+	need += 6 * ev->u.xattr.namelen + 2 * ev->u.xattr.valuelen;
+    else if (ev->data_type == SHALL_LOG_ACL)
+	need += 64 * ev->u.acl.count;
+    p = start = shall_outbuf_reserve(ob, need);
+    if (! p) return 0;
+    p = put_i64(put_lit(p, "{\"pos\":"), where);
+    p = put_field(p, "len", ev->length);
+    p = put_time(put_lit(p, ",\"time\":"), ev->req_sec, ev->req_nsec);
+    p = put_field(p, "sec", ev->req_sec);
+    p = put_field(p, "nsec", ev->req_nsec);
+    p = put_lit(p, ",\"op\":");
+    if (ev->operation) {
+	const char * name = shall_event_opname(ev->operation);
+	p = put_string(p, name, strlen(name));
+    } else {
+	p = put_lit(p, "\"DEBUG\"");
+    }
+    p = put_field(p, "opcode", ev->operation);
+    if (ev->before)
+	p = put_lit(p, ",\"before\":true");
+    else
+	p = put_lit(p, ",\"before\":false");
+    p = put_field(p, "result", ev->result);
+    if (ev->has_creds) {
+	p = put_u64(put_lit(p, ",\"creds\":{\"uid\":"), ev->creds.uid);
+	p = put_u64(put_lit(p, ",\"euid\":"), ev->creds.euid);
+	p = put_u64(put_lit(p, ",\"fsuid\":"), ev->creds.fsuid);
+	p = put_u64(put_lit(p, ",\"gid\":"), ev->creds.gid);
+	p = put_u64(put_lit(p, ",\"egid\":"), ev->creds.egid);
+	p = put_u64(put_lit(p, ",\"fsgid\":"), ev->creds.fsgid);
+	*p++ = '}';
+    }
+    if (ev->num_names > 0) {
+	p = put_lit(p, ",\"names\":[");
+	for (n = 0; n < ev->num_names; n++) {
+	    if (n) *p++ = ',';
+	    p = put_string(p, ev->name[n], ev->namelen[n]);
+	}
+	*p++ = ']';
+    }
+    switch (ev->data_type) {
+	case SHALL_LOG_FILEID :
+	    p = put_field(p, "fileid", ev->u.fileid);
+	    break;
+	case SHALL_LOG_SIZE :
+	    p = put_field(p, "size", ev->u.size);
+	    break;
+	case SHALL_LOG_REGION :
+	    p = put_region(p, &ev->u.region);
+	    break;
+	case SHALL_LOG_HASH :
+	    p = put_region(p, &ev->u.region);
+	    p = put_lit(p, ",\"hash\":");
+	    p = put_hex(p, ev->u.region.hash, SHALL_HASH_LENGTH);
+	    break;
+	case SHALL_LOG_DATA :
+	    p = put_region(p, &ev->u.region);
+	    p = put_lit(p, ",\"data\":");
+	    p = put_hex(p, ev->u.region.data, ev->u.region.length);
+	    break;
+	case SHALL_LOG_CLONE : {
+	    const shall_event_clone_t * ek = &ev->u.clone;
+	    p = put_field(p, "fileid", ek->src_fileid);
+	    p = put_field(p, "start", ek->src_start);
+	    p = put_field(p, "length", ek->length);
+	    p = put_field(p, "dst_fileid", ek->dst_fileid);
+	    p = put_field(p, "dst_start", ek->dst_start);
+	    break;
+	}
+	case SHALL_LOG_ATTR :
+	    p = put_attr(p, &ev->u.attr);
+	    break;
+	case SHALL_LOG_ACL :
+	    p = put_acl(p, &ev->u.acl);
+	    break;
+	case SHALL_LOG_XATTR : {
+	    const shall_event_xattr_t * ex = &ev->u.xattr;
+	    p = put_lit(p, ",\"xattr\":{\"name\":");
+	    p = put_string(p, ex->name, ex->namelen);
+	    p = put_field(p, "flags", ex->flags);
+	    p = put_lit(p, ",\"value\":");
+	    p = put_hex(p, ex->value, ex->valuelen);
+	    *p++ = '}';
+	    break;
+	}
+    }
+    p = put_lit(p, "}\n");
+    ob->len += p - start;
+    return 1;
+}
+
+int shall_format_record(shall_outbuf_t * ob, const shall_event_t * ev) {
+    struct shall_record rec;
+    size_t len = sizeof(rec);
+    char * p, * start;
+    int n;
+    for (n = 0; n < ev->num_names; n++)
+	len += ev->namelen[n];
+    len = (len + 7) & ~(size_t)7;
+    p = start = shall_outbuf_reserve(ob, len);
+    if (! p) return 0;
+    memset(&rec, 0, sizeof(rec));
+    rec.length = htole32(len);
+    rec.operation = htole32(ev->before ? -ev->operation : ev->operation);
+    rec.result = htole32(ev->result);
+    rec.flags = htole32(ev->flags);
+    rec.req_sec = htole64(ev->req_sec);
+    rec.req_nsec = htole32(ev->req_nsec);
+    for (n = 0; n < ev->num_names; n++)
+	rec.namelen[n] = htole32(ev->namelen[n]);
+    if (ev->has_creds) {
+	rec.uid = htole64(ev->creds.uid);
+	rec.euid = htole64(ev->creds.euid);
+	rec.fsuid = htole64(ev->creds.fsuid);
+	rec.gid = htole64(ev->creds.gid);
+	rec.egid = htole64(ev->creds.egid);
+	rec.fsgid = htole64(ev->creds.fsgid);
+    }
+    switch (ev->data_type) {
+	case SHALL_LOG_FILEID :
+	    rec.fileid = htole32(ev->u.fileid);
+	    break;
+	case SHALL_LOG_SIZE :
+	    rec.size = htole64(ev->u.size);
+	    break;
+	case SHALL_LOG_REGION :
+	case SHALL_LOG_HASH :
+	case SHALL_LOG_DATA :
+	    rec.fileid = htole32(ev->u.region.fileid);
+	    rec.start = htole64(ev->u.region.start);
+	    rec.size = htole64(ev->u.region.length);
+	    break;
+	case SHALL_LOG_CLONE :
+	    rec.fileid = htole32(ev->u.clone.src_fileid);
+	    rec.start = htole64(ev->u.clone.src_start);
+	    rec.size = htole64(ev->u.clone.length);
+	    rec.dst_fileid = htole32(ev->u.clone.dst_fileid);
+	    rec.dst_start = htole64(ev->u.clone.dst_start);
+	    break;
+	case SHALL_LOG_ATTR :
+	    rec.attr_flags = htole32(ev->u.attr.flags);
+	    rec.mode = htole32(ev->u.attr.mode);
+	    rec.user = htole32(ev->u.attr.user);
+	    rec.group = htole32(ev->u.attr.group);
+	    rec.size = htole64(ev->u.attr.size);
+	    rec.atime_sec = htole64(ev->u.attr.atime_sec);
+	    rec.atime_nsec = htole32(ev->u.attr.atime_nsec);
+	    rec.mtime_sec = htole64(ev->u.attr.mtime_sec);
+	    rec.mtime_nsec = htole32(ev->u.attr.mtime_nsec);
+	    break;
+    }
+    memcpy(p, &rec, sizeof(rec));
+    p += sizeof(rec);
+    for (n = 0; n < ev->num_names; n++) {
+	memcpy(p, ev->name[n], ev->namelen[n]);
+	p += ev->namelen[n];
+    }
+    memset(p, 0, start + len - p);
+    ob->len += len;
+    return 1;
+}
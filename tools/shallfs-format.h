@@ -0,0 +1,119 @@
+/* shallfs-format.h
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ *
+ * this file is part of SHALLFS
+ *
+ * Copyright (c) 2017-2019 Claudio Calvelli <shallfs@gladserv.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 2 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program (see the file COPYING in the distribution).
+ * If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef _SHALL_FORMAT_H_
+#define _SHALL_FORMAT_H_
+
+#include <stdint.h>
+#include <string.h>
+#include <sys/types.h>
+#include "shallfs-event.h"
+
+/* output events in formats meant for other programs rather than people:
+ * JSON Lines, one object per event, or fixed-size binary records; the
+ * formatters write into a large buffer which is written out with a single
+ * system call when full, or which grows in memory if there is no file
+ * descriptor to write to */
+
+typedef struct {
+    char * data;
+    size_t len;
+    size_t size;
+    int fd;				/* -1 to grow in memory */
+} shall_outbuf_t;
+
+/* default buffer size */
+#define SHALL_OUTBUF_SIZE 1048576
+
+/* initialise a buffer; returns 1 if OK, 0 with errno set on error */
+int shall_outbuf_init(shall_outbuf_t *, int fd, size_t size);
+
+/* write all data in the buffer to its file descriptor; returns 1 if OK,
+ * 0 with errno set on error */
+int shall_outbuf_flush(shall_outbuf_t *);
+
+/* free the buffer without writing anything */
+void shall_outbuf_free(shall_outbuf_t *);
+
+/* make space for "len" more bytes, writing out the buffer or growing it as
+ * needed; returns a pointer to the space, or NULL with errno set */
+char * __shall_outbuf_reserve(shall_outbuf_t *, size_t len);
+
+static inline char * shall_outbuf_reserve(shall_outbuf_t * ob, size_t len) {
+    if (ob->size - ob->len >= len) return ob->data + ob->len;
+    return __shall_outbuf_reserve(ob, len);
+}
+
+static inline int shall_outbuf_append(shall_outbuf_t * ob,
+				      const void * data, size_t len)
+{
+    char * ptr = shall_outbuf_reserve(ob, len);
+    if (! ptr) return 0;
+    memcpy(ptr, data, len);
+    ob->len += len;
+    return 1;
+}
+
+/* append one event as a line of JSON; "where" is the event's position in
+ * the journal; returns 1 if OK, 0 with errno set on error */
+int shall_format_json(shall_outbuf_t *, off_t where, const shall_event_t *);
+
+/* fixed-size binary record, little-endian, followed by the file names
+ * (not NUL-terminated) and padded to a multiple of 8 bytes; the fields
+ * which are not used by an event's data type are 0; ACLs, extended
+ * attribute values and data are not included */
+struct shall_record {
+    uint32_t length;			/*   0: including names, padding */
+    int32_t operation;			/*   4: negative if "before" */
+    int32_t result;			/*   8 */
+    uint32_t flags;			/*  12: enum shall_log_flags */
+    int64_t req_sec;			/*  16 */
+    uint32_t req_nsec;			/*  24 */
+    uint32_t namelen[2];		/*  28 */
+    int32_t fileid;			/*  36: CLONE: source */
+    uint64_t uid;			/*  40 */
+    uint64_t euid;			/*  48 */
+    uint64_t fsuid;			/*  56 */
+    uint64_t gid;			/*  64 */
+    uint64_t egid;			/*  72 */
+    uint64_t fsgid;			/*  80 */
+    int64_t start;			/*  88: region or clone source */
+    int64_t size;			/*  96: length, SIZE, ATTR size/dev */
+    int64_t dst_start;			/* 104: CLONE */
+    int32_t dst_fileid;			/* 112: CLONE */
+    uint32_t attr_flags;		/* 116: enum shall_attr_flags */
+    uint32_t mode;			/* 120 */
+    uint32_t user;			/* 124 */
+    uint32_t group;			/* 128 */
+    uint32_t atime_nsec;		/* 132 */
+    int64_t atime_sec;			/* 136 */
+    int64_t mtime_sec;			/* 144 */
+    uint32_t mtime_nsec;		/* 152 */
+    uint32_t reserved;			/* 156 */
+} __attribute__((packed));
+
+/* append one event as a binary record; returns 1 if OK, 0 with errno set
+ * on error */
+int shall_format_record(shall_outbuf_t *, const shall_event_t *);
+
+#endif /* _SHALL_FORMAT_H_ */
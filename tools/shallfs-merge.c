@@ -0,0 +1,251 @@
+/* merge events from several journals or saved files in time order; used by
+ * readshallfs
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ *
+ * this file is part of SHALLFS
+ *
+ * Copyright (c) 2017-2019 Claudio Calvelli <shallfs@gladserv.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 2 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program (see the file COPYING in the distribution).
+ * If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include "shallfs-common.h"
+#include "shallfs-event.h"
+#include "shallfs-reader.h"
+#include "shallfs-merge.h"
+
+/* how far ahead of the events being merged we ask the kernel to read */
+#define READ_AHEAD (4 * 1048576)
+
+/* how much we return at a time, unless an event is bigger */
+#define MERGE_BUFFER 1048576
+
+typedef struct {
+    const char * name;
+    int index;
+    int fd;
+    /* for files */
+    const char * map;
+    size_t maplen;
+    size_t advised;			/* read ahead up to here */
+    /* for devices */
+    shall_sb_data_t sb;
+    shall_devreader_t * reader;
+    /* the current span: the whole map, or what the reader returned */
+    const char * span;
+    size_t len;
+    size_t pos;				/* after the head event */
+    shall_event_t head;			/* next event from this input */
+} input_t;
+
+struct shall_merge_s {
+    int count;
+    input_t * inputs;
+    input_t ** heap;			/* inputs with a head event */
+    int nheap;
+    char * buffer;
+    size_t size;
+};
+
+/* the order of events: by time, then by input */
+static inline int before(const input_t * a, const input_t * b) {
+    if (a->head.req_sec != b->head.req_sec)
+	return a->head.req_sec < b->head.req_sec;
+    if (a->head.req_nsec != b->head.req_nsec)
+	return a->head.req_nsec < b->head.req_nsec;
+    return a->index < b->index;
+}
+
+static void sift_down(shall_merge_t * m, int n) {
+    while (1) {
+	int c = 2 * n + 1;
+	input_t * t;
+	if (c >= m->nheap) return;
+	if (c + 1 < m->nheap && before(m->heap[c + 1], m->heap[c])) c++;
+	if (! before(m->heap[c], m->heap[n])) return;
+	t = m->heap[c];
+	m->heap[c] = m->heap[n];
+	m->heap[n] = t;
+	n = c;
+    }
+}
+
+static void sift_up(shall_merge_t * m, int n) {
+    while (n > 0) {
+	int p = (n - 1) / 2;
+	input_t * t;
+	if (! before(m->heap[n], m->heap[p])) return;
+	t = m->heap[p];
+	m->heap[p] = m->heap[n];
+	m->heap[n] = t;
+	n = p;
+    }
+}
+
+/* ask the kernel to read the next part of a mapped file */
+static void read_ahead(input_t * in) {
+    size_t len;
+    if (in->pos + READ_AHEAD / 2 < in->advised) return;
+    if (in->advised >= in->maplen) return;
+    len = in->maplen - in->advised;
+    if (len > READ_AHEAD) len = READ_AHEAD;
+    madvise((void *)(in->map + in->advised), len, MADV_WILLNEED);
+    in->advised += len;
+}
+
+/* decode the next event from an input; returns 1 if there is one, 0 at
+ * the end, -1 on error */
+static int next_head(input_t * in) {
+    while (1) {
+	int len;
+	if (in->pos >= in->len) {
+	    ssize_t nr;
+	    if (! in->reader) return 0;
+	    nr = shall_devreader_next(in->reader, &in->span);
+	    if (nr <= 0) return nr;
+	    in->len = nr;
+	    in->pos = 0;
+	}
+	len = shall_event_decode(in->span + in->pos, in->len - in->pos,
+				 &in->head);
+	if (len <= 0) {
+	    /* an incomplete event at the end of a file is an error, as
+	     * it is when reading a single file */
+	    errno = EINVAL;
+	    return -1;
+	}
+	in->pos += len;
+	if (in->map) read_ahead(in);
+	return 1;
+    }
+}
+
+static int open_input(input_t * in, int verbose) {
+    struct stat st;
+    if (stat(in->name, &st) < 0) return 0;
+    if (S_ISBLK(st.st_mode)) {
+	in->fd = shall_open_device(in->name, 1, &in->sb);
+	if (in->fd < 0) return 0;
+	in->reader = shall_devreader_open(in->fd, &in->sb, 0, verbose);
+	return in->reader != NULL;
+    }
+    in->fd = open(in->name, O_RDONLY);
+    if (in->fd < 0) return 0;
+    in->map = shall_event_map(in->fd, &in->maplen);
+    if (! in->map) return 0;
+    in->span = in->map;
+    in->len = in->maplen;
+    read_ahead(in);
+    return 1;
+}
+
+static void close_input(input_t * in) {
+    if (in->reader) shall_devreader_close(in->reader);
+    if (in->map) shall_event_unmap(in->map, in->maplen);
+    if (in->fd >= 0) close(in->fd);
+}
+
+shall_merge_t * shall_merge_open(const char * const * names, int count,
+				 int verbose, const char ** failed)
+{
+    shall_merge_t * m = calloc(1, sizeof(*m));
+    int n, sve;
+    if (! m) return NULL;
+    m->inputs = calloc(count, sizeof(input_t));
+    m->heap = calloc(count, sizeof(input_t *));
+    m->size = MERGE_BUFFER;
+    m->buffer = malloc(m->size);
+    if (! m->inputs || ! m->heap || ! m->buffer) goto error;
+    for (n = 0; n < count; n++)
+	m->inputs[n].fd = -1;
+    for (m->count = 0; m->count < count; m->count++) {
+	input_t * in = &m->inputs[m->count];
+	int ok;
+	in->name = names[m->count];
+	in->index = m->count;
+	if (failed) *failed = in->name;
+	if (! open_input(in, verbose)) {
+	    m->count++;
+	    goto error;
+	}
+	ok = next_head(in);
+	if (ok < 0) {
+	    m->count++;
+	    goto error;
+	}
+	if (ok) {
+	    m->heap[m->nheap++] = in;
+	    sift_up(m, m->nheap - 1);
+	}
+    }
+    return m;
+error:
+    sve = errno;
+    shall_merge_close(m);
+    errno = sve;
+    return NULL;
+}
+
+ssize_t shall_merge_next(shall_merge_t * m, const char ** span,
+			 const char ** failed)
+{
+    size_t done = 0;
+    while (m->nheap > 0) {
+	input_t * in = m->heap[0];
+	size_t len = in->head.length;
+	int ok;
+	if (done + len > m->size) {
+	    char * nb;
+	    /* return what we have, unless this one event doesn't fit */
+	    if (done > 0) break;
+	    nb = realloc(m->buffer, len);
+	    if (! nb) return -1;
+	    m->buffer = nb;
+	    m->size = len;
+	}
+	memcpy(m->buffer + done, in->head.raw, len);
+	done += len;
+	ok = next_head(in);
+	if (ok < 0) {
+	    if (failed) *failed = in->name;
+	    return -1;
+	}
+	if (! ok) m->heap[0] = m->heap[--m->nheap];
+	sift_down(m, 0);
+    }
+    *span = m->buffer;
+    return done;
+}
+
+void shall_merge_close(shall_merge_t * m) {
+    int n;
+    for (n = 0; n < m->count; n++)
+	close_input(&m->inputs[n]);
+    free(m->inputs);
+    free(m->heap);
+    free(m->buffer);
+    free(m);
+}
@@ -0,0 +1,53 @@
+/* shallfs-merge.h
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ *
+ * this file is part of SHALLFS
+ *
+ * Copyright (c) 2017-2019 Claudio Calvelli <shallfs@gladserv.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 2 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program (see the file COPYING in the distribution).
+ * If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef _SHALL_MERGE_H_
+#define _SHALL_MERGE_H_
+
+#include <sys/types.h>
+
+/* read events from several inputs, each of which is a file produced by
+ * readshallfs or an unmounted device, and return them as a single stream
+ * in order of request time; events logged at the same time are returned
+ * in the order they appear in each input, and in the order the inputs
+ * were given if they come from different inputs; files are mapped in
+ * memory and the kernel is asked to read ahead of the events being
+ * merged, devices are read with a shall_devreader_t */
+
+typedef struct shall_merge_s shall_merge_t;
+
+/* open all inputs; returns NULL with errno set on error, in which case
+ * "failed", if not NULL, is set to the name of the input which caused it */
+shall_merge_t * shall_merge_open(const char * const * names, int count,
+				 int verbose, const char ** failed);
+
+/* get the next span of complete events, copied to a buffer inside the
+ * merge; returns its length, 0 at the end of all inputs, or -1 with
+ * errno set on error (and "failed" set as above); the span is valid
+ * until the next call */
+ssize_t shall_merge_next(shall_merge_t *, const char **, const char ** failed);
+
+/* close all inputs and free all resources */
+void shall_merge_close(shall_merge_t *);
+
+#endif /* _SHALL_MERGE_H_ */
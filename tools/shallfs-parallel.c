@@ -0,0 +1,155 @@
+/* run jobs on several threads, with results collected in order; used by
+ * readshallfs
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ *
+ * this file is part of SHALLFS
+ *
+ * Copyright (c) 2017-2019 Claudio Calvelli <shallfs@gladserv.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 2 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program (see the file COPYING in the distribution).
+ * If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <errno.h>
+#include <pthread.h>
+#include "shallfs-parallel.h"
+
+struct shall_parallel_s {
+    shall_parallel_work_t work;
+    void * arg;
+    int threads;			/* threads actually started */
+    int queue;
+    void ** jobs;			/* ring of "queue" jobs */
+    char * done;
+    pthread_t * thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    /* the following are protected by "lock" */
+    long submitted;
+    long taken;				/* jobs given to a thread */
+    int stop;
+    /* this is only used by the caller's thread */
+    long collected;
+};
+
+static void * worker_thread(void * _sp) {
+    shall_parallel_t * sp = _sp;
+    pthread_mutex_lock(&sp->lock);
+    while (1) {
+	void * job;
+	int slot;
+	while (! sp->stop && sp->taken >= sp->submitted)
+	    pthread_cond_wait(&sp->cond, &sp->lock);
+	if (sp->taken >= sp->submitted) break;
+	slot = sp->taken++ % sp->queue;
+	job = sp->jobs[slot];
+	pthread_mutex_unlock(&sp->lock);
+	sp->work(job, sp->arg);
+	pthread_mutex_lock(&sp->lock);
+	sp->done[slot] = 1;
+	pthread_cond_broadcast(&sp->cond);
+    }
+    pthread_mutex_unlock(&sp->lock);
+    return NULL;
+}
+
+shall_parallel_t * shall_parallel_start(int threads, int queue,
+					shall_parallel_work_t work, void * arg)
+{
+    shall_parallel_t * sp;
+    int sve;
+    if (threads < 1) threads = 1;
+    if (queue < threads) queue = threads;
+    sp = calloc(1, sizeof(*sp));
+    if (! sp) return NULL;
+    sp->work = work;
+    sp->arg = arg;
+    sp->queue = queue;
+    sp->jobs = calloc(queue, sizeof(void *));
+    sp->done = calloc(queue, 1);
+    sp->thread = calloc(threads, sizeof(pthread_t));
+    if (! sp->jobs || ! sp->done || ! sp->thread) goto error;
+    pthread_mutex_init(&sp->lock, NULL);
+    pthread_cond_init(&sp->cond, NULL);
+    while (sp->threads < threads) {
+	errno = pthread_create(&sp->thread[sp->threads], NULL,
+			       worker_thread, sp);
+	if (errno) {
+	    /* as long as we have one thread we can run, just slower */
+	    if (sp->threads > 0) break;
+	    pthread_cond_destroy(&sp->cond);
+	    pthread_mutex_destroy(&sp->lock);
+	    goto error;
+	}
+	sp->threads++;
+    }
+    return sp;
+error:
+    sve = errno;
+    free(sp->thread);
+    free(sp->done);
+    free(sp->jobs);
+    free(sp);
+    errno = sve;
+    return NULL;
+}
+
+int shall_parallel_full(const shall_parallel_t * sp) {
+    return sp->submitted - sp->collected >= sp->queue;
+}
+
+int shall_parallel_submit(shall_parallel_t * sp, void * job) {
+    if (shall_parallel_full(sp)) {
+	errno = EBUSY;
+	return 0;
+    }
+    pthread_mutex_lock(&sp->lock);
+    sp->jobs[sp->submitted % sp->queue] = job;
+    sp->submitted++;
+    pthread_cond_broadcast(&sp->cond);
+    pthread_mutex_unlock(&sp->lock);
+    return 1;
+}
+
+void * shall_parallel_next(shall_parallel_t * sp) {
+    void * job;
+    int slot;
+    if (sp->collected >= sp->submitted) return NULL;
+    slot = sp->collected % sp->queue;
+    pthread_mutex_lock(&sp->lock);
+    while (! sp->done[slot])
+	pthread_cond_wait(&sp->cond, &sp->lock);
+    sp->done[slot] = 0;
+    job = sp->jobs[slot];
+    pthread_mutex_unlock(&sp->lock);
+    sp->collected++;
+    return job;
+}
+
+void shall_parallel_stop(shall_parallel_t * sp) {
+    int n;
+    pthread_mutex_lock(&sp->lock);
+    sp->stop = 1;
+    pthread_cond_broadcast(&sp->cond);
+    pthread_mutex_unlock(&sp->lock);
+    for (n = 0; n < sp->threads; n++)
+	pthread_join(sp->thread[n], NULL);
+    pthread_cond_destroy(&sp->cond);
+    pthread_mutex_destroy(&sp->lock);
+    free(sp->thread);
+    free(sp->done);
+    free(sp->jobs);
+    free(sp);
+}
@@ -0,0 +1,56 @@
+/* shallfs-parallel.h
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ *
+ * this file is part of SHALLFS
+ *
+ * Copyright (c) 2017-2019 Claudio Calvelli <shallfs@gladserv.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 2 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program (see the file COPYING in the distribution).
+ * If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef _SHALL_PARALLEL_H_
+#define _SHALL_PARALLEL_H_
+
+/* run jobs on a number of threads and get the results back in the order
+ * the jobs were submitted; the jobs are opaque to this code, which just
+ * passes them to the "work" function; submitting jobs and collecting the
+ * results must be done from the same thread */
+
+typedef struct shall_parallel_s shall_parallel_t;
+
+typedef void (*shall_parallel_work_t)(void * job, void * arg);
+
+/* start the threads; "queue" is the max number of jobs submitted but not
+ * yet collected; returns NULL with errno set on error */
+shall_parallel_t * shall_parallel_start(int threads, int queue,
+					shall_parallel_work_t work, void * arg);
+
+/* check if there is space to submit another job */
+int shall_parallel_full(const shall_parallel_t *);
+
+/* submit a job; returns 1 if OK, 0 with errno set to EBUSY if the queue
+ * is full */
+int shall_parallel_submit(shall_parallel_t *, void * job);
+
+/* wait for the oldest job submitted to finish and return it, or return
+ * NULL if there are no jobs left to collect */
+void * shall_parallel_next(shall_parallel_t *);
+
+/* stop the threads and free all resources; jobs which have not been
+ * collected are completed but not returned */
+void shall_parallel_stop(shall_parallel_t *);
+
+#endif /* _SHALL_PARALLEL_H_ */
@@ -0,0 +1,307 @@
+/* read events from an unmounted device using a prefetch thread; used by
+ * readshallfs
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ *
+ * this file is part of SHALLFS
+ *
+ * Copyright (c) 2017-2019 Claudio Calvelli <shallfs@gladserv.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 2 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program (see the file COPYING in the distribution).
+ * If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE /* for O_DIRECT */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <endian.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include "shallfs-common.h"
+#include "shallfs-event.h"
+#include "shallfs-reader.h"
+
+#define NBUFFERS 2
+
+/* one buffer; "start" is nonzero only for the first buffer if the journal
+ * does not start at a block boundary */
+typedef struct {
+    char * data;
+    size_t start;
+    size_t fill;
+    int error;				/* errno, if the read failed */
+} devbuffer_t;
+
+struct shall_devreader_s {
+    shall_sb_data_t * sb;
+    int fd;				/* our own descriptor */
+    int verbose;
+    size_t bufsize;
+    devbuffer_t buffers[NBUFFERS];
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    /* the following are protected by "lock" */
+    long produced;			/* buffers filled by the thread */
+    long released;			/* buffers given back by consumer */
+    int stop;				/* ask the thread to stop */
+    int finished;			/* thread has read everything */
+    /* the following are only used by the consumer */
+    long consumed;			/* buffers taken by consumer */
+    devbuffer_t * current;		/* buffer being looked at */
+    size_t pos;				/* next data in current buffer */
+    char * pending;			/* event crossing two buffers */
+    size_t pending_len;
+    size_t pending_size;
+    /* the following are only used by the thread */
+    off_t where;			/* next block to read */
+    off_t remain;			/* bytes left, from "where" */
+    int next;				/* next superblock */
+};
+
+/* fill one buffer with whole blocks, skipping superblocks and wrapping
+ * around at the end of the device; returns 0 or an errno */
+static int fill_buffer(shall_devreader_t * rd, devbuffer_t * buf) {
+    const shall_sb_data_t * sb = rd->sb;
+    size_t done = 0;
+    while (done < rd->bufsize && rd->remain > 0) {
+	off_t ns = rd->next < sb->num_superblocks
+		 ? (shall_superblock_location(rd->next) - SHALL_SB_OFFSET)
+		 : sb->device_size;
+	size_t todo = ns - rd->where;
+	ssize_t nr;
+	if (todo > rd->bufsize - done) todo = rd->bufsize - done;
+	if (todo > rd->remain)
+	    todo = (rd->remain + SHALL_DEV_BLOCK - 1)
+		 & ~(off_t)(SHALL_DEV_BLOCK - 1);
+	if (rd->verbose)
+	    printf("devreader @%lld (sb=%d %lld) %ld\n",
+		   (long long)rd->where, rd->next, (long long)ns, (long)todo);
+	nr = pread(rd->fd, buf->data + done, todo, rd->where);
+	if (nr < 0) return errno;
+	if (nr == 0) return EIO;
+	done += nr;
+	rd->where += nr;
+	rd->remain -= nr;
+	if (rd->where < ns) continue;
+	rd->next++;
+	rd->where += SHALL_DEV_BLOCK;
+	if (rd->where < sb->device_size) continue;
+	rd->next = 1;
+	rd->where = SHALL_DEV_BLOCK;
+    }
+    /* the last block may contain more than we asked for */
+    if (rd->remain < 0) {
+	done += rd->remain;
+	rd->remain = 0;
+    }
+    buf->fill = done;
+    return 0;
+}
+
+static void * prefetch_thread(void * _rd) {
+    shall_devreader_t * rd = _rd;
+    while (1) {
+	devbuffer_t * buf;
+	int err;
+	pthread_mutex_lock(&rd->lock);
+	while (! rd->stop && rd->produced - rd->released >= NBUFFERS)
+	    pthread_cond_wait(&rd->cond, &rd->lock);
+	if (rd->stop || rd->remain <= 0) {
+	    rd->finished = 1;
+	    pthread_cond_broadcast(&rd->cond);
+	    pthread_mutex_unlock(&rd->lock);
+	    return NULL;
+	}
+	pthread_mutex_unlock(&rd->lock);
+	buf = &rd->buffers[rd->produced % NBUFFERS];
+	/* only the first buffer can start in the middle of a block */
+	if (rd->produced > 0) buf->start = 0;
+	err = fill_buffer(rd, buf);
+	pthread_mutex_lock(&rd->lock);
+	buf->error = err;
+	rd->produced++;
+	if (err) rd->finished = 1;
+	pthread_cond_broadcast(&rd->cond);
+	pthread_mutex_unlock(&rd->lock);
+	if (err) return NULL;
+    }
+}
+
+shall_devreader_t * shall_devreader_open(int fd, shall_sb_data_t * sb,
+					 size_t bufsize, int verbose)
+{
+    char procname[64];
+    shall_devreader_t * rd;
+    int n, sve;
+    if (bufsize < 1) bufsize = SHALL_DEVREADER_BUFFER;
+    bufsize = (bufsize + SHALL_DEV_BLOCK - 1) & ~(size_t)(SHALL_DEV_BLOCK - 1);
+    rd = calloc(1, sizeof(*rd));
+    if (! rd) return NULL;
+    rd->sb = sb;
+    rd->verbose = verbose;
+    rd->bufsize = bufsize;
+    /* we need our own descriptor for O_DIRECT, as the caller may want
+     * to use theirs for normal I/O */
+    snprintf(procname, sizeof(procname), "/proc/self/fd/%d", fd);
+    rd->fd = open(procname, O_RDONLY | O_DIRECT);
+    if (rd->fd < 0) rd->fd = dup(fd);
+    if (rd->fd < 0) goto error;
+    for (n = 0; n < NBUFFERS; n++) {
+	void * ptr;
+	errno = posix_memalign(&ptr, SHALL_DEV_BLOCK, bufsize);
+	if (errno) goto error;
+	rd->buffers[n].data = ptr;
+    }
+    /* start reading from the block containing the first event */
+    shall_locate_start(sb);
+    rd->where = sb->real_start & ~(off_t)(SHALL_DEV_BLOCK - 1);
+    rd->buffers[0].start = sb->real_start - rd->where;
+    rd->remain = sb->data_length + rd->buffers[0].start;
+    rd->next = sb->next_superblock;
+    pthread_mutex_init(&rd->lock, NULL);
+    pthread_cond_init(&rd->cond, NULL);
+    errno = pthread_create(&rd->thread, NULL, prefetch_thread, rd);
+    if (errno) {
+	pthread_cond_destroy(&rd->cond);
+	pthread_mutex_destroy(&rd->lock);
+	goto error;
+    }
+    return rd;
+error:
+    sve = errno;
+    for (n = 0; n < NBUFFERS; n++)
+	free(rd->buffers[n].data);
+    if (rd->fd >= 0) close(rd->fd);
+    free(rd);
+    errno = sve;
+    return NULL;
+}
+
+/* give the current buffer back to the thread and wait for the next one;
+ * returns 1 if there is one, 0 at end of data, -1 on error */
+static int next_buffer(shall_devreader_t * rd) {
+    pthread_mutex_lock(&rd->lock);
+    if (rd->current) {
+	rd->current = NULL;
+	rd->released++;
+	pthread_cond_broadcast(&rd->cond);
+    }
+    while (rd->consumed >= rd->produced && ! rd->finished)
+	pthread_cond_wait(&rd->cond, &rd->lock);
+    if (rd->consumed >= rd->produced) {
+	pthread_mutex_unlock(&rd->lock);
+	return 0;
+    }
+    rd->current = &rd->buffers[rd->consumed % NBUFFERS];
+    rd->consumed++;
+    pthread_mutex_unlock(&rd->lock);
+    if (rd->current->error) {
+	errno = rd->current->error;
+	return -1;
+    }
+    rd->pos = rd->current->start;
+    return 1;
+}
+
+/* move data from the current buffer to the pending event */
+static int add_pending(shall_devreader_t * rd, size_t len) {
+    if (rd->pending_len + len > rd->pending_size) {
+	size_t ns = rd->pending_len + len + SHALL_DEV_BLOCK;
+	char * np = realloc(rd->pending, ns);
+	if (! np) return 0;
+	rd->pending = np;
+	rd->pending_size = ns;
+    }
+    memcpy(rd->pending + rd->pending_len, rd->current->data + rd->pos, len);
+    rd->pending_len += len;
+    rd->pos += len;
+    return 1;
+}
+
+/* see how much more data the pending event needs: 0 means it's complete */
+static ssize_t pending_needs(const shall_devreader_t * rd) {
+    struct shall_devheader dh;
+    size_t nh;
+    if (rd->pending_len < sizeof(dh))
+	return sizeof(dh) - rd->pending_len;
+    memcpy(&dh, rd->pending, sizeof(dh));
+    if (shall_checksum_log(&dh) != le32toh(dh.checksum)) goto invalid;
+    nh = le32toh(dh.next_header);
+    if (nh < sizeof(dh)) goto invalid;
+    return nh - rd->pending_len;
+invalid:
+    errno = EINVAL;
+    return -1;
+}
+
+ssize_t shall_devreader_next(shall_devreader_t * rd, const char ** span) {
+    /* the pending event has been returned last time, if complete */
+    if (rd->pending_len > 0 && pending_needs(rd) == 0)
+	rd->pending_len = 0;
+    while (1) {
+	ssize_t avail, len;
+	if (! rd->current || rd->pos >= rd->current->fill) {
+	    int ok = next_buffer(rd);
+	    if (ok <= 0) return ok;
+	    continue;
+	}
+	avail = rd->current->fill - rd->pos;
+	if (rd->pending_len > 0) {
+	    /* complete the event started in the previous buffer; we may
+	     * need to look at the header before we know its length */
+	    len = pending_needs(rd);
+	    if (len < 0) return -1;
+	    if (len > avail) len = avail;
+	    if (! add_pending(rd, len)) return -1;
+	    len = pending_needs(rd);
+	    if (len < 0) return -1;
+	    if (len > 0) continue;
+	    *span = rd->pending;
+	    len = rd->pending_len;
+	} else {
+	    len = shall_event_scan(rd->current->data + rd->pos, avail);
+	    if (len < 0) return -1;
+	    if (len == 0) {
+		/* incomplete event at the end of the buffer */
+		if (! add_pending(rd, avail)) return -1;
+		continue;
+	    }
+	    *span = rd->current->data + rd->pos;
+	    rd->pos += len;
+	}
+	shall_advance_pointers(rd->sb, len);
+	return len;
+    }
+}
+
+void shall_devreader_close(shall_devreader_t * rd) {
+    int n;
+    pthread_mutex_lock(&rd->lock);
+    rd->stop = 1;
+    pthread_cond_broadcast(&rd->cond);
+    pthread_mutex_unlock(&rd->lock);
+    pthread_join(rd->thread, NULL);
+    pthread_cond_destroy(&rd->cond);
+    pthread_mutex_destroy(&rd->lock);
+    for (n = 0; n < NBUFFERS; n++)
+	free(rd->buffers[n].data);
+    free(rd->pending);
+    close(rd->fd);
+    free(rd);
+}
@@ -0,0 +1,57 @@
+/* shallfs-reader.h
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ *
+ * this file is part of SHALLFS
+ *
+ * Copyright (c) 2017-2019 Claudio Calvelli <shallfs@gladserv.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 2 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program (see the file COPYING in the distribution).
+ * If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _SHALL_READER_H_
+#define _SHALL_READER_H_
+
+#include <sys/types.h>
+#include "shallfs-common.h"
+
+/* read all events from an unmounted device, as fast as the device allows:
+ * a separate thread reads large blocks of the journal (with O_DIRECT if
+ * possible) into one buffer while the program looks at the events in the
+ * other, skipping the superblocks and wrapping around the end of the
+ * device; the events are returned as spans pointing inside the buffers,
+ * and only an event which crosses from one buffer to the next is copied */
+
+typedef struct shall_devreader_s shall_devreader_t;
+
+/* default size of each of the two buffers */
+#define SHALL_DEVREADER_BUFFER (4 * 1048576)
+
+/* start reading the journal described by the superblock information, which
+ * must stay valid until shall_devreader_close, and will be updated as the
+ * events are returned, like shall_read_logs does; "bufsize" is rounded
+ * up to a multiple of SHALL_DEV_BLOCK, 0 means use the default; returns
+ * NULL with errno set on error */
+shall_devreader_t * shall_devreader_open(int fd, shall_sb_data_t *,
+					 size_t bufsize, int verbose);
+
+/* get the next span of complete events; returns its length, 0 at the end
+ * of the journal, or -1 with errno set on error; the span is valid until
+ * the next call */
+ssize_t shall_devreader_next(shall_devreader_t *, const char **);
+
+/* stop reading and free all resources */
+void shall_devreader_close(shall_devreader_t *);
+
+#endif /* _SHALL_READER_H_ */
@@ -0,0 +1,297 @@
+/* output file rotation with background compression; used by readshallfs
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ *
+ * this file is part of SHALLFS
+ *
+ * Copyright (c) 2017-2019 Claudio Calvelli <shallfs@gladserv.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 2 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program (see the file COPYING in the distribution).
+ * If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdio_ext.h> /* for __fpending */
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <zlib.h>
+#include "shallfs-rotate.h"
+
+#define COMPRESS_BUFFER 262144
+
+/* a rotated file waiting to be compressed */
+typedef struct pending_s pending_t;
+struct pending_s {
+    pending_t * next;
+    char name[0];
+};
+
+struct shall_rotate_s {
+    char * name;
+    const char * pname;
+    FILE * F;
+    off_t max_size;
+    time_t max_age;
+    struct timespec started;		/* when "F" was opened */
+    int compress;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    /* the following are protected by "lock" */
+    pending_t * first;
+    pending_t * last;
+    int stop;
+};
+
+/* compress one file to NAME.gz via a temporary file, so that NAME.gz only
+ * appears once it is complete; returns 1 if OK, 0 with errno set */
+static int compress_file(const char * name) {
+    size_t nl = strlen(name);
+    char * gzname = malloc(2 * nl + 12), * tmpname, * buffer = NULL;
+    int fd = -1, sve;
+    gzFile gz = NULL;
+    if (! gzname) return 0;
+    tmpname = gzname + nl + 4;
+    sprintf(gzname, "%s.gz", name);
+    sprintf(tmpname, "%s.gz.tmp", name);
+    buffer = malloc(COMPRESS_BUFFER);
+    if (! buffer) goto error;
+    fd = open(name, O_RDONLY);
+    if (fd < 0) goto error;
+    gz = gzopen(tmpname, "wb");
+    if (! gz) {
+	if (! errno) errno = ENOMEM;
+	goto error;
+    }
+    while (1) {
+	ssize_t nr = read(fd, buffer, COMPRESS_BUFFER);
+	if (nr < 0) goto error;
+	if (nr == 0) break;
+	if (gzwrite(gz, buffer, nr) != nr) {
+	    gzerror(gz, &sve);
+	    if (sve != Z_ERRNO) errno = EIO;
+	    goto error;
+	}
+    }
+    close(fd);
+    fd = -1;
+    sve = gzclose(gz);
+    gz = NULL;
+    if (sve != Z_OK) {
+	if (sve != Z_ERRNO) errno = EIO;
+	goto error;
+    }
+    /* make sure the data is safe before the uncompressed file goes */
+    fd = open(tmpname, O_RDONLY);
+    if (fd < 0 || fsync(fd) < 0) goto error;
+    close(fd);
+    fd = -1;
+    if (rename(tmpname, gzname) < 0) goto error;
+    if (unlink(name) < 0) goto error;
+    free(buffer);
+    free(gzname);
+    return 1;
+error:
+    sve = errno;
+    if (gz) gzclose(gz);
+    if (fd >= 0) close(fd);
+    unlink(tmpname);
+    free(buffer);
+    free(gzname);
+    errno = sve;
+    return 0;
+}
+
+static void * compress_thread(void * _rt) {
+    shall_rotate_t * rt = _rt;
+    while (1) {
+	pending_t * pf;
+	pthread_mutex_lock(&rt->lock);
+	while (! rt->stop && ! rt->first)
+	    pthread_cond_wait(&rt->cond, &rt->lock);
+	pf = rt->first;
+	if (! pf) {
+	    pthread_mutex_unlock(&rt->lock);
+	    return NULL;
+	}
+	rt->first = pf->next;
+	if (! rt->first) rt->last = NULL;
+	pthread_mutex_unlock(&rt->lock);
+	/* if it fails, the uncompressed file is still there */
+	if (! compress_file(pf->name))
+	    fprintf(stderr, "%s: %s: %s\n",
+		    rt->pname, pf->name, strerror(errno));
+	free(pf);
+    }
+}
+
+/* open the file and remember when */
+/* open the current file; if "created" is not NULL, it is set to 1 if
+ * the file did not exist before, so that it can be removed on error */
+static int open_file(shall_rotate_t * rt, int append, int * created) {
+    int flags = O_WRONLY|O_CREAT|(append ? O_APPEND : O_TRUNC);
+    int fd = open(rt->name, flags|O_EXCL, 0666), sve;
+    if (created) *created = fd >= 0;
+    if (fd < 0 && errno == EEXIST)
+	fd = open(rt->name, flags, 0666);
+    if (fd < 0) return 0;
+    rt->F = fdopen(fd, append ? "ab" : "wb");
+    if (! rt->F) {
+	sve = errno;
+	close(fd);
+	errno = sve;
+	return 0;
+    }
+    clock_gettime(CLOCK_REALTIME, &rt->started);
+    return 1;
+}
+
+shall_rotate_t * shall_rotate_open(const char * name, int append,
+				   off_t max_size, time_t max_age,
+				   int compress, const char * pname)
+{
+    shall_rotate_t * rt = calloc(1, sizeof(*rt));
+    int sve, created = 0;
+    if (! rt) return NULL;
+    rt->name = strdup(name);
+    if (! rt->name) goto error;
+    rt->pname = pname;
+    rt->max_size = max_size;
+    rt->max_age = max_age;
+    if (! open_file(rt, append, &created)) goto error;
+    if (compress) {
+	pthread_mutex_init(&rt->lock, NULL);
+	pthread_cond_init(&rt->cond, NULL);
+	errno = pthread_create(&rt->thread, NULL, compress_thread, rt);
+	if (errno) {
+	    pthread_cond_destroy(&rt->cond);
+	    pthread_mutex_destroy(&rt->lock);
+	    goto error;
+	}
+	rt->compress = 1;
+    }
+    return rt;
+error:
+    sve = errno;
+    if (rt->F) {
+	fclose(rt->F);
+	/* don't remove a file the user already had */
+	if (created) unlink(name);
+    }
+    free(rt->name);
+    free(rt);
+    errno = sve;
+    return NULL;
+}
+
+FILE * shall_rotate_file(const shall_rotate_t * rt) {
+    return rt->F;
+}
+
+/* size of the file, including data still in the FILE's buffer */
+static off_t file_size(const shall_rotate_t * rt) {
+    struct stat sbuff;
+    if (fstat(fileno(rt->F), &sbuff) < 0) return 0;
+    return sbuff.st_size + __fpending(rt->F);
+}
+
+int shall_rotate_due(const shall_rotate_t * rt) {
+    if (rt->max_age > 0 && time(NULL) - rt->started.tv_sec >= rt->max_age)
+	return 1;
+    if (rt->max_size > 0 && file_size(rt) >= rt->max_size)
+	return 1;
+    return 0;
+}
+
+/* close the current file and give it its final name; returns 1 if OK,
+ * 0 with errno set on error */
+static int close_file(shall_rotate_t * rt) {
+    size_t nl = strlen(rt->name);
+    pending_t * pf = malloc(sizeof(pending_t) + nl + 32);
+    struct tm tm;
+    struct stat sbuff;
+    int n, seq, sve;
+    if (! pf) return 0;
+    if (fflush(rt->F) == EOF || fsync(fileno(rt->F)) < 0) goto error;
+    if (fclose(rt->F) == EOF) {
+	rt->F = NULL;
+	goto error;
+    }
+    rt->F = NULL;
+    localtime_r(&rt->started.tv_sec, &tm);
+    n = sprintf(pf->name, "%s.", rt->name);
+    n += strftime(pf->name + n, 32, "%Y%m%d-%H%M%S", &tm);
+    n += sprintf(pf->name + n, ".%06ld", rt->started.tv_nsec / 1000);
+    /* the microseconds keep the names in order, so this is unlikely */
+    for (seq = 1; stat(pf->name, &sbuff) == 0; seq++)
+	sprintf(pf->name + n, ".%d", seq);
+    if (rename(rt->name, pf->name) < 0) goto error;
+    if (! rt->compress) {
+	free(pf);
+	return 1;
+    }
+    pf->next = NULL;
+    pthread_mutex_lock(&rt->lock);
+    if (rt->last)
+	rt->last->next = pf;
+    else
+	rt->first = pf;
+    rt->last = pf;
+    pthread_cond_broadcast(&rt->cond);
+    pthread_mutex_unlock(&rt->lock);
+    return 1;
+error:
+    sve = errno;
+    free(pf);
+    errno = sve;
+    return 0;
+}
+
+int shall_rotate_next(shall_rotate_t * rt) {
+    if (! close_file(rt)) return 0;
+    return open_file(rt, 0, NULL);
+}
+
+int shall_rotate_close(shall_rotate_t * rt) {
+    int ok = 1, sve = 0;
+    if (rt->F && file_size(rt) > 0) {
+	ok = close_file(rt);
+    } else if (rt->F) {
+	/* nothing was written, so don't leave an empty file behind */
+	ok = fclose(rt->F) != EOF;
+	rt->F = NULL;
+	if (ok) ok = unlink(rt->name) == 0;
+    }
+    if (! ok) sve = errno;
+    if (rt->F) fclose(rt->F);
+    if (rt->compress) {
+	pthread_mutex_lock(&rt->lock);
+	rt->stop = 1;
+	pthread_cond_broadcast(&rt->cond);
+	pthread_mutex_unlock(&rt->lock);
+	pthread_join(rt->thread, NULL);
+	pthread_cond_destroy(&rt->cond);
+	pthread_mutex_destroy(&rt->lock);
+    }
+    free(rt->name);
+    free(rt);
+    errno = sve;
+    return ok;
+}
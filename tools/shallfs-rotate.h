@@ -0,0 +1,66 @@
+/* shallfs-rotate.h
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ *
+ * this file is part of SHALLFS
+ *
+ * Copyright (c) 2017-2019 Claudio Calvelli <shallfs@gladserv.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 2 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program (see the file COPYING in the distribution).
+ * If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef _SHALL_ROTATE_H_
+#define _SHALL_ROTATE_H_
+
+#include <stdio.h>
+#include <time.h>
+#include <sys/types.h>
+
+/* an output file which is closed and renamed when it becomes too large or
+ * too old, so a long-running program does not produce one ever-growing
+ * file; the file being written always has the name given, and when it is
+ * rotated it is synced and renamed to NAME.YYYYMMDD-HHMMSS.UUUUUU (the
+ * local time it was started, to the microsecond, so the names sort in
+ * order), and other programs only ever see complete files under those
+ * names; optionally, a separate thread compresses the rotated files with
+ * gzip, replacing each one with NAME.YYYYMMDD-HHMMSS.UUUUUU.gz, so that
+ * writing never waits for the compression */
+
+typedef struct shall_rotate_s shall_rotate_t;
+
+/* open the file; "max_size" (bytes) and "max_age" (seconds) are the
+ * limits, 0 meaning no limit; "pname" is used in messages from the
+ * compression thread; returns NULL with errno set on error */
+shall_rotate_t * shall_rotate_open(const char * name, int append,
+				   off_t max_size, time_t max_age,
+				   int compress, const char * pname);
+
+/* the file to write to; this changes after shall_rotate_next */
+FILE * shall_rotate_file(const shall_rotate_t *);
+
+/* check if the file needs rotating; the size includes data written to
+ * the file descriptor and data buffered by the FILE, but not data which
+ * the program keeps in its own buffers */
+int shall_rotate_due(const shall_rotate_t *);
+
+/* rotate the file now; returns 1 if OK, 0 with errno set on error */
+int shall_rotate_next(shall_rotate_t *);
+
+/* rotate the file, unless it is empty, and wait for the compression
+ * thread to finish; returns 1 if OK, 0 with errno set on error; the
+ * resources are freed in either case */
+int shall_rotate_close(shall_rotate_t *);
+
+#endif /* _SHALL_ROTATE_H_ */
@@ -0,0 +1,47 @@
+/* shallfs-stream.h
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ *
+ * this file is part of SHALLFS
+ *
+ * Copyright (c) 2017-2019 Claudio Calvelli <shallfs@gladserv.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 2 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program (see the file COPYING in the distribution).
+ * If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef _SHALL_STREAM_H_
+#define _SHALL_STREAM_H_
+
+#include <stdint.h>
+
+/* the protocol used by shallstream: a subscriber connects to the UNIX
+ * socket, sends a request line, receives "OK SESSION POSITION" (or
+ * "ERROR message") and then frames, each made of this header followed
+ * by "length" bytes of events; see docs/shallstream */
+
+#define SHALL_STREAM_MAGIC 0x46534853	/* "SHSF" */
+
+/* longest request line accepted, including the newline */
+#define SHALL_STREAM_REQUEST 4096
+
+/* all fields are little-endian */
+struct shall_stream_frame {
+    uint32_t magic;
+    uint32_t length;			/* of the events which follow */
+    uint64_t cursor;			/* stream position after them */
+    uint64_t lost;			/* bytes skipped before them */
+} __attribute__((packed));
+
+#endif /* _SHALL_STREAM_H_ */
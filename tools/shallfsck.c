@@ -33,9 +33,12 @@
 #include <time.h>
 #include <math.h>
 #include "shallfs-common.h"
+#include "shallfs-event.h"
+#include "shallfs-format.h"
+#include "shallfs-parallel.h"
+#include "shallfs-reader.h"
 #include <shallfs/operation.h>
 #include <shallfs/device.h>
-#include <shallfs/opdata.h>
 
 enum {
     err_ok               =  0,   /* no errors */
@@ -49,9 +52,10 @@ enum {
 
 static long autofsck = 0, num_superblocks = 0, progress = -1, force = 0;
 static long use_super = 0, readonly = 0, yes_please = 0, do_help = 0;
+static long threads = 8;
 static int end_progress = 1, last_progress = -1, progress_len = 0;
 static int extra_sb_scan = 0;
-static const char * device = NULL;
+static const char * device = NULL, * salvage_file = NULL;
 
 static const shall_options_t options[] = {
     { 'a', &autofsck,        NULL,
@@ -64,12 +68,17 @@ static const shall_options_t options[] = {
       "Force consistency check even if the device looks OK" },
     { 'h', &do_help,         NULL,
       "Print this helpful message" },
+    { 'j', &threads,         "THREADS",
+      "Read and check up to THREADS superblocks at a time (default 8)" },
     { 'l', &use_super,       "N-SUPER",
       "Use the specified superblock instead of searching for one" },
     { 'n', &readonly,        NULL,
       "Do not make any changes, just check and report" },
     { 'p', &autofsck,        NULL,
       "Automatically repair simple problems, suitable for running at boot" },
+    { 's', NULL,             "FILE",
+      "Save all events which can be read to FILE, skipping damaged data",
+      &salvage_file },
     { 'y', &yes_please,      NULL,
       "Answer \"yes\" to all questions." },
     {  0,  NULL,             NULL, NULL }
@@ -91,8 +100,14 @@ static const char * parse_options(int argc, char *argv[]) {
 	return "Cannot use -a/-p with -n";
     if (autofsck && yes_please)
 	return "Cannot use -a/-p with -y";
+    if (autofsck && salvage_file)
+	return "Cannot use -a/-p with -s";
     if (readonly && yes_please)
 	return "Cannot use -n with -y";
+    if (threads < 1)
+	return "Invalid number of threads";
+    /* saving the events needs a full scan even if the device is clean */
+    if (salvage_file) force = 1;
     if (num_superblocks != 0 && num_superblocks < 8)
     	return "Invalid number of superblocks, must be at least 8";
     if (use_super > 0 && num_superblocks > 0 && use_super >= num_superblocks)
@@ -100,6 +115,76 @@ static const char * parse_options(int argc, char *argv[]) {
     return NULL;
 }
 
+/* superblocks are small and far apart, so reading them one at a time is
+ * limited by the latency of the device: we read and check several at once
+ * using a pool of threads, and look at the results in order; all reads use
+ * pread, so the main thread can rewrite superblocks at the same time */
+typedef struct {
+    int which;
+    int ok;				/* read and decoded */
+    shall_check_t check;		/* only valid if "ok" */
+    shall_sb_data_t sb;
+} sb_job_t;
+
+typedef struct {
+    int fd;
+    off_t size;				/* end of device */
+    int next;				/* next superblock to submit */
+    int limit;				/* number of superblocks, or -1 */
+    int queue;
+    sb_job_t * jobs;			/* one per queue slot */
+    shall_parallel_t * pool;
+} sb_scan_t;
+
+static void sb_read_job(void * _job, void * _scan) {
+    sb_job_t * job = _job;
+    const sb_scan_t * scan = _scan;
+    job->ok = shall_pread_sb(scan->fd, &job->sb, job->which);
+    if (job->ok)
+	job->check = shall_check_sb_size(scan->size, &job->sb, job->which);
+}
+
+/* start reading superblocks from 0 to "limit - 1", or until the end of
+ * the device if "limit" is negative; returns 0 with errno set on error */
+static int sb_scan_start(sb_scan_t * scan, int fd, int limit) {
+    scan->fd = fd;
+    scan->size = lseek(fd, 0, SEEK_END);
+    if (scan->size < 0) return 0;
+    scan->next = 0;
+    scan->limit = limit;
+    scan->queue = 4 * threads;
+    scan->jobs = malloc(scan->queue * sizeof(sb_job_t));
+    if (! scan->jobs) return 0;
+    scan->pool = shall_parallel_start(threads, scan->queue, sb_read_job, scan);
+    if (! scan->pool) {
+	int sve = errno;
+	free(scan->jobs);
+	errno = sve;
+	return 0;
+    }
+    return 1;
+}
+
+/* get the next superblock, in order; NULL if there are no more; the
+ * result is valid until the next call */
+static const sb_job_t * sb_scan_next(sb_scan_t * scan) {
+    /* the slot of the previous result can be reused now */
+    while (! shall_parallel_full(scan->pool)) {
+	sb_job_t * job = &scan->jobs[scan->next % scan->queue];
+	if (scan->limit >= 0 && scan->next >= scan->limit) break;
+	if (shall_superblock_location(scan->next) >= scan->size) break;
+	job->which = scan->next++;
+	job->ok = 0;
+	shall_parallel_submit(scan->pool, job);
+    }
+    return shall_parallel_next(scan->pool);
+}
+
+static void sb_scan_stop(sb_scan_t * scan) {
+    shall_parallel_stop(scan->pool);
+    free(scan->jobs);
+}
+
 static int sb_same(const shall_sb_data_t * a, const shall_sb_data_t * b) {
     // XXX compare data between a and b
     return 1;
@@ -147,9 +232,13 @@ static void show_progress(int pass, int change) {
 
 /* read all superblocks and compare information for consistency,
  * rewrite any which does need rewriting */
-static int compare_superblocks(int fd, const shall_sb_data_t * sb) {
+static int compare_superblocks(const char * pname, int fd,
+			       const shall_sb_data_t * sb)
+{
     struct shall_devsuper dsb;
     shall_sb_data_t ts;
+    sb_scan_t scan;
+    const sb_job_t * job;
     int uncorrected[sb->num_superblocks];
     int n, n_corrected = 0, n_uncorrected = 0;
     ts = *sb;
@@ -158,11 +247,17 @@ static int compare_superblocks(int fd, const shall_sb_data_t * sb) {
     shall_init_sb(&dsb, &ts, NULL);
     clear_progress();
     printf("Pass 1: scan superblocks\n");
-    for (n = 0; n < sb->num_superblocks; n++) {
+    if (! sb_scan_start(&scan, fd, sb->num_superblocks)) {
+	fprintf(stderr, "%s: %s: %s\n", pname, device, strerror(errno));
+	return err_operation;
+    }
+    while ((job = sb_scan_next(&scan)) != NULL) {
 	int ok = 1;
+	n = job->which;
 	if (n != sb->this_superblock) {
-	    if (! shall_read_sb(fd, &ts, n) || ! sb_same(sb, &ts))
-		ok = 0;
+	    if (! job->ok || job->check != shall_check_ok ||
+		! sb_same(sb, &job->sb))
+		    ok = 0;
 	}
 	if (! ok ||
 	    (sb->flags & SHALL_SB_DIRTY) ||
@@ -175,6 +270,7 @@ static int compare_superblocks(int fd, const shall_sb_data_t * sb) {
 	}
 	show_progress(1, 1);
     }
+    sb_scan_stop(&scan);
     clear_progress();
     if (n_uncorrected) {
 	if (n_corrected)
@@ -238,60 +334,326 @@ static void fix_superblock(shall_sb_data_t * sb, shall_check_t chk, FILE * F) {
 
 /* read all superblocks and find the best one; this is called only if
  * automatic recovery did not do that for us */
-static void do_extra_sb_scan(int fd, shall_sb_data_t * sb) {
-    shall_sb_data_t ts;
-    int n;
+static void do_extra_sb_scan(const char * pname, int fd, shall_sb_data_t * sb) {
+    sb_scan_t scan;
+    const sb_job_t * job;
     shall_check_t changed = shall_check_ok;
     clear_progress();
     printf("Pass 0: extra superblock scan due to errors opening device\n");
-    for (n = 0; n < sb->num_superblocks; n++) {
-	if (n != sb->this_superblock) {
-	    if (shall_read_sb_raw(fd, &ts, n)) {
-		shall_check_t check = shall_check_sb(fd, sb, n);
-		if (! (check & ~shall_check_fixable)) {
-		    if (ts.version > sb->version) {
-			changed = check;
-			*sb = ts;
-		    }
+    if (! sb_scan_start(&scan, fd, sb->num_superblocks)) {
+	fprintf(stderr, "%s: %s: %s\n", pname, device, strerror(errno));
+	return;
+    }
+    while ((job = sb_scan_next(&scan)) != NULL) {
+	if (job->which != sb->this_superblock && job->ok) {
+	    if (! (job->check & ~shall_check_fixable)) {
+		if (job->sb.version > sb->version) {
+		    changed = job->check;
+		    *sb = job->sb;
 		}
 	    }
 	}
 	show_progress(0, 1);
     }
+    sb_scan_stop(&scan);
     clear_progress();
     if (changed) fix_superblock(sb, changed, NULL);
 }
 
-static int do_full_scan(const char * pname, int fd, shall_sb_data_t * sb) {
-    char buffer[65536];
+/* salvage: when an event is damaged, the events after it can still be
+ * found by looking for a valid header at each possible position (a
+ * multiple of the alignment) which is followed by another valid header;
+ * the damaged area in between is lost, and can be replaced with LOST
+ * events so that programs reading the journal can go past it */
+#define SALVAGE_BUFFER (4 * 1048576)
+#define SALVAGE_LOOKAHEAD 1048576
+/* a LOST event must fit in the smallest buffer a reader may use: the
+ * kernel returns -EFBIG for an event larger than the read buffer, and
+ * readshallfs -m and -i read 16KB at a time */
+#define SALVAGE_CHUNK SHALL_DEV_BLOCK
+
+typedef struct {
+    off_t start;			/* offset in the journal */
+    off_t length;
+    int64_t sec;			/* time of the event before it */
+    int nsec;
+} lost_t;
+
+static lost_t * lost = NULL;
+static int n_lost = 0, lost_size = 0;
+
+static int add_lost(off_t start, off_t length, int64_t sec, int nsec) {
+    if (n_lost >= lost_size) {
+	int ns = lost_size ? 2 * lost_size : 16;
+	lost_t * nl = realloc(lost, ns * sizeof(lost_t));
+	if (! nl) return 0;
+	lost = nl;
+	lost_size = ns;
+    }
+    lost[n_lost].start = start;
+    lost[n_lost].length = length;
+    lost[n_lost].sec = sec;
+    lost[n_lost].nsec = nsec;
+    n_lost++;
+    return 1;
+}
+
+/* prepare a LOST event covering "len" bytes of which "size" were lost;
+ * the buffer must have space for "len" bytes and is all used, the part
+ * after the event itself filled with zeros */
+static void make_lost(char * buffer, size_t len, off_t size,
+		      int64_t sec, int nsec)
+{
+    struct shall_devheader dh;
+    shall_event_t ev;
+    size_t el;
+    memset(&ev, 0, sizeof(ev));
+    ev.operation = SHALL_LOST;
+    ev.req_sec = sec;
+    ev.req_nsec = nsec;
+    /* a 32-byte area only has space for the header */
+    if (len >= sizeof(dh) + sizeof(struct shall_devsize)) {
+	ev.flags = ev.data_type = SHALL_LOG_SIZE;
+	ev.u.size = size;
+    }
+    el = shall_event_encode(&ev, buffer, len);
+    memset(buffer + el, 0, len - el);
+    memcpy(&dh, buffer, sizeof(dh));
+    dh.next_header = htole32(len);
+    dh.checksum = htole32(shall_checksum_log(&dh));
+    memcpy(buffer, &dh, sizeof(dh));
+}
+
+static void data_progress(off_t pos, int * lp) {
+    int tp = pos / sizeof(struct shall_devsuper);
+    if (tp > *lp) {
+	show_progress(2, tp - *lp);
+	*lp = tp;
+    }
+}
+
+/* read the journal from "start" to the end, recording the damaged areas;
+ * "sec" and "nsec" are the time of the last event before "start"; if
+ * "out" is not NULL, the events are saved there, with a LOST event for
+ * each damaged area; returns 0 with errno set on error */
+static int salvage_scan(int fd, const shall_sb_data_t * sb, off_t start,
+			int64_t sec, int nsec, shall_outbuf_t * out, int * lp)
+{
+    shall_sb_data_t rsb = *sb;
+    char * buffer = malloc(SALVAGE_BUFFER);
+    off_t base = start, lost_at = -1;
+    size_t have = 0, align = sb->alignment;
+    int eof = 0;
+    if (! buffer) return 0;
+    shall_locate_start(&rsb);
+    shall_advance_pointers(&rsb, start);
+    while (! eof || have > 0) {
+	size_t pos = 0;
+	if (! eof) {
+	    ssize_t nr = shall_read_data(fd, &rsb, buffer + have,
+					 SALVAGE_BUFFER - have, 0);
+	    if (nr < 0) goto error;
+	    if (nr == 0 && have < SALVAGE_BUFFER) {
+		errno = EIO;
+		goto error;
+	    }
+	    shall_advance_pointers(&rsb, nr);
+	    have += nr;
+	    eof = rsb.data_length == 0;
+	}
+	while (pos < have) {
+	    size_t avail = have - pos, limit;
+	    ssize_t found;
+	    if (lost_at < 0) {
+		shall_event_t ev;
+		int nh = shall_event_decode(buffer + pos, avail, &ev);
+		if (nh > 0) {
+		    if (out && ! shall_outbuf_append(out, buffer + pos, nh))
+			goto error;
+		    sec = ev.req_sec;
+		    nsec = ev.req_nsec;
+		    pos += nh;
+		    continue;
+		}
+		/* an incomplete event is only damaged if it is at the end
+		 * of the journal, or too big for our buffer */
+		if (nh == 0 && ! eof && (pos > 0 || have < SALVAGE_BUFFER))
+		    break;
+		lost_at = base + pos;
+	    }
+	    /* look for the next event, keeping enough data after it to
+	     * check that it is followed by another one */
+	    if (eof)
+		limit = avail;
+	    else if (avail > SALVAGE_LOOKAHEAD)
+		limit = avail - SALVAGE_LOOKAHEAD;
+	    else
+		break;
+	    found = shall_event_resync(buffer + pos, avail, limit, align);
+	    if (found < 0) {
+		pos += (limit + align - 1) / align * align;
+		if (pos > have) pos = have;
+		continue;
+	    }
+	    pos += found;
+	    if (! add_lost(lost_at, base + pos - lost_at, sec, nsec)) goto error;
+	    if (out) {
+		char * ev = shall_outbuf_reserve(out, 40);
+		if (! ev) goto error;
+		make_lost(ev, 40, base + pos - lost_at, sec, nsec);
+		out->len += 40;
+	    }
+	    lost_at = -1;
+	}
+	memmove(buffer, buffer + pos, have - pos);
+	have -= pos;
+	base += pos;
+	data_progress(base, lp);
+    }
+    if (lost_at >= 0) {
+	if (! add_lost(lost_at, base - lost_at, sec, nsec)) goto error;
+	if (out) {
+	    char * ev = shall_outbuf_reserve(out, 40);
+	    if (! ev) goto error;
+	    make_lost(ev, 40, base - lost_at, sec, nsec);
+	    out->len += 40;
+	}
+    }
+    free(buffer);
+    return 1;
+error:
+    free(buffer);
+    return 0;
+}
+
+/* replace each damaged area with LOST events, each at most SALVAGE_CHUNK
+ * bytes so that any program can read them; a larger area becomes several
+ * consecutive LOST events */
+static int salvage_rewrite(int fd, const shall_sb_data_t * sb) {
+    char buffer[SALVAGE_CHUNK];
+    size_t min = sizeof(struct shall_devheader);
+    int n;
+    for (n = 0; n < n_lost; n++) {
+	shall_sb_data_t wsb = *sb;
+	off_t len = lost[n].length;
+	/* only an incomplete event at the end of the journal can be too
+	 * small for a header, and readers ignore that anyway */
+	if (len < min) continue;
+	shall_locate_start(&wsb);
+	shall_advance_pointers(&wsb, lost[n].start);
+	while (len > 0) {
+	    size_t todo = len > SALVAGE_CHUNK ? SALVAGE_CHUNK : len;
+	    /* don't leave a piece too small for another LOST event */
+	    if (len > todo && len - todo < min)
+		todo -= sb->alignment * ((min + sb->alignment - 1)
+					 / sb->alignment);
+	    make_lost(buffer, todo, todo, lost[n].sec, lost[n].nsec);
+	    if (! shall_write_data(fd, &wsb, buffer, todo)) return 0;
+	    shall_advance_pointers(&wsb, todo);
+	    len -= todo;
+	}
+    }
+    return 1;
+}
+
+/* read the whole journal with the prefetching reader, so the device is
+ * read in large blocks by one thread while this one checks the events in
+ * the previous block: the reader verifies the header checksums and the
+ * chain of next_header fields, and we decode each event to make sure its
+ * contents are consistent with its header; if there is a damaged event,
+ * continue with salvage_scan to find what can still be read */
+static int check_journal(int fd, const shall_sb_data_t * sb, int * lp) {
     shall_sb_data_t csb = *sb;
+    shall_devreader_t * rd;
     off_t pos = 0;
-    int err = err_ok, lp = 0;
-    clear_progress();
-    printf("Pass 2: scan data for validity\n");
-    /* do a fake read to calculate pointers */
-    shall_read_logs(fd, &csb, buffer, 0, 0);
+    int64_t sec = 0;
+    int nsec = 0;
+    rd = shall_devreader_open(fd, &csb, 0, 0);
+    if (! rd) return 0;
     while (1) {
+	shall_event_iter_t it;
+	shall_event_t ev;
+	const char * span;
 	ssize_t nr;
-	int tp;
-	nr = shall_read_data(fd, &csb, buffer, sizeof(buffer), 0);
+	int ok;
+	nr = shall_devreader_next(rd, &span);
 	if (nr == 0) break;
-	if (nr < 0) goto error;
-	// XXX verify checksum, size and data of all logs in buffer
-	// XXX if any invalid, try to locate next one and then "blank"
-	// XXX it (asking first unless -y) by replacing it with an
-	// XXX overflow log of some special type and then rewrite buffer
+	if (nr < 0 && errno != EINVAL) goto error;
+	if (nr < 0) goto invalid;
+	shall_event_iter_init(&it, span, nr);
+	while ((ok = shall_event_next(&it, &ev)) > 0) {
+	    sec = ev.req_sec;
+	    nsec = ev.req_nsec;
+	}
+	if (ok < 0 || it.pos < nr) {
+	    pos += it.pos;
+	    goto invalid;
+	}
 	pos += nr;
-	shall_advance_pointers(&csb, nr);
-	tp = pos / sizeof(struct shall_devsuper);
-	if (tp > lp) {
-	    show_progress(2, tp - lp);
-	    lp = tp;
+	data_progress(pos, lp);
+    }
+    shall_devreader_close(rd);
+    return 1;
+invalid:
+    shall_devreader_close(rd);
+    return salvage_scan(fd, sb, pos, sec, nsec, NULL, lp);
+error:
+    shall_devreader_close(rd);
+    return 0;
+}
+
+static int do_full_scan(const char * pname, int fd, shall_sb_data_t * sb) {
+    off_t total = 0;
+    int err = err_ok, lp = 0, n;
+    clear_progress();
+    printf("Pass 2: scan data for validity\n");
+    if (salvage_file) {
+	shall_outbuf_t out;
+	int ofd = open(salvage_file, O_WRONLY|O_CREAT|O_TRUNC, 0666), ok;
+	if (ofd < 0) {
+	    clear_progress();
+	    fprintf(stderr, "%s: %s: %s\n",
+		    pname, salvage_file, strerror(errno));
+	    return err_operation;
+	}
+	if (! shall_outbuf_init(&out, ofd, 0)) {
+	    close(ofd);
+	    goto error;
+	}
+	ok = salvage_scan(fd, sb, 0, 0, 0, &out, &lp);
+	if (ok) ok = shall_outbuf_flush(&out);
+	if (close(ofd) < 0) ok = 0;
+	shall_outbuf_free(&out);
+	if (! ok) {
+	    int sve = errno;
+	    clear_progress();
+	    fprintf(stderr, "%s: %s: %s\n", pname, salvage_file, strerror(sve));
+	    return err_operation;
 	}
+    } else {
+	if (! check_journal(fd, sb, &lp)) goto error;
     }
     clear_progress();
-    return err;
+    if (n_lost == 0) return err;
+    for (n = 0; n < n_lost; n++) {
+	printf("Pass 2: damaged data, %lld bytes at offset %lld\n",
+	       (long long)lost[n].length, (long long)lost[n].start);
+	total += lost[n].length;
+    }
+    printf("Pass 2: %lld of %lld bytes lost in %d damaged area%s\n",
+	   (long long)total, (long long)sb->data_length,
+	   n_lost, n_lost == 1 ? "" : "s");
+    if (readonly || ! yes_please) {
+	printf("Use \"-y\" to replace the damaged data so the events after "
+	       "it can be read\n");
+	return err | err_uncorrected;
+    }
+    if (! salvage_rewrite(fd, sb)) goto error;
+    if (fsync(fd) < 0) goto error;
+    printf("Pass 2 replaced the damaged data with LOST events\n");
+    return err | err_corrected;
 error:
+    clear_progress();
     fprintf(stderr, "%s: %s: Error reading events: %s\n",
 	    pname, device, strerror(errno));
     err |= err_uncorrected;
@@ -306,24 +668,24 @@ static const char * status_name(int err) {
 
 /* use unnecessary force to find a superblock somehow */
 static int search_superblock(int fd, shall_sb_data_t * sb, const char * pname) {
-    off_t limit = lseek(fd, 0, SEEK_END);
-    int n_sb = 0;
-    if (limit < 0) return 0; /* nothing we can do! */
-    while (1) {
-	shall_check_t check;
-	int n = n_sb++;
-	if (shall_superblock_location(n) >= limit) return 0;
-	if (! shall_read_sb_raw(fd, sb, n)) continue;
-	check = shall_check_sb(fd, sb, n);
-	if (check & ~shall_check_fixable) continue;
+    sb_scan_t scan;
+    const sb_job_t * job;
+    if (! sb_scan_start(&scan, fd, -1)) return 0; /* nothing we can do! */
+    while ((job = sb_scan_next(&scan)) != NULL) {
+	if (! job->ok) continue;
+	if (job->check & ~shall_check_fixable) continue;
 	/* errors are fixable, try to fix them */
+	*sb = job->sb;
 	printf("%s: %s: Rescued partially valid superblock %d, fixed:\n    ",
-	       pname, device, n);
-	fix_superblock(sb, check, stdout);
+	       pname, device, job->which);
+	fix_superblock(sb, job->check, stdout);
 	printf("\n");
 	extra_sb_scan = 1;
+	sb_scan_stop(&scan);
 	return 1;
     }
+    sb_scan_stop(&scan);
+    return 0;
 }
 
 int main(int argc, char *argv[]) {
@@ -386,16 +748,16 @@ int main(int argc, char *argv[]) {
     end_progress = sb.num_superblocks;
     if (extra_sb_scan) {
 	end_progress += sb.num_superblocks;
-	do_extra_sb_scan(fd, &sb);
+	do_extra_sb_scan(pname, fd, &sb);
     }
     if (full_scan && ! (err & err_uncorrected))
 	end_progress += (sb.data_length + sizeof(struct shall_devsuper) - 1)
 		      / sizeof(struct shall_devsuper);
     /* now read all superblocks and compare them for consistency */
-    err |= compare_superblocks(fd, &sb);
+    err |= compare_superblocks(pname, fd, &sb);
     if (full_scan && ! (err & err_uncorrected)) {
-	do_full_scan(pname, fd, &sb);
-    } else if (err && err_uncorrected) {
+	err |= do_full_scan(pname, fd, &sb);
+    } else if (err & err_uncorrected) {
 	clear_progress();
 	printf("Skipping pass 2 because of previous uncorrected errors\n");
     } else {
@@ -0,0 +1,1259 @@
+/* builds an index over files of events produced by readshallfs or shalldrain,
+ * and uses it to find the events on a path, by a user or in a time range
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ *
+ * this file is part of SHALLFS
+ *
+ * Copyright (c) 2017-2019 Claudio Calvelli <shallfs@gladserv.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 2 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program (see the file COPYING in the distribution).
+ * If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#define _GNU_SOURCE /* for strptime */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <string.h>
+#include <ctype.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <endian.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+#include "shallfs-common.h"
+#include "shallfs-event.h"
+#include "shallfs-format.h"
+#include <shallfs/operation.h>
+
+/* the index is a directory containing a manifest, which lists the files
+ * indexed and the runs; each run is an immutable file with three sorted
+ * sections of entries, by time, by user ID and by path, each entry
+ * pointing to an event in one of the files; adding events writes new
+ * runs, and when there are too many a separate thread merges them into
+ * one while indexing continues; the manifest is replaced atomically, so
+ * queries never see a partial update and don't need to lock anything */
+
+enum {
+    by_time,
+    by_uid,
+    by_path,
+    num_sections
+};
+
+/* an entry as stored in a run, little-endian; "key" is the user ID, or
+ * the offset of the path in the names following the entries */
+struct entry {
+    uint64_t key;
+    int64_t sec;
+    uint32_t nsec;
+    uint32_t file;
+    uint64_t offset;
+    uint32_t namelen;
+    uint32_t reserved;
+} __attribute__((packed));
+
+#define RUN_MAGIC "SHALLIDX"
+#define RUN_VERSION 1
+
+struct run_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t reserved;
+    uint64_t count[num_sections];
+    uint64_t names;			/* length of names */
+} __attribute__((packed));
+
+/* an entry in memory */
+typedef struct {
+    uint64_t key;
+    const char * name;
+    int namelen;
+    int64_t sec;
+    uint32_t nsec;
+    uint32_t file;
+    uint64_t offset;
+} entry_t;
+
+/* a run mapped in memory */
+typedef struct {
+    char * name;
+    const char * map;
+    size_t len;
+    uint64_t count[num_sections];
+    const struct entry * entries[num_sections];
+    const char * names;
+} run_t;
+
+/* a run being written */
+typedef struct {
+    FILE * F;
+    FILE * names;
+    char * tmpname;
+    char * name;
+    struct run_header header;
+    int section;
+    const char * lastname;		/* to store each name only once */
+    int lastlen;
+    uint64_t lastkey;
+} writer_t;
+
+/* entries collected in memory before writing a run */
+typedef struct {
+    entry_t * entries[num_sections];
+    long count[num_sections];
+    long size[num_sections];
+    char * arena;			/* copy of all names */
+    size_t arenalen;
+    size_t arenasize;
+} builder_t;
+
+/* a file which has been indexed; its position in "files" is its number */
+typedef struct {
+    char * name;
+    int64_t size;			/* indexed up to here */
+} ifile_t;
+
+/* one result of a query */
+typedef struct {
+    int64_t sec;
+    uint32_t nsec;
+    uint32_t file;
+    uint64_t offset;
+} hit_t;
+
+typedef struct {
+    const char * map;
+    size_t len;
+    int error;
+} mapped_t;
+
+#define MAX_RUNS 8
+#define MANIFEST_TAG "shallindex 1"
+
+static long help = 0, verbose = 0, merge_all = 0, records = 0, list = 0;
+static long max_entries = 1048576, uid = -1;
+static const char * index_dir = NULL, * prefix = NULL, * output = NULL;
+static const char * since = NULL, * until = NULL;
+static shall_optlist_t add;
+
+static const shall_options_t options[] = {
+    { 'a', NULL,             "FILE",
+      "Add FILE (produced by readshallfs or shalldrain) to the index",
+      NULL, &add },
+    { 'h', &help,            NULL,
+      "Print this helpful message" },
+    { 'l', &list,            NULL,
+      "List the file and offset of each matching event" },
+    { 'm', &max_entries,     "NUMBER",
+      "Write a run every NUMBER index entries (default 1048576)" },
+    { 'M', &merge_all,       NULL,
+      "Merge all runs into one before exiting" },
+    { 'n', NULL,             "PREFIX",
+      "Only show events on files whose name starts with PREFIX",
+      &prefix },
+    { 'o', NULL,             "FILE",
+      "Store the matching events in FILE, which readshallfs -i can read",
+      &output },
+    { 'R', &records,         NULL,
+      "Output events as fixed-size binary records (default: JSON Lines)" },
+    { 't', NULL,             "TIME",
+      "Only show events logged at or after TIME",
+      &since },
+    { 'T', NULL,             "TIME",
+      "Only show events logged before TIME",
+      &until },
+    { 'u', &uid,             "UID",
+      "Only show events from processes with real user ID UID" },
+    { 'v', &verbose,         NULL,
+      "Print statistics on standard error" },
+    {  0,  NULL,             NULL, NULL }
+};
+
+static const shall_args_t args[] = {
+    { &index_dir, "INDEX",  1,
+      "Directory containing the index, created by the first -a" },
+    { NULL,      NULL,           0, NULL }
+};
+
+static const char * pname;
+static int64_t from = INT64_MIN, to = INT64_MAX;
+
+/* the manifest, protected by "lock" while the merge thread runs */
+static ifile_t * files = NULL;
+static long nfiles = 0;
+static char ** runs = NULL;
+static int nruns = 0;
+static unsigned long next_run = 0;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* the merge thread */
+static pthread_t merger;
+static int merging = 0;			/* thread started, not yet joined */
+static volatile int merge_done = 0;
+static int merge_error = 0;
+static char ** merge_runs = NULL;
+static int merge_count = 0;
+
+static long long stat_events = 0, stat_entries = 0, stat_runs = 0;
+static long long stat_merges = 0;
+
+/* parse the argument of -t and -T, like readshallfs does */
+static int parse_time(const char * arg, int64_t * result) {
+    static const char * formats[] = {
+	"%Y-%m-%d %H:%M:%S",
+	"%Y-%m-%dT%H:%M:%S",
+	"%Y-%m-%d %H:%M",
+	"%Y-%m-%d",
+	NULL
+    };
+    char * ep;
+    int n;
+    *result = strtoll(arg, &ep, 10);
+    if (ep != arg && ! *ep) return 1;
+    for (n = 0; formats[n]; n++) {
+	struct tm tm;
+	memset(&tm, 0, sizeof(tm));
+	ep = strptime(arg, formats[n], &tm);
+	if (! ep || *ep) continue;
+	tm.tm_isdst = -1;
+	*result = mktime(&tm);
+	return 1;
+    }
+    return 0;
+}
+
+/* name of a file in the index directory; returns NULL if out of memory */
+static char * index_path(const char * name) {
+    char * path = malloc(strlen(index_dir) + strlen(name) + 2);
+    if (path) sprintf(path, "%s/%s", index_dir, name);
+    return path;
+}
+
+static int sync_dir(void) {
+    int fd = open(index_dir, O_RDONLY | O_DIRECTORY), ok;
+    if (fd < 0) return 0;
+    ok = fsync(fd) == 0;
+    close(fd);
+    return ok;
+}
+
+/* write a name, with spaces and anything unprintable as %XX */
+static void print_name(FILE * F, const char * name) {
+    for (; *name; name++) {
+	unsigned char c = *name;
+	if (isascii((int)c) && isprint((int)c) && c != '%' && c != ' ')
+	    fputc(c, F);
+	else
+	    fprintf(F, "%%%02x", c);
+    }
+}
+
+/* the reverse of print_name, in place */
+static void unescape(char * name) {
+    char * dp = name;
+    while (*name) {
+	unsigned int c;
+	if (*name == '%' && sscanf(name + 1, "%2x", &c) == 1) {
+	    *dp++ = c;
+	    name += 3;
+	} else {
+	    *dp++ = *name++;
+	}
+    }
+    *dp = 0;
+}
+
+static void free_manifest(void) {
+    int n;
+    for (n = 0; n < nfiles; n++)
+	free(files[n].name);
+    for (n = 0; n < nruns; n++)
+	free(runs[n]);
+    free(files);
+    free(runs);
+    files = NULL;
+    runs = NULL;
+    nfiles = nruns = 0;
+}
+
+static int add_run_name(char * name) {
+    char ** nr = realloc(runs, (nruns + 1) * sizeof(char *));
+    if (! nr) return 0;
+    runs = nr;
+    runs[nruns++] = name;
+    return 1;
+}
+
+/* read the manifest; a missing manifest is an empty index; returns 1 if
+ * OK, 0 with errno set on error */
+static int read_manifest(void) {
+    char * path = index_path("manifest"), line[PATH_MAX + 64];
+    FILE * F;
+    int ok = 1;
+    free_manifest();
+    next_run = 0;
+    if (! path) return 0;
+    F = fopen(path, "r");
+    free(path);
+    if (! F) return errno == ENOENT;
+    if (! fgets(line, sizeof(line), F) ||
+	strncmp(line, MANIFEST_TAG "\n", strlen(MANIFEST_TAG) + 1) != 0)
+    {
+	fclose(F);
+	errno = EINVAL;
+	return 0;
+    }
+    while (ok && fgets(line, sizeof(line), F)) {
+	char name[PATH_MAX + 64], * copy;
+	long long size;
+	line[strcspn(line, "\n")] = 0;
+	if (sscanf(line, "next %lu", &next_run) == 1) continue;
+	if (sscanf(line, "file %lld %s", &size, name) == 2) {
+	    ifile_t * nf = realloc(files, (nfiles + 1) * sizeof(ifile_t));
+	    unescape(name);
+	    copy = strdup(name);
+	    if (! nf || ! copy) {
+		if (nf) files = nf;
+		free(copy);
+		ok = 0;
+		break;
+	    }
+	    files = nf;
+	    files[nfiles].name = copy;
+	    files[nfiles].size = size;
+	    nfiles++;
+	    continue;
+	}
+	if (sscanf(line, "run %s", name) == 1) {
+	    copy = strdup(name);
+	    if (! copy || ! add_run_name(copy)) {
+		free(copy);
+		ok = 0;
+	    }
+	    continue;
+	}
+	errno = EINVAL;
+	ok = 0;
+    }
+    if (ferror(F)) ok = 0;
+    fclose(F);
+    return ok;
+}
+
+/* replace the manifest atomically; called with "lock" held */
+static int write_manifest(void) {
+    char * path = index_path("manifest"), * tmp = index_path("manifest.tmp");
+    FILE * F = NULL;
+    int ok = 0, n;
+    if (! path || ! tmp) goto out;
+    F = fopen(tmp, "w");
+    if (! F) goto out;
+    fprintf(F, "%s\nnext %lu\n", MANIFEST_TAG, next_run);
+    for (n = 0; n < nfiles; n++) {
+	fprintf(F, "file %lld ", (long long)files[n].size);
+	print_name(F, files[n].name);
+	fputc('\n', F);
+    }
+    for (n = 0; n < nruns; n++)
+	fprintf(F, "run %s\n", runs[n]);
+    ok = fflush(F) == 0 && fsync(fileno(F)) == 0;
+    if (fclose(F) != 0) ok = 0;
+    if (ok) ok = rename(tmp, path) == 0 && sync_dir();
+    if (! ok) {
+	int sve = errno;
+	unlink(tmp);
+	errno = sve;
+    }
+out:
+    free(path);
+    free(tmp);
+    return ok;
+}
+
+/* remove runs left behind by an interrupted program */
+static void remove_orphans(void) {
+    DIR * D = opendir(index_dir);
+    struct dirent * ent;
+    if (! D) return;
+    while ((ent = readdir(D)) != NULL) {
+	char * path;
+	int n;
+	if (strncmp(ent->d_name, "run.", 4) != 0) continue;
+	for (n = 0; n < nruns; n++)
+	    if (strcmp(runs[n], ent->d_name) == 0) break;
+	if (n < nruns) continue;
+	path = index_path(ent->d_name);
+	if (! path) break;
+	if (verbose) fprintf(stderr, "removing %s\n", path);
+	unlink(path);
+	free(path);
+    }
+    closedir(D);
+}
+
+/* the order of entries in each section: by key, then by position in the
+ * journal so that the events come out in the order they were logged */
+static int entry_cmp(int section, const entry_t * a, const entry_t * b) {
+    if (section == by_uid && a->key != b->key)
+	return a->key < b->key ? -1 : 1;
+    if (section == by_path) {
+	int len = a->namelen < b->namelen ? a->namelen : b->namelen;
+	int c = memcmp(a->name, b->name, len);
+	if (c) return c;
+	if (a->namelen != b->namelen) return a->namelen - b->namelen;
+    }
+    if (a->sec != b->sec) return a->sec < b->sec ? -1 : 1;
+    if (a->nsec != b->nsec) return a->nsec < b->nsec ? -1 : 1;
+    if (a->file != b->file) return a->file < b->file ? -1 : 1;
+    if (a->offset != b->offset) return a->offset < b->offset ? -1 : 1;
+    return 0;
+}
+
+static int cmp_time(const void * a, const void * b) {
+    return entry_cmp(by_time, a, b);
+}
+
+static int cmp_uid(const void * a, const void * b) {
+    return entry_cmp(by_uid, a, b);
+}
+
+static int cmp_path(const void * a, const void * b) {
+    return entry_cmp(by_path, a, b);
+}
+
+static int (* const compare[num_sections])(const void *, const void *) = {
+    [by_time] = cmp_time,
+    [by_uid]  = cmp_uid,
+    [by_path] = cmp_path,
+};
+
+/* get an entry from a mapped run */
+static void get_entry(const run_t * r, int section, uint64_t n, entry_t * e) {
+    const struct entry * de = &r->entries[section][n];
+    e->key = le64toh(de->key);
+    e->sec = le64toh(de->sec);
+    e->nsec = le32toh(de->nsec);
+    e->file = le32toh(de->file);
+    e->offset = le64toh(de->offset);
+    e->namelen = le32toh(de->namelen);
+    e->name = section == by_path ? r->names + e->key : NULL;
+}
+
+static void close_run(run_t * r) {
+    if (r->map) munmap((void *)r->map, r->len);
+    free(r->name);
+    r->map = NULL;
+    r->name = NULL;
+}
+
+/* map a run and check that it makes sense; returns 1 if OK, 0 with errno
+ * set on error */
+static int open_run(run_t * r, const char * name) {
+    const struct run_header * h;
+    struct stat sbuff;
+    char * path = index_path(name);
+    uint64_t total = 0, nameslen;
+    int fd, s, sve;
+    memset(r, 0, sizeof(*r));
+    if (! path) return 0;
+    fd = open(path, O_RDONLY);
+    free(path);
+    if (fd < 0) return 0;
+    if (fstat(fd, &sbuff) < 0) goto error;
+    if (sbuff.st_size < sizeof(*h)) goto invalid;
+    r->len = sbuff.st_size;
+    r->map = mmap(NULL, r->len, PROT_READ, MAP_SHARED, fd, 0);
+    if (r->map == MAP_FAILED) {
+	r->map = NULL;
+	goto error;
+    }
+    close(fd);
+    fd = -1;
+    r->name = strdup(name);
+    if (! r->name) goto error;
+    h = (const struct run_header *)r->map;
+    if (memcmp(h->magic, RUN_MAGIC, sizeof(h->magic)) != 0 ||
+	le32toh(h->version) != RUN_VERSION)
+	    goto invalid;
+    for (s = 0; s < num_sections; s++) {
+	r->count[s] = le64toh(h->count[s]);
+	if (r->count[s] > r->len / sizeof(struct entry)) goto invalid;
+	r->entries[s] = (const struct entry *)(r->map + sizeof(*h)) + total;
+	total += r->count[s];
+    }
+    nameslen = le64toh(h->names);
+    if (sizeof(*h) + total * sizeof(struct entry) + nameslen != r->len)
+	goto invalid;
+    r->names = (const char *)(r->entries[0] + total);
+    return 1;
+invalid:
+    errno = EINVAL;
+error:
+    sve = errno;
+    if (fd >= 0) close(fd);
+    close_run(r);
+    errno = sve;
+    return 0;
+}
+
+/* start writing a new run; returns 1 if OK, 0 with errno set */
+static int writer_open(writer_t * w) {
+    char buffer[32];
+    memset(w, 0, sizeof(*w));
+    pthread_mutex_lock(&lock);
+    snprintf(buffer, sizeof(buffer), "run.%08lu", next_run++);
+    pthread_mutex_unlock(&lock);
+    w->name = strdup(buffer);
+    strcat(buffer, ".tmp");
+    w->tmpname = index_path(buffer);
+    if (! w->name || ! w->tmpname) goto error;
+    w->F = fopen(w->tmpname, "w");
+    if (! w->F) goto error;
+    w->names = tmpfile();
+    if (! w->names) goto error;
+    memcpy(w->header.magic, RUN_MAGIC, sizeof(w->header.magic));
+    w->header.version = htole32(RUN_VERSION);
+    if (fwrite(&w->header, sizeof(w->header), 1, w->F) != 1) goto error;
+    return 1;
+error:
+    {
+	int sve = errno;
+	if (w->F) {
+	    fclose(w->F);
+	    unlink(w->tmpname);
+	}
+	if (w->names) fclose(w->names);
+	free(w->tmpname);
+	free(w->name);
+	errno = sve;
+	return 0;
+    }
+}
+
+/* add an entry; the sections must be written in order */
+static int writer_add(writer_t * w, int section, const entry_t * e) {
+    struct entry de;
+    uint64_t key = e->key;
+    if (section == by_path) {
+	if (! w->lastname || w->lastlen != e->namelen ||
+	    memcmp(w->lastname, e->name, e->namelen) != 0)
+	{
+	    w->lastkey = w->header.names;
+	    if (fwrite(e->name, e->namelen, 1, w->names) != 1) return 0;
+	    w->header.names += e->namelen;
+	    w->lastname = e->name;
+	    w->lastlen = e->namelen;
+	}
+	key = w->lastkey;
+    }
+    de.key = htole64(key);
+    de.sec = htole64(e->sec);
+    de.nsec = htole32(e->nsec);
+    de.file = htole32(e->file);
+    de.offset = htole64(e->offset);
+    de.namelen = htole32(e->namelen);
+    de.reserved = 0;
+    if (fwrite(&de, sizeof(de), 1, w->F) != 1) return 0;
+    w->header.count[section]++;
+    return 1;
+}
+
+/* finish the run and make it durable; it isn't part of the index until
+ * the manifest says so; returns the run's name, or NULL with errno set,
+ * in both cases freeing everything else */
+static char * writer_close(writer_t * w, int ok) {
+    char * path = index_path(w->name), buffer[65536];
+    size_t nr;
+    int s, sve;
+    if (! path) ok = 0;
+    for (s = 0; s < num_sections; s++)
+	w->header.count[s] = htole64(w->header.count[s]);
+    w->header.names = htole64(w->header.names);
+    if (ok && fseek(w->names, 0, SEEK_SET) < 0) ok = 0;
+    while (ok && (nr = fread(buffer, 1, sizeof(buffer), w->names)) > 0)
+	if (fwrite(buffer, nr, 1, w->F) != 1) ok = 0;
+    if (ferror(w->names)) ok = 0;
+    if (ok && fseek(w->F, 0, SEEK_SET) < 0) ok = 0;
+    if (ok && fwrite(&w->header, sizeof(w->header), 1, w->F) != 1) ok = 0;
+    if (ok && (fflush(w->F) != 0 || fsync(fileno(w->F)) < 0)) ok = 0;
+    sve = errno;
+    if (fclose(w->F) != 0 && ok) {
+	sve = errno;
+	ok = 0;
+    }
+    fclose(w->names);
+    if (ok && rename(w->tmpname, path) < 0) {
+	sve = errno;
+	ok = 0;
+    }
+    if (! ok) unlink(w->tmpname);
+    free(w->tmpname);
+    free(path);
+    if (ok) return w->name;
+    free(w->name);
+    errno = sve;
+    return NULL;
+}
+
+/* merge runs into a new one; returns its name, or NULL with errno set */
+static char * merge_runs_into(char * const * names, int count) {
+    run_t * r = calloc(count, sizeof(run_t));
+    uint64_t * pos = calloc(count, sizeof(uint64_t));
+    entry_t * head = calloc(count, sizeof(entry_t));
+    writer_t w;
+    char * result = NULL;
+    int n, s, ok = 0, sve;
+    if (! r || ! pos || ! head) goto out;
+    for (n = 0; n < count; n++)
+	if (! open_run(&r[n], names[n])) goto out;
+    if (! writer_open(&w)) goto out;
+    ok = 1;
+    for (s = 0; ok && s < num_sections; s++) {
+	for (n = 0; n < count; n++) {
+	    pos[n] = 0;
+	    if (r[n].count[s] > 0) get_entry(&r[n], s, 0, &head[n]);
+	}
+	while (ok) {
+	    int best = -1;
+	    /* there are only a few runs, so we don't bother with a heap */
+	    for (n = 0; n < count; n++) {
+		if (pos[n] >= r[n].count[s]) continue;
+		if (best < 0 || entry_cmp(s, &head[n], &head[best]) < 0)
+		    best = n;
+	    }
+	    if (best < 0) break;
+	    if (! writer_add(&w, s, &head[best])) ok = 0;
+	    if (++pos[best] < r[best].count[s])
+		get_entry(&r[best], s, pos[best], &head[best]);
+	}
+    }
+    result = writer_close(&w, ok);
+out:
+    sve = errno;
+    if (r)
+	for (n = 0; n < count; n++)
+	    close_run(&r[n]);
+    free(r);
+    free(pos);
+    free(head);
+    errno = sve;
+    return result;
+}
+
+/* replace the runs which were merged with the result, which goes where
+ * the first of them was; called with "lock" held */
+static int replace_runs(char * const * old, int count, char * merged) {
+    int n, m, first = -1;
+    for (n = m = 0; n < nruns; n++) {
+	char * name = runs[n];
+	int o;
+	for (o = 0; o < count; o++)
+	    if (strcmp(name, old[o]) == 0) break;
+	if (o >= count) {
+	    runs[m++] = name;
+	    continue;
+	}
+	if (first < 0) {
+	    first = m;
+	    runs[m++] = merged;
+	}
+	free(name);
+    }
+    nruns = m;
+    if (first < 0 && ! add_run_name(merged)) return 0;
+    if (! write_manifest()) return 0;
+    for (n = 0; n < count; n++) {
+	char * path = index_path(old[n]);
+	if (path) unlink(path);
+	free(path);
+    }
+    stat_merges++;
+    return 1;
+}
+
+static void * merge_thread(void * _unused) {
+    char * merged = merge_runs_into(merge_runs, merge_count);
+    pthread_mutex_lock(&lock);
+    if (! merged || ! replace_runs(merge_runs, merge_count, merged))
+	merge_error = errno;
+    merge_done = 1;
+    pthread_mutex_unlock(&lock);
+    return NULL;
+}
+
+/* wait for the merge thread to finish; returns 1 if it was successful,
+ * 0 with errno set if not */
+static int join_merge(void) {
+    int n;
+    if (! merging) return 1;
+    pthread_join(merger, NULL);
+    merging = 0;
+    for (n = 0; n < merge_count; n++)
+	free(merge_runs[n]);
+    free(merge_runs);
+    merge_runs = NULL;
+    merge_count = 0;
+    if (merge_error) {
+	errno = merge_error;
+	return 0;
+    }
+    return 1;
+}
+
+/* start merging all current runs, if there are too many (or "force" and
+ * more than one) and we aren't already doing it; returns 1 if OK, 0 with
+ * errno set */
+static int start_merge(int force) {
+    int n;
+    if (merging && merge_done && ! join_merge()) return 0;
+    if (merging) return 1;
+    if (nruns < 2 || (! force && nruns <= MAX_RUNS)) return 1;
+    merge_runs = calloc(nruns, sizeof(char *));
+    if (! merge_runs) return 0;
+    for (merge_count = 0; merge_count < nruns; merge_count++) {
+	merge_runs[merge_count] = strdup(runs[merge_count]);
+	if (! merge_runs[merge_count]) goto error;
+    }
+    merge_done = 0;
+    errno = pthread_create(&merger, NULL, merge_thread, NULL);
+    if (errno) goto error;
+    merging = 1;
+    return 1;
+error:
+    n = errno;
+    while (merge_count > 0)
+	free(merge_runs[--merge_count]);
+    free(merge_runs);
+    merge_runs = NULL;
+    errno = n;
+    return 0;
+}
+
+static int builder_add(builder_t * b, int section, const entry_t * e) {
+    if (b->count[section] >= b->size[section]) {
+	long ns = b->size[section] ? 2 * b->size[section] : 4096;
+	entry_t * ne = realloc(b->entries[section], ns * sizeof(entry_t));
+	if (! ne) return 0;
+	b->entries[section] = ne;
+	b->size[section] = ns;
+    }
+    b->entries[section][b->count[section]++] = *e;
+    stat_entries++;
+    return 1;
+}
+
+/* add a path entry, copying the name as the event may go away */
+static int builder_path(builder_t * b, entry_t * e, const char * name,
+			int len)
+{
+    if (len < 1) return 1;
+    if (b->arenalen + len > b->arenasize) {
+	size_t ns = b->arenasize ? 2 * b->arenasize : 1048576;
+	char * na;
+	while (ns < b->arenalen + len) ns *= 2;
+	na = realloc(b->arena, ns);
+	if (! na) return 0;
+	b->arena = na;
+	b->arenasize = ns;
+    }
+    memcpy(b->arena + b->arenalen, name, len);
+    /* the pointer is set when the run is written, as "arena" can move */
+    e->key = b->arenalen;
+    e->namelen = len;
+    b->arenalen += len;
+    return builder_add(b, by_path, e);
+}
+
+static long builder_entries(const builder_t * b) {
+    return b->count[by_time] + b->count[by_uid] + b->count[by_path];
+}
+
+/* write the entries in memory as a new run and add it to the manifest,
+ * together with how much of the file has been indexed; returns 1 if OK,
+ * 0 with errno set */
+static int flush_run(builder_t * b, long file, int64_t size) {
+    writer_t w;
+    char * name;
+    int s, ok = 1;
+    long n;
+    if (builder_entries(b) > 0) {
+	for (n = 0; n < b->count[by_path]; n++)
+	    b->entries[by_path][n].name =
+		b->arena + b->entries[by_path][n].key;
+	for (s = 0; s < num_sections; s++)
+	    qsort(b->entries[s], b->count[s], sizeof(entry_t), compare[s]);
+	if (! writer_open(&w)) return 0;
+	for (s = 0; ok && s < num_sections; s++)
+	    for (n = 0; ok && n < b->count[s]; n++)
+		if (! writer_add(&w, s, &b->entries[s][n])) ok = 0;
+	name = writer_close(&w, ok);
+	if (! name) return 0;
+	for (s = 0; s < num_sections; s++)
+	    b->count[s] = 0;
+	b->arenalen = 0;
+	stat_runs++;
+    } else {
+	name = NULL;
+    }
+    pthread_mutex_lock(&lock);
+    files[file].size = size;
+    ok = (! name || add_run_name(name)) && write_manifest();
+    pthread_mutex_unlock(&lock);
+    if (! ok) return 0;
+    return start_merge(0);
+}
+
+/* index the events in a file, starting where we stopped last time, so
+ * that a file which is still being written to can be added again later;
+ * returns 1 if OK, 0 with an error message printed */
+static int add_file(builder_t * b, shall_fileids_t * fileids,
+		    const char * name)
+{
+    char * full = realpath(name, NULL);
+    const char * map;
+    size_t maplen;
+    shall_event_iter_t it;
+    shall_event_t ev;
+    int64_t start;
+    long file;
+    int fd, ok;
+    if (! full) {
+	perror(name);
+	return 0;
+    }
+    for (file = 0; file < nfiles; file++)
+	if (strcmp(files[file].name, full) == 0) break;
+    if (file >= nfiles) {
+	ifile_t * nf;
+	pthread_mutex_lock(&lock);
+	nf = realloc(files, (nfiles + 1) * sizeof(ifile_t));
+	if (nf) {
+	    files = nf;
+	    files[nfiles].name = full;
+	    files[nfiles].size = 0;
+	    nfiles++;
+	}
+	pthread_mutex_unlock(&lock);
+	if (! nf) {
+	    perror(pname);
+	    free(full);
+	    return 0;
+	}
+    } else {
+	free(full);
+    }
+    fd = open(name, O_RDONLY);
+    if (fd < 0) {
+	perror(name);
+	return 0;
+    }
+    map = shall_event_map(fd, &maplen);
+    if (! map) {
+	perror(name);
+	close(fd);
+	return 0;
+    }
+    start = files[file].size;
+    if (start > maplen) {
+	fprintf(stderr, "%s: %s: file is shorter than when it was indexed\n",
+		pname, name);
+	shall_event_unmap(map, maplen);
+	close(fd);
+	return 0;
+    }
+    shall_event_iter_init(&it, map + start, maplen - start);
+    while ((ok = shall_event_next(&it, &ev)) > 0) {
+	entry_t e;
+	int n, names = ev.num_names;
+	const char * fname[2] = { NULL, NULL };
+	memset(&e, 0, sizeof(e));
+	e.sec = ev.req_sec;
+	e.nsec = ev.req_nsec;
+	e.file = file;
+	e.offset = ev.raw - map;
+	stat_events++;
+	if (! builder_add(b, by_time, &e)) goto out_error;
+	if (ev.has_creds) {
+	    e.key = ev.creds.uid;
+	    if (! builder_add(b, by_uid, &e)) goto out_error;
+	}
+	/* the second name of a symlink is its target, and a user log
+	 * contains a message, not a name */
+	if (ev.operation == SHALL_SYMLINK && names > 1) names = 1;
+	if (ev.operation == SHALL_USERLOG) names = 0;
+	for (n = 0; n < names; n++)
+	    if (! builder_path(b, &e, ev.name[n], ev.namelen[n]))
+		goto out_error;
+	switch (ev.data_type) {
+	    case SHALL_LOG_FILEID :
+		if (ev.num_names == 0)
+		    fname[0] = shall_fileids_lookup(fileids, ev.u.fileid);
+		break;
+	    case SHALL_LOG_REGION :
+	    case SHALL_LOG_HASH :
+	    case SHALL_LOG_DATA :
+		fname[0] = shall_fileids_lookup(fileids, ev.u.region.fileid);
+		break;
+	    case SHALL_LOG_CLONE :
+		fname[0] = shall_fileids_lookup(fileids, ev.u.clone.src_fileid);
+		fname[1] = shall_fileids_lookup(fileids, ev.u.clone.dst_fileid);
+		break;
+	}
+	for (n = 0; n < 2; n++)
+	    if (fname[n] && ! builder_path(b, &e, fname[n], strlen(fname[n])))
+		goto out_error;
+	if (! shall_fileids_update(fileids, &ev)) goto out_error;
+	if (builder_entries(b) >= max_entries &&
+	    ! flush_run(b, file, start + it.pos))
+		goto out_error;
+    }
+    if (ok < 0) {
+	fprintf(stderr, "%s: %s: invalid event at %lld\n",
+		pname, name, (long long)(start + it.pos));
+	goto out;
+    }
+    if (it.pos < it.len && verbose)
+	fprintf(stderr, "%s: %s: incomplete event at %lld, not indexed yet\n",
+		pname, name, (long long)(start + it.pos));
+    if (! flush_run(b, file, start + it.pos)) goto out_error;
+    shall_event_unmap(map, maplen);
+    close(fd);
+    return 1;
+out_error:
+    perror(name);
+out:
+    shall_event_unmap(map, maplen);
+    close(fd);
+    return 0;
+}
+
+/* index all files given with -a, and merge if requested; returns 1 if
+ * OK, 0 with an error message printed */
+static int update_index(void) {
+    builder_t b;
+    shall_fileids_t * fileids = shall_fileids_new();
+    char * path = index_path("lock");
+    int fd, n, ok = 1, s;
+    memset(&b, 0, sizeof(b));
+    if (! fileids || ! path) {
+	perror(pname);
+	shall_fileids_free(fileids);
+	free(path);
+	return 0;
+    }
+    if (mkdir(index_dir, 0777) < 0 && errno != EEXIST) {
+	perror(index_dir);
+	goto out_free;
+    }
+    fd = open(path, O_RDWR | O_CREAT, 0666);
+    if (fd < 0) {
+	perror(path);
+	goto out_free;
+    }
+    if (flock(fd, LOCK_EX | LOCK_NB) < 0) {
+	fprintf(stderr, "%s: %s: index is being updated by another program\n",
+		pname, index_dir);
+	close(fd);
+	goto out_free;
+    }
+    if (! read_manifest()) {
+	fprintf(stderr, "%s: %s/manifest: %s\n",
+		pname, index_dir, strerror(errno));
+	ok = 0;
+    } else {
+	remove_orphans();
+    }
+    for (n = 0; ok && n < add.count; n++)
+	ok = add_file(&b, fileids, add.values[n]);
+    if (! join_merge()) {
+	fprintf(stderr, "%s: merging runs: %s\n", pname, strerror(errno));
+	ok = 0;
+    }
+    if (ok && merge_all && nruns > 1) {
+	if (! start_merge(1) || ! join_merge()) {
+	    fprintf(stderr, "%s: merging runs: %s\n", pname, strerror(errno));
+	    ok = 0;
+	}
+    }
+    if (verbose)
+	fprintf(stderr, "%lld events, %lld entries, %lld runs written, "
+		"%lld merges, %d runs in index\n",
+		stat_events, stat_entries, stat_runs, stat_merges, nruns);
+    close(fd);
+    for (s = 0; s < num_sections; s++)
+	free(b.entries[s]);
+    free(b.arena);
+    shall_fileids_free(fileids);
+    free(path);
+    return ok;
+out_free:
+    shall_fileids_free(fileids);
+    free(path);
+    return 0;
+}
+
+/* find the first entry in a section which is not before "e" */
+static uint64_t lower_bound(const run_t * r, int section, const entry_t * e) {
+    uint64_t lo = 0, hi = r->count[section];
+    while (lo < hi) {
+	uint64_t mid = lo + (hi - lo) / 2;
+	entry_t m;
+	get_entry(r, section, mid, &m);
+	if (entry_cmp(section, &m, e) < 0)
+	    lo = mid + 1;
+	else
+	    hi = mid;
+    }
+    return lo;
+}
+
+static int add_hit(hit_t ** hits, long * nhits, long * maxhits,
+		   const entry_t * e)
+{
+    if (*nhits >= *maxhits) {
+	long nm = *maxhits ? 2 * *maxhits : 4096;
+	hit_t * nh = realloc(*hits, nm * sizeof(hit_t));
+	if (! nh) return 0;
+	*hits = nh;
+	*maxhits = nm;
+    }
+    (*hits)[*nhits].sec = e->sec;
+    (*hits)[*nhits].nsec = e->nsec;
+    (*hits)[*nhits].file = e->file;
+    (*hits)[*nhits].offset = e->offset;
+    (*nhits)++;
+    return 1;
+}
+
+/* find the matching entries in one run, using the best section */
+static int search_run(const run_t * r, hit_t ** hits, long * nhits,
+		      long * maxhits)
+{
+    int section = prefix ? by_path : uid >= 0 ? by_uid : by_time;
+    int plen = prefix ? strlen(prefix) : 0;
+    entry_t start, e;
+    uint64_t n;
+    memset(&start, 0, sizeof(start));
+    start.sec = from;
+    start.key = uid;
+    start.name = prefix;
+    start.namelen = plen;
+    if (section == by_path) start.sec = INT64_MIN;
+    for (n = lower_bound(r, section, &start); n < r->count[section]; n++) {
+	get_entry(r, section, n, &e);
+	if (section == by_path) {
+	    if (e.namelen < plen || memcmp(e.name, prefix, plen) != 0) break;
+	    if (e.sec < from || e.sec >= to) continue;
+	} else {
+	    if (section == by_uid && e.key != uid) break;
+	    if (e.sec >= to) break;
+	}
+	if (! add_hit(hits, nhits, maxhits, &e)) return 0;
+    }
+    return 1;
+}
+
+static int hit_cmp(const void * _a, const void * _b) {
+    const hit_t * a = _a, * b = _b;
+    if (a->sec != b->sec) return a->sec < b->sec ? -1 : 1;
+    if (a->nsec != b->nsec) return a->nsec < b->nsec ? -1 : 1;
+    if (a->file != b->file) return a->file < b->file ? -1 : 1;
+    if (a->offset != b->offset) return a->offset < b->offset ? -1 : 1;
+    return 0;
+}
+
+/* find the event for a hit, mapping its file the first time */
+static int find_event(mapped_t * maps, const hit_t * h, shall_event_t * ev) {
+    mapped_t * m = &maps[h->file];
+    int len;
+    if (! m->map && ! m->error) {
+	int fd = open(files[h->file].name, O_RDONLY);
+	if (fd >= 0) {
+	    m->map = shall_event_map(fd, &m->len);
+	    close(fd);
+	}
+	if (! m->map) {
+	    m->error = 1;
+	    fprintf(stderr, "%s: %s: %s\n",
+		    pname, files[h->file].name, strerror(errno));
+	}
+    }
+    if (m->error) return 0;
+    if (h->offset >= m->len) goto invalid;
+    len = shall_event_decode(m->map + h->offset, m->len - h->offset, ev);
+    if (len <= 0) goto invalid;
+    return 1;
+invalid:
+    fprintf(stderr, "%s: %s: no event at %lld, was the file changed?\n",
+	    pname, files[h->file].name, (long long)h->offset);
+    return 0;
+}
+
+/* look up the events matching the query and output them; returns 1 if
+ * OK, 0 with an error message printed */
+static int query(void) {
+    run_t * r = NULL;
+    hit_t * hits = NULL;
+    mapped_t * maps = NULL;
+    long nhits = 0, maxhits = 0, n, shown = 0;
+    shall_outbuf_t out;
+    FILE * dest = NULL;
+    int nr = 0, ok = 0, tries;
+    /* a merge could remove a run between reading the manifest and
+     * opening it, in which case we look at the new manifest */
+    for (tries = 0; tries < 10; tries++) {
+	if (! read_manifest()) {
+	    fprintf(stderr, "%s: %s/manifest: %s\n",
+		    pname, index_dir, strerror(errno));
+	    return 0;
+	}
+	r = calloc(nruns ? nruns : 1, sizeof(run_t));
+	if (! r) {
+	    perror(pname);
+	    return 0;
+	}
+	for (nr = 0; nr < nruns; nr++)
+	    if (! open_run(&r[nr], runs[nr])) break;
+	if (nr >= nruns) break;
+	if (errno != ENOENT) {
+	    fprintf(stderr, "%s: %s/%s: %s\n",
+		    pname, index_dir, runs[nr], strerror(errno));
+	    goto out;
+	}
+	while (nr > 0)
+	    close_run(&r[--nr]);
+	free(r);
+	r = NULL;
+    }
+    if (! r) {
+	fprintf(stderr, "%s: %s: index keeps changing\n", pname, index_dir);
+	return 0;
+    }
+    for (n = 0; n < nr; n++)
+	if (! search_run(&r[n], &hits, &nhits, &maxhits)) {
+	    perror(pname);
+	    goto out;
+	}
+    qsort(hits, nhits, sizeof(hit_t), hit_cmp);
+    maps = calloc(nfiles ? nfiles : 1, sizeof(mapped_t));
+    if (! maps) {
+	perror(pname);
+	goto out;
+    }
+    if (output) {
+	dest = fopen(output, "wb");
+	if (! dest) {
+	    perror(output);
+	    goto out;
+	}
+    } else if (! list) {
+	if (! shall_outbuf_init(&out, 1, 0)) {
+	    perror(pname);
+	    goto out;
+	}
+    }
+    ok = 1;
+    for (n = 0; ok && n < nhits; n++) {
+	shall_event_t ev;
+	/* an event with two matching names is found twice */
+	if (n > 0 && hit_cmp(&hits[n], &hits[n - 1]) == 0) continue;
+	if (hits[n].file >= nfiles) continue;
+	if (! find_event(maps, &hits[n], &ev)) continue;
+	if (prefix && uid >= 0 && (! ev.has_creds || ev.creds.uid != uid))
+	    continue;
+	shown++;
+	if (list) {
+	    print_name(stdout, files[hits[n].file].name);
+	    printf(" %lld\n", (long long)hits[n].offset);
+	} else if (dest) {
+	    if (fwrite(ev.raw, ev.length, 1, dest) != 1) {
+		perror(output);
+		ok = 0;
+	    }
+	} else if (records) {
+	    if (! shall_format_record(&out, &ev)) ok = 0;
+	} else {
+	    if (! shall_format_json(&out, hits[n].offset, &ev)) ok = 0;
+	}
+    }
+    if (dest) {
+	if (fclose(dest) == EOF && ok) {
+	    perror(output);
+	    ok = 0;
+	}
+    } else if (! list) {
+	if (ok && ! shall_outbuf_flush(&out)) ok = 0;
+	if (! ok) perror("(stdout)");
+	shall_outbuf_free(&out);
+    }
+    if (verbose)
+	fprintf(stderr, "%d runs, %ld entries, %ld events\n",
+		nr, nhits, shown);
+out:
+    if (maps)
+	for (n = 0; n < nfiles; n++)
+	    if (maps[n].map) shall_event_unmap(maps[n].map, maps[n].len);
+    free(maps);
+    while (nr > 0)
+	close_run(&r[--nr]);
+    free(r);
+    free(hits);
+    return ok;
+}
+
+int main(int argc, char *argv[]) {
+    const char * errmsg =
+	shall_parse_options(argc - 1, argv + 1, options, args);
+    int ok = 1;
+    pname = strrchr(argv[0], '/');
+    if (pname)
+	pname++;
+    else
+	pname = argv[0];
+    if (help) {
+	shall_print_help(stdout, pname, options, args);
+	return 0;
+    }
+    if (! errmsg && max_entries < 1)
+	errmsg = "Invalid NUMBER for -m";
+    if (! errmsg && since && ! parse_time(since, &from))
+	errmsg = "Invalid TIME for -t";
+    if (! errmsg && until && ! parse_time(until, &to))
+	errmsg = "Invalid TIME for -T";
+    if (! errmsg && (list + records + (output != NULL)) > 1)
+	errmsg = "Can only specify one of -l, -o and -R";
+    if (errmsg) {
+	fprintf(stderr, "%s: %s\nUse \"%s -h\" for help\n",
+		pname, errmsg, pname);
+	return 1;
+    }
+    if (add.count > 0 || merge_all)
+	ok = update_index();
+    /* just updating the index unless there is something to look for */
+    if (ok && ((add.count == 0 && ! merge_all) || prefix || uid >= 0 ||
+	       since || until || list || records || output))
+	ok = query();
+    free_manifest();
+    free(add.values);
+    return ok ? 0 : 1;
+}
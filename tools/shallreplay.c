@@ -0,0 +1,1427 @@
+/* replays the events in a file produced by readshallfs or shalldrain onto a
+ * mirror directory
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ *
+ * this file is part of SHALLFS
+ *
+ * Copyright (c) 2017-2019 Claudio Calvelli <shallfs@gladserv.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 2 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program (see the file COPYING in the distribution).
+ * If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#define _GNU_SOURCE /* for copy_file_range and renameat2 */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <limits.h>
+#include <errno.h>
+#include <string.h>
+#include <endian.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <sys/xattr.h>
+#include "shallfs-common.h"
+#include "shallfs-event.h"
+#include <shallfs/operation.h>
+#include <shallfs/device.h>
+
+/* the main thread reads the events in order and adds the ones which
+ * change something to a window of pending operations; each operation
+ * waits for all earlier pending operations which touch the same path, a
+ * directory containing it, or a file inside it, so operations on
+ * unrelated files run in parallel but the result is the same as applying
+ * them in order; file IDs are translated to names while reading, so
+ * WRITEs follow renames of the file; the checkpoint is the position of
+ * the first event whose operation is not complete */
+
+/* operations complete out of order, so after a restart the events from
+ * the checkpoint include some which have already been done, and doing
+ * them again could be wrong: a later MOVE may have changed the names they
+ * refer to; so each operation is recorded in CHECKPOINT.log when it is
+ * complete, before any operation waiting for it can start, and skipped
+ * after a restart; each checkpoint copies the records still needed from
+ * the log, and then starts a new log
+ *
+ * MOVE and SWAP can't just be repeated if they were done but not recorded:
+ * the source may have been created again since, and a SWAP would swap
+ * back; so before doing one we also record (and sync) which files the
+ * names referred to, and after a restart an operation whose names no
+ * longer refer to those files has already been done */
+typedef struct {
+    off_t offset;			/* position of event in file */
+    dev_t dev[2];
+    ino_t ino[2];			/* 0 if the name did not exist */
+} intent_t;
+
+typedef struct op_s op_t;
+struct op_s {
+    op_t * next;			/* in window, in journal order */
+    op_t * next_ready;
+    off_t offset;			/* position of event in file */
+    shall_event_t ev;
+    char * path[2];			/* as logged, starting with '/' */
+    int pathlen[2];
+    int npaths;
+    char * extra;			/* symlink target, xattr name */
+    int has_intent;			/* "intent" is in CHECKPOINT.log */
+    intent_t intent;
+    int recorded;			/* complete, in CHECKPOINT.log */
+    int waiting;			/* earlier operations not done */
+    int done;
+    int ndeps;
+    int maxdeps;
+    op_t ** deps;			/* operations waiting for this */
+};
+
+#define COPY_BUFFER 1048576
+
+static long help = 0, verbose = 0, before = 0, threads = 4;
+static long window = 1024, interval = 10;
+static const char * events = NULL, * source = NULL, * mirror = NULL;
+static const char * checkpoint = NULL;
+
+static const shall_options_t options[] = {
+    { 'B', &before,          NULL,
+      "Apply events logged before the operation, instead of after" },
+    { 'c', NULL,             "CHECKPOINT",
+      "Record progress in CHECKPOINT, and restart from there",
+      &checkpoint },
+    { 'h', &help,            NULL,
+      "Print this helpful message" },
+    { 'i', &interval,        "SECONDS",
+      "Update CHECKPOINT every SECONDS (default 10)" },
+    { 'j', &threads,         "THREADS",
+      "Apply operations using THREADS threads (default 4)" },
+    { 'v', &verbose,         NULL,
+      "Print each operation applied" },
+    { 'w', &window,          "NUMBER",
+      "Keep at most NUMBER operations pending (default 1024)" },
+    {  0,  NULL,             NULL, NULL }
+};
+
+static const shall_args_t args[] = {
+    { &events,   "EVENTS",  1,
+      "File containing events, produced by readshallfs or shalldrain" },
+    { &source,   "SOURCE",  1,
+      "Directory to copy written data from (the filesystem logged)" },
+    { &mirror,   "MIRROR",  1,
+      "Directory to apply the operations to" },
+    { NULL,      NULL,           0, NULL }
+};
+
+static const char * pname;
+static int srcfd, mirfd;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+/* the following are protected by "lock" */
+static op_t * first = NULL, * last = NULL;
+static op_t * ready_first = NULL, * ready_last = NULL;
+static int pending = 0;
+static int stopping = 0;
+static long errors = 0;
+/* CHECKPOINT.log, and the fields "recorded", "has_intent" and "intent"
+ * of the operations in the window, are protected by "log_lock" */
+static pthread_mutex_t log_lock = PTHREAD_MUTEX_INITIALIZER;
+static char * log_name = NULL, * old_log_name = NULL;
+static int log_fd = -1;
+/* records written without syncing only survive if the system was not
+ * restarted, so the log starts with the boot ID */
+static char boot_id[64] = "";
+/* records from an earlier run, sorted by offset */
+static intent_t * old_intents = NULL;
+static size_t n_old_intents = 0, max_old_intents = 0;
+static off_t * old_done = NULL;
+static size_t n_old_done = 0, max_old_done = 0;
+
+/* the changes of name after each event, so that a WRITE can find its
+ * data in SOURCE if the file has been renamed since: "other" is the new
+ * name of "key" and of anything inside it, or NULL if it was deleted;
+ * sorted by key, then offset */
+typedef struct {
+    const char * key;			/* not NUL-terminated */
+    int keylen;
+    off_t offset;
+    const char * other;			/* not NUL-terminated */
+    int otherlen;
+} rename_t;
+
+static rename_t * renames = NULL;
+static size_t n_renames = 0, max_renames = 0;
+
+/* with -B we apply the events logged before each operation, otherwise
+ * the successful ones logged after it; never both, as with log=twice
+ * that would apply every operation twice */
+static inline int wanted(const shall_event_t * ev) {
+    return before ? ev->before : ! ev->before && ev->result >= 0;
+}
+
+/* open the directory containing a path (as logged, starting with '/')
+ * inside "root", one component at a time and without following symbolic
+ * links, so that a name in the journal can never lead outside "root";
+ * ".." is refused; "*base" is set to the last component, inside "path";
+ * returns a descriptor to pass to close_parent, or -1 with errno set */
+static int open_parent(int root, const char * path, const char ** base) {
+    int dfd = root;
+    while (*path == '/') path++;
+    if (! *path) {
+	*base = ".";
+	return root;
+    }
+    while (1) {
+	const char * end = strchrnul(path, '/'), * next = end;
+	size_t len = end - path;
+	char comp[NAME_MAX + 1];
+	int nfd;
+	while (*next == '/') next++;
+	if (len == 2 && path[0] == '.' && path[1] == '.') {
+	    errno = EPERM;
+	    goto error;
+	}
+	if (! *next) {
+	    *base = path;
+	    return dfd;
+	}
+	if (len > NAME_MAX) {
+	    errno = ENAMETOOLONG;
+	    goto error;
+	}
+	memcpy(comp, path, len);
+	comp[len] = 0;
+	nfd = openat(dfd, comp,
+		     O_PATH | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+	if (nfd < 0) goto error;
+	if (dfd != root) close(dfd);
+	dfd = nfd;
+	path = next;
+    }
+error:
+    if (dfd != root) {
+	int sve = errno;
+	close(dfd);
+	errno = sve;
+    }
+    return -1;
+}
+
+static void close_parent(int root, int dfd) {
+    if (dfd >= 0 && dfd != root) close(dfd);
+}
+
+static void report(const char * what, const char * path) {
+    int sve = errno;
+    fprintf(stderr, "%s: %s %s: %s\n", pname, what, path, strerror(sve));
+    pthread_mutex_lock(&lock);
+    errors++;
+    pthread_mutex_unlock(&lock);
+}
+
+/* copy a region from one file to another, without going through user
+ * space if the kernel can do that; stops early at the end of the input,
+ * which may have been truncated since the data was written */
+static int copy_region(int in, off_t in_start, int out, off_t out_start,
+		       int64_t length)
+{
+    char * buffer = NULL;
+    while (length > 0) {
+	ssize_t nr;
+	loff_t ip = in_start, op = out_start;
+	if (! buffer) {
+	    nr = copy_file_range(in, &ip, out, &op, length, 0);
+	    if (nr < 0 && (errno == EXDEV || errno == ENOSYS ||
+			   errno == EINVAL || errno == EOPNOTSUPP))
+	    {
+		/* the kernel can't, do it the slow way */
+		buffer = malloc(COPY_BUFFER);
+		if (! buffer) return 0;
+		continue;
+	    }
+	} else {
+	    nr = pread(in, buffer,
+		       length < COPY_BUFFER ? length : COPY_BUFFER, in_start);
+	    if (nr > 0 && pwrite(out, buffer, nr, out_start) != nr)
+		nr = -1;
+	}
+	if (nr < 0) {
+	    if (errno == EINTR) continue;
+	    free(buffer);
+	    return 0;
+	}
+	if (nr == 0) break;
+	in_start += nr;
+	out_start += nr;
+	length -= nr;
+    }
+    free(buffer);
+    return 1;
+}
+
+/* convert a SET_ACL event to the extended attribute used by Linux */
+static int set_acl(const char * path, const shall_event_acl_t * acl) {
+    int count = acl->count + (acl->count > 0 ? 4 : 3), n, k = 0;
+    size_t len = 4 + 8 * count;
+    unsigned char * value = malloc(len), * ptr;
+    const char * name = acl->access ? "system.posix_acl_access"
+				    : "system.posix_acl_default";
+    int ok, sve;
+#define put_entry(tag, perm, id) \
+    do { \
+	uint16_t t = htole16(tag), p = htole16((perm) & 7); \
+	uint32_t i = htole32(id); \
+	ptr = value + 4 + 8 * k++; \
+	memcpy(ptr, &t, 2); \
+	memcpy(ptr + 2, &p, 2); \
+	memcpy(ptr + 4, &i, 4); \
+    } while (0)
+    if (! value) return 0;
+    memcpy(value, "\2\0\0\0", 4);
+    /* the entries must be sorted by tag, then ID */
+    put_entry(0x01, acl->perm, -1);
+    for (n = 0; n < acl->count; n++) {
+	int perm, is_group, id;
+	id = shall_event_acl_entry(acl, n, &perm, &is_group);
+	if (! is_group) put_entry(0x02, perm, id);
+    }
+    put_entry(0x04, acl->perm >> 7, -1);
+    for (n = 0; n < acl->count; n++) {
+	int perm, is_group, id;
+	id = shall_event_acl_entry(acl, n, &perm, &is_group);
+	if (is_group) put_entry(0x08, perm, id);
+    }
+    if (acl->count > 0) put_entry(0x10, acl->perm >> 21, -1);
+    put_entry(0x20, acl->perm >> 14, -1);
+#undef put_entry
+    ok = lsetxattr(path, name, value, len, 0) == 0;
+    sve = errno;
+    free(value);
+    errno = sve;
+    return ok;
+}
+
+static int format_intent(char * line, size_t size, const intent_t * it) {
+    return snprintf(line, size, "I %lld %llu %llu %llu %llu\n",
+		    (long long)it->offset,
+		    (unsigned long long)it->dev[0],
+		    (unsigned long long)it->ino[0],
+		    (unsigned long long)it->dev[1],
+		    (unsigned long long)it->ino[1]);
+}
+
+/* append an intent to CHECKPOINT.log and make sure it is on disk before
+ * the operation is done; returns 1 if OK, 0 with errno set */
+static int record_intent(op_t * op) {
+    char line[128];
+    int len, ok;
+    len = format_intent(line, sizeof(line), &op->intent);
+    pthread_mutex_lock(&log_lock);
+    ok = write(log_fd, line, len) == len && fdatasync(log_fd) == 0;
+    if (ok) op->has_intent = 1;
+    pthread_mutex_unlock(&log_lock);
+    return ok;
+}
+
+/* append to CHECKPOINT.log that an operation is complete; this is not
+ * synced, as the operation itself may not be on disk yet: after a crash
+ * only the records copied to the checkpoint count */
+static void record_done(op_t * op) {
+    char line[32];
+    int len = snprintf(line, sizeof(line), "D %lld\n", (long long)op->offset);
+    pthread_mutex_lock(&log_lock);
+    if (write(log_fd, line, len) == len)
+	op->recorded = 1;
+    else
+	report("record", log_name);
+    pthread_mutex_unlock(&log_lock);
+}
+
+/* before a MOVE or SWAP, if we have a checkpoint: if an earlier run
+ * recorded which files the names referred to, and they don't any more,
+ * the operation has already been done; otherwise record them now;
+ * returns 1 if the operation needs doing */
+static int check_intent(op_t * op, int d0, const char * b0,
+			int d1, const char * b1)
+{
+    intent_t now;
+    struct stat sbuff;
+    if (! checkpoint) return 1;
+    memset(&now, 0, sizeof(now));
+    now.offset = op->offset;
+    if (d0 >= 0 && fstatat(d0, b0, &sbuff, AT_SYMLINK_NOFOLLOW) == 0) {
+	now.dev[0] = sbuff.st_dev;
+	now.ino[0] = sbuff.st_ino;
+    }
+    if (op->ev.operation == SHALL_SWAP && d1 >= 0 &&
+	fstatat(d1, b1, &sbuff, AT_SYMLINK_NOFOLLOW) == 0)
+    {
+	now.dev[1] = sbuff.st_dev;
+	now.ino[1] = sbuff.st_ino;
+    }
+    if (op->has_intent) {
+	if (now.dev[0] == op->intent.dev[0] &&
+	    now.ino[0] == op->intent.ino[0] &&
+	    now.dev[1] == op->intent.dev[1] &&
+	    now.ino[1] == op->intent.ino[1])
+		return 1;
+	if (verbose) {
+	    pthread_mutex_lock(&lock);
+	    printf("%-10s %s already done\n",
+		   shall_event_opname(op->ev.operation), op->path[0]);
+	    pthread_mutex_unlock(&lock);
+	}
+	return 0;
+    }
+    op->intent = now;
+    if (record_intent(op)) return 1;
+    report("record", log_name);
+    return 0;
+}
+
+/* look up the first change of name of "key" after "offset" */
+static int compare_rename(const void * _a, const void * _b) {
+    const rename_t * a = _a, * b = _b;
+    int len = a->keylen < b->keylen ? a->keylen : b->keylen;
+    int cmp = memcmp(a->key, b->key, len);
+    if (cmp) return cmp;
+    if (a->keylen != b->keylen) return a->keylen < b->keylen ? -1 : 1;
+    return a->offset < b->offset ? -1 : a->offset > b->offset;
+}
+
+static const rename_t * next_rename(const char * key, int keylen,
+				    off_t offset)
+{
+    rename_t want = { key, keylen, offset + 1, NULL, 0 };
+    size_t lo = 0, hi = n_renames;
+    while (lo < hi) {
+	size_t mid = lo + (hi - lo) / 2;
+	if (compare_rename(&renames[mid], &want) < 0)
+	    lo = mid + 1;
+	else
+	    hi = mid;
+    }
+    if (lo < n_renames && renames[lo].keylen == keylen &&
+	memcmp(renames[lo].key, key, keylen) == 0)
+	    return &renames[lo];
+    return NULL;
+}
+
+/* find the name a file has after the last event, following any later
+ * MOVE or SWAP of the file or of a directory containing it; returns a
+ * new string, or NULL with errno == 0 if the file was deleted later, or
+ * with errno set on error */
+static char * current_name(const char * path, off_t offset) {
+    char * name = strdup(path);
+    if (! name) return NULL;
+    while (1) {
+	const rename_t * best = NULL;
+	int len = strlen(name), bestlen = 0, n;
+	char * nn;
+	for (n = len; n > 0; n--) {
+	    const rename_t * r;
+	    if (n < len && name[n] != '/') continue;
+	    r = next_rename(name, n, offset);
+	    if (r && (! best || r->offset < best->offset)) {
+		best = r;
+		bestlen = n;
+	    }
+	}
+	if (! best) return name;
+	offset = best->offset;
+	if (! best->other) {
+	    free(name);
+	    errno = 0;
+	    return NULL;
+	}
+	nn = malloc(best->otherlen + len - bestlen + 1);
+	if (! nn) {
+	    free(name);
+	    return NULL;
+	}
+	memcpy(nn, best->other, best->otherlen);
+	strcpy(nn + best->otherlen, name + bestlen);
+	free(name);
+	name = nn;
+    }
+}
+
+/* copy the data for a WRITE from SOURCE, where the file may have a
+ * different name by now */
+static void copy_source(const op_t * op, int fd) {
+    const shall_event_region_t * er = &op->ev.u.region;
+    const char * base;
+    char * name = current_name(op->path[0], op->offset);
+    int dfd, in;
+    if (! name) {
+	/* if it was deleted later, nobody will miss the data */
+	if (errno) report("copy", op->path[0]);
+	return;
+    }
+    dfd = open_parent(srcfd, name, &base);
+    in = dfd < 0 ? -1 : openat(dfd, base, O_RDONLY | O_NOFOLLOW);
+    if (in < 0) {
+	report("open source", name);
+    } else {
+	if (! copy_region(in, er->start, fd, er->start, er->length))
+	    report("copy", op->path[0]);
+	close(in);
+    }
+    close_parent(srcfd, dfd);
+    free(name);
+}
+
+/* set extended attributes without following symbolic links: there are no
+ * *at() versions of the xattr calls, so we go through the directory we
+ * opened safely */
+static char * xattr_path(int dfd, const char * base) {
+    char * full = malloc(strlen(base) + 32);
+    if (full) sprintf(full, "/proc/self/fd/%d/%s", dfd, base);
+    return full;
+}
+
+/* apply one operation to the mirror; errors are reported, and errors
+ * which just mean the operation was already done (because we restarted
+ * from a checkpoint) are ignored; names are looked up with open_parent,
+ * so they can't lead outside the mirror */
+static void apply(op_t * op) {
+    const shall_event_t * ev = &op->ev;
+    const shall_event_attr_t * at = &ev->u.attr;
+    const char * p0 = op->path[0];
+    const char * p1 = op->npaths > 1 ? op->path[1] : NULL;
+    const char * b0 = NULL, * b1 = NULL;
+    char * full = NULL;
+    struct stat sbuff;
+    int fd, in, d0, d1 = -1, renaming;
+    if (verbose) {
+	pthread_mutex_lock(&lock);
+	printf("%-10s %s%s%s\n", shall_event_opname(ev->operation),
+	       p0, p1 || op->extra ? " " : "",
+	       p1 ? p1 : op->extra ? op->extra : "");
+	pthread_mutex_unlock(&lock);
+    }
+    /* a missing directory may just mean that this was already done;
+     * MOVE and SWAP check below */
+    renaming = ev->operation == SHALL_MOVE || ev->operation == SHALL_SWAP;
+    d0 = open_parent(mirfd, p0, &b0);
+    if (d0 < 0) {
+	if (errno == ENOENT &&
+	    (ev->operation == SHALL_DELETE || ev->operation == SHALL_RMDIR))
+		return;
+	if (errno != ENOENT || ! renaming) {
+	    report("lookup", p0);
+	    return;
+	}
+    }
+    if (p1) {
+	d1 = open_parent(mirfd, p1, &b1);
+	if (d1 < 0 && (errno != ENOENT || ! renaming)) {
+	    report("lookup", p1);
+	    goto out;
+	}
+    }
+    switch (ev->operation) {
+	case SHALL_META :
+	    if (ev->data_type != SHALL_LOG_ATTR) break;
+	    if (at->flags & shall_attr_size) {
+		fd = openat(d0, b0, O_WRONLY | O_NOFOLLOW | O_NONBLOCK);
+		if (fd < 0 || ftruncate(fd, at->size) < 0)
+		    report("truncate", p0);
+		if (fd >= 0) close(fd);
+	    }
+	    /* symbolic links have no mode to change */
+	    if ((at->flags & shall_attr_mode) &&
+		(fstatat(d0, b0, &sbuff, AT_SYMLINK_NOFOLLOW) < 0 ||
+		 (! S_ISLNK(sbuff.st_mode) &&
+		  fchmodat(d0, b0, at->mode & 07777,
+			   AT_SYMLINK_NOFOLLOW) < 0)))
+		    report("chmod", p0);
+	    if ((at->flags & (shall_attr_user | shall_attr_group)) &&
+		fchownat(d0, b0,
+			 (at->flags & shall_attr_user) ? at->user : -1,
+			 (at->flags & shall_attr_group) ? at->group : -1,
+			 AT_SYMLINK_NOFOLLOW) < 0)
+		    report("chown", p0);
+	    if (at->flags & (shall_attr_atime | shall_attr_mtime)) {
+		struct timespec ts[2];
+		ts[0].tv_sec = at->atime_sec;
+		ts[0].tv_nsec = (at->flags & shall_attr_atime)
+			      ? at->atime_nsec : UTIME_OMIT;
+		ts[1].tv_sec = at->mtime_sec;
+		ts[1].tv_nsec = (at->flags & shall_attr_mtime)
+			      ? at->mtime_nsec : UTIME_OMIT;
+		if (utimensat(d0, b0, ts, AT_SYMLINK_NOFOLLOW) < 0)
+		    report("utimes", p0);
+	    }
+	    break;
+	case SHALL_MKNOD : {
+	    mode_t mode = at->mode;
+	    dev_t dev = makedev((uint64_t)at->size >> 32,
+				at->size & 0xffffffff);
+	    if (! (mode & S_IFMT))
+		mode |= (at->flags & shall_attr_block) ? S_IFBLK
+			: (at->flags & shall_attr_char) ? S_IFCHR : S_IFIFO;
+	    if (mknodat(d0, b0, mode, dev) < 0 && errno != EEXIST)
+		report("mknod", p0);
+	    break;
+	}
+	case SHALL_MKDIR :
+	    if (mkdirat(d0, b0, at->mode & 07777) < 0 && errno != EEXIST)
+		report("mkdir", p0);
+	    break;
+	case SHALL_LINK :
+	    if (linkat(d0, b0, d1, b1, 0) < 0 && errno != EEXIST)
+		report("link", p1);
+	    break;
+	case SHALL_SYMLINK :
+	    if (symlinkat(op->extra, d0, b0) < 0 && errno != EEXIST)
+		report("symlink", p0);
+	    break;
+	case SHALL_CREATE :
+	    fd = openat(d0, b0, O_WRONLY | O_CREAT | O_NOFOLLOW | O_NONBLOCK,
+			at->mode & 07777);
+	    if (fd < 0)
+		report("create", p0);
+	    else
+		close(fd);
+	    break;
+	case SHALL_DELETE :
+	    if (unlinkat(d0, b0, 0) < 0 && errno != ENOENT)
+		report("delete", p0);
+	    break;
+	case SHALL_RMDIR :
+	    if (unlinkat(d0, b0, AT_REMOVEDIR) < 0 && errno != ENOENT)
+		report("rmdir", p0);
+	    break;
+	case SHALL_WRITE : {
+	    const shall_event_region_t * er = &ev->u.region;
+	    fd = openat(d0, b0, O_WRONLY | O_CREAT | O_NOFOLLOW | O_NONBLOCK,
+			0600);
+	    if (fd < 0) {
+		report("open", p0);
+		break;
+	    }
+	    if (er->data) {
+		if (pwrite(fd, er->data, er->length, er->start) != er->length)
+		    report("write", p0);
+	    } else {
+		copy_source(op, fd);
+	    }
+	    close(fd);
+	    break;
+	}
+	case SHALL_CLONE : {
+	    const shall_event_clone_t * ec = &ev->u.clone;
+	    in = openat(d0, b0, O_RDONLY | O_NOFOLLOW | O_NONBLOCK);
+	    if (in < 0) {
+		report("open", p0);
+		break;
+	    }
+	    fd = openat(d1, b1, O_WRONLY | O_CREAT | O_NOFOLLOW | O_NONBLOCK,
+			0600);
+	    if (fd < 0) {
+		report("open", p1);
+	    } else {
+		if (! copy_region(in, ec->src_start, fd, ec->dst_start,
+				  ec->length))
+		    report("clone", p1);
+		close(fd);
+	    }
+	    close(in);
+	    break;
+	}
+	case SHALL_MOVE :
+	    if (! check_intent(op, d0, b0, d1, b1)) break;
+	    if (d1 < 0) {
+		report("lookup", p1);
+		break;
+	    }
+	    /* if the source has gone and the target exists, we've already
+	     * done this before the last checkpoint */
+	    if (d0 < 0)
+		errno = ENOENT;
+	    else if (renameat(d0, b0, d1, b1) == 0)
+		break;
+	    if (errno != ENOENT ||
+		fstatat(d1, b1, &sbuff, AT_SYMLINK_NOFOLLOW) < 0)
+		    report("rename", p0);
+	    break;
+	case SHALL_SWAP :
+	    if (! check_intent(op, d0, b0, d1, b1)) break;
+	    if (d0 < 0 || d1 < 0) {
+		report("lookup", d0 < 0 ? p0 : p1);
+		break;
+	    }
+	    if (renameat2(d0, b0, d1, b1, RENAME_EXCHANGE) < 0)
+		report("exchange", p0);
+	    break;
+	case SHALL_SET_ACL :
+	case SHALL_SET_XATTR :
+	case SHALL_DEL_XATTR :
+	    full = xattr_path(d0, b0);
+	    if (! full) {
+		report("xattr", p0);
+		break;
+	    }
+	    if (ev->operation == SHALL_SET_ACL) {
+		if (ev->data_type == SHALL_LOG_ACL &&
+		    ! set_acl(full, &ev->u.acl))
+		    report("setfacl", p0);
+	    } else if (ev->operation == SHALL_SET_XATTR) {
+		const shall_event_xattr_t * ex = &ev->u.xattr;
+		char * name;
+		if (ev->data_type != SHALL_LOG_XATTR) break;
+		name = strndup(ex->name, ex->namelen);
+		if (! name ||
+		    lsetxattr(full, name, ex->value, ex->valuelen, 0) < 0)
+		    report("setxattr", p0);
+		free(name);
+	    } else {
+		if (lremovexattr(full, op->extra) < 0 && errno != ENODATA)
+		    report("removexattr", p0);
+	    }
+	    free(full);
+	    break;
+    }
+out:
+    close_parent(mirfd, d0);
+    close_parent(mirfd, d1);
+}
+
+/* check if one path is the same as the other, or inside it */
+static int related(const char * a, int la, const char * b, int lb) {
+    if (la > lb) {
+	const char * t = a;
+	int lt = la;
+	a = b;
+	la = lb;
+	b = t;
+	lb = lt;
+    }
+    if (strncmp(a, b, la) != 0) return 0;
+    return la == lb || b[la] == '/' || (la > 0 && a[la - 1] == '/');
+}
+
+static int conflicts(const op_t * a, const op_t * b) {
+    int i, j;
+    for (i = 0; i < a->npaths; i++)
+	for (j = 0; j < b->npaths; j++)
+	    if (related(a->path[i], a->pathlen[i],
+			b->path[j], b->pathlen[j]))
+		return 1;
+    return 0;
+}
+
+static void free_op(op_t * op) {
+    free(op->path[0]);
+    free(op->path[1]);
+    free(op->extra);
+    free(op->deps);
+    free(op);
+}
+
+/* add a path to an operation; returns 1 if OK, 0 if out of memory */
+static int add_path(op_t * op, const char * name, int len) {
+    op->path[op->npaths] = strndup(name, len);
+    if (! op->path[op->npaths]) return 0;
+    op->pathlen[op->npaths] = len;
+    op->npaths++;
+    return 1;
+}
+
+/* same, for a file ID; returns 1 if OK, 0 if out of memory or the file ID
+ * is not known, for example because the OPEN was not in the journal */
+static int add_fileid(op_t * op, const shall_fileids_t * fileids,
+		      int fileid)
+{
+    const char * name = shall_fileids_lookup(fileids, fileid);
+    if (! name) {
+	fprintf(stderr, "%s: unknown file ID %d at %lld\n",
+		pname, fileid, (long long)op->offset);
+	pthread_mutex_lock(&lock);
+	errors++;
+	pthread_mutex_unlock(&lock);
+	errno = 0;
+	return 0;
+    }
+    return add_path(op, name, strlen(name));
+}
+
+/* check if an earlier run completed the operation for an event */
+static int find_done(off_t offset) {
+    size_t lo = 0, hi = n_old_done;
+    while (lo < hi) {
+	size_t mid = lo + (hi - lo) / 2;
+	if (old_done[mid] < offset)
+	    lo = mid + 1;
+	else
+	    hi = mid;
+    }
+    return lo < n_old_done && old_done[lo] == offset;
+}
+
+/* find an intent recorded by an earlier run */
+static const intent_t * find_intent(off_t offset) {
+    size_t lo = 0, hi = n_old_intents;
+    while (lo < hi) {
+	size_t mid = lo + (hi - lo) / 2;
+	if (old_intents[mid].offset < offset)
+	    lo = mid + 1;
+	else
+	    hi = mid;
+    }
+    if (lo < n_old_intents && old_intents[lo].offset == offset)
+	return &old_intents[lo];
+    return NULL;
+}
+
+/* prepare the operation for an event, if there is something to do;
+ * returns NULL with errno == 0 if not, with errno set on error */
+static op_t * make_op(const shall_event_t * ev, off_t offset,
+		      const shall_fileids_t * fileids)
+{
+    op_t * op;
+    int ok = 1;
+    errno = 0;
+    if (! wanted(ev)) return NULL;
+    switch (ev->operation) {
+	case SHALL_META :
+	case SHALL_MKNOD :
+	case SHALL_MKDIR :
+	case SHALL_CREATE :
+	case SHALL_DELETE :
+	case SHALL_RMDIR :
+	case SHALL_SET_ACL :
+	case SHALL_SET_XATTR :
+	    if (ev->num_names < 1) return NULL;
+	    break;
+	case SHALL_LINK :
+	case SHALL_SYMLINK :
+	case SHALL_MOVE :
+	case SHALL_SWAP :
+	case SHALL_DEL_XATTR :
+	    if (ev->num_names < 2) return NULL;
+	    break;
+	case SHALL_WRITE :
+	    if (ev->data_type != SHALL_LOG_REGION &&
+		ev->data_type != SHALL_LOG_HASH &&
+		ev->data_type != SHALL_LOG_DATA)
+		    return NULL;
+	    break;
+	case SHALL_CLONE :
+	    if (ev->data_type != SHALL_LOG_CLONE) return NULL;
+	    break;
+	default :
+	    return NULL;
+    }
+    if (find_done(offset)) return NULL;
+    op = calloc(1, sizeof(*op));
+    if (! op) return NULL;
+    op->offset = offset;
+    op->ev = *ev;
+    switch (ev->operation) {
+	case SHALL_WRITE :
+	    ok = add_fileid(op, fileids, ev->u.region.fileid);
+	    break;
+	case SHALL_CLONE :
+	    ok = add_fileid(op, fileids, ev->u.clone.src_fileid) &&
+		 add_fileid(op, fileids, ev->u.clone.dst_fileid);
+	    break;
+	case SHALL_SYMLINK :
+	case SHALL_DEL_XATTR :
+	    /* the second name is not a path */
+	    ok = add_path(op, ev->name[0], ev->namelen[0]);
+	    if (ok) {
+		op->extra = strndup(ev->name[1], ev->namelen[1]);
+		ok = op->extra != NULL;
+	    }
+	    break;
+	default :
+	    ok = add_path(op, ev->name[0], ev->namelen[0]);
+	    if (ok && ev->num_names > 1)
+		ok = add_path(op, ev->name[1], ev->namelen[1]);
+	    break;
+    }
+    if (! ok) {
+	int sve = errno;
+	free_op(op);
+	errno = sve;
+	return NULL;
+    }
+    if (ev->operation == SHALL_MOVE || ev->operation == SHALL_SWAP) {
+	const intent_t * it = find_intent(offset);
+	if (it) {
+	    op->intent = *it;
+	    op->has_intent = 1;
+	}
+    }
+    return op;
+}
+
+/* called with "lock" held */
+static void make_ready(op_t * op) {
+    op->next_ready = NULL;
+    if (ready_last)
+	ready_last->next_ready = op;
+    else
+	ready_first = op;
+    ready_last = op;
+    pthread_cond_broadcast(&cond);
+}
+
+/* add an operation to the window, after all the earlier ones it must
+ * wait for; called with "lock" held; returns 1 if OK, 0 if out of memory */
+static int schedule(op_t * op) {
+    op_t * e;
+    for (e = first; e; e = e->next) {
+	if (e->done || ! conflicts(e, op)) continue;
+	if (e->ndeps >= e->maxdeps) {
+	    int nm = e->maxdeps + 8;
+	    op_t ** nd = realloc(e->deps, nm * sizeof(op_t *));
+	    if (! nd) return 0;
+	    e->deps = nd;
+	    e->maxdeps = nm;
+	}
+	e->deps[e->ndeps++] = op;
+	op->waiting++;
+    }
+    op->next = NULL;
+    if (last)
+	last->next = op;
+    else
+	first = op;
+    last = op;
+    pending++;
+    if (! op->waiting) make_ready(op);
+    return 1;
+}
+
+/* remove the operations at the start of the window which are complete;
+ * called with "lock" held */
+static void retire(void) {
+    while (first && first->done) {
+	op_t * op = first;
+	first = op->next;
+	if (! first) last = NULL;
+	pending--;
+	free_op(op);
+    }
+}
+
+static void * worker_thread(void * _unused) {
+    while (1) {
+	op_t * op;
+	int n;
+	pthread_mutex_lock(&lock);
+	while (! ready_first && ! stopping)
+	    pthread_cond_wait(&cond, &lock);
+	op = ready_first;
+	if (! op) {
+	    pthread_mutex_unlock(&lock);
+	    return NULL;
+	}
+	ready_first = op->next_ready;
+	if (! ready_first) ready_last = NULL;
+	pthread_mutex_unlock(&lock);
+	apply(op);
+	/* the record must be there before any operation which waits for
+	 * this one can start */
+	if (checkpoint) record_done(op);
+	pthread_mutex_lock(&lock);
+	op->done = 1;
+	for (n = 0; n < op->ndeps; n++)
+	    if (--op->deps[n]->waiting == 0)
+		make_ready(op->deps[n]);
+	pthread_cond_broadcast(&cond);
+	pthread_mutex_unlock(&lock);
+    }
+}
+
+static int add_done(off_t offset) {
+    if (n_old_done >= max_old_done) {
+	size_t nm = max_old_done + 256;
+	off_t * nd = realloc(old_done, nm * sizeof(off_t));
+	if (! nd) return 0;
+	old_done = nd;
+	max_old_done = nm;
+    }
+    old_done[n_old_done++] = offset;
+    return 1;
+}
+
+static int add_intent(const intent_t * it) {
+    if (n_old_intents >= max_old_intents) {
+	size_t nm = max_old_intents + 64;
+	intent_t * ni = realloc(old_intents, nm * sizeof(intent_t));
+	if (! ni) return 0;
+	old_intents = ni;
+	max_old_intents = nm;
+    }
+    old_intents[n_old_intents++] = *it;
+    return 1;
+}
+
+/* read the records for events from "start" in the checkpoint or in a
+ * log; the completed operations are ignored unless "trust_done"; a line
+ * without newline was never finished, and ends the file */
+static int read_records(FILE * F, off_t start, int trust_done) {
+    char line[128];
+    while (fgets(line, sizeof(line), F)) {
+	long long offset;
+	unsigned long long dev0, ino0, dev1, ino1;
+	if (! strchr(line, '\n')) break;
+	if (sscanf(line, "D %lld", &offset) == 1) {
+	    if (trust_done && offset >= start && ! add_done(offset))
+		return 0;
+	} else if (sscanf(line, "I %lld %llu %llu %llu %llu",
+			  &offset, &dev0, &ino0, &dev1, &ino1) == 5)
+	{
+	    intent_t it;
+	    if (offset < start) continue;
+	    it.offset = offset;
+	    it.dev[0] = dev0;
+	    it.ino[0] = ino0;
+	    it.dev[1] = dev1;
+	    it.ino[1] = ino1;
+	    if (! add_intent(&it)) return 0;
+	} else {
+	    errno = EINVAL;
+	    return 0;
+	}
+    }
+    return 1;
+}
+
+/* read the checkpoint; a missing file means start from the beginning */
+static int read_checkpoint(off_t * offset) {
+    FILE * F = fopen(checkpoint, "r");
+    long long val;
+    int ok;
+    *offset = 0;
+    if (! F) return errno == ENOENT;
+    if (fscanf(F, "%lld\n", &val) != 1 || val < 0) {
+	fclose(F);
+	errno = EINVAL;
+	return 0;
+    }
+    *offset = val;
+    /* the checkpoint is written after syncing the mirror, so its records
+     * can always be trusted */
+    ok = read_records(F, val, 1);
+    fclose(F);
+    return ok;
+}
+
+/* read a log left by an earlier run; the completed operations only count
+ * if the system has not been restarted since */
+static int read_log(const char * name, off_t start) {
+    FILE * F = fopen(name, "r");
+    char line[128];
+    int trust_done = 0, ok;
+    if (! F) return errno == ENOENT;
+    if (fgets(line, sizeof(line), F) &&
+	strncmp(line, "B ", 2) == 0 && strchr(line, '\n'))
+    {
+	*strchr(line, '\n') = 0;
+	trust_done = boot_id[0] && strcmp(line + 2, boot_id) == 0;
+    } else {
+	rewind(F);
+    }
+    ok = read_records(F, start, trust_done);
+    fclose(F);
+    return ok;
+}
+
+static int compare_intent(const void * _a, const void * _b) {
+    const intent_t * a = _a, * b = _b;
+    return a->offset < b->offset ? -1 : a->offset > b->offset;
+}
+
+static int compare_offset(const void * _a, const void * _b) {
+    const off_t * a = _a, * b = _b;
+    return *a < *b ? -1 : *a > *b;
+}
+
+/* read what an earlier run recorded after the checkpoint at "start" */
+static int read_logs(off_t start) {
+    FILE * F;
+    log_name = malloc(strlen(checkpoint) + 5);
+    old_log_name = malloc(strlen(checkpoint) + 9);
+    if (! log_name || ! old_log_name) return 0;
+    sprintf(log_name, "%s.log", checkpoint);
+    sprintf(old_log_name, "%s.log.old", checkpoint);
+    F = fopen("/proc/sys/kernel/random/boot_id", "r");
+    if (F) {
+	if (! fgets(boot_id, sizeof(boot_id), F)) boot_id[0] = 0;
+	fclose(F);
+	boot_id[strcspn(boot_id, "\n")] = 0;
+    }
+    if (! read_log(old_log_name, start) || ! read_log(log_name, start))
+	return 0;
+    if (n_old_intents > 1)
+	qsort(old_intents, n_old_intents, sizeof(intent_t), compare_intent);
+    if (n_old_done > 1)
+	qsort(old_done, n_old_done, sizeof(off_t), compare_offset);
+    return 1;
+}
+
+/* start a new, empty, CHECKPOINT.log; called with "log_lock" held, or
+ * before starting the threads */
+static int open_log(void) {
+    char line[80];
+    int len = snprintf(line, sizeof(line), "B %s\n", boot_id);
+    log_fd = open(log_name, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0666);
+    if (log_fd < 0) return 0;
+    if (write(log_fd, line, len) == len && fsync(log_fd) == 0) return 1;
+    close(log_fd);
+    log_fd = -1;
+    return 0;
+}
+
+/* write the records still needed by a checkpoint at "offset": the
+ * operations in the window which are complete or have an intent, and
+ * what an earlier run recorded for events not yet reached; called by the
+ * main thread, which is the only one to change the window, with
+ * "log_lock" held */
+static int write_records(FILE * F, off_t offset) {
+    op_t * op;
+    size_t n;
+    for (op = first; op; op = op->next) {
+	char line[128];
+	if (op->recorded) {
+	    if (fprintf(F, "D %lld\n", (long long)op->offset) < 0) return 0;
+	} else if (op->has_intent && ! find_intent(op->offset)) {
+	    format_intent(line, sizeof(line), &op->intent);
+	    if (fputs(line, F) == EOF) return 0;
+	}
+    }
+    for (n = 0; n < n_old_done; n++)
+	if (old_done[n] >= offset &&
+	    fprintf(F, "D %lld\n", (long long)old_done[n]) < 0)
+		return 0;
+    for (n = 0; n < n_old_intents; n++) {
+	char line[128];
+	if (old_intents[n].offset < offset) continue;
+	format_intent(line, sizeof(line), &old_intents[n]);
+	if (fputs(line, F) == EOF) return 0;
+    }
+    return 1;
+}
+
+/* record that all events before "offset" have been applied, as well as
+ * the completed operations after it: the records are taken from the
+ * window and CHECKPOINT.log is replaced by an empty one, then the mirror
+ * is made durable and the checkpoint replaced atomically; the old log is
+ * only removed after that */
+static int write_checkpoint(off_t offset) {
+    char * tmpname;
+    FILE * F;
+    int ok, sve = 0, rotated = 0;
+    tmpname = malloc(strlen(checkpoint) + 5);
+    if (! tmpname) return 0;
+    sprintf(tmpname, "%s.tmp", checkpoint);
+    F = fopen(tmpname, "w");
+    if (! F) {
+	sve = errno;
+	free(tmpname);
+	errno = sve;
+	return 0;
+    }
+    pthread_mutex_lock(&log_lock);
+    ok = fprintf(F, "%lld\n", (long long)offset) > 0 &&
+	 write_records(F, offset);
+    /* at startup there is no log open yet, and the old ones are only
+     * removed once the checkpoint has their records */
+    if (ok && log_fd >= 0) {
+	int ofd = log_fd;
+	ok = rename(log_name, old_log_name) == 0 && open_log();
+	if (ok) {
+	    close(ofd);
+	    rotated = 1;
+	} else {
+	    log_fd = ofd;
+	}
+    }
+    if (! ok) sve = errno;
+    pthread_mutex_unlock(&log_lock);
+    if (ok) {
+	ok = fflush(F) != EOF && fsync(fileno(F)) == 0 && syncfs(mirfd) == 0;
+	if (! ok) sve = errno;
+    }
+    if (fclose(F) == EOF && ok) {
+	ok = 0;
+	sve = errno;
+    }
+    if (ok && rename(tmpname, checkpoint) < 0) {
+	ok = 0;
+	sve = errno;
+    }
+    if (! ok) unlink(tmpname);
+    free(tmpname);
+    if (ok && unlink(old_log_name) < 0 && errno != ENOENT) {
+	ok = 0;
+	sve = errno;
+    }
+    if (ok && ! rotated && ! open_log()) {
+	ok = 0;
+	sve = errno;
+    }
+    errno = sve;
+    return ok;
+}
+
+static int add_rename(const char * key, int keylen, off_t offset,
+		      const char * other, int otherlen)
+{
+    rename_t * r;
+    if (n_renames >= max_renames) {
+	size_t nm = max_renames + 256;
+	rename_t * nr = realloc(renames, nm * sizeof(rename_t));
+	if (! nr) return 0;
+	renames = nr;
+	max_renames = nm;
+    }
+    r = &renames[n_renames++];
+    r->key = key;
+    r->keylen = keylen;
+    r->offset = offset;
+    r->other = other;
+    r->otherlen = otherlen;
+    return 1;
+}
+
+/* find all the changes of name in the events from "pos", so WRITEs know
+ * where to find their data in SOURCE; names point into the map */
+static int index_renames(const char * map, size_t maplen, off_t pos) {
+    while (pos < maplen) {
+	shall_event_t ev;
+	int len = shall_event_decode(map + pos, maplen - pos, &ev);
+	if (len <= 0) break;  /* the main loop deals with it */
+	if (wanted(&ev)) {
+	    switch (ev.operation) {
+		case SHALL_DELETE :
+		case SHALL_RMDIR :
+		    if (ev.num_names >= 1 &&
+			! add_rename(ev.name[0], ev.namelen[0], pos, NULL, 0))
+			    return 0;
+		    break;
+		case SHALL_MOVE :
+		    /* whatever had the new name was replaced */
+		    if (ev.num_names >= 2 &&
+			(! add_rename(ev.name[1], ev.namelen[1], pos,
+				      NULL, 0) ||
+			 ! add_rename(ev.name[0], ev.namelen[0], pos,
+				      ev.name[1], ev.namelen[1])))
+			    return 0;
+		    break;
+		case SHALL_SWAP :
+		    if (ev.num_names >= 2 &&
+			(! add_rename(ev.name[0], ev.namelen[0], pos,
+				      ev.name[1], ev.namelen[1]) ||
+			 ! add_rename(ev.name[1], ev.namelen[1], pos,
+				      ev.name[0], ev.namelen[0])))
+			    return 0;
+		    break;
+	    }
+	}
+	pos += len;
+    }
+    if (n_renames > 1)
+	qsort(renames, n_renames, sizeof(rename_t), compare_rename);
+    return 1;
+}
+
+int main(int argc, char *argv[]) {
+    const char * errmsg =
+	shall_parse_options(argc - 1, argv + 1, options, args);
+    shall_fileids_t * fileids;
+    pthread_t * workers;
+    const char * map;
+    size_t maplen;
+    off_t start = 0, pos;
+    time_t last_checkpoint = time(NULL);
+    int fd, n, ok = 1;
+    pname = strrchr(argv[0], '/');
+    if (pname)
+	pname++;
+    else
+	pname = argv[0];
+    if (help) {
+	shall_print_help(stdout, pname, options, args);
+	return 0;
+    }
+    if (! errmsg && threads < 1)
+	errmsg = "Invalid number of threads";
+    if (! errmsg && window < 1)
+	errmsg = "Invalid NUMBER for -w";
+    if (! errmsg && interval < 1)
+	errmsg = "Invalid SECONDS for -i";
+    if (errmsg) {
+	fprintf(stderr, "%s: %s\nUse \"%s -h\" for help\n",
+		pname, errmsg, pname);
+	return 1;
+    }
+    fd = open(events, O_RDONLY);
+    if (fd < 0) {
+	perror(events);
+	return 1;
+    }
+    map = shall_event_map(fd, &maplen);
+    if (! map) {
+	perror(events);
+	return 1;
+    }
+    srcfd = open(source, O_RDONLY | O_DIRECTORY);
+    if (srcfd < 0) {
+	perror(source);
+	return 1;
+    }
+    mirfd = open(mirror, O_RDONLY | O_DIRECTORY);
+    if (mirfd < 0) {
+	perror(mirror);
+	return 1;
+    }
+    if (checkpoint && ! read_checkpoint(&start)) {
+	perror(checkpoint);
+	return 1;
+    }
+    if (start > maplen) {
+	fprintf(stderr, "%s: %s: checkpoint is after the end of %s\n",
+		pname, checkpoint, events);
+	return 1;
+    }
+    /* make what an earlier run left in the log part of the checkpoint,
+     * and start a new log */
+    if (checkpoint &&
+	(! read_logs(start) || ! write_checkpoint(start)))
+    {
+	perror(log_name ? log_name : checkpoint);
+	return 1;
+    }
+    if (! index_renames(map, maplen, start)) {
+	perror(pname);
+	return 1;
+    }
+    fileids = shall_fileids_new();
+    workers = calloc(threads, sizeof(pthread_t));
+    if (! fileids || ! workers) {
+	perror(pname);
+	return 1;
+    }
+    /* the file IDs still open at the checkpoint were opened before it */
+    for (pos = 0; pos < start; ) {
+	shall_event_t ev;
+	int len = shall_event_decode(map + pos, maplen - pos, &ev);
+	if (len <= 0) {
+	    fprintf(stderr, "%s: %s: invalid event at %lld\n",
+		    pname, events, (long long)pos);
+	    return 1;
+	}
+	if (! shall_fileids_update(fileids, &ev)) {
+	    perror(pname);
+	    return 1;
+	}
+	pos += len;
+    }
+    for (n = 0; n < threads; n++) {
+	errno = pthread_create(&workers[n], NULL, worker_thread, NULL);
+	if (errno) {
+	    perror(pname);
+	    return 1;
+	}
+    }
+    while (pos < maplen) {
+	shall_event_t ev;
+	op_t * op;
+	int len = shall_event_decode(map + pos, maplen - pos, &ev);
+	if (len == 0) break;  /* still being written, do it next time */
+	if (len < 0) {
+	    fprintf(stderr, "%s: %s: invalid event at %lld\n",
+		    pname, events, (long long)pos);
+	    ok = 0;
+	    break;
+	}
+	op = make_op(&ev, pos, fileids);
+	if (! op && errno) {
+	    perror(pname);
+	    ok = 0;
+	    break;
+	}
+	/* after make_op, which may need the name of a file being closed */
+	if (! shall_fileids_update(fileids, &ev)) {
+	    perror(pname);
+	    ok = 0;
+	    break;
+	}
+	pos += len;
+	pthread_mutex_lock(&lock);
+	retire();
+	while (op && pending >= window) {
+	    pthread_cond_wait(&cond, &lock);
+	    retire();
+	}
+	if (op && ! schedule(op)) {
+	    pthread_mutex_unlock(&lock);
+	    perror(pname);
+	    ok = 0;
+	    break;
+	}
+	if (checkpoint && time(NULL) - last_checkpoint >= interval) {
+	    off_t done = first ? first->offset : pos;
+	    pthread_mutex_unlock(&lock);
+	    if (! write_checkpoint(done)) {
+		perror(checkpoint);
+		ok = 0;
+		break;
+	    }
+	    last_checkpoint = time(NULL);
+	} else {
+	    pthread_mutex_unlock(&lock);
+	}
+    }
+    /* wait for all scheduled operations, even after an error */
+    pthread_mutex_lock(&lock);
+    retire();
+    while (first) {
+	pthread_cond_wait(&cond, &lock);
+	retire();
+    }
+    stopping = 1;
+    pthread_cond_broadcast(&cond);
+    pthread_mutex_unlock(&lock);
+    for (n = 0; n < threads; n++)
+	pthread_join(workers[n], NULL);
+    if (ok && checkpoint && ! write_checkpoint(pos)) {
+	perror(checkpoint);
+	ok = 0;
+    }
+    shall_fileids_free(fileids);
+    shall_event_unmap(map, maplen);
+    close(fd);
+    close(srcfd);
+    close(mirfd);
+    if (log_fd >= 0) close(log_fd);
+    free(log_name);
+    free(old_log_name);
+    free(old_intents);
+    free(old_done);
+    free(renames);
+    free(workers);
+    if (errors > 0)
+	fprintf(stderr, "%s: %ld operations failed\n", pname, errors);
+    return ok && ! errors ? 0 : 1;
+}
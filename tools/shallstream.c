@@ -0,0 +1,871 @@
+/* serves the events of a mounted shall filesystem to any number of local
+ * subscribers over a UNIX socket, each with its own filter and cursor
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ *
+ * this file is part of SHALLFS
+ *
+ * Copyright (c) 2017-2019 Claudio Calvelli <shallfs@gladserv.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 2 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program (see the file COPYING in the distribution).
+ * If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <string.h>
+#include <ctype.h>
+#include <signal.h>
+#include <endian.h>
+#include <time.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include "shallfs-common.h"
+#include "shallfs-event.h"
+#include "shallfs-filter.h"
+#include "shallfs-stream.h"
+#include <shallfs/device.h>
+
+/* the server reads events from the filesystem straight into a spool,
+ * which is a temporary file mapped in memory and divided in segments used
+ * as a ring: when the newest segment is full, the oldest one is reused;
+ * every event has a position in the stream, which only grows, and each
+ * subscriber has its own position, so a slow subscriber just falls behind
+ * in the spool, and only loses events if it falls behind by more than
+ * the whole spool; everything runs in a single thread, and subscribers
+ * are sent batches of events with sendmsg, pointing directly into the
+ * spool, so events are never copied unless a subscriber is so slow that
+ * a segment is reused while part of a batch is still waiting to be sent;
+ * the protocol is in shallfs-stream.h */
+
+#define NUM_SEGMENTS 16
+#define MAX_SPANS 64
+#define MAX_BATCH 1048576		/* events sent at once */
+#define MAX_EXAMINE (4 * MAX_BATCH)	/* events looked at for a batch */
+#define MAX_REQUEST SHALL_STREAM_REQUEST
+
+typedef struct {
+    uint64_t start;			/* stream position of first event */
+    size_t fill;
+} segment_t;
+
+typedef struct {
+    int fd;
+    int ready;				/* request received */
+    int failed;				/* must be dropped */
+    char * request;
+    size_t reqlen;
+    shall_event_filter_t * filter;
+    uint64_t pos;			/* next event to look at */
+    uint64_t lost;			/* to report in the next frame */
+    /* the batch being sent: the frame header, then spans of events */
+    struct shall_stream_frame frame;
+    struct iovec iov[MAX_SPANS + 1];
+    int niov;
+    int first;				/* first iov not yet sent */
+    int segment;			/* where the spans point */
+    char * copy;			/* if the segment was reused */
+} client_t;
+
+static long help = 0, verbose = 0, tap = 0, file_input = 0, from_start = 0;
+static long bufsize = 1048576, spool_size = 268435456, mode = 0600;
+static long max_clients = 64;
+static const char * sockname = NULL, * fspath = NULL, * tmpdir = NULL;
+static const char * cursor_file = NULL, * prefix = NULL;
+static const char * operations = NULL;
+static long uid = -1;
+
+static const shall_options_t options[] = {
+    { 'a', &from_start,      NULL,
+      "Subscriber: without a saved cursor, start with the oldest event" },
+    { 'b', &bufsize,         "SIZE",
+      "Server: read events using buffers of SIZE bytes (default 1m)" },
+    { 'c', &max_clients,     "NUMBER",
+      "Server: accept at most NUMBER subscribers (default 64)" },
+    { 'f', NULL,             "FILE",
+      "Subscriber: save the position in FILE and resume from it",
+      &cursor_file },
+    { 'h', &help,            NULL,
+      "Print this helpful message" },
+    { 'i', &file_input,      NULL,
+      "Server: PATH is a file or pipe containing events" },
+    { 'm', &mode,            "MODE",
+      "Server: permissions of SOCKET (default 0600)" },
+    { 'n', NULL,             "PREFIX",
+      "Subscriber: only receive events on files starting with PREFIX",
+      &prefix },
+    { 'o', NULL,             "OPERATIONS",
+      "Subscriber: only receive the operations in a comma-separated list",
+      &operations },
+    { 's', &spool_size,      "SIZE",
+      "Server: keep SIZE bytes of recent events (default 256m)" },
+    { 't', &tap,             NULL,
+      "Server: don't keep events in the journal until they are read" },
+    { 'T', NULL,             "DIR",
+      "Server: create the spool in DIR (default: $TMPDIR or /tmp)",
+      &tmpdir },
+    { 'u', &uid,             "UID",
+      "Subscriber: only receive events from real user ID UID" },
+    { 'v', &verbose,         NULL,
+      "Server: report subscribers connecting and leaving" },
+    {  0,  NULL,             NULL, NULL }
+};
+
+static const shall_args_t args[] = {
+    { &sockname, "SOCKET", 1,
+      "The UNIX socket where the server listens" },
+    { &fspath,   "PATH",   0,
+      "The mountpoint/fspath/device of the mounted shallfs to serve; "
+      "without PATH, subscribe and write events to standard output" },
+    { NULL,      NULL,           0, NULL }
+};
+
+static const char * pname;
+static volatile sig_atomic_t stopping = 0;
+
+/* the spool */
+static char * spool = NULL;
+static size_t segsize;
+static segment_t segments[NUM_SEGMENTS];
+static int current = 0;			/* being filled */
+static int oldest = 0;
+static uint64_t head = 0;		/* position after the newest event */
+static size_t partial = 0;		/* incomplete event after "fill" */
+static uint64_t session;
+
+static client_t ** clients = NULL;
+static int nclients = 0;
+
+static void stop_signal(int sig) {
+    stopping = 1;
+}
+
+/* position of the oldest event in the spool */
+static uint64_t spool_tail(void) {
+    return segments[oldest].start;
+}
+
+/* the segment containing a position, which must be in the spool */
+static int find_segment(uint64_t pos) {
+    int n = oldest;
+    while (n != current && pos >= segments[n].start + segments[n].fill)
+	n = (n + 1) % NUM_SEGMENTS;
+    return n;
+}
+
+static void free_client(client_t * c) {
+    close(c->fd);
+    if (c->filter) shall_event_filter_free(c->filter);
+    free(c->request);
+    free(c->copy);
+    free(c);
+}
+
+static void drop_client(int n, const char * why) {
+    if (verbose)
+	printf("subscriber %d: %s\n", clients[n]->fd, why);
+    free_client(clients[n]);
+    clients[n] = clients[--nclients];
+}
+
+/* a subscriber is still sending data from a segment which we are about
+ * to reuse: copy what it still has to send */
+static int save_batch(client_t * c) {
+    size_t len = 0, done = 0;
+    int n;
+    for (n = c->first; n < c->niov; n++)
+	len += c->iov[n].iov_len;
+    c->copy = malloc(len);
+    if (! c->copy) return 0;
+    for (n = c->first; n < c->niov; n++) {
+	memcpy(c->copy + done, c->iov[n].iov_base, c->iov[n].iov_len);
+	done += c->iov[n].iov_len;
+    }
+    c->iov[0].iov_base = c->copy;
+    c->iov[0].iov_len = len;
+    c->first = 0;
+    c->niov = 1;
+    c->segment = -1;
+    return 1;
+}
+
+/* start filling the next segment, reusing the oldest one if needed */
+static void next_segment(void) {
+    int next = (current + 1) % NUM_SEGMENTS, n;
+    const char * from = spool + current * segsize + segments[current].fill;
+    if (next == oldest) {
+	for (n = 0; n < nclients; n++) {
+	    client_t * c = clients[n];
+	    if (c->first < c->niov && c->segment == oldest && ! save_batch(c))
+	    {
+		c->failed = 1;
+		c->first = c->niov = 0;
+	    }
+	}
+	oldest = (oldest + 1) % NUM_SEGMENTS;
+    }
+    /* an incomplete event moves to the new segment */
+    memmove(spool + next * segsize, from, partial);
+    segments[next].start = head;
+    segments[next].fill = 0;
+    current = next;
+}
+
+/* read more events into the spool; returns 1 if OK, 0 at end of file,
+ * -1 with errno set on error */
+static int read_events(int fd) {
+    segment_t * s = &segments[current];
+    ssize_t nr, len;
+    if (segsize - s->fill - partial < bufsize) {
+	next_segment();
+	s = &segments[current];
+    }
+    nr = read(fd, spool + current * segsize + s->fill + partial, bufsize);
+    if (nr < 0) return (errno == EAGAIN || errno == EINTR) ? 1 : -1;
+    if (nr == 0) return 0;
+    partial += nr;
+    /* the filesystem only returns complete events, but a file or pipe
+     * may not */
+    len = shall_event_scan(spool + current * segsize + s->fill, partial);
+    if (len < 0) return -1;
+    if (len == 0 && partial >= bufsize) {
+	errno = EFBIG;
+	return -1;
+    }
+    s->fill += len;
+    partial -= len;
+    head += len;
+    return 1;
+}
+
+/* parse a request line; returns NULL if OK, or an error message */
+static const char * parse_request(client_t * c) {
+    char * line = c->request, * tok, * save = NULL;
+    c->pos = head;
+    for (tok = strtok_r(line, " \t", &save); tok;
+	 tok = strtok_r(NULL, " \t", &save))
+    {
+	char * value = strchr(tok, '=');
+	if (! value) return "invalid request";
+	*value++ = 0;
+	if (! c->filter) {
+	    c->filter = shall_event_filter_new();
+	    if (! c->filter) return strerror(errno);
+	}
+	if (strcmp(tok, "from") == 0) {
+	    unsigned long long s, p;
+	    char extra;
+	    if (strcmp(value, "start") == 0) {
+		c->pos = spool_tail();
+	    } else if (strcmp(value, "now") == 0) {
+		c->pos = head;
+	    } else if (sscanf(value, "%llx:%llu%c", &s, &p, &extra) == 2) {
+		/* a position from an earlier server is no use, but the
+		 * journal may still have events it did not see */
+		if (s != session || p > head)
+		    c->pos = spool_tail();
+		else
+		    c->pos = p;
+	    } else {
+		return "invalid value for \"from\"";
+	    }
+	} else if (strcmp(tok, "ops") == 0) {
+	    if (! shall_event_filter_operations(c->filter, value))
+		return "invalid value for \"ops\"";
+	} else if (strcmp(tok, "uid") == 0) {
+	    char * ep;
+	    unsigned long long u = strtoull(value, &ep, 10);
+	    if (ep == value || *ep) return "invalid value for \"uid\"";
+	    shall_event_filter_uid(c->filter, u);
+	} else if (strcmp(tok, "prefix") == 0) {
+	    char * dp = value, * sp = value;
+	    /* %XX escapes, so that the prefix can contain spaces */
+	    while (*sp) {
+		unsigned int ch;
+		if (*sp == '%' && sscanf(sp + 1, "%2x", &ch) == 1) {
+		    *dp++ = ch;
+		    sp += 3;
+		} else {
+		    *dp++ = *sp++;
+		}
+	    }
+	    *dp = 0;
+	    if (! shall_event_filter_prefix(c->filter, value))
+		return "invalid value for \"prefix\"";
+	} else {
+	    return "invalid request";
+	}
+    }
+    return NULL;
+}
+
+/* prepare the next batch of events for a subscriber; returns 1 if there
+ * is something to send, 0 if not, -1 with errno set on error */
+static int prepare_batch(client_t * c) {
+    uint64_t tail = spool_tail();
+    size_t examined = 0, sent = 0;
+    const char * base;
+    segment_t * s;
+    int seg;
+    if (c->pos < tail) {
+	c->lost += tail - c->pos;
+	c->pos = tail;
+    }
+    if (c->pos >= head) {
+	if (! c->lost) return 0;
+    }
+    c->niov = 1;
+    c->first = 0;
+    c->segment = -1;
+    if (c->pos < head) {
+	seg = find_segment(c->pos);
+	s = &segments[seg];
+	base = spool + seg * segsize + (c->pos - s->start);
+	c->segment = seg;
+	while (c->pos + examined < s->start + s->fill &&
+	       examined < MAX_EXAMINE && sent < MAX_BATCH)
+	{
+	    const char * event = base + examined;
+	    int len = 0, ok = 1;
+	    if (c->filter) {
+		/* base is c->pos, not the start of the segment */
+		ok = shall_event_filter_match(c->filter, event,
+					      s->start + s->fill - c->pos
+					      - examined, &len);
+		if (ok < 0) return -1;
+	    } else {
+		struct shall_devheader dh;
+		memcpy(&dh, event, sizeof(dh));
+		len = le32toh(dh.next_header);
+	    }
+	    /* the spool only contains valid events */
+	    if (len <= 0) {
+		errno = EINVAL;
+		return -1;
+	    }
+	    if (ok) {
+		struct iovec * last = &c->iov[c->niov - 1];
+		if (c->niov > 1 &&
+		    (const char *)last->iov_base + last->iov_len == event)
+		{
+		    last->iov_len += len;
+		} else if (c->niov <= MAX_SPANS) {
+		    c->iov[c->niov].iov_base = (void *)event;
+		    c->iov[c->niov].iov_len = len;
+		    c->niov++;
+		} else {
+		    break;
+		}
+		sent += len;
+	    }
+	    examined += len;
+	}
+    }
+    c->pos += examined;
+    c->frame.magic = htole32(SHALL_STREAM_MAGIC);
+    c->frame.length = htole32(sent);
+    c->frame.cursor = htole64(c->pos);
+    c->frame.lost = htole64(c->lost);
+    c->lost = 0;
+    c->iov[0].iov_base = &c->frame;
+    c->iov[0].iov_len = sizeof(c->frame);
+    return 1;
+}
+
+/* send as much as possible of the current batch; returns 1 if OK, 0 with
+ * errno set if the subscriber has gone */
+static int send_batch(client_t * c) {
+    while (c->first < c->niov) {
+	struct msghdr msg;
+	ssize_t nw;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = c->iov + c->first;
+	msg.msg_iovlen = c->niov - c->first;
+	nw = sendmsg(c->fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+	if (nw < 0) {
+	    if (errno == EAGAIN || errno == EINTR) return 1;
+	    return 0;
+	}
+	while (nw > 0 && c->first < c->niov) {
+	    struct iovec * v = &c->iov[c->first];
+	    if (nw >= v->iov_len) {
+		nw -= v->iov_len;
+		c->first++;
+	    } else {
+		v->iov_base = (char *)v->iov_base + nw;
+		v->iov_len -= nw;
+		nw = 0;
+	    }
+	}
+    }
+    free(c->copy);
+    c->copy = NULL;
+    return 1;
+}
+
+/* read the request from a new subscriber; returns 1 if OK, 0 if the
+ * subscriber must be dropped */
+static int read_request(client_t * c) {
+    char * nl, reply[64];
+    const char * err;
+    ssize_t nr = read(c->fd, c->request + c->reqlen,
+		      MAX_REQUEST - 1 - c->reqlen);
+    if (nr < 0) return errno == EAGAIN || errno == EINTR;
+    if (nr == 0) return 0;
+    c->reqlen += nr;
+    c->request[c->reqlen] = 0;
+    nl = strchr(c->request, '\n');
+    if (! nl) {
+	if (c->reqlen < MAX_REQUEST - 1) return 1;
+	err = "request too long";
+    } else {
+	*nl = 0;
+	err = parse_request(c);
+    }
+    if (err) {
+	/* best effort, the subscriber goes anyway */
+	if (write(c->fd, "ERROR ", 6) < 0 ||
+	    write(c->fd, err, strlen(err)) < 0 ||
+	    write(c->fd, "\n", 1) < 0)
+	{
+	}
+	return 0;
+    }
+    /* the reply goes out like a batch, so we don't block */
+    c->ready = 1;
+    snprintf(reply, sizeof(reply), "OK %llx %llu\n",
+	     (unsigned long long)session, (unsigned long long)c->pos);
+    c->copy = strdup(reply);
+    if (! c->copy) return 0;
+    c->iov[0].iov_base = c->copy;
+    c->iov[0].iov_len = strlen(reply);
+    c->first = 0;
+    c->niov = 1;
+    c->segment = -1;
+    return send_batch(c);
+}
+
+static int add_client(int lfd) {
+    client_t * c;
+    int fd = accept(lfd, NULL, NULL);
+    if (fd < 0) return errno == EAGAIN || errno == EINTR;
+    if (nclients >= max_clients) {
+	close(fd);
+	if (verbose) printf("too many subscribers\n");
+	return 1;
+    }
+    c = calloc(1, sizeof(*c));
+    if (c) c->request = malloc(MAX_REQUEST);
+    if (! c || ! c->request) {
+	if (c) free(c);
+	close(fd);
+	return 0;
+    }
+    c->fd = fd;
+    c->segment = -1;
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    clients[nclients++] = c;
+    if (verbose) printf("subscriber %d: connected\n", fd);
+    return 1;
+}
+
+static int open_socket(void) {
+    struct sockaddr_un addr;
+    struct stat sbuff;
+    int fd;
+    if (strlen(sockname) >= sizeof(addr.sun_path)) {
+	errno = ENAMETOOLONG;
+	return -1;
+    }
+    /* remove a socket left by a server which didn't stop cleanly */
+    if (lstat(sockname, &sbuff) == 0 && S_ISSOCK(sbuff.st_mode))
+	unlink(sockname);
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) return -1;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, sockname);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+	chmod(sockname, mode) < 0 ||
+	listen(fd, 16) < 0 ||
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) < 0)
+    {
+	int sve = errno;
+	close(fd);
+	errno = sve;
+	return -1;
+    }
+    return fd;
+}
+
+static int open_input(void) {
+    struct stat sbuff;
+    int fd;
+    if (file_input) return open(fspath, O_RDONLY | O_NONBLOCK);
+    if (stat(fspath, &sbuff) < 0) return -1;
+    if (S_ISDIR(sbuff.st_mode)) {
+	if (! shall_find_device(fspath, &sbuff.st_rdev)) {
+	    errno = ENODEV;
+	    return -1;
+	}
+    } else if (! S_ISBLK(sbuff.st_mode)) {
+	errno = ENOTBLK;
+	return -1;
+    }
+    fd = shall_open_peekfile(sbuff.st_rdev, 0);
+    if (fd >= 0 && tap && ! shall_peek_register(fd, 0)) {
+	close(fd);
+	return -1;
+    }
+    return fd;
+}
+
+static int create_spool(void) {
+    const char * dir = tmpdir ? tmpdir : getenv("TMPDIR");
+    char * name;
+    int fd;
+    if (! dir) dir = "/tmp";
+    name = malloc(strlen(dir) + 20);
+    if (! name) return 0;
+    sprintf(name, "%s/shallstream.XXXXXX", dir);
+    fd = mkstemp(name);
+    if (fd < 0) {
+	free(name);
+	return 0;
+    }
+    /* the spool disappears when the server stops */
+    unlink(name);
+    free(name);
+    if (ftruncate(fd, segsize * NUM_SEGMENTS) < 0) {
+	close(fd);
+	return 0;
+    }
+    spool = mmap(NULL, segsize * NUM_SEGMENTS, PROT_READ | PROT_WRITE,
+		 MAP_SHARED, fd, 0);
+    close(fd);
+    if (spool == MAP_FAILED) {
+	spool = NULL;
+	return 0;
+    }
+    return 1;
+}
+
+static int run_server(void) {
+    struct sigaction sa;
+    struct pollfd * pfd;
+    int lfd, logfd, n, ok = 1, eof = 0;
+    segsize = (spool_size / NUM_SEGMENTS) & ~(size_t)(SHALL_DEV_BLOCK - 1);
+    if (segsize < 2 * bufsize) {
+	fprintf(stderr, "%s: spool too small for the buffer size\n", pname);
+	return 0;
+    }
+    session = ((uint64_t)time(NULL) << 20) ^ getpid();
+    clients = calloc(max_clients, sizeof(client_t *));
+    pfd = calloc(max_clients + 2, sizeof(struct pollfd));
+    if (! clients || ! pfd || ! create_spool()) {
+	perror(pname);
+	return 0;
+    }
+    logfd = open_input();
+    if (logfd < 0) {
+	perror(fspath);
+	return 0;
+    }
+    lfd = open_socket();
+    if (lfd < 0) {
+	perror(sockname);
+	return 0;
+    }
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = stop_signal;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    while (ok && ! stopping) {
+	int np = 0, timeout = -1;
+	pfd[np].fd = lfd;
+	pfd[np++].events = POLLIN;
+	/* at end of file, a file keeps returning POLLIN */
+	pfd[np].fd = eof ? -1 : logfd;
+	pfd[np++].events = POLLIN;
+	for (n = 0; n < nclients; n++) {
+	    client_t * c = clients[n];
+	    pfd[np].fd = c->fd;
+	    pfd[np].events = POLLIN;
+	    if (c->first < c->niov)
+		pfd[np].events |= POLLOUT;
+	    else if (c->ready && (c->pos < head || c->lost))
+		timeout = 0;
+	    np++;
+	}
+	if (file_input && ! eof) timeout = 0;
+	if (verbose) fflush(stdout);
+	if (poll(pfd, np, timeout) < 0) {
+	    if (errno == EINTR) continue;
+	    perror(pname);
+	    break;
+	}
+	if (pfd[1].revents) {
+	    int rd = read_events(logfd);
+	    if (rd < 0) {
+		perror(fspath);
+		ok = 0;
+		break;
+	    }
+	    if (rd == 0) eof = 1;
+	    /* the events are in the spool, the filesystem can drop them */
+	    if (rd > 0 && ! file_input && ! tap &&
+		! shall_ack_logs(logfd, lseek(logfd, 0, SEEK_CUR)))
+	    {
+		perror(fspath);
+		ok = 0;
+		break;
+	    }
+	}
+	/* go backwards, so dropping a subscriber doesn't skip another */
+	for (n = nclients - 1; n >= 0; n--) {
+	    client_t * c = clients[n];
+	    int batches;
+	    if (c->failed) {
+		drop_client(n, "out of memory");
+		continue;
+	    }
+	    if (! c->ready) {
+		if (pfd[n + 2].revents && ! read_request(c))
+		    drop_client(n, "bad request or hung up");
+		continue;
+	    }
+	    if (pfd[n + 2].revents & (POLLIN | POLLHUP | POLLERR)) {
+		/* subscribers don't send anything after the request */
+		char buffer[256];
+		ssize_t nr = read(c->fd, buffer, sizeof(buffer));
+		if (nr == 0 || (nr < 0 && errno != EAGAIN)) {
+		    drop_client(n, "disconnected");
+		    continue;
+		}
+	    }
+	    /* a few batches at a time, so the others get a turn */
+	    for (batches = 0; batches < 4; batches++) {
+		if (c->first >= c->niov) {
+		    int pb = prepare_batch(c);
+		    if (pb < 0) {
+			drop_client(n, strerror(errno));
+			break;
+		    }
+		    if (pb == 0) break;
+		}
+		if (! send_batch(c)) {
+		    drop_client(n, "disconnected");
+		    break;
+		}
+		if (c->first < c->niov) break;
+	    }
+	}
+	if (pfd[0].revents && ! add_client(lfd)) perror(pname);
+    }
+    while (nclients > 0)
+	drop_client(nclients - 1, "server stopping");
+    close(lfd);
+    unlink(sockname);
+    close(logfd);
+    munmap(spool, segsize * NUM_SEGMENTS);
+    free(clients);
+    free(pfd);
+    return ok;
+}
+
+/* read exactly "len" bytes; returns 1 if OK, 0 at end of file, -1 with
+ * errno set on error */
+static int read_all(int fd, void * _buffer, size_t len) {
+    char * buffer = _buffer;
+    size_t done = 0;
+    while (done < len) {
+	ssize_t nr = read(fd, buffer + done, len - done);
+	if (nr < 0 && errno == EINTR) continue;
+	if (nr < 0) return -1;
+	if (nr == 0) {
+	    if (done == 0) return 0;
+	    errno = EPROTO;
+	    return -1;
+	}
+	done += nr;
+    }
+    return 1;
+}
+
+static int save_cursor(const char * cursor) {
+    char * tmp = malloc(strlen(cursor_file) + 5);
+    FILE * F;
+    int ok;
+    if (! tmp) return 0;
+    sprintf(tmp, "%s.tmp", cursor_file);
+    F = fopen(tmp, "w");
+    if (! F) {
+	free(tmp);
+	return 0;
+    }
+    fprintf(F, "%s\n", cursor);
+    ok = fclose(F) == 0 && rename(tmp, cursor_file) == 0;
+    if (! ok) unlink(tmp);
+    free(tmp);
+    return ok;
+}
+
+static int run_subscriber(void) {
+    struct sockaddr_un addr;
+    char request[MAX_REQUEST], line[128], cursor[64], * data = NULL;
+    unsigned long long sess, pos;
+    size_t rlen = 0, datasize = 0;
+    int fd, n, rd;
+    strcpy(cursor, from_start ? "start" : "now");
+    if (cursor_file) {
+	FILE * F = fopen(cursor_file, "r");
+	if (F) {
+	    if (fgets(line, sizeof(line), F) &&
+		sscanf(line, "%llx:%llu", &sess, &pos) == 2)
+		    snprintf(cursor, sizeof(cursor), "%llx:%llu", sess, pos);
+	    fclose(F);
+	}
+    }
+    rlen = snprintf(request, sizeof(request), "from=%s", cursor);
+    if (operations)
+	rlen += snprintf(request + rlen, sizeof(request) - rlen,
+			 " ops=%s", operations);
+    if (uid >= 0)
+	rlen += snprintf(request + rlen, sizeof(request) - rlen,
+			 " uid=%ld", uid);
+    if (prefix) {
+	rlen += snprintf(request + rlen, sizeof(request) - rlen, " prefix=");
+	for (n = 0; prefix[n] && rlen < sizeof(request) - 4; n++) {
+	    unsigned char c = prefix[n];
+	    if (isascii((int)c) && isgraph((int)c) && c != '%')
+		request[rlen++] = c;
+	    else
+		rlen += sprintf(request + rlen, "%%%02x", c);
+	}
+    }
+    if (rlen >= sizeof(request) - 2) {
+	fprintf(stderr, "%s: request too long\n", pname);
+	return 0;
+    }
+    request[rlen++] = '\n';
+    if (strlen(sockname) >= sizeof(addr.sun_path)) {
+	fprintf(stderr, "%s: %s\n", sockname, strerror(ENAMETOOLONG));
+	return 0;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, sockname);
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+	write(fd, request, rlen) != rlen)
+    {
+	perror(sockname);
+	return 0;
+    }
+    /* the reply line, one byte at a time as the events follow it */
+    for (n = 0; n < sizeof(line) - 1; n++) {
+	if (read_all(fd, &line[n], 1) <= 0) break;
+	if (line[n] == '\n') break;
+    }
+    line[n] = 0;
+    if (sscanf(line, "OK %llx %llu", &sess, &pos) != 2) {
+	fprintf(stderr, "%s: %s: %s\n", pname, sockname,
+		strncmp(line, "ERROR ", 6) == 0 ? line + 6 : "invalid reply");
+	close(fd);
+	return 0;
+    }
+    while (1) {
+	struct shall_stream_frame frame;
+	size_t len;
+	rd = read_all(fd, &frame, sizeof(frame));
+	if (rd <= 0) break;
+	if (le32toh(frame.magic) != SHALL_STREAM_MAGIC) {
+	    errno = EPROTO;
+	    rd = -1;
+	    break;
+	}
+	len = le32toh(frame.length);
+	if (frame.lost)
+	    fprintf(stderr, "%s: lost %llu bytes of events\n", pname,
+		    (unsigned long long)le64toh(frame.lost));
+	if (len > datasize) {
+	    char * nd = realloc(data, len);
+	    if (! nd) {
+		rd = -1;
+		break;
+	    }
+	    data = nd;
+	    datasize = len;
+	}
+	rd = read_all(fd, data, len);
+	if (rd <= 0) {
+	    if (rd == 0) errno = EPROTO;
+	    rd = -1;
+	    break;
+	}
+	if (len > 0 && (fwrite(data, len, 1, stdout) != 1 ||
+			fflush(stdout) == EOF))
+	{
+	    perror("(stdout)");
+	    break;
+	}
+	/* only after the events are out */
+	snprintf(cursor, sizeof(cursor), "%llx:%llu",
+		 sess, (unsigned long long)le64toh(frame.cursor));
+	if (cursor_file && ! save_cursor(cursor)) {
+	    perror(cursor_file);
+	    break;
+	}
+    }
+    if (rd < 0) perror(sockname);
+    free(data);
+    close(fd);
+    return rd == 0;
+}
+
+int main(int argc, char *argv[]) {
+    const char * errmsg =
+	shall_parse_options(argc - 1, argv + 1, options, args);
+    pname = strrchr(argv[0], '/');
+    if (pname)
+	pname++;
+    else
+	pname = argv[0];
+    if (help) {
+	shall_print_help(stdout, pname, options, args);
+	return 0;
+    }
+    if (! errmsg && bufsize < SHALL_DEV_BLOCK)
+	errmsg = "Invalid buffer SIZE for -b";
+    if (! errmsg && spool_size < 1)
+	errmsg = "Invalid SIZE for -s";
+    if (! errmsg && max_clients < 1)
+	errmsg = "Invalid NUMBER for -c";
+    if (errmsg) {
+	fprintf(stderr, "%s: %s\nUse \"%s -h\" for help\n",
+		pname, errmsg, pname);
+	return 1;
+    }
+    if (fspath) return run_server() ? 0 : 1;
+    return run_subscriber() ? 0 : 1;
+}
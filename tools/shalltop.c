@@ -0,0 +1,650 @@
+/* shows which operations, users and directories generate the events logged
+ * by a mounted shall filesystem, like top(1)
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ *
+ * this file is part of SHALLFS
+ *
+ * Copyright (c) 2017-2019 Claudio Calvelli <shallfs@gladserv.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 2 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program (see the file COPYING in the distribution).
+ * If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <string.h>
+#include <signal.h>
+#include <endian.h>
+#include <time.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "shallfs-common.h"
+#include "shallfs-event.h"
+#include "shallfs-stream.h"
+#include <shallfs/operation.h>
+
+/* events come from the filesystem, as a tap which does not keep them in
+ * the journal, or from a shallstream server; each one is counted, with its
+ * size in the journal, by operation, by user and by directory, in hash
+ * tables which are cleared after each report; only events with a file ID
+ * and no name need the file ID table, which the other events update */
+
+typedef struct counter_s counter_t;
+struct counter_s {
+    counter_t * next;
+    char * key;
+    uint64_t events;
+    uint64_t bytes;
+};
+
+typedef struct {
+    const char * title;
+    counter_t ** table;
+    long size;
+    long count;
+} table_t;
+
+#define INITIAL_HASH 256
+#define READ_BUFFER 1048576
+
+static long help = 0, batch = 0, file_input = 0, interval = 2, depth = 2;
+static long rows = 10, iterations = 0;
+static const char * fspath = NULL, * sockname = NULL, * statsfile = NULL;
+
+static const shall_options_t options[] = {
+    { 'b', &batch,           NULL,
+      "Batch mode: don't clear the screen before each report" },
+    { 'd', &interval,        "SECONDS",
+      "Report every SECONDS (default 2)" },
+    { 'D', &depth,           "DEPTH",
+      "Show directories DEPTH levels below the root (default 2)" },
+    { 'h', &help,            NULL,
+      "Print this helpful message" },
+    { 'i', &file_input,      NULL,
+      "PATH is a file of events: show one report for all of it" },
+    { 'k', &rows,            "NUMBER",
+      "Show at most NUMBER lines in each table (default 10)" },
+    { 'n', &iterations,      "NUMBER",
+      "Stop after NUMBER reports (default: run until interrupted)" },
+    { 's', NULL,             "STATS-FILE",
+      "Also show the drain rate and lag from shalldrain's STATS-FILE",
+      &statsfile },
+    { 'S', NULL,             "SOCKET",
+      "Get the events from the shallstream server at SOCKET",
+      &sockname },
+    {  0,  NULL,             NULL, NULL }
+};
+
+static const shall_args_t args[] = {
+    { &fspath,   "PATH",  1,
+      "The mountpoint/fspath/device of the mounted shallfs to watch" },
+    { NULL,      NULL,           0, NULL }
+};
+
+static const char * pname;
+static volatile sig_atomic_t stopping = 0;
+static table_t by_op = { "OPERATION" };
+static table_t by_uid = { "UID" };
+static table_t by_dir = { "DIRECTORY" };
+static shall_fileids_t * fileids = NULL;
+static uint64_t total_events = 0, total_bytes = 0, lost = 0;
+
+static void stop_signal(int sig) {
+    stopping = 1;
+}
+
+static unsigned long key_hash(const char * key, int len) {
+    unsigned long h = 2166136261U;
+    while (len-- > 0)
+	h = (h ^ (unsigned char)*key++) * 16777619U;
+    return h;
+}
+
+static int grow_table(table_t * t) {
+    long nsize = t->size ? 2 * t->size : INITIAL_HASH, n;
+    counter_t ** nt = calloc(nsize, sizeof(counter_t *));
+    if (! nt) return 0;
+    for (n = 0; n < t->size; n++) {
+	while (t->table[n]) {
+	    counter_t * c = t->table[n];
+	    unsigned long h = key_hash(c->key, strlen(c->key)) & (nsize - 1);
+	    t->table[n] = c->next;
+	    c->next = nt[h];
+	    nt[h] = c;
+	}
+    }
+    free(t->table);
+    t->table = nt;
+    t->size = nsize;
+    return 1;
+}
+
+static int count(table_t * t, const char * key, int len, size_t bytes) {
+    unsigned long h;
+    counter_t * c;
+    if (t->count >= t->size && ! grow_table(t)) return 0;
+    h = key_hash(key, len) & (t->size - 1);
+    for (c = t->table[h]; c; c = c->next)
+	if (strncmp(c->key, key, len) == 0 && c->key[len] == 0) break;
+    if (! c) {
+	c = malloc(sizeof(*c));
+	if (! c) return 0;
+	c->key = malloc(len + 1);
+	if (! c->key) {
+	    free(c);
+	    return 0;
+	}
+	memcpy(c->key, key, len);
+	c->key[len] = 0;
+	c->events = c->bytes = 0;
+	c->next = t->table[h];
+	t->table[h] = c;
+	t->count++;
+    }
+    c->events++;
+    c->bytes += bytes;
+    return 1;
+}
+
+static void clear_table(table_t * t) {
+    long n;
+    for (n = 0; n < t->size; n++) {
+	while (t->table[n]) {
+	    counter_t * c = t->table[n];
+	    t->table[n] = c->next;
+	    free(c->key);
+	    free(c);
+	}
+    }
+    t->count = 0;
+}
+
+/* the directory to count a file name in: the first "depth" components,
+ * or the directory containing the file if it is not that deep */
+static int dir_length(const char * name, int len) {
+    int n, level = 0, last = 0;
+    for (n = 0; n < len; n++) {
+	if (name[n] != '/' || n == 0) continue;
+	last = n;
+	if (++level >= depth) return n;
+    }
+    return last;
+}
+
+static int process(const char * event, int len) {
+    char buffer[32];
+    shall_event_t ev;
+    const char * name = NULL;
+    int namelen = 0;
+    if (shall_event_decode(event, len, &ev) <= 0) {
+	errno = EINVAL;
+	return 0;
+    }
+    total_events++;
+    total_bytes += ev.length;
+    if (! count(&by_op, shall_event_opname(ev.operation),
+		strlen(shall_event_opname(ev.operation)), ev.length))
+	    return 0;
+    if (ev.has_creds)
+	snprintf(buffer, sizeof(buffer), "%llu",
+		 (unsigned long long)ev.creds.uid);
+    else
+	strcpy(buffer, "-");
+    if (! count(&by_uid, buffer, strlen(buffer), ev.length)) return 0;
+    /* a user log has a message instead of a name */
+    if (ev.num_names > 0 && ev.operation != SHALL_USERLOG) {
+	name = ev.name[0];
+	namelen = ev.namelen[0];
+    } else if (ev.data_type == SHALL_LOG_FILEID) {
+	name = shall_fileids_lookup(fileids, ev.u.fileid);
+    } else if (ev.data_type == SHALL_LOG_REGION ||
+	       ev.data_type == SHALL_LOG_HASH ||
+	       ev.data_type == SHALL_LOG_DATA) {
+	name = shall_fileids_lookup(fileids, ev.u.region.fileid);
+    } else if (ev.data_type == SHALL_LOG_CLONE) {
+	name = shall_fileids_lookup(fileids, ev.u.clone.dst_fileid);
+    }
+    if (name && ! namelen) namelen = strlen(name);
+    if (name) {
+	int dl = dir_length(name, namelen);
+	if (! count(&by_dir, dl ? name : "/", dl ? dl : 1, ev.length))
+	    return 0;
+    } else if (! count(&by_dir, "-", 1, ev.length)) {
+	return 0;
+    }
+    if (shall_fileids_relevant(event) && ! shall_fileids_update(fileids, &ev))
+	return 0;
+    return 1;
+}
+
+/* count all complete events in a buffer; returns the length used, or -1
+ * with errno set */
+static ssize_t process_events(const char * data, size_t len) {
+    ssize_t done = shall_event_scan(data, len), pos = 0;
+    if (done < 0) return -1;
+    while (pos < done) {
+	struct shall_devheader dh;
+	memcpy(&dh, data + pos, sizeof(dh));
+	if (! process(data + pos, le32toh(dh.next_header))) return -1;
+	pos += le32toh(dh.next_header);
+    }
+    return done;
+}
+
+static void format_size(char * buffer, size_t len, double size) {
+    static const char units[] = " KMGT";
+    int u = 0;
+    while (size >= 1024 && u < 4) {
+	size /= 1024;
+	u++;
+    }
+    if (u == 0)
+	snprintf(buffer, len, "%.0f", size);
+    else
+	snprintf(buffer, len, "%.1f%c", size, units[u]);
+}
+
+static int counter_cmp(const void * _a, const void * _b) {
+    const counter_t * a = *(const counter_t **)_a;
+    const counter_t * b = *(const counter_t **)_b;
+    if (a->bytes != b->bytes) return a->bytes > b->bytes ? -1 : 1;
+    if (a->events != b->events) return a->events > b->events ? -1 : 1;
+    return strcmp(a->key, b->key);
+}
+
+/* print the biggest entries in a table, then clear it */
+static void print_table(table_t * t, double secs) {
+    counter_t ** list = malloc((t->count ? t->count : 1) * sizeof(*list));
+    long n, m = 0;
+    if (! list) {
+	clear_table(t);
+	return;
+    }
+    for (n = 0; n < t->size; n++) {
+	counter_t * c;
+	for (c = t->table[n]; c; c = c->next)
+	    list[m++] = c;
+    }
+    qsort(list, m, sizeof(*list), counter_cmp);
+    printf("\n%-40s %10s %10s %6s\n", t->title, "EVENTS/S", "BYTES/S", "%");
+    for (n = 0; n < m && n < rows; n++) {
+	char rate[32];
+	format_size(rate, sizeof(rate), list[n]->bytes / secs);
+	printf("%-40.40s %10.1f %10s %6.1f\n", list[n]->key,
+	       list[n]->events / secs, rate,
+	       total_bytes ? 100.0 * list[n]->bytes / total_bytes : 0);
+    }
+    free(list);
+    clear_table(t);
+}
+
+/* show the drain rate, lag and unsynced data written by shalldrain */
+static void print_drain(void) {
+    char line[128], rate[32] = "?", lag[32] = "?";
+    long long pending = -1;
+    FILE * F = fopen(statsfile, "r");
+    double val;
+    if (! F) {
+	printf("drain: %s: %s\n", statsfile, strerror(errno));
+	return;
+    }
+    while (fgets(line, sizeof(line), F)) {
+	if (sscanf(line, "drain_rate: %lf", &val) == 1)
+	    format_size(rate, sizeof(rate), val);
+	else if (sscanf(line, "lag: %lf", &val) == 1)
+	    format_size(lag, sizeof(lag), val);
+	else
+	    sscanf(line, "pending: %lld", &pending);
+    }
+    fclose(F);
+    printf("drain: %s/s, lag %s", rate, lag);
+    if (pending >= 0) printf(", %lld bytes not yet synced", pending);
+    putchar('\n');
+}
+
+/* show the state of the journal, and the events seen since the last
+ * report, then clear the counters */
+static void report(dev_t dev, double secs) {
+    static long long last_logged = -1;
+    static off_t last_length = -1;
+    char line[64], a[32], b[32];
+    time_t now = time(NULL);
+    struct tm tm;
+    if (! batch) printf("\033[H\033[2J");
+    strftime(line, sizeof(line), "%Y-%m-%d %H:%M:%S",
+	     localtime_r(&now, &tm));
+    printf("%s - %s - %s\n", pname, fspath, line);
+    if (! file_input) {
+	shall_sb_data_t sb;
+	long long logged;
+	int shown = 0;
+	if (shall_mounted_info(dev, &sb)) {
+	    format_size(a, sizeof(a), sb.data_length);
+	    format_size(b, sizeof(b), sb.max_length);
+	    printf("journal: %s of %s (%.1f%%)", a, b,
+		   sb.max_length > 0
+		       ? 100.0 * sb.data_length / sb.max_length : 0);
+	    if (last_length >= 0) {
+		double fill = (sb.data_length - last_length) / secs;
+		format_size(a, sizeof(a), fill < 0 ? -fill : fill);
+		printf(", %s at %s/s", fill < 0 ? "emptying" : "filling", a);
+	    }
+	    last_length = sb.data_length;
+	    shown = 1;
+	}
+	if (shall_mounted_counter(dev, "logged", &logged)) {
+	    printf("%slogged %lld", shown ? "; " : "journal: ", logged);
+	    if (last_logged >= 0)
+		printf(" (%.1f/s)", (logged - last_logged) / secs);
+	    last_logged = logged;
+	    shown = 1;
+	}
+	if (shown) putchar('\n');
+	if (statsfile) print_drain();
+    }
+    format_size(a, sizeof(a), total_bytes / secs);
+    printf("seen: %.1f events/s, %s/s over %.1fs",
+	   total_events / secs, a, secs);
+    if (lost) {
+	format_size(b, sizeof(b), lost);
+	printf(", lost %s", b);
+    }
+    putchar('\n');
+    print_table(&by_op, secs);
+    print_table(&by_uid, secs);
+    print_table(&by_dir, secs);
+    fflush(stdout);
+    total_events = total_bytes = lost = 0;
+}
+
+/* one report for a whole file, with rates based on the event times */
+static int run_file(void) {
+    const char * map;
+    size_t len;
+    int64_t first = INT64_MAX, last = INT64_MIN;
+    shall_event_iter_t it;
+    shall_event_t ev;
+    int fd = open(fspath, O_RDONLY), ok;
+    if (fd < 0) {
+	perror(fspath);
+	return 0;
+    }
+    map = shall_event_map(fd, &len);
+    if (! map) {
+	perror(fspath);
+	close(fd);
+	return 0;
+    }
+    shall_event_iter_init(&it, map, len);
+    while ((ok = shall_event_next(&it, &ev)) > 0) {
+	if (ev.req_sec < first) first = ev.req_sec;
+	if (ev.req_sec > last) last = ev.req_sec;
+	if (! process(ev.raw, ev.length)) {
+	    ok = -1;
+	    break;
+	}
+    }
+    if (ok < 0)
+	fprintf(stderr, "%s: %s: invalid event at %lld\n",
+		pname, fspath, (long long)it.pos);
+    else
+	report(0, last > first ? last - first + 1 : 1);
+    shall_event_unmap(map, len);
+    close(fd);
+    return ok == 0;
+}
+
+static int connect_stream(void) {
+    struct sockaddr_un addr;
+    static const char request[] = "from=now\n";
+    char line[128];
+    int fd, n;
+    if (strlen(sockname) >= sizeof(addr.sun_path)) {
+	errno = ENAMETOOLONG;
+	return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, sockname);
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) return -1;
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+	write(fd, request, strlen(request)) != strlen(request))
+	    goto error;
+    /* the reply line, one byte at a time as the events follow it */
+    for (n = 0; n < sizeof(line) - 1; n++) {
+	if (read(fd, &line[n], 1) != 1) goto error;
+	if (line[n] == '\n') break;
+    }
+    line[n] = 0;
+    if (strncmp(line, "OK ", 3) != 0) {
+	errno = EPROTO;
+	goto error;
+    }
+    return fd;
+error:
+    n = errno;
+    close(fd);
+    errno = n;
+    return -1;
+}
+
+/* take the frames out of data received from shallstream: the first
+ * "*events" bytes of the buffer are events, and the rest of the "len"
+ * bytes came from the socket; the events found are moved after the ones
+ * already there, and "*events" is updated; "*state" is what remains of
+ * the current frame, or 0 if a header is expected next; returns the
+ * length of data which follows the events and is still to be examined
+ * (a partial header), or -1 with errno set */
+static ssize_t unframe(char * data, size_t len, size_t * events,
+		       uint64_t * state)
+{
+    size_t pos = *events, out = *events;
+    while (pos < len) {
+	struct shall_stream_frame frame;
+	size_t take;
+	if (*state == 0) {
+	    if (len - pos < sizeof(frame)) break;
+	    memcpy(&frame, data + pos, sizeof(frame));
+	    if (le32toh(frame.magic) != SHALL_STREAM_MAGIC) {
+		errno = EPROTO;
+		return -1;
+	    }
+	    lost += le64toh(frame.lost);
+	    *state = le32toh(frame.length);
+	    pos += sizeof(frame);
+	    continue;
+	}
+	take = len - pos < *state ? len - pos : *state;
+	memmove(data + out, data + pos, take);
+	out += take;
+	pos += take;
+	*state -= take;
+    }
+    memmove(data + out, data + pos, len - pos);
+    *events = out;
+    return len - pos;
+}
+
+static double elapsed(const struct timespec * since) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - since->tv_sec) + (now.tv_nsec - since->tv_nsec) / 1e9;
+}
+
+static int run_live(void) {
+    struct sigaction sa;
+    struct stat sbuff;
+    struct timespec last;
+    char * buffer = malloc(READ_BUFFER);
+    size_t have = 0, header = 0;
+    uint64_t state = 0;
+    long done = 0;
+    int fd, ok = 1, skipping = 0;
+    if (! buffer) {
+	perror(pname);
+	return 0;
+    }
+    if (stat(fspath, &sbuff) < 0) {
+	perror(fspath);
+	return 0;
+    }
+    if (S_ISDIR(sbuff.st_mode)) {
+	if (! shall_find_device(fspath, &sbuff.st_rdev)) {
+	    fprintf(stderr, "%s: cannot find shallfs on %s\n", pname, fspath);
+	    return 0;
+	}
+    } else if (! S_ISBLK(sbuff.st_mode)) {
+	fprintf(stderr, "%s: %s: not a block device or directory\n",
+		pname, fspath);
+	return 0;
+    }
+    if (sockname) {
+	fd = connect_stream();
+	if (fd < 0) {
+	    perror(sockname);
+	    return 0;
+	}
+    } else {
+	/* a tap doesn't keep events in the journal; the events already
+	 * there when we start are not counted */
+	fd = shall_open_peekfile(sbuff.st_rdev, 0);
+	if (fd < 0 || ! shall_peek_register(fd, 0)) {
+	    perror(fspath);
+	    return 0;
+	}
+	skipping = 1;
+    }
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = stop_signal;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    clock_gettime(CLOCK_MONOTONIC, &last);
+    report(sbuff.st_rdev, 1);
+    while (! stopping) {
+	struct pollfd pfd;
+	double secs = elapsed(&last);
+	ssize_t nr;
+	if (secs >= interval) {
+	    clock_gettime(CLOCK_MONOTONIC, &last);
+	    report(sbuff.st_rdev, secs);
+	    if (iterations > 0 && ++done >= iterations) break;
+	    continue;
+	}
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+	if (poll(&pfd, 1, (interval - secs) * 1000 + 1) < 0) {
+	    if (errno == EINTR) continue;
+	    perror(pname);
+	    ok = 0;
+	    break;
+	}
+	if (! pfd.revents) continue;
+	nr = read(fd, buffer + have, READ_BUFFER - have);
+	if (nr < 0 && (errno == EAGAIN || errno == EINTR)) {
+	    skipping = 0;
+	    continue;
+	}
+	if (nr <= 0) {
+	    if (nr == 0) fprintf(stderr, "%s: end of events\n", pname);
+	    else perror(sockname ? sockname : fspath);
+	    ok = nr == 0;
+	    break;
+	}
+	if (skipping) continue;
+	if (sockname) {
+	    ssize_t left = unframe(buffer, have + nr, &header, &state);
+	    if (left < 0) {
+		perror(sockname);
+		ok = 0;
+		break;
+	    }
+	    /* "header" is the length of the events at the start */
+	    nr = process_events(buffer, header);
+	    if (nr < 0) {
+		perror(sockname);
+		ok = 0;
+		break;
+	    }
+	    memmove(buffer, buffer + nr, header - nr + left);
+	    header -= nr;
+	    have = header + left;
+	    if (have >= READ_BUFFER) {
+		fprintf(stderr, "%s: event too large\n", pname);
+		ok = 0;
+		break;
+	    }
+	} else {
+	    /* the filesystem only returns complete events */
+	    if (process_events(buffer, nr) < 0) {
+		perror(fspath);
+		ok = 0;
+		break;
+	    }
+	}
+    }
+    close(fd);
+    free(buffer);
+    return ok;
+}
+
+int main(int argc, char *argv[]) {
+    const char * errmsg =
+	shall_parse_options(argc - 1, argv + 1, options, args);
+    int ok;
+    pname = strrchr(argv[0], '/');
+    if (pname)
+	pname++;
+    else
+	pname = argv[0];
+    if (help) {
+	shall_print_help(stdout, pname, options, args);
+	return 0;
+    }
+    if (! errmsg && interval < 1)
+	errmsg = "Invalid SECONDS for -d";
+    if (! errmsg && depth < 1)
+	errmsg = "Invalid DEPTH for -D";
+    if (! errmsg && rows < 1)
+	errmsg = "Invalid NUMBER for -k";
+    if (! errmsg && file_input && sockname)
+	errmsg = "Cannot specify both -i and -S";
+    if (errmsg) {
+	fprintf(stderr, "%s: %s\nUse \"%s -h\" for help\n",
+		pname, errmsg, pname);
+	return 1;
+    }
+    fileids = shall_fileids_new();
+    if (! fileids) {
+	perror(pname);
+	return 1;
+    }
+    ok = file_input ? run_file() : run_live();
+    clear_table(&by_op);
+    clear_table(&by_uid);
+    clear_table(&by_dir);
+    free(by_op.table);
+    free(by_uid.table);
+    free(by_dir.table);
+    shall_fileids_free(fileids);
+    return ok ? 0 : 1;
+}
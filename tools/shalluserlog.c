@@ -68,6 +68,18 @@ int main(int argc, char *argv[]) {
 	perror(fspath);
 	return 1;
     }
+    /* if this is the mountpoint (or anything inside the mount) we don't
+     * need to search for the device, and the length is only limited by
+     * the commit size; if the message is too long for that, it would
+     * be truncated by the control file, so that's an error */
+    if (! S_ISBLK(sbuff.st_mode)) {
+	if (shall_ioctl_userlog(fspath, message, strlen(message)))
+	    return 0;
+	if (errno == E2BIG) {
+	    fprintf(stderr, "%s: message too long for %s\n", pname, fspath);
+	    return 1;
+	}
+    }
     if (S_ISDIR(sbuff.st_mode)) {
 	if (! shall_find_device(fspath, &sbuff.st_rdev)) {
 	    fprintf(stderr, "%s: cannot find shallfs on %s\n",
@@ -79,7 +91,7 @@ int main(int argc, char *argv[]) {
 		pname, fspath);
 	return 1;
     }
-    if (shall_ctrl_userlog(sbuff.st_rdev, message) < 0) {
+    if (! shall_ctrl_userlog(sbuff.st_rdev, message)) {
 	perror(fspath);
 	return 1;
     }
@@ -20,9 +20,13 @@
  * If not, see <http://www.gnu.org/licenses/>.
  */
 
+#define _GNU_SOURCE /* for renameat2 */
 #include <stdio.h>
 #include <stdlib.h>
 #include <errno.h>
+#include <signal.h>
+#include <dirent.h>
+#include <ftw.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <sys/stat.h>
@@ -34,6 +38,10 @@
 #include <time.h>
 #include <math.h>
 #include "shallfs-common.h"
+#include "shallfs-crc.h"
+#include "shallfs-event.h"
+#include <shallfs/operation.h>
+#include <shallfs/device.h>
 
 enum {
     err_ok               =  0,   /* no errors */
@@ -44,17 +52,26 @@ enum {
 };
 
 static long runs = 100, passes = 1, runtime = 0, do_help = 0;
+static long self_only = 0, benchmark = 0;
 static long runs_ok = 0, runs_failed = 0;
 static const char * test_root = NULL, * output = NULL;
+static char * tooldir = NULL;
 static FILE * OF = NULL;
+static uint64_t random_state;
+static char errbuff[256];
 
 static const shall_options_t options[] = {
+    { 'b', &benchmark,       NULL,
+      "Measure the speed of the tools' crc32 code and exit" },
     { 'h', &do_help,         NULL,
       "Print this helpful message" },
     { 'r', &runs,            "N-TESTS",
       "Run N-TESTS tests for each filesystem function (default: 100" },
     { 'p', &passes,          "N-PASSES",
       "Run N-PASSES complete testing cycles (default: 1)" },
+    { 's', &self_only,       NULL,
+      "Only run the self-tests, which check the tools and do not need a"
+      " mounted filesystem; the only argument is then OUTPUT" },
     { 't', &runtime,         "SECONDS",
       "Stop after SECONDS seconds, even if the testing is not complete"
       " (default: 0, which disables it)" },
@@ -62,7 +79,7 @@ static const shall_options_t options[] = {
 };
 
 static const shall_args_t args[] = {
-    { &test_root,  "TEST_ROOT",  1,
+    { &test_root,  "TEST_ROOT",  0,
       "Directory to use for testing; must be on a mounted shallfs" },
     { &output,     "OUTPUT",     0,
       "File to record test result; if omitted, just return status code" },
@@ -76,17 +93,870 @@ static const char * parse_options(int argc, char *argv[]) {
     if (runs < 1) return "-r requires an argument > 0";
     if (passes < 1) return "-p requires an argument > 0";
     if (runtime < 0) return "-t requires an argument >= 0";
+    if (benchmark) return NULL;
+    if (self_only) {
+	if (output) return "Too many command line arguments";
+	output = test_root;
+	test_root = NULL;
+	return NULL;
+    }
+    if (! test_root) return "Please provide TEST_ROOT";
+    return NULL;
+}
+
+/* xorshift64*, so that a failing test can be repeated from its seed */
+static uint64_t random_next(void) {
+    random_state ^= random_state >> 12;
+    random_state ^= random_state << 25;
+    random_state ^= random_state >> 27;
+    return random_state * 0x2545f4914f6cdd1dULL;
+}
+
+static void random_fill(unsigned char * buffer, size_t len) {
+    while (len > 0) {
+	uint64_t r = random_next();
+	int n;
+	for (n = 0; n < 8 && len > 0; n++, len--) {
+	    *buffer++ = r;
+	    r >>= 8;
+	}
+    }
+}
+
+/* the bitwise crc32 the tools used before shallfs-crc.c, which is
+ * obviously the same as the kernel's crc32_le */
+static unsigned int crc_reference(unsigned int crc,
+				  const unsigned char * data, size_t len)
+{
+    while (len-- > 0) {
+	int i;
+	crc ^= *data++;
+	for (i = 0; i < 8; i++)
+	    crc = (crc >> 1) ^ ((crc & 1) ? 0xedb88320 : 0);
+    }
+    return crc;
+}
+
+/* compare shall_crc32 and shall_crc32_batch with the reference, with
+ * every alignment and every length up to a few times the size of the
+ * inner loops, and with random seeds */
+#define CRC_MAXLEN 272
+#define CRC_ALIGN 16
+#define CRC_BATCH 9
+static const char * test_crc32(void) {
+    static const char check[] = "123456789";
+    unsigned char buffer[CRC_BATCH][CRC_MAXLEN + CRC_ALIGN];
+    const void * data[CRC_BATCH];
+    unsigned int result[CRC_BATCH];
+    uint64_t seed = random_state;
+    size_t align, len;
+    int n;
+    /* the standard check value, with the usual inversions */
+    if ((shall_crc32(~0U, check, 9) ^ ~0U) != 0xcbf43926)
+	return "crc32(\"123456789\") is not cbf43926";
+    random_fill(&buffer[0][0], sizeof(buffer));
+    for (align = 0; align < CRC_ALIGN; align++) {
+	for (len = 0; len <= CRC_MAXLEN; len++) {
+	    unsigned int crc = random_next(), want, got;
+	    want = crc_reference(crc, &buffer[0][align], len);
+	    got = shall_crc32(crc, &buffer[0][align], len);
+	    if (got == want) continue;
+	    snprintf(errbuff, sizeof(errbuff),
+		     "crc32 align=%d len=%d: got %08x, expected %08x "
+		     "(random seed %llx)", (int)align, (int)len, got, want,
+		     (unsigned long long)seed);
+	    return errbuff;
+	}
+    }
+    /* the batch code, for all counts up to a couple of rounds of its
+     * interleaved loop plus some left over */
+    for (n = 0; n < CRC_BATCH; n++)
+	data[n] = &buffer[n][random_next() % CRC_ALIGN];
+    for (len = 0; len <= CRC_MAXLEN; len += 1 + len / 8) {
+	unsigned int crc = random_next();
+	int count;
+	for (count = 1; count <= CRC_BATCH; count++) {
+	    shall_crc32_batch(crc, data, len, result, count);
+	    for (n = 0; n < count; n++) {
+		unsigned int want = crc_reference(crc, data[n], len);
+		if (result[n] == want) continue;
+		snprintf(errbuff, sizeof(errbuff),
+			 "crc32 batch count=%d n=%d len=%d: got %08x, "
+			 "expected %08x (random seed %llx)",
+			 count, n, (int)len, result[n], want,
+			 (unsigned long long)seed);
+		return errbuff;
+	    }
+	}
+    }
     return NULL;
 }
 
-static struct {
+/* run one of the other tools, found in the same directory as this one,
+ * with its output discarded; if "kill_after" is positive, descriptor
+ * "watch" is a pipe and the tool is killed after writing that many lines
+ * to it, to simulate a crash at a random point; returns the exit status,
+ * -1 if killed, -2 with errno set if it could not be run */
+static int run_tool(const char * tool, const char * const * args,
+		    int watch, int kill_after)
+{
+    const char * argv[16];
+    char path[4096];
+    int pfd[2] = { -1, -1 }, status, n = 0;
+    pid_t pid;
+    snprintf(path, sizeof(path), "%s/%s", tooldir, tool);
+    argv[n++] = tool;
+    if (kill_after > 0 && pipe(pfd) < 0) return -2;
+    while (*args && n < 15) argv[n++] = *args++;
+    argv[n] = NULL;
+    fflush(NULL);
+    pid = fork();
+    if (pid < 0) {
+	int sve = errno;
+	if (pfd[0] >= 0) close(pfd[0]);
+	if (pfd[1] >= 0) close(pfd[1]);
+	errno = sve;
+	return -2;
+    }
+    if (pid == 0) {
+	int null = open("/dev/null", O_WRONLY);
+	if (null >= 0) dup2(null, 1);
+	if (kill_after > 0) {
+	    dup2(pfd[1], watch);
+	    close(pfd[0]);
+	}
+	execv(path, (char * const *)argv);
+	perror(path);
+	_exit(127);
+    }
+    if (kill_after > 0) {
+	char c;
+	close(pfd[1]);
+	while (kill_after > 0 && read(pfd[0], &c, 1) == 1)
+	    if (c == '\n') kill_after--;
+	if (! kill_after) kill(pid, SIGKILL);
+	close(pfd[0]);
+    }
+    if (waitpid(pid, &status, 0) < 0) return -2;
+    if (WIFSIGNALED(status) && WTERMSIG(status) == SIGKILL) return -1;
+    return WIFEXITED(status) ? WEXITSTATUS(status) : 128;
+}
+
+/* fill a journal with random USERLOG events, each padded to the
+ * alignment like the kernel does; returns the length used */
+static size_t random_events(char * buffer, size_t len, int align) {
+    size_t used = 0;
+    while (1) {
+	struct shall_devheader dh;
+	shall_event_t ev;
+	char msg[256];
+	size_t el, al;
+	memset(&ev, 0, sizeof(ev));
+	ev.operation = SHALL_USERLOG;
+	ev.req_sec = random_next() >> 33;
+	ev.flags = SHALL_LOG_FILE1;
+	ev.num_names = 1;
+	ev.name[0] = msg;
+	ev.namelen[0] = 1 + random_next() % sizeof(msg);
+	random_fill((unsigned char *)msg, ev.namelen[0]);
+	el = shall_event_encode(&ev, NULL, 0);
+	al = (el + align - 1) / align * align;
+	if (used + al > len) return used;
+	shall_event_encode(&ev, buffer + used, el);
+	memset(buffer + used + el, 0, al - el);
+	memcpy(&dh, buffer + used, sizeof(dh));
+	dh.next_header = htole32(al);
+	dh.checksum = htole32(shall_checksum_log(&dh));
+	memcpy(buffer + used, &dh, sizeof(dh));
+	used += al;
+    }
+}
+
+/* largest number of superblocks which fit in a device */
+static int max_superblocks(off_t size) {
+    int n = 9;
+    while (shall_superblock_location(n) + sizeof(struct shall_devsuper)
+	   <= size)
+	n++;
+    return n;
+}
+
+/* random device size between 6 and 16MB, and superblocks to go with it */
+#define TUNE_MAXSIZE (16 * 1048576)
+static off_t random_layout(int * superblocks) {
+    off_t size = 6 * 1048576 +
+	random_next() % (TUNE_MAXSIZE - 6 * 1048576 + SHALL_DEV_BLOCK);
+    size -= size % SHALL_DEV_BLOCK;
+    *superblocks = 9 + random_next() % (max_superblocks(size) - 9);
+    return size;
+}
+
+/* create an image with mkshallfs and put some events in it, starting
+ * at a random position so they may wrap around the end of the device;
+ * then change size, superblocks and alignment with tuneshallfs, killing
+ * it at random points and completing the update with -u; the journal
+ * must contain the same events, and shallfsck must be happy with it */
+static const char * test_tuneshallfs(void) {
+    const char * tmpdir = getenv("TMPDIR");
+    const char * args[10];
+    char dir[4096], image[4200], sizebuf[32], nsbuf[32], alignbuf[32];
+    char * events = NULL, * check = NULL;
+    uint64_t seed = random_state;
+    shall_sb_data_t sb;
+    struct shall_devsuper ssb;
+    off_t size, new_size, space;
+    size_t len;
+    int fd = -1, nsb, new_nsb, align, new_align, crashes, status;
+    const char * errmsg = NULL;
+    /* mkshallfs -c wants to create the image itself */
+    snprintf(dir, sizeof(dir), "%s/testshallfs.XXXXXX",
+	     tmpdir ? tmpdir : "/tmp");
+    if (! mkdtemp(dir)) {
+	snprintf(errbuff, sizeof(errbuff), "%.200s: %s", dir, strerror(errno));
+	return errbuff;
+    }
+    snprintf(image, sizeof(image), "%s/image", dir);
+    size = random_layout(&nsb);
+    align = 8 * (1 + random_next() % 32);
+    snprintf(sizebuf, sizeof(sizebuf), "%lld", (long long)size);
+    snprintf(nsbuf, sizeof(nsbuf), "%d", nsb);
+    snprintf(alignbuf, sizeof(alignbuf), "%d", align);
+    args[0] = "-q"; args[1] = "-c"; args[2] = "-a"; args[3] = alignbuf;
+    args[4] = "-b"; args[5] = nsbuf; args[6] = image; args[7] = sizebuf;
+    args[8] = NULL;
+    status = run_tool("mkshallfs", args, 1, 0);
+    if (status) {
+	snprintf(errbuff, sizeof(errbuff), "mkshallfs exited with status %d "
+		 "(random seed %llx)", status, (unsigned long long)seed);
+	errmsg = errbuff;
+	goto out;
+    }
+    /* tuneshallfs can grow the journal up to the size of the file */
+    if (truncate(image, TUNE_MAXSIZE) < 0) goto out_errno;
+    fd = open(image, O_RDWR);
+    if (fd < 0) goto out_errno;
+    if (! shall_read_sb(fd, &sb, 0)) {
+	errmsg = "cannot read superblock created by mkshallfs";
+	goto out;
+    }
+    new_size = random_layout(&new_nsb);
+    new_align = 8 * (1 + random_next() % 32);
+    /* leave enough space free that the journal can be rearranged */
+    space = new_size - new_nsb * SHALL_DEV_BLOCK;
+    if (space > sb.data_space) space = sb.data_space;
+    events = malloc(space);
+    check = malloc(space);
+    if (! events || ! check) goto out_errno;
+    len = random_events(events, random_next() % (space / 2), align);
+    sb.data_start = (random_next() % sb.data_space) / align * align;
+    sb.data_length = len;
+    if (sb.max_length < len) sb.max_length = len;
+    sb.next_superblock = -1;
+    shall_locate_start(&sb);
+    if (! shall_write_data(fd, &sb, events, len)) goto out_errno;
+    shall_init_sb(&ssb, &sb, NULL);
+    if (! shall_write_all_sb(fd, &ssb, 0)) goto out_errno;
+    close(fd);
+    fd = -1;
+    /* now change everything, crashing up to 3 times */
+    snprintf(sizebuf, sizeof(sizebuf), "%lld", (long long)new_size);
+    snprintf(nsbuf, sizeof(nsbuf), "%d", new_nsb);
+    snprintf(alignbuf, sizeof(alignbuf), "%d", new_align);
+    args[0] = "-C"; args[1] = "3"; args[2] = "-r"; args[3] = sizebuf;
+    args[4] = "-b"; args[5] = nsbuf; args[6] = "-a"; args[7] = alignbuf;
+    args[8] = image; args[9] = NULL;
+    crashes = random_next() % 4;
+    while (1) {
+	int kill_after = crashes > 0 ? 1 + random_next() % 8 : 0;
+	status = run_tool("tuneshallfs", args, 3, kill_after);
+	if (status != -1) break;
+	crashes--;
+	/* it may have finished just before it was killed */
+	fd = open(image, O_RDONLY);
+	if (fd < 0) goto out_errno;
+	if (! shall_read_sb_raw(fd, &sb, 0)) goto out_errno;
+	close(fd);
+	fd = -1;
+	if (! (sb.flags & SHALL_SB_UPDATE)) {
+	    status = 0;
+	    break;
+	}
+	args[2] = "-u"; args[3] = image; args[4] = NULL;
+    }
+    if (status) {
+	snprintf(errbuff, sizeof(errbuff), "tuneshallfs %s exited with "
+		 "status %d (random seed %llx)", args[2], status,
+		 (unsigned long long)seed);
+	errmsg = errbuff;
+	goto out;
+    }
+    fd = open(image, O_RDONLY);
+    if (fd < 0) goto out_errno;
+    if (! shall_read_sb(fd, &sb, 0) || sb.device_size != new_size ||
+	sb.num_superblocks != new_nsb || sb.alignment != new_align ||
+	sb.data_length != len || (sb.flags & SHALL_SB_UPDATE))
+    {
+	snprintf(errbuff, sizeof(errbuff), "wrong superblock after "
+		 "tuneshallfs (random seed %llx)", (unsigned long long)seed);
+	errmsg = errbuff;
+	goto out;
+    }
+    sb.next_superblock = -1;
+    shall_locate_start(&sb);
+    if (shall_read_data(fd, &sb, check, len, 0) != len ||
+	memcmp(events, check, len) != 0)
+    {
+	snprintf(errbuff, sizeof(errbuff), "journal changed by "
+		 "tuneshallfs (random seed %llx)", (unsigned long long)seed);
+	errmsg = errbuff;
+	goto out;
+    }
+    args[0] = "-f"; args[1] = "-n"; args[2] = image; args[3] = NULL;
+    status = run_tool("shallfsck", args, 1, 0);
+    if (status) {
+	snprintf(errbuff, sizeof(errbuff), "shallfsck exited with status %d "
+		 "after tuneshallfs (random seed %llx)", status,
+		 (unsigned long long)seed);
+	errmsg = errbuff;
+    }
+    goto out;
+out_errno:
+    snprintf(errbuff, sizeof(errbuff), "%.200s: %s", image, strerror(errno));
+    errmsg = errbuff;
+out:
+    if (fd >= 0) close(fd);
+    unlink(image);
+    rmdir(dir);
+    free(events);
+    free(check);
+    return errmsg;
+}
+
+/* a random workload for shallreplay: the operations are done on a real
+ * directory, and logged as events as the kernel would; the names which
+ * exist are kept in three lists */
+typedef struct {
+    char ** names;
+    int count, size;
+} namelist_t;
+
+typedef struct {
+    const char * root;
+    char * events;
+    size_t len, size;
+    namelist_t files, dirs, links;
+    int counter;			/* to make up new names */
+    int fileid;
+} workload_t;
+
+static int add_name(namelist_t * nl, char * name) {
+    if (! name) return 0;
+    if (nl->count >= nl->size) {
+	int ns = nl->size ? 2 * nl->size : 64;
+	char ** nn = realloc(nl->names, ns * sizeof(char *));
+	if (! nn) {
+	    free(name);
+	    return 0;
+	}
+	nl->names = nn;
+	nl->size = ns;
+    }
+    nl->names[nl->count++] = name;
+    return 1;
+}
+
+static void remove_name(namelist_t * nl, int n) {
+    free(nl->names[n]);
+    nl->names[n] = nl->names[--nl->count];
+}
+
+static void free_names(namelist_t * nl) {
+    while (nl->count > 0) remove_name(nl, 0);
+    free(nl->names);
+}
+
+/* after renaming "from" to "to", rename everything inside it too */
+static int rename_names(namelist_t * nl, const char * from, const char * to)
+{
+    int fl = strlen(from), n;
+    for (n = 0; n < nl->count; n++) {
+	char * name = nl->names[n], * nn;
+	if (strncmp(name, from, fl) != 0 || name[fl] != '/') continue;
+	nn = malloc(strlen(to) + strlen(name) - fl + 1);
+	if (! nn) return 0;
+	sprintf(nn, "%s%s", to, name + fl);
+	free(name);
+	nl->names[n] = nn;
+    }
+    return 1;
+}
+
+static int is_inside(const char * name, const char * dir) {
+    int dl = strlen(dir);
+    return strncmp(name, dir, dl) == 0 && name[dl] == '/';
+}
+
+/* log one event, always after a successful operation */
+static int log_event(workload_t * w, int operation, const char * name1,
+		     const char * name2, shall_event_t * ev)
+{
+    size_t el;
+    ev->operation = operation;
+    if (name1) {
+	ev->flags |= SHALL_LOG_FILE1;
+	ev->name[ev->num_names] = name1;
+	ev->namelen[ev->num_names++] = strlen(name1);
+    }
+    if (name2) {
+	ev->flags |= SHALL_LOG_FILE2;
+	ev->name[ev->num_names] = name2;
+	ev->namelen[ev->num_names++] = strlen(name2);
+    }
+    ev->data_type = ev->flags & SHALL_LOG_DMASK;
+    el = shall_event_encode(ev, NULL, 0);
+    if (w->len + el > w->size) {
+	size_t ns = 2 * (w->size + el);
+	char * ne = realloc(w->events, ns);
+	if (! ne) return 0;
+	w->events = ne;
+	w->size = ns;
+    }
+    w->len += shall_event_encode(ev, w->events + w->len, el);
+    return 1;
+}
+
+static int log_names(workload_t * w, int operation, const char * name1,
+		     const char * name2)
+{
+    shall_event_t ev;
+    memset(&ev, 0, sizeof(ev));
+    return log_event(w, operation, name1, name2, &ev);
+}
+
+static int log_attr(workload_t * w, int operation, const char * name,
+		    int flags, int mode, off_t size)
+{
+    shall_event_t ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.flags = SHALL_LOG_ATTR;
+    ev.u.attr.flags = flags;
+    ev.u.attr.mode = mode;
+    ev.u.attr.size = size;
+    return log_event(w, operation, name, NULL, &ev);
+}
+
+static int log_fileid(workload_t * w, int operation, const char * name,
+		      int fileid)
+{
+    shall_event_t ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.flags = SHALL_LOG_FILEID;
+    ev.u.fileid = fileid;
+    return log_event(w, operation, name, NULL, &ev);
+}
+
+/* the name in the source directory; two buffers, for rename */
+static char * real_name(const workload_t * w, const char * name) {
+    static char buffer[2][4096];
+    static int which = 0;
+    which = 1 - which;
+    snprintf(buffer[which], sizeof(buffer[which]), "%s%s", w->root, name);
+    return buffer[which];
+}
+
+/* a new name inside a random directory, or the root */
+static char * new_name(workload_t * w, char type) {
+    int n = random_next() % (w->dirs.count + 1);
+    const char * dir = n < w->dirs.count ? w->dirs.names[n] : "";
+    char * name = malloc(strlen(dir) + 16);
+    if (name) sprintf(name, "%s/%c%d", dir, type, ++w->counter);
+    return name;
+}
+
+/* do one random operation and log it; returns 0 with errno set on error */
+static int random_operation(workload_t * w) {
+    namelist_t * fl = &w->files, * dl = &w->dirs;
+    int choice = random_next() % 100, f = 0, d = 0, ok = 1;
+    char * name = NULL, buffer[8192];
+    if (fl->count) f = random_next() % fl->count;
+    if (dl->count) d = random_next() % dl->count;
+    if (choice < 8) {
+	name = new_name(w, 'd');
+	if (! name || mkdir(real_name(w, name), 0755) < 0) goto error;
+	ok = log_attr(w, SHALL_MKDIR, name, shall_attr_mode, 0755, 0) &&
+	     add_name(dl, name);
+    } else if (choice < 20 || ! fl->count) {
+	int fd;
+	name = new_name(w, 'f');
+	if (! name) goto error;
+	fd = open(real_name(w, name), O_WRONLY | O_CREAT | O_EXCL, 0644);
+	if (fd < 0) goto error;
+	close(fd);
+	ok = log_attr(w, SHALL_CREATE, name, shall_attr_mode, 0644, 0) &&
+	     add_name(fl, name);
+    } else if (choice < 50) {
+	/* written while open, so the WRITE has a file ID */
+	shall_event_t ev;
+	off_t start = random_next() % 65536;
+	size_t len = 1 + random_next() % sizeof(buffer);
+	int fd = open(real_name(w, fl->names[f]), O_WRONLY);
+	if (fd < 0) return 0;
+	random_fill((unsigned char *)buffer, len);
+	ok = pwrite(fd, buffer, len, start) == len;
+	close(fd);
+	if (! ok) return 0;
+	w->fileid++;
+	memset(&ev, 0, sizeof(ev));
+	ev.flags = SHALL_LOG_REGION;
+	ev.u.region.fileid = w->fileid;
+	ev.u.region.start = start;
+	ev.u.region.length = len;
+	ok = log_fileid(w, SHALL_OPEN, fl->names[f], w->fileid) &&
+	     log_event(w, SHALL_WRITE, NULL, NULL, &ev) &&
+	     log_fileid(w, SHALL_CLOSE, NULL, w->fileid);
+    } else if (choice < 55) {
+	off_t size = random_next() % 65536;
+	if (truncate(real_name(w, fl->names[f]), size) < 0) return 0;
+	ok = log_attr(w, SHALL_META, fl->names[f], shall_attr_size, 0, size);
+    } else if (choice < 60) {
+	int mode = 0600 | (random_next() & 0077);
+	if (chmod(real_name(w, fl->names[f]), mode) < 0) return 0;
+	ok = log_attr(w, SHALL_META, fl->names[f], shall_attr_mode, mode, 0);
+    } else if (choice < 70) {
+	/* move a file, sometimes replacing another one */
+	char * from = fl->names[f];
+	int other = fl->count > 1 && random_next() % 4 == 0
+		  ? random_next() % fl->count : f;
+	if (other != f) {
+	    name = strdup(fl->names[other]);
+	} else {
+	    name = new_name(w, 'f');
+	}
+	if (! name) goto error;
+	if (rename(real_name(w, from), real_name(w, name)) < 0) goto error;
+	ok = log_names(w, SHALL_MOVE, from, name);
+	free(fl->names[f]);
+	fl->names[f] = name;
+	name = NULL;
+	if (other != f) remove_name(fl, other);
+    } else if (choice < 76 && dl->count) {
+	/* move a directory somewhere not inside itself */
+	char * from = dl->names[d];
+	name = new_name(w, 'd');
+	if (! name) goto error;
+	if (is_inside(name, from)) {
+	    free(name);
+	    return 1;
+	}
+	if (rename(real_name(w, from), real_name(w, name)) < 0) goto error;
+	ok = log_names(w, SHALL_MOVE, from, name) &&
+	     rename_names(fl, from, name) && rename_names(dl, from, name) &&
+	     rename_names(&w->links, from, name);
+	free(dl->names[d]);
+	dl->names[d] = name;
+	name = NULL;
+    } else if (choice < 82 && fl->count > 1) {
+	int other = random_next() % fl->count;
+	if (other == f) return 1;
+	if (renameat2(AT_FDCWD, real_name(w, fl->names[f]), AT_FDCWD,
+		      real_name(w, fl->names[other]), RENAME_EXCHANGE) < 0)
+		return 0;
+	ok = log_names(w, SHALL_SWAP, fl->names[f], fl->names[other]);
+    } else if (choice < 90) {
+	if (unlink(real_name(w, fl->names[f])) < 0) return 0;
+	ok = log_names(w, SHALL_DELETE, fl->names[f], NULL);
+	remove_name(fl, f);
+    } else if (choice < 95 && dl->count) {
+	/* only an empty directory can go */
+	int n;
+	for (n = 0; n < fl->count; n++)
+	    if (is_inside(fl->names[n], dl->names[d])) return 1;
+	for (n = 0; n < dl->count; n++)
+	    if (is_inside(dl->names[n], dl->names[d])) return 1;
+	for (n = 0; n < w->links.count; n++)
+	    if (is_inside(w->links.names[n], dl->names[d])) return 1;
+	if (rmdir(real_name(w, dl->names[d])) < 0) return 0;
+	ok = log_names(w, SHALL_RMDIR, dl->names[d], NULL);
+	remove_name(dl, d);
+    } else {
+	char target[32];
+	name = new_name(w, 'l');
+	if (! name) goto error;
+	snprintf(target, sizeof(target), "target%d", w->counter);
+	if (symlink(target, real_name(w, name)) < 0) goto error;
+	ok = log_names(w, SHALL_SYMLINK, name, target) &&
+	     add_name(&w->links, name);
+    }
+    if (! ok) errno = ENOMEM;
+    return ok;
+error:
+    free(name);
+    return 0;
+}
+
+/* compare two directory trees: names, types, file contents and modes,
+ * symbolic link targets; returns NULL if they are the same */
+static const char * compare_trees(const char * a, const char * b) {
+    struct dirent ** la, ** lb;
+    const char * errmsg = NULL;
+    int na = scandir(a, &la, NULL, alphasort), nb, n;
+    if (na < 0) {
+	snprintf(errbuff, sizeof(errbuff), "%.200s: %s", a, strerror(errno));
+	return errbuff;
+    }
+    nb = scandir(b, &lb, NULL, alphasort);
+    if (nb < 0) {
+	snprintf(errbuff, sizeof(errbuff), "%.200s: %s", b, strerror(errno));
+	errmsg = errbuff;
+	nb = 0;
+	lb = NULL;
+    }
+    for (n = 0; ! errmsg && (n < na || n < nb); n++) {
+	char pa[4096], pb[4096];
+	struct stat sa, sb;
+	if (n >= na || n >= nb ||
+	    strcmp(la[n]->d_name, lb[n]->d_name) != 0)
+	{
+	    snprintf(errbuff, sizeof(errbuff), "%.150s/%.50s: in one tree only",
+		     b, n < na && (n >= nb ||
+				   strcmp(la[n]->d_name, lb[n]->d_name) < 0)
+			? la[n]->d_name : lb[n]->d_name);
+	    errmsg = errbuff;
+	    break;
+	}
+	if (strcmp(la[n]->d_name, ".") == 0 ||
+	    strcmp(la[n]->d_name, "..") == 0)
+		continue;
+	snprintf(pa, sizeof(pa), "%s/%s", a, la[n]->d_name);
+	snprintf(pb, sizeof(pb), "%s/%s", b, lb[n]->d_name);
+	if (lstat(pa, &sa) < 0 || lstat(pb, &sb) < 0 ||
+	    (sa.st_mode & S_IFMT) != (sb.st_mode & S_IFMT))
+	{
+	    snprintf(errbuff, sizeof(errbuff), "%.200s: different type", pb);
+	    errmsg = errbuff;
+	} else if (S_ISDIR(sa.st_mode)) {
+	    errmsg = compare_trees(pa, pb);
+	} else if (S_ISLNK(sa.st_mode)) {
+	    char ta[256], tb[256];
+	    ssize_t ra = readlink(pa, ta, sizeof(ta));
+	    ssize_t rb = readlink(pb, tb, sizeof(tb));
+	    if (ra != rb || ra < 0 || memcmp(ta, tb, ra) != 0) {
+		snprintf(errbuff, sizeof(errbuff),
+			 "%.200s: different target", pb);
+		errmsg = errbuff;
+	    }
+	} else if (sa.st_size != sb.st_size ||
+		   (sa.st_mode & 07777) != (sb.st_mode & 07777))
+	{
+	    snprintf(errbuff, sizeof(errbuff),
+		     "%.200s: different size or mode", pb);
+	    errmsg = errbuff;
+	} else {
+	    char da[8192], db[8192];
+	    int fa = open(pa, O_RDONLY), fb = open(pb, O_RDONLY);
+	    ssize_t ra = 1, rb;
+	    while (fa >= 0 && fb >= 0 && ra > 0) {
+		ra = read(fa, da, sizeof(da));
+		rb = read(fb, db, sizeof(db));
+		if (ra != rb || ra < 0 || memcmp(da, db, ra) != 0) break;
+	    }
+	    if (fa < 0 || fb < 0 || ra != 0) {
+		snprintf(errbuff, sizeof(errbuff),
+			 "%.200s: different contents", pb);
+		errmsg = errbuff;
+	    }
+	    if (fa >= 0) close(fa);
+	    if (fb >= 0) close(fb);
+	}
+    }
+    for (n = 0; n < na; n++) free(la[n]);
+    free(la);
+    for (n = 0; n < nb; n++) free(lb[n]);
+    free(lb);
+    return errmsg;
+}
+
+static int remove_one(const char * path, const struct stat * st,
+		      int flag, struct FTW * ftw)
+{
+    remove(path);
+    return 0;
+}
+
+/* generate a random workload, then replay it on an empty mirror with
+ * shallreplay, killing it at random points and restarting it from its
+ * checkpoint: the result must be the same as the original */
+#define REPLAY_MAXOPS 4000
+static const char * test_shallreplay(void) {
+    const char * tmpdir = getenv("TMPDIR");
+    const char * args[12];
+    char dir[4096], src[4200], mirror[4200], events[4200], ckpt[4200];
+    char threads[16];
+    uint64_t seed = random_state;
+    workload_t w;
+    const char * errmsg = NULL;
+    int nops, n, fd, crashes, status;
+    memset(&w, 0, sizeof(w));
+    snprintf(dir, sizeof(dir), "%s/testshallfs.XXXXXX",
+	     tmpdir ? tmpdir : "/tmp");
+    if (! mkdtemp(dir)) {
+	snprintf(errbuff, sizeof(errbuff), "%.200s: %s", dir, strerror(errno));
+	return errbuff;
+    }
+    snprintf(src, sizeof(src), "%s/source", dir);
+    snprintf(mirror, sizeof(mirror), "%s/mirror", dir);
+    snprintf(events, sizeof(events), "%s/events", dir);
+    snprintf(ckpt, sizeof(ckpt), "%s/checkpoint", dir);
+    if (mkdir(src, 0755) < 0 || mkdir(mirror, 0755) < 0) goto out_errno;
+    w.root = src;
+    nops = 100 + random_next() % REPLAY_MAXOPS;
+    for (n = 0; n < nops; n++)
+	if (! random_operation(&w) && (fprintf(stderr,"DBG op %d %s\n", n, strerror(errno)),1))
+	    goto out_errno;
+    fd = open(events, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) goto out_errno;
+    n = write(fd, w.events, w.len);
+    if (close(fd) < 0 || n != w.len) goto out_errno;
+    snprintf(threads, sizeof(threads), "%d", 1 + (int)(random_next() % 4));
+    args[0] = "-v"; args[1] = "-i"; args[2] = "1"; args[3] = "-j";
+    args[4] = threads; args[5] = "-c"; args[6] = ckpt; args[7] = events;
+    args[8] = src; args[9] = mirror; args[10] = NULL;
+    crashes = random_next() % 4;
+    do {
+	int kill_after = crashes-- > 0 ? 1 + random_next() % nops : 0;
+	status = run_tool("shallreplay", args, 1, kill_after);
+    } while (status == -1);
+    if (status) {
+	snprintf(errbuff, sizeof(errbuff), "shallreplay exited with status "
+		 "%d (random seed %llx)", status, (unsigned long long)seed);
+	errmsg = errbuff;
+	goto out;
+    }
+    errmsg = compare_trees(src, mirror);
+    if (errmsg) {
+	char msg[256];
+	snprintf(msg, sizeof(msg), "%.200s (random seed %llx)",
+		 errmsg, (unsigned long long)seed);
+	strcpy(errbuff, msg);
+	errmsg = errbuff;
+    }
+    goto out;
+out_errno:
+    snprintf(errbuff, sizeof(errbuff), "%.200s: %s", dir, strerror(errno));
+    errmsg = errbuff;
+out:
+    nftw(dir, remove_one, 16, FTW_DEPTH | FTW_PHYS);
+    free(w.events);
+    free_names(&w.files);
+    free_names(&w.dirs);
+    free_names(&w.links);
+    return errmsg;
+}
+
+typedef struct {
     const char * name;
     const char * (*code)(void);
-} functions[] = {
+} test_t;
+
+static const test_t functions[] = {
     // XXX
     { NULL, NULL }
 };
 
+/* tests of the tools, which don't need a mounted filesystem; some run
+ * the other tools on an image file in $TMPDIR */
+static const test_t selftests[] = {
+    { "crc32",       test_crc32 },
+    { "tuneshallfs", test_tuneshallfs },
+    { "shallreplay", test_shallreplay },
+    { NULL, NULL }
+};
+
+/* run all tests in a table; returns 0 if we ran out of time */
+static int run_tests(const test_t * tests, time_t endtime) {
+    int func;
+    for (func = 0; tests[func].name; func++) {
+	int run;
+	if (OF)
+	    fprintf(OF, "Running: %s\n", tests[func].name);
+	for (run = 0; run  < runs; run++) {
+	    const char * errmsg = tests[func].code();
+	    if (errmsg) {
+		runs_failed ++;
+		if (OF) fprintf(OF, "%d: ERROR %s\n", run + 1, errmsg);
+	    } else {
+		runs_ok ++;
+		if (OF) fprintf(OF, "%d: OK\n", run + 1);
+	    }
+	    if (runtime > 0 && endtime < time(NULL)) return 0;
+	}
+    }
+    return 1;
+}
+
+static double elapsed(const struct timespec * start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) +
+	   (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+/* measure the speed of the crc32 code: large buffers, as used when
+ * checking a whole journal, and batches of event headers, as used by
+ * shall_check_logs; the reference is there for comparison */
+static int run_benchmark(void) {
+    static const struct {
+	const char * name;
+	size_t len;
+	int batch;
+    } tests[] = {
+	{ "reference, 4096 bytes", 4096, 0 },
+	{ "shall_crc32, 64 bytes", 64, 1 },
+	{ "shall_crc32, 4096 bytes", 4096, 1 },
+	{ "shall_crc32, 1MB", 1048576, 1 },
+	{ "shall_crc32_batch, 4 x event header",
+	  shall_devheader_checksize, 4 },
+	{ "shall_crc32_batch, 64 x event header",
+	  shall_devheader_checksize, 64 },
+	{ NULL, 0, 0 }
+    };
+    size_t size = 4 * 1048576;
+    unsigned char * buffer = malloc(size);
+    int t;
+    if (! buffer) {
+	perror("malloc");
+	return err_operation;
+    }
+    random_fill(buffer, size);
+    for (t = 0; tests[t].name; t++) {
+	struct timespec start;
+	const void * data[64];
+	unsigned int result[64], crc = 0;
+	size_t done = 0, total = tests[t].batch ? 1024 * 1048576 : 32 * 1048576;
+	int count = tests[t].batch > 1 ? tests[t].batch : 1, n;
+	double secs;
+	for (n = 0; n < count; n++)
+	    data[n] = buffer + (n * tests[t].len) % (size - tests[t].len);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	while (done < total) {
+	    if (tests[t].batch == 0) {
+		crc = crc_reference(crc, data[0], tests[t].len);
+	    } else if (tests[t].batch == 1) {
+		crc = shall_crc32(crc, data[0], tests[t].len);
+	    } else {
+		shall_crc32_batch(crc, data, tests[t].len, result, count);
+		crc ^= result[0];
+	    }
+	    done += count * tests[t].len;
+	}
+	secs = elapsed(&start);
+	printf("%-40s %9.1f MB/s (%08x)\n", tests[t].name,
+	       secs > 0 ? done / secs / 1048576.0 : 0.0, crc);
+    }
+    free(buffer);
+    return err_ok;
+}
+
 int main(int argc, char *argv[]) {
     struct stat sbuff;
     const char * pname = strrchr(argv[0], '/');
@@ -106,18 +976,33 @@ int main(int argc, char *argv[]) {
 		pname, errmsg, pname);
 	return err_syntax;
     }
-    if (stat(test_root, &sbuff) < 0) {
-	perror(test_root);
+    tooldir = strdup(argv[0]);
+    if (! tooldir) {
+	perror(pname);
 	return err_operation;
     }
-    if (! S_ISDIR(sbuff.st_mode)) {
-	fprintf(stderr, "%s: %s is not a directory\n", pname, test_root);
-	return err_syntax;
-    }
-    if (! shall_find_device(test_root, &sbuff.st_rdev)) {
-	fprintf(stderr, "%s: cannot find shallfs on %s\n",
-		pname, test_root);
-	return err_syntax;
+    if (strrchr(tooldir, '/'))
+	*strrchr(tooldir, '/') = 0;
+    else
+	strcpy(tooldir, ".");
+    random_state = time(NULL) ^ ((uint64_t)getpid() << 32);
+    if (! random_state) random_state = 1;
+    if (benchmark)
+	return run_benchmark();
+    if (! self_only) {
+	if (stat(test_root, &sbuff) < 0) {
+	    perror(test_root);
+	    return err_operation;
+	}
+	if (! S_ISDIR(sbuff.st_mode)) {
+	    fprintf(stderr, "%s: %s is not a directory\n", pname, test_root);
+	    return err_syntax;
+	}
+	if (! shall_find_device(test_root, &sbuff.st_rdev)) {
+	    fprintf(stderr, "%s: cannot find shallfs on %s\n",
+		    pname, test_root);
+	    return err_syntax;
+	}
     }
     if (output) {
 	OF = fopen(output, "w");
@@ -131,27 +1016,12 @@ int main(int argc, char *argv[]) {
     if (runtime > 0)
 	endtime = time(NULL) + runtime;
     for (pass = 0; pass < passes; pass++) {
-	int func;
 	if (OF)
 	    fprintf(OF, "Pass: %d\n", pass + 1);
-	for (func = 0; functions[func].name; func++) {
-	    int run;
-	    if (OF)
-		fprintf(OF, "Running: %s\n", functions[func].name);
-	    for (run = 0; run  < runs; run++) {
-		errmsg = functions[func].code();
-		if (errmsg) {
-		    runs_failed ++;
-		    if (OF) fprintf(OF, "%d: ERROR %s\n", run + 1, errmsg);
-		} else {
-		    runs_ok ++;
-		    if (OF) fprintf(OF, "%d: OK\n", run + 1);
-		}
-		if (runtime > 0 && endtime < time(NULL)) goto out;
-	    }
-	}
+	if (! run_tests(selftests, endtime)) break;
+	if (self_only) continue;
+	if (! run_tests(functions, endtime)) break;
     }
-out:
     if (OF) {
 	fprintf(OF, "Result: %ld OK, %ld FAILED\n", runs_ok, runs_failed);
 	fclose(OF);
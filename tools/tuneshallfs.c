@@ -31,7 +31,10 @@
 #include <stdint.h>
 #include <string.h>
 #include <time.h>
+#include <math.h>
+#include <pthread.h>
 #include "shallfs-common.h"
+#include "shallfs-crc.h"
 #include <shallfs/operation.h>
 #include <shallfs/device.h>
 
@@ -51,3 +54,1034 @@
 //    anything) mark the superblock as operational, delete the move plan,
 //    and update all superblocks.
 
+/* largest amount of data copied with a single read and write, and number
+ * of buffers the reader thread can fill ahead of the writes */
+#define CHUNK (4 * 1024 * 1024)
+#define NBUFFERS 4
+
+static long alignment = 0, num_superblocks = 0, progress = -1, show = 0;
+static long progress_bar = 0, readonly = 0, interval = 10, resume = 0;
+static long do_help = 0;
+static int progress_len = 0, last_progress = -1;
+static const char * device = NULL, * fs_size = NULL;
+
+static const shall_options_t options[] = {
+    { 'a', &alignment,       "ALIGN",
+      "New alignment of event logs, multiple of 8 and <= 4096" },
+    { 'b', &num_superblocks, "N-SUPER",
+      "New number of superblocks, more than 8 and fitting in the device" },
+    { 'C', &progress,        "FILENO",
+      "Produces progress information on a file descriptor" },
+    { 'c', &progress_bar,    NULL,
+      "Show progress while copying data" },
+    { 'h', &do_help,         NULL,
+      "Print this helpful message" },
+    { 'l', &show,            NULL,
+      "Show current values without changing anything" },
+    { 'n', &readonly,        NULL,
+      "Just show what would be done, do not write anything" },
+    { 'r', NULL,             "SIZE",
+      "Resize the journal to SIZE bytes, 0 to use the whole device",
+      &fs_size },
+    { 't', &interval,        "SECONDS",
+      "Maximum time between checkpoints while copying (default 10)" },
+    { 'u', &resume,          NULL,
+      "Complete a previously interrupted update" },
+    {  0,  NULL,             NULL, NULL }
+};
+
+static const shall_args_t args[] = {
+    { &device,  "DEVICE",  1,
+      "The block device (or image file) to modify" },
+    { NULL,     NULL,    0, NULL }
+};
+
+static const char * parse_options(int argc, char *argv[]) {
+    const char * err = shall_parse_options(argc, argv, options, args);
+    if (err) return err;
+    if (do_help) return NULL;
+    if (show && (alignment || num_superblocks || fs_size || progress >= 0 ||
+		 progress_bar || readonly || resume))
+	return "Cannot use -l with any other option";
+    if (resume && (alignment || num_superblocks || fs_size))
+	return "Cannot use -a, -b or -r with -u";
+#define mkstr(S, B) S #B
+    if (alignment &&
+	(alignment < 8 || alignment > SHALL_DEV_BLOCK || alignment % 8))
+	return mkstr("Invalid alignment, must be positive, "
+		     "multiple of 8 and <= ", SHALL_DEV_BLOCK);
+#undef mkstr
+    if (num_superblocks != 0 && num_superblocks <= 8)
+	return "Invalid number of superblocks, must be more than 8";
+    if (interval < 1)
+	return "Invalid checkpoint interval";
+    if (progress_bar) {
+	if (progress > 0)
+	    return "Cannot have both -c and -C";
+	progress = 0;
+    }
+    if (! show && ! resume && ! alignment && ! num_superblocks && ! fs_size)
+	return "Nothing to do, please specify -a, -b, -l, -r or -u";
+    return NULL;
+}
+
+static void clear_progress(void) {
+    if (progress != 0 || progress_len < 1) return;
+    printf("\r%*c\r", progress_len, ' ');
+    progress_len = 0;
+}
+
+/* report progress; with a bar, only when it changes visibly */
+static void show_progress(off_t done, off_t total) {
+    char buf[128];
+    int now;
+    if (progress < 0 || total < 1) return;
+    now = 1000.0 * done / total;
+    if (now == last_progress && done < total) return;
+    last_progress = now;
+    if (progress == 0) {
+	float percent = 100.0 * done / total;
+	int n, dash = lround(percent / 2.0), len;
+	snprintf(buf, sizeof(buf), "Copying |");
+	len = strlen(buf);
+	for (n = 0; n < dash && len < sizeof(buf); n++)
+	    buf[len++] = '=';
+	for (; n < 50 && len < sizeof(buf); n++)
+	    buf[len++] = ' ';
+	if (len < sizeof(buf))
+	    snprintf(buf + len, sizeof(buf) - len, "| %5.1f%%", percent);
+	else
+	    buf[sizeof(buf) - 1] = 0;
+	len = strlen(buf);
+	putchar('\r');
+	if (len < progress_len)
+	    printf("%*c\r", progress_len, ' ');
+	printf("%s", buf);
+	fflush(stdout);
+	progress_len = len;
+    } else {
+	snprintf(buf, sizeof(buf), "%lld %lld %s\n",
+		 (long long)done, (long long)total, device);
+	if (write(progress, buf, strlen(buf)) < 0) {
+	    /* nothing but otherwise gcc complains about ignoring
+	     * return value of write() */
+	}
+    }
+}
+
+/* read or write exactly "len" bytes at "where" */
+static int read_at(int fd, char * buf, size_t len, off_t where) {
+    while (len > 0) {
+	ssize_t nr = pread(fd, buf, len, where);
+	if (nr < 0) return 0;
+	if (nr == 0) {
+	    errno = EIO;
+	    return 0;
+	}
+	buf += nr;
+	len -= nr;
+	where += nr;
+    }
+    return 1;
+}
+
+static int write_at(int fd, const char * buf, size_t len, off_t where) {
+    while (len > 0) {
+	ssize_t nw = pwrite(fd, buf, len, where);
+	if (nw < 0) return 0;
+	if (nw == 0) {
+	    errno = ENOSPC;
+	    return 0;
+	}
+	buf += nw;
+	len -= nw;
+	where += nw;
+    }
+    return 1;
+}
+
+/* the part of the device format which determines where the data goes */
+typedef struct {
+    off_t size;
+    off_t space;
+    int num_superblocks;
+} layout_t;
+
+/* a position in the device, like real_start and next_superblock */
+typedef struct {
+    off_t pos;
+    int next;
+} cursor_t;
+
+static inline off_t superblock_block(int n) {
+    return shall_superblock_location(n) - SHALL_SB_OFFSET;
+}
+
+/* find the device position of a logical position in the ring buffer */
+static void cursor_init(cursor_t * c, const layout_t * l, off_t logical) {
+    c->pos = logical;
+    c->next = 0;
+    while (c->next < l->num_superblocks &&
+	   superblock_block(c->next) <= c->pos)
+    {
+	c->next++;
+	c->pos += SHALL_DEV_BLOCK;
+    }
+}
+
+/* amount of data which can be stored contiguously from the cursor */
+static off_t cursor_run(const cursor_t * c, const layout_t * l) {
+    off_t end = c->next < l->num_superblocks
+	      ? superblock_block(c->next) : l->size;
+    return end - c->pos;
+}
+
+/* advance by at most cursor_run() bytes, skipping any superblock and
+ * wrapping around at the end of the device */
+static void cursor_advance(cursor_t * c, const layout_t * l, off_t len) {
+    c->pos += len;
+    if (cursor_run(c, l) > 0) return;
+    c->next++;
+    c->pos += SHALL_DEV_BLOCK;
+    if (c->pos < l->size) return;
+    c->next = 1;
+    c->pos = SHALL_DEV_BLOCK;
+}
+
+/* the opposite of cursor_init: -1 if the position is a superblock or past
+ * the end of the device */
+static off_t logical_position(const layout_t * l, off_t pos) {
+    int n = 0;
+    if (pos >= l->size) return -1;
+    while (n < l->num_superblocks && superblock_block(n) <= pos) {
+	if (pos < superblock_block(n) + SHALL_DEV_BLOCK) return -1;
+	n++;
+    }
+    return pos - n * (off_t)SHALL_DEV_BLOCK;
+}
+
+/* the journal is copied in segments, which are contiguous on the device in
+ * both the old and new layout; a segment is copied starting from the end
+ * which moves away from the rest of the segment, so each part only
+ * overwrites source data which has already been copied */
+typedef struct {
+    off_t src;
+    off_t dst;
+    off_t length;
+    off_t order;			/* data copied before this segment */
+} segment_t;
+
+typedef struct {
+    layout_t old;
+    layout_t new;
+    off_t old_start;			/* logical, in the old layout */
+    off_t new_start;			/* logical, in the new layout */
+    off_t length;
+    off_t total;			/* data which needs copying */
+    int count;
+    segment_t * seg;			/* in the order they are copied */
+    int * by_src;			/* sorted by source */
+    int * by_dst;			/* sorted by destination */
+    off_t staging;			/* staging area, or -1 */
+    off_t staging_size;
+} plan_t;
+
+static inline int forward(const segment_t * s) {
+    return s->dst < s->src;
+}
+
+static inline off_t distance(const segment_t * s) {
+    return s->dst < s->src ? s->src - s->dst : s->dst - s->src;
+}
+
+/* qsort does not pass any context to the comparison function */
+static const segment_t * sort_seg;
+static int sort_dst;
+
+static int compare_segments(const void * _a, const void * _b) {
+    const segment_t * a = &sort_seg[*(const int *)_a];
+    const segment_t * b = &sort_seg[*(const int *)_b];
+    off_t pa = sort_dst ? a->dst : a->src, pb = sort_dst ? b->dst : b->src;
+    return pa < pb ? -1 : pa > pb;
+}
+
+static void sort_index(const plan_t * p, int * idx, int dst) {
+    int n;
+    for (n = 0; n < p->count; n++)
+	idx[n] = n;
+    sort_seg = p->seg;
+    sort_dst = dst;
+    qsort(idx, p->count, sizeof(int), compare_segments);
+}
+
+/* first segment in a sorted index which ends after "pos"; the segments
+ * never overlap each other, so they are also sorted by their end */
+static int first_after(const plan_t * p, const int * idx, int dst, off_t pos) {
+    int lo = 0, hi = p->count;
+    while (lo < hi) {
+	int mid = (lo + hi) / 2;
+	const segment_t * s = &p->seg[idx[mid]];
+	if ((dst ? s->dst : s->src) + s->length <= pos)
+	    lo = mid + 1;
+	else
+	    hi = mid;
+    }
+    return lo;
+}
+
+static void free_plan(plan_t * p) {
+    free(p->seg);
+    free(p->by_src);
+    free(p->by_dst);
+    p->seg = NULL;
+    p->by_src = p->by_dst = NULL;
+    p->count = 0;
+}
+
+/* divide the journal in segments for a given start in the new layout;
+ * data which stays where it is does not need a segment */
+static int make_segments(plan_t * p) {
+    cursor_t src, dst;
+    off_t done = 0;
+    int size = 0;
+    free_plan(p);
+    cursor_init(&src, &p->old, p->old_start);
+    cursor_init(&dst, &p->new, p->new_start);
+    while (done < p->length) {
+	off_t run = cursor_run(&src, &p->old), drun = cursor_run(&dst, &p->new);
+	if (run > drun) run = drun;
+	if (run > p->length - done) run = p->length - done;
+	if (src.pos != dst.pos) {
+	    if (p->count >= size) {
+		int ns = size + 64;
+		segment_t * ne = realloc(p->seg, ns * sizeof(segment_t));
+		if (! ne) return 0;
+		p->seg = ne;
+		size = ns;
+	    }
+	    p->seg[p->count].src = src.pos;
+	    p->seg[p->count].dst = dst.pos;
+	    p->seg[p->count].length = run;
+	    p->count++;
+	}
+	cursor_advance(&src, &p->old, run);
+	cursor_advance(&dst, &p->new, run);
+	done += run;
+    }
+    p->by_src = malloc((p->count + 1) * sizeof(int));
+    p->by_dst = malloc((p->count + 1) * sizeof(int));
+    if (! p->by_src || ! p->by_dst) return 0;
+    return 1;
+}
+
+/* put the segments in an order such that no segment is written over the
+ * source of a segment which has not been copied yet; this is impossible
+ * if the segments depend on each other in a loop, for example when the
+ * device is full and the data needs rotating */
+static int order_segments(plan_t * p) {
+    int n = p->count, head = 0, tail = 0, i, k;
+    int * indeg = calloc(n + 1, sizeof(int));
+    int * queue = malloc((n + 1) * sizeof(int));
+    segment_t * sorted = malloc((n + 1) * sizeof(segment_t));
+    off_t total = 0;
+    if (! indeg || ! queue || ! sorted) goto fail;
+    sort_index(p, p->by_src, 0);
+    sort_index(p, p->by_dst, 1);
+    for (i = 0; i < n; i++) {
+	const segment_t * y = &p->seg[i];
+	for (k = first_after(p, p->by_src, 0, y->dst); k < n; k++) {
+	    if (p->seg[p->by_src[k]].src >= y->dst + y->length) break;
+	    if (p->by_src[k] != i) indeg[i]++;
+	}
+    }
+    for (i = 0; i < n; i++)
+	if (! indeg[i]) queue[tail++] = i;
+    while (head < tail) {
+	int x = queue[head++];
+	const segment_t * s = &p->seg[x];
+	for (k = first_after(p, p->by_dst, 1, s->src); k < n; k++) {
+	    int y = p->by_dst[k];
+	    if (p->seg[y].dst >= s->src + s->length) break;
+	    if (y != x && --indeg[y] == 0) queue[tail++] = y;
+	}
+    }
+    if (tail < n) {
+	errno = EDEADLK;
+	goto fail;
+    }
+    for (i = 0; i < n; i++) {
+	sorted[i] = p->seg[queue[i]];
+	sorted[i].order = total;
+	total += sorted[i].length;
+    }
+    free(p->seg);
+    p->seg = sorted;
+    p->total = total;
+    sort_index(p, p->by_src, 0);
+    sort_index(p, p->by_dst, 1);
+    free(indeg);
+    free(queue);
+    return 1;
+fail:
+    free(indeg);
+    free(queue);
+    free(sorted);
+    return 0;
+}
+
+/* look for a staging area in a free part of the old journal, avoiding
+ * anything which will be written to */
+static void staging_candidate(plan_t * p, off_t start, off_t end) {
+    int first = p->old.num_superblocks < p->new.num_superblocks
+	      ? p->old.num_superblocks : p->new.num_superblocks;
+    while (start < end && p->staging_size < CHUNK) {
+	off_t stop = end, skip = end, a, b;
+	int k = first_after(p, p->by_dst, 1, start), n;
+	if (k < p->count && p->seg[p->by_dst[k]].dst < stop) {
+	    stop = p->seg[p->by_dst[k]].dst;
+	    skip = stop + p->seg[p->by_dst[k]].length;
+	}
+	for (n = first; n < p->new.num_superblocks; n++) {
+	    off_t sb = superblock_block(n);
+	    if (sb + SHALL_DEV_BLOCK <= start || sb >= stop) continue;
+	    stop = sb;
+	    skip = sb + SHALL_DEV_BLOCK;
+	}
+	if (stop < start) stop = start;
+	a = (start + SHALL_DEV_BLOCK - 1) & ~(off_t)(SHALL_DEV_BLOCK - 1);
+	b = stop & ~(off_t)(SHALL_DEV_BLOCK - 1);
+	if (b - a > p->staging_size) {
+	    p->staging = a;
+	    p->staging_size = b - a > CHUNK ? CHUNK : b - a;
+	}
+	start = skip;
+    }
+}
+
+static void find_staging(plan_t * p) {
+    off_t free = p->old.space - p->length;
+    cursor_t c;
+    int n;
+    p->staging = -1;
+    p->staging_size = 0;
+    for (n = 0; n < p->count; n++)
+	if (distance(&p->seg[n]) < CHUNK) break;
+    if (n >= p->count || free < 1) return;
+    cursor_init(&c, &p->old, (p->old_start + p->length) % p->old.space);
+    while (free > 0 && p->staging_size < CHUNK) {
+	off_t run = cursor_run(&c, &p->old);
+	if (run > free) run = free;
+	staging_candidate(p, c.pos, c.pos + run);
+	cursor_advance(&c, &p->old, run);
+	free -= run;
+    }
+}
+
+static int try_plan(plan_t * p, off_t start) {
+    p->new_start = start;
+    if (! make_segments(p)) return 0;
+    if (! order_segments(p)) return 0;
+    find_staging(p);
+    return 1;
+}
+
+/* calculate the update plan; this only depends on the old superblock and
+ * the new layout, so an interrupted update finds the same plan again */
+static int make_plan(plan_t * p, const shall_sb_data_t * sb,
+		     const layout_t * new)
+{
+    shall_sb_data_t osb = *sb;
+    off_t start;
+    memset(p, 0, sizeof(*p));
+    p->old.size = sb->device_size;
+    p->old.space = sb->data_space;
+    p->old.num_superblocks = sb->num_superblocks;
+    p->new = *new;
+    p->old_start = sb->data_start;
+    p->length = sb->data_length;
+    if (p->length > new->space) {
+	errno = ENOSPC;
+	return 0;
+    }
+    /* keep the journal where it is if possible, so only the data displaced
+     * by the change needs to move; failing that, start at the beginning */
+    osb.next_superblock = -1;
+    shall_locate_start(&osb);
+    start = logical_position(new, osb.real_start);
+    if (start >= 0 && start < new->space) {
+	if (try_plan(p, start)) return 1;
+	if (errno != EDEADLK) return 0;
+    }
+    return try_plan(p, osb.real_start % SHALL_DEV_BLOCK);
+}
+
+/* a piece of a segment, copied with a single read and write; a piece is
+ * staged if it overlaps its own source, and then it must be saved in the
+ * staging area before writing it */
+typedef struct {
+    int seg;
+    off_t offset;			/* within the segment */
+    off_t length;
+    off_t src;
+    off_t dst;
+    off_t order;			/* data copied before this piece */
+    int staged;
+} piece_t;
+
+/* find the piece which starts at a given point in the copy order; the
+ * pieces only depend on the plan and on this point, so an interrupted
+ * update gets the same ones again */
+static int get_piece(const plan_t * p, off_t order, piece_t * pc) {
+    int lo = 0, hi = p->count;
+    const segment_t * s;
+    off_t size, done;
+    if (order >= p->total) return 0;
+    while (hi - lo > 1) {
+	int mid = (lo + hi) / 2;
+	if (p->seg[mid].order <= order)
+	    lo = mid;
+	else
+	    hi = mid;
+    }
+    s = &p->seg[lo];
+    done = order - s->order;
+    /* pieces smaller than the distance moved never overwrite themselves;
+     * if the distance is small we prefer staging larger pieces to
+     * checkpointing after each small one */
+    size = distance(s);
+    if (size >= CHUNK)
+	size = CHUNK;
+    else if (p->staging_size > size)
+	size = p->staging_size;
+    pc->seg = lo;
+    pc->length = s->length - done < size ? s->length - done : size;
+    pc->offset = forward(s) ? done : s->length - done - pc->length;
+    pc->src = s->src + pc->offset;
+    pc->dst = s->dst + pc->offset;
+    pc->order = order;
+    pc->staged = pc->length > distance(s);
+    return 1;
+}
+
+/* see how far the checkpoint needs to be before writing a piece: all the
+ * source data it overwrites, other than its own, must have been copied
+ * and the checkpoint must say so, or repeating the copy after an
+ * interruption would read the wrong data */
+static off_t piece_needs(const plan_t * p, const piece_t * pc) {
+    off_t need = 0, a = pc->dst, b = pc->dst + pc->length;
+    int k;
+    for (k = first_after(p, p->by_src, 0, a); k < p->count; k++) {
+	int i = p->by_src[k];
+	const segment_t * x = &p->seg[i];
+	off_t o0, o1, n;
+	if (x->src >= b) break;
+	o0 = (a > x->src ? a : x->src) - x->src;
+	o1 = (b < x->src + x->length ? b : x->src + x->length) - x->src;
+	if (forward(x)) {
+	    if (i == pc->seg && o1 > pc->offset) o1 = pc->offset;
+	    if (o1 <= o0) continue;
+	    n = x->order + o1;
+	} else {
+	    if (i == pc->seg && o0 < pc->offset + pc->length)
+		o0 = pc->offset + pc->length;
+	    if (o1 <= o0) continue;
+	    n = x->order + x->length - o0;
+	}
+	if (n > need) need = n;
+    }
+    return need;
+}
+
+/* data copy: a thread reads the pieces in order, and the main thread
+ * writes them and decides when to checkpoint; reading ahead is safe
+ * because a piece is never written over the source of a later one */
+typedef struct {
+    char * data;
+    piece_t piece;
+    int error;				/* errno, if the read failed */
+} slot_t;
+
+typedef struct {
+    const plan_t * plan;
+    int fd;
+    shall_sb_data_t sb;			/* old superblock, updating */
+    shall_sb_info_t change;		/* the update plan */
+    off_t checkpoint;			/* last checkpoint written */
+    time_t last;			/* time of last checkpoint */
+    slot_t slots[NBUFFERS];
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    /* the following are protected by "lock" */
+    long produced;			/* slots filled by the thread */
+    long released;			/* slots written by main thread */
+    int stop;				/* ask the thread to stop */
+    int finished;			/* thread has read everything */
+    /* the following are only used by the thread */
+    off_t next;				/* next piece to read */
+} mover_t;
+
+static void * reader_thread(void * _mv) {
+    mover_t * mv = _mv;
+    while (1) {
+	slot_t * slot;
+	int err = 0, more;
+	pthread_mutex_lock(&mv->lock);
+	while (! mv->stop && mv->produced - mv->released >= NBUFFERS)
+	    pthread_cond_wait(&mv->cond, &mv->lock);
+	if (mv->stop) {
+	    mv->finished = 1;
+	    pthread_cond_broadcast(&mv->cond);
+	    pthread_mutex_unlock(&mv->lock);
+	    return NULL;
+	}
+	pthread_mutex_unlock(&mv->lock);
+	slot = &mv->slots[mv->produced % NBUFFERS];
+	more = get_piece(mv->plan, mv->next, &slot->piece);
+	if (more) {
+	    if (! read_at(mv->fd, slot->data, slot->piece.length,
+			  slot->piece.src))
+		err = errno;
+	    mv->next += slot->piece.length;
+	}
+	pthread_mutex_lock(&mv->lock);
+	if (more) {
+	    slot->error = err;
+	    mv->produced++;
+	}
+	if (err || ! more) mv->finished = 1;
+	pthread_cond_broadcast(&mv->cond);
+	pthread_mutex_unlock(&mv->lock);
+	if (err || ! more) return NULL;
+    }
+}
+
+/* wait for the next piece; NULL at the end */
+static slot_t * next_slot(mover_t * mv) {
+    slot_t * slot = NULL;
+    pthread_mutex_lock(&mv->lock);
+    while (mv->released >= mv->produced && ! mv->finished)
+	pthread_cond_wait(&mv->cond, &mv->lock);
+    if (mv->released < mv->produced)
+	slot = &mv->slots[mv->released % NBUFFERS];
+    pthread_mutex_unlock(&mv->lock);
+    return slot;
+}
+
+static void release_slot(mover_t * mv) {
+    pthread_mutex_lock(&mv->lock);
+    mv->released++;
+    pthread_cond_broadcast(&mv->cond);
+    pthread_mutex_unlock(&mv->lock);
+}
+
+/* store the update plan in a superblock */
+static int write_plan(mover_t * mv, int which) {
+    struct shall_devsuper ssb;
+    shall_init_sb(&ssb, &mv->sb, &mv->change);
+    return shall_write_sb(mv->fd, &ssb, which);
+}
+
+/* make sure all data copied so far is on the device, then record that
+ * in superblocks 1 and 0, in this order and one at a time, so that an
+ * interruption leaves at least one of them valid; a staged piece is
+ * saved before the checkpoint which allows writing it */
+static int checkpoint(mover_t * mv, off_t order, const slot_t * staged) {
+    if (fdatasync(mv->fd) < 0) return 0;
+    mv->change.moved = order;
+    mv->change.saved = -1;
+    mv->change.saved_crc = 0;
+    if (staged) {
+	if (! write_at(mv->fd, staged->data, staged->piece.length,
+		       mv->plan->staging))
+	    return 0;
+	if (fdatasync(mv->fd) < 0) return 0;
+	mv->change.saved = order;
+	mv->change.saved_crc =
+	    shall_crc32(0x4c414853, staged->data, staged->piece.length);
+    }
+    if (! write_plan(mv, 1)) return 0;
+    if (fdatasync(mv->fd) < 0) return 0;
+    if (! write_plan(mv, 0)) return 0;
+    if (fdatasync(mv->fd) < 0) return 0;
+    mv->checkpoint = order;
+    mv->last = time(NULL);
+    return 1;
+}
+
+/* an interruption just after saving a staged piece means its source may
+ * be partly overwritten, so we copy it from the staging area; if that no
+ * longer matches, it has been reused for the next piece, which is only
+ * done once the piece has been written */
+static int resume_staged(mover_t * mv, char * buffer) {
+    const plan_t * p = mv->plan;
+    piece_t pc;
+    if (mv->change.saved != mv->change.moved) return 1;
+    if (! get_piece(p, mv->change.moved, &pc) || ! pc.staged) return 1;
+    if (! read_at(mv->fd, buffer, pc.length, p->staging)) return 0;
+    if (shall_crc32(0x4c414853, buffer, pc.length) == mv->change.saved_crc)
+	if (! write_at(mv->fd, buffer, pc.length, pc.dst))
+	    return 0;
+    mv->next = pc.order + pc.length;
+    return 1;
+}
+
+/* copy all data from mv->change.moved onwards */
+static int move_data(mover_t * mv) {
+    const plan_t * p = mv->plan;
+    slot_t * slot;
+    int n, sve, ok = 1;
+    for (n = 0; n < NBUFFERS; n++) {
+	mv->slots[n].data = malloc(CHUNK);
+	if (! mv->slots[n].data) goto out_free;
+    }
+    mv->checkpoint = mv->next = mv->change.moved;
+    mv->last = time(NULL);
+    if (! resume_staged(mv, mv->slots[0].data)) goto out_free;
+    pthread_mutex_init(&mv->lock, NULL);
+    pthread_cond_init(&mv->cond, NULL);
+    errno = pthread_create(&mv->thread, NULL, reader_thread, mv);
+    if (errno) {
+	pthread_cond_destroy(&mv->cond);
+	pthread_mutex_destroy(&mv->lock);
+	goto out_free;
+    }
+    show_progress(mv->next, p->total);
+    while (ok && (slot = next_slot(mv)) != NULL) {
+	const piece_t * pc = &slot->piece;
+	off_t need = piece_needs(p, pc);
+	if (slot->error) {
+	    errno = slot->error;
+	    ok = 0;
+	} else if (need > pc->order) {
+	    /* cannot happen if the plan is correct */
+	    errno = EINVAL;
+	    ok = 0;
+	} else if (pc->staged) {
+	    ok = checkpoint(mv, pc->order, slot);
+	} else if (need > mv->checkpoint ||
+		   time(NULL) - mv->last >= interval)
+	{
+	    ok = checkpoint(mv, pc->order, NULL);
+	}
+	if (ok) ok = write_at(mv->fd, slot->data, pc->length, pc->dst);
+	if (ok) show_progress(pc->order + pc->length, p->total);
+	release_slot(mv);
+    }
+    sve = errno;
+    pthread_mutex_lock(&mv->lock);
+    mv->stop = 1;
+    pthread_cond_broadcast(&mv->cond);
+    pthread_mutex_unlock(&mv->lock);
+    pthread_join(mv->thread, NULL);
+    pthread_cond_destroy(&mv->cond);
+    pthread_mutex_destroy(&mv->lock);
+    clear_progress();
+    errno = sve;
+    if (ok) ok = checkpoint(mv, p->total, NULL);
+    sve = errno;
+    for (n = 0; n < NBUFFERS; n++)
+	free(mv->slots[n].data);
+    errno = sve;
+    return ok;
+out_free:
+    sve = errno;
+    for (n = 0; n < NBUFFERS; n++)
+	free(mv->slots[n].data);
+    errno = sve;
+    return 0;
+}
+
+/* write the superblocks for the new layout, superblock 0 last: until
+ * then, an interrupted update can still be completed with -u */
+static int write_new_superblocks(int fd, const plan_t * p,
+				 const shall_sb_data_t * sb, int new_align)
+{
+    struct shall_devsuper ssb;
+    shall_sb_data_t data = *sb;
+    int which;
+    data.version++;
+    data.flags = SHALL_SB_VALID;
+    data.device_size = p->new.size;
+    data.data_space = p->new.space;
+    data.num_superblocks = p->new.num_superblocks;
+    data.alignment = new_align;
+    data.data_start = p->new_start;
+    data.data_length = p->length;
+    if (data.max_length > p->new.space) data.max_length = p->new.space;
+    if (data.max_length < p->length) data.max_length = p->length;
+    shall_init_sb(&ssb, &data, NULL);
+    for (which = 1; which < p->new.num_superblocks; which++)
+	if (! shall_write_sb(fd, &ssb, which)) return 0;
+    if (fdatasync(fd) < 0) return 0;
+    if (! shall_write_sb(fd, &ssb, 0)) return 0;
+    return fdatasync(fd) >= 0;
+}
+
+/* read superblock 0 and check that all the others agree with it */
+static int read_superblocks(const char * pname, int fd, off_t eod,
+			    shall_sb_data_t * sb)
+{
+    int which;
+    if (! shall_pread_sb(fd, sb, 0) ||
+	shall_check_sb_size(eod, sb, 0) != shall_check_ok)
+    {
+	fprintf(stderr, "%s: %s: invalid superblock, please run shallfsck\n",
+		pname, device);
+	return 0;
+    }
+    if (sb->flags & SHALL_SB_UPDATE) {
+	fprintf(stderr,
+		"%s: %s: an update was interrupted, use -u to complete it\n",
+		pname, device);
+	return 0;
+    }
+    if (sb->flags & SHALL_SB_DIRTY) {
+	fprintf(stderr, "%s: %s: device was not cleanly unmounted, "
+		"please run shallfsck\n", pname, device);
+	return 0;
+    }
+    for (which = 1; which < sb->num_superblocks; which++) {
+	shall_sb_data_t other;
+	if (! shall_pread_sb(fd, &other, which) ||
+	    shall_check_sb_size(eod, &other, which) != shall_check_ok ||
+	    other.device_size != sb->device_size ||
+	    other.num_superblocks != sb->num_superblocks ||
+	    other.alignment != sb->alignment ||
+	    (other.flags & SHALL_SB_UPDATE))
+	{
+	    fprintf(stderr, "%s: %s: superblock %d does not match, "
+		    "please run shallfsck -f\n", pname, device, which);
+	    return 0;
+	}
+    }
+    return 1;
+}
+
+/* find the update plan of an interrupted update, from superblock 0 or 1,
+ * whichever has the latest checkpoint */
+static int read_update(const char * pname, int fd, off_t eod,
+		       shall_sb_data_t * sb, shall_sb_info_t * change)
+{
+    int which, found = 0;
+    for (which = 0; which < 2; which++) {
+	shall_sb_data_t osb;
+	shall_sb_info_t och;
+	if (! shall_pread_sb_update(fd, &osb, &och, which)) continue;
+	if (shall_check_sb_size(eod, &osb, which) != shall_check_ok) continue;
+	/* superblock 0 is the last one to be updated at the end */
+	if (! (osb.flags & SHALL_SB_UPDATE)) {
+	    if (which > 0) continue;
+	    fprintf(stderr, "%s: %s: there is no update to complete\n",
+		    pname, device);
+	    return 0;
+	}
+	if (found &&
+	    (osb.device_size != sb->device_size ||
+	     osb.num_superblocks != sb->num_superblocks ||
+	     osb.data_start != sb->data_start ||
+	     osb.data_length != sb->data_length ||
+	     och.dev_size != change->dev_size ||
+	     och.num_superblocks != change->num_superblocks))
+	{
+	    fprintf(stderr, "%s: %s: superblocks 0 and 1 have different "
+		    "update plans\n", pname, device);
+	    return 0;
+	}
+	if (! found || och.moved > change->moved) {
+	    *sb = osb;
+	    *change = och;
+	}
+	found = 1;
+    }
+    if (! found) {
+	fprintf(stderr, "%s: %s: cannot find the update plan, "
+		"please run shallfsck\n", pname, device);
+	return 0;
+    }
+    if (change->dev_size % SHALL_DEV_BLOCK || change->dev_size < 65536 ||
+	change->dev_size > eod ||
+	change->num_superblocks <= 8 ||
+	shall_superblock_location(change->num_superblocks - 1) +
+	    sizeof(struct shall_devsuper) > change->dev_size ||
+	change->alignment < 8 || change->alignment > SHALL_DEV_BLOCK ||
+	change->alignment % 8 || change->moved < 0)
+    {
+	fprintf(stderr, "%s: %s: invalid update plan\n", pname, device);
+	return 0;
+    }
+    return 1;
+}
+
+static void print_values(const char * pname, const char * what,
+			 off_t size, int nsb, int align)
+{
+    printf("%s: %s: %s -b %d -a %d, device size %lld, journal size %lld\n",
+	   pname, device, what, nsb, align, (long long)size,
+	   (long long)size - nsb * SHALL_DEV_BLOCK);
+}
+
+int main(int argc, char *argv[]) {
+    const char * pname = strrchr(argv[0], '/');
+    const char * errmsg = parse_options(argc - 1, argv + 1);
+    shall_sb_data_t sb;
+    shall_sb_info_t change;
+    struct stat sbuff;
+    layout_t new;
+    plan_t plan;
+    mover_t mv;
+    off_t eod;
+    int fd, sve, flags;
+    if (pname)
+	pname++;
+    else
+	pname = argv[0];
+    if (do_help) {
+	shall_print_help(stdout, pname, options, args);
+	return 0;
+    }
+    if (errmsg) {
+	fprintf(stderr, "%s: %s\nUse \"%s -h\" for help\n",
+		pname, errmsg, pname);
+	return 1;
+    }
+    /* a block device which is mounted cannot be opened with O_EXCL */
+    if (stat(device, &sbuff) < 0) goto out_error;
+    flags = readonly || show ? O_RDONLY : O_RDWR;
+    if (S_ISBLK(sbuff.st_mode)) flags |= O_EXCL;
+    fd = open(device, flags);
+    if (fd < 0) goto out_error;
+    eod = lseek(fd, 0, SEEK_END);
+    if (eod < 0) goto out_close;
+    eod -= eod % SHALL_DEV_BLOCK;
+    memset(&change, 0, sizeof(change));
+    if (resume) {
+	/* step 1.1: load the plan */
+	if (! read_update(pname, fd, eod, &sb, &change)) goto out_fail;
+	sb.flags &= ~SHALL_SB_UPDATE;
+    } else {
+	/* step 1 */
+	if (! read_superblocks(pname, fd, eod, &sb)) goto out_fail;
+	if (show) {
+	    print_values(pname, "current:", sb.device_size,
+			 sb.num_superblocks, sb.alignment);
+	    printf("%s: %s: journal contains %lld bytes\n",
+		   pname, device, (long long)sb.data_length);
+	    printf("%s: %s: the device has %lld bytes\n",
+		   pname, device, (long long)eod);
+	    close(fd);
+	    return 0;
+	}
+	/* step 2 */
+	change.dev_size = sb.device_size;
+	if (fs_size) {
+	    char * ep;
+	    change.dev_size = shall_strtol(fs_size, &ep);
+	    if (change.dev_size == 0) change.dev_size = eod;
+	    if (*ep || ep == fs_size ||
+		change.dev_size < 16 * SHALL_DEV_BLOCK ||
+		change.dev_size % SHALL_DEV_BLOCK ||
+		change.dev_size > eod)
+	    {
+		fprintf(stderr, "%s: %s: invalid device size %s\n",
+			pname, device, fs_size);
+		close(fd);
+		return 1;
+	    }
+	}
+	change.num_superblocks = num_superblocks;
+	if (! num_superblocks && ! fs_size)
+	    change.num_superblocks = sb.num_superblocks;
+	if (! num_superblocks && fs_size)
+	    while (shall_superblock_location(change.num_superblocks)
+		   < change.dev_size)
+		change.num_superblocks++;
+	if (change.num_superblocks <= 8 ||
+	    shall_superblock_location(change.num_superblocks - 1) +
+		sizeof(struct shall_devsuper) > change.dev_size)
+	{
+	    fprintf(stderr, "%s: %s: superblocks do not fit in the device\n",
+		    pname, device);
+	    close(fd);
+	    return 1;
+	}
+	change.alignment = alignment ? alignment : sb.alignment;
+    }
+    new.size = change.dev_size;
+    new.num_superblocks = change.num_superblocks;
+    new.space = new.size - new.num_superblocks * SHALL_DEV_BLOCK;
+    if (! make_plan(&plan, &sb, &new)) {
+	if (errno == ENOSPC) {
+	    fprintf(stderr, "%s: %s: the journal contains %lld bytes, "
+		    "which do not fit in %lld\n", pname, device,
+		    (long long)sb.data_length, (long long)new.space);
+	    goto out_fail;
+	}
+	if (errno == EDEADLK) {
+	    fprintf(stderr, "%s: %s: the journal is too full to rearrange "
+		    "it in place, please read some events first\n",
+		    pname, device);
+	    goto out_fail;
+	}
+	goto out_close;
+    }
+    print_values(pname, "current:", sb.device_size, sb.num_superblocks,
+		 sb.alignment);
+    print_values(pname, "new:    ", new.size, new.num_superblocks,
+		 change.alignment);
+    printf("%s: %s: %lld bytes of data to copy",
+	   pname, device, (long long)plan.total);
+    if (resume)
+	printf(", %lld already copied", (long long)change.moved);
+    printf("\n");
+    if (plan.staging_size > 0 && plan.total > 0)
+	printf("%s: %s: using %lld bytes at %lld as a staging area\n",
+	       pname, device, (long long)plan.staging_size,
+	       (long long)plan.staging);
+    if (readonly) {
+	free_plan(&plan);
+	close(fd);
+	return 0;
+    }
+    if (plan.total > 0) {
+	memset(&mv, 0, sizeof(mv));
+	mv.plan = &plan;
+	mv.fd = fd;
+	mv.sb = sb;
+	mv.sb.flags |= SHALL_SB_UPDATE;
+	mv.change = change;
+	if (! resume) {
+	    /* step 3: the superblocks which exist in both layouts, starting
+	     * with superblock 0 so that from now on the device cannot be
+	     * mounted until the update completes */
+	    int which, last = sb.num_superblocks < new.num_superblocks
+			    ? sb.num_superblocks : new.num_superblocks;
+	    mv.change.moved = 0;
+	    mv.change.saved = -1;
+	    for (which = 0; which < last; which++) {
+		if (! write_plan(&mv, which)) goto out_close;
+		if (which == 0 && fdatasync(fd) < 0) goto out_close;
+	    }
+	    if (fdatasync(fd) < 0) goto out_close;
+	}
+	/* step 4 */
+	if (change.moved < plan.total && ! move_data(&mv)) goto out_close;
+    }
+    /* step 5 */
+    if (! write_new_superblocks(fd, &plan, &sb, change.alignment))
+	goto out_close;
+    free_plan(&plan);
+    if (close(fd) < 0) goto out_error;
+    printf("%s: %s: device updated successfully\n", pname, device);
+    return 0;
+out_close:
+    sve = errno;
+    close(fd);
+    errno = sve;
+out_error:
+    fprintf(stderr, "%s: %s: %s\n", pname, device, strerror(errno));
+    return 1;
+out_fail:
+    close(fd);
+    return 1;
+}